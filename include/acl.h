@@ -0,0 +1,153 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+#ifndef __ACL_H__
+#define __ACL_H__
+
+#include "inspircd_config.h"
+#include <string>
+#include <vector>
+
+/** A set of IPv4 and IPv6 prefixes, each with a value, for finding the longest prefix
+ * an address falls in.
+ *
+ * This is a binary radix (Patricia) trie: each node holds a prefix, and nodes with only
+ * one child are never created, so a lookup visits at most one node per bit of the
+ * address however many prefixes there are, and usually far fewer. Addresses are matched
+ * in their binary form, so nothing is parsed per lookup, unlike utils::sockets::MatchCIDR.
+ */
+class CoreExport CIDRTrie : public classbase
+{
+	struct Node
+	{
+		/** The prefix, with the bits after the first bits cleared */
+		unsigned char prefix[16];
+		unsigned int bits;
+		/** The value of this prefix, or -1 if it was only created to join two others */
+		int value;
+		/** Subtrees whose next bit after this prefix is 0 and 1, or -1 */
+		int child[2];
+	};
+
+	std::vector<Node> nodes;
+
+	/** Roots for IPv4 and IPv6, or -1 */
+	int roots[2];
+
+	size_t count;
+
+	int NewNode(const unsigned char *prefix, unsigned int bits, int value);
+
+ public:
+	CIDRTrie();
+
+	/** Remove every prefix
+	 */
+	void Clear();
+
+	/** Add a prefix, or change the value of one already added
+	 * @param family AF_INET or AF_INET6
+	 * @param addr 4 or 16 bytes, in network order
+	 * @param bits Length of the prefix
+	 * @param value Any value 0 or above
+	 */
+	void Add(int family, const unsigned char *addr, unsigned int bits, int value);
+
+	/** Add a prefix in text form, such as 192.0.2.0/24 or 2001:db8::/32; an address on its
+	 * own is a prefix of its full length, and * is every address of both kinds.
+	 * @return False if the mask is invalid
+	 */
+	bool Add(const std::string &mask, int value);
+
+	/** Find the value of the longest prefix an address falls in
+	 * @return The value, or -1 if the address is in none of the prefixes
+	 */
+	int Find(int family, const unsigned char *addr) const;
+
+	/** Find the value of the longest prefix an address falls in. IPv4 addresses mapped
+	 * into IPv6 are looked up as IPv4.
+	 * @return The value, or -1 if the address is in none of the prefixes
+	 */
+	int Find(const sockaddr *sa) const;
+
+	/** The number of prefixes added
+	 */
+	size_t Count() const
+	{
+		return count;
+	}
+};
+
+/** Access control lists, from acl tags. Each list covers a path, and the list with the
+ * longest path a request's URI falls under decides whether the client may make it: the
+ * longest allow or deny mask the client's address falls in applies, and clients in none
+ * of them get the list's default.
+ */
+class CoreExport AccessControl : public classbase
+{
+ public:
+	struct PathACL
+	{
+		std::string path;
+		CIDRTrie masks;
+		/** -1 until a tag gives a default; it is then worked out from the masks */
+		int defaultallow;
+		bool hasallow, hasdeny;
+	};
+
+ private:
+	InspIRCd *ServerInstance;
+
+	/** Longest path first */
+	std::vector<PathACL *> acls;
+
+	std::vector<PathACL *> pending;
+
+	void Clear(std::vector<PathACL *> &list);
+
+	/** Add a space separated list of masks, or a file of them, to a list
+	 */
+	void AddMasks(PathACL *acl, const std::string &masks, int value, const std::string &source);
+	void AddFile(PathACL *acl, const std::string &file, int value);
+
+ public:
+	/** Requests denied, since startup
+	 */
+	unsigned long Denied;
+
+	AccessControl(InspIRCd *Instance);
+
+	~AccessControl();
+
+	/** Called before the first acl tag is read
+	 */
+	void Begin();
+
+	/** Add a list from an acl tag. Tags for the same path are merged. Throws CoreException
+	 * if a mask is invalid or a file can't be read.
+	 * @param def "allow", "deny", or empty to leave it to other tags for this path, or
+	 * failing that to deny if only allow masks are given and allow otherwise
+	 */
+	void Add(const std::string &path, const std::string &allow, const std::string &deny,
+		const std::string &allowfile, const std::string &denyfile, const std::string &def);
+
+	/** Called after the last acl tag is read
+	 */
+	void Apply();
+
+	/** Decide whether a client may request a URI
+	 * @param sa The client's address
+	 * @param uri The request's URI, after it has been cleaned up by HandleURI
+	 */
+	bool Allowed(const sockaddr *sa, const std::string &uri);
+};
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef __BACKEND_H__
 #define __BACKEND_H__
 
+class Connection;
+
 class CoreExport Backend : public classbase
 {
  protected:
@@ -15,7 +17,7 @@ class CoreExport Backend : public classbase
 	{
 	}
 	
-	virtual int ServeFile(int sockfd, int filefd, off_t &sent, off_t filesize) = 0;
+	virtual int ServeFile(Connection *c, int filefd, off_t &sent, off_t filesize) = 0;
 };
 
 class WriteBackend : public Backend
@@ -35,7 +37,7 @@ class WriteBackend : public Backend
 	{
 	}
 	
-	virtual int ServeFile(int sockfd, int filefd, off_t &sent, off_t filesize);
+	virtual int ServeFile(Connection *c, int filefd, off_t &sent, off_t filesize);
 };
 
 #endif
@@ -0,0 +1,143 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+#ifndef __CLIENTLIMITS_H__
+#define __CLIENTLIMITS_H__
+
+#include "inspircd_config.h"
+#include "timer.h"
+#include <vector>
+
+/** A limit tag: which clients it applies to, and what they are allowed
+ */
+struct LimitRule
+{
+	/** AF_INET or AF_INET6, or 0 if the rule matches everyone */
+	int family;
+	unsigned char mask[16];
+	int maskbits;
+
+	/** Clients are grouped by address prefixes of these lengths, and each group is limited as one */
+	int ipv4prefix, ipv6prefix;
+
+	/** Concurrent connections per group; 0 for no limit */
+	unsigned int maxconns;
+	/** Requests per second, and how many may be made at once; 0 for no limit */
+	int rate, burst;
+};
+
+/** Per-client (or per-network) connection caps and request rate limits.
+ *
+ * State is kept for each group of clients in an open-addressed hash table keyed on the
+ * binary address, masked to the group's prefix. Connections are counted, and refused
+ * when a group is over its limit, as soon as they are accepted and before a Connection
+ * is created for them; each request then takes a token from its group's bucket, which
+ * refills at the rule's rate. Idle groups are dropped by a timer.
+ */
+class CoreExport ClientLimiter : public classbase
+{
+	struct Key
+	{
+		unsigned short rule;
+		unsigned char family;
+		unsigned char addr[16];
+	};
+
+	struct Entry
+	{
+		Key key;
+		bool used;
+		unsigned int connections;
+		int tokens;
+		time_t refilled;
+	};
+
+	InspIRCd *ServerInstance;
+
+	std::vector<LimitRule> rules;
+
+	/** Slots; a power of two in size and never more than half full
+	 */
+	std::vector<Entry> table;
+	size_t count;
+
+	Timer *expiry;
+
+	/** Find the rule for an address, and the key of its group
+	 * @return The rule's index, or -1 if there is none or it limits nothing
+	 */
+	int Match(const sockaddr *sa, Key &key);
+
+	static size_t Hash(const Key &key);
+
+	/** Find the slot holding a key, or the empty slot it would go in
+	 */
+	size_t Slot(const Key &key) const;
+
+	/** Find a key's entry, adding it if asked to
+	 * @return The entry, or NULL if it isn't there and create is false
+	 */
+	Entry *Find(const Key &key, bool create);
+
+	/** Top up an entry's bucket for the time since it was last topped up
+	 */
+	void Refill(Entry &e, const LimitRule &r, time_t now);
+
+	void Rebuild(size_t size, time_t now, bool dropidle);
+
+ public:
+	/** Connections refused and requests rejected, since startup
+	 */
+	unsigned long Refused, Rejected;
+
+	ClientLimiter(InspIRCd *Instance);
+
+	~ClientLimiter();
+
+	/** Called before the first limit tag is read
+	 */
+	void Begin();
+
+	/** Add a rule from a limit tag. Throws CoreException if the mask is invalid.
+	 */
+	void AddRule(const std::string &mask, int maxconns, int rate, int burst, int ipv4prefix, int ipv6prefix);
+
+	/** Called after the last limit tag is read. Forgets all counts, as rules may have moved.
+	 */
+	void Apply();
+
+	/** Decide whether to take a connection which has just been accepted
+	 * @param sa The client's address
+	 * @param rule Set to the rule to pass to Attach, or -1
+	 * @return False if the connection should be closed straight away
+	 */
+	bool Admit(const sockaddr *sa, int &rule);
+
+	/** Count a connection allowed by Admit against its group
+	 */
+	void Attach(Connection *c, int rule);
+
+	/** Stop counting a connection; called as it is destroyed
+	 */
+	void Release(Connection *c);
+
+	/** Take a token for a request on a connection. Connections made by modules, which
+	 * Admit never saw, are limited by the address they were given.
+	 * @return False if the client has made too many requests
+	 */
+	bool TakeRequest(Connection *c);
+
+	/** Drop the state of groups with no connections and a full bucket
+	 */
+	void Expire(time_t now);
+};
+
+#endif
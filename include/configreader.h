@@ -278,7 +278,8 @@ class CoreExport ServerConfig : public Extensible
 	 */
 	bool writelog;
 
-	/** The size of the read() buffer
+	/** Default SO_SNDBUF and SO_RCVBUF for bind blocks which don't set their own,
+	 * or 0 to leave them to the kernel
 	 */
 	int NetBufferSize;
 
@@ -304,6 +305,10 @@ class CoreExport ServerConfig : public Extensible
 	 */
 	int LogLevel;
 
+	/** Mask of LogSubsystem values whose DEBUG and VERBOSE messages are logged
+	 */
+	int LogSubsystems;
+
 	/** The full pathname and filename of the PID
 	 * file as defined in the configuration.
 	 */
@@ -329,6 +334,10 @@ class CoreExport ServerConfig : public Extensible
 	 */
 	char DocRoot[MAXBUF];
 
+	/** File names tried, in order, for a request for a directory
+	 */
+	std::vector<std::string> IndexFiles;
+
 	/** Where to chroot() to.
 	 */
 	char ChRoot[MAXBUF];
@@ -336,6 +345,14 @@ class CoreExport ServerConfig : public Extensible
 	/** Maximum size of a POST body.
 	 */
 	int MaxPostBody;
+
+	/** Maximum amount of unprocessed request data buffered for a connection
+	 */
+	int MaxRequestBuffer;
+
+	/** Maximum pipelined requests processed for one connection per mainloop iteration
+	 */
+	int PipelineBudget;
 	
 	/** Duration to cache stat() calls (0 is disabled)
 	 */
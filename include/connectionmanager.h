@@ -13,21 +13,63 @@ class ConnectionManager : public classbase
 {
  private:
 	InspIRCd *ServerInstance;
+
+	/** Connections with pipelined requests waiting to be processed
+	 */
+	std::deque<Connection *> Pipelines;
+
+	/** True while the listeners are paused because we can't take more connections
+	 */
+	bool ListenersPaused;
  public:
-	ConnectionManager(InspIRCd* Instance) : ServerInstance(Instance) { };
+	ConnectionManager(InspIRCd* Instance) : ServerInstance(Instance), ListenersPaused(false) { };
 
 	/** Add a connection.
 	 * This will create a new connection and initialise it.
 	 * @param socket The socket id (file descriptor) this connection is on
 	 * @param port The port number this connection connected on
-	 * @param ip The IP address of the connection
-	 * @return This function has no return value, but may not succeed always. XXX fix this
+	 * @param ip The client's address, as accept() returned it (copied, not kept)
+	 * @param rawhooks If false, OnRawSocketAccept is not called. Modules creating connections
+	 * of their own (e.g. from one end of a socketpair) use this so that the connection is not
+	 * mistaken for one accepted from a listener.
+	 * @return The new connection, or NULL if it could not be added
 	 */
-	void Add(int socket, int port, int socketfamily, sockaddr *ip);
+	Connection *Add(int socket, int port, int socketfamily, sockaddr *ip, bool rawhooks = true);
 
 	/** Disconnect a connection gracefully
 	 * @param connection The connection to remove
 	 * @return Although this function has no return type, on exit the connection provided will no longer exist. XXX fix this
 	 */
 	void Delete(Connection *c);
+
+	/** Queue a connection whose request buffer holds another request, to be processed
+	 * by ProcessPipelines. Requests are not processed as soon as the last one ends, as
+	 * that would recurse (EndRequest -> CheckRequest -> SendHeaders -> EndRequest ...)
+	 * once for every request a client pipelines.
+	 * @param c The connection
+	 */
+	void SchedulePipeline(Connection *c);
+
+	/** Remove a connection from the pipeline queue, if it is there
+	 * @param c The connection
+	 */
+	void CancelPipeline(Connection *c);
+
+	/** Process queued pipelined requests. Called once per mainloop iteration; each
+	 * connection gets at most performance::pipeline-budget requests, so one client can't
+	 * hog the server. A connection with more waiting is queued for the next iteration.
+	 * Responses produced here are written out together when the socket is next writable.
+	 */
+	void ProcessPipelines();
+
+	/** Stop accepting connections on every listener, because the connection limit has
+	 * been reached or we are out of descriptors. New connections wait in the kernel's
+	 * accept queue rather than waking the mainloop over and over.
+	 */
+	void PauseListeners();
+
+	/** Start accepting connections again, if the listeners are paused and there is room.
+	 * Called whenever connections are culled.
+	 */
+	void ResumeListeners();
 };
@@ -26,17 +26,110 @@ enum HttpState
 	HTTP_RECV_REQBODY, /* Waiting to finish recieving request data */
 	HTTP_SEND_HEADERS, /* Sending response headers */
 	HTTP_SEND_DATA, /* Sending response body */
+	HTTP_UPGRADED, /* Taken over by a module speaking another protocol; see Module::OnUpgrade */
 	HTTP_FINISHED
 };
 
 class Backend;
+class VirtualHost;
+class MimeType;
+
+/** Data read from a connection which hasn't been used yet.
+ *
+ * This is a plain block of memory with the unused data between two offsets. Reads go
+ * straight into the free space after it, and requests are parsed where they lie; using
+ * data only moves the start offset. What is left is moved to the front of the block
+ * only when a read needs the room. Blocks of the usual size are kept for reuse when a
+ * connection has no unused data, so idle connections hold none.
+ */
+class CoreExport RecvBuffer : public classbase
+{
+	char *block;
+	size_t start, end, size;
+
+	/** Replace the block with one of newsize bytes, moving the unused data to its front */
+	void Resize(size_t newsize);
+
+	RecvBuffer(const RecvBuffer &);
+	RecvBuffer &operator=(const RecvBuffer &);
+
+ public:
+	RecvBuffer() : block(NULL), start(0), end(0), size(0)
+	{
+	}
+
+	~RecvBuffer()
+	{
+		Release();
+	}
+
+	/** The unused data; only valid until the next call to Prepare or Append
+	 */
+	const char *Data() const
+	{
+		return block + start;
+	}
+
+	size_t Length() const
+	{
+		return end - start;
+	}
+
+	/** Make room to read into after the unused data
+	 * @param want The least room wanted
+	 * @param room Set to the room there is, which is at least want
+	 * @return Where to read to; call Commit with the number of bytes read
+	 */
+	char *Prepare(size_t want, size_t &room);
+
+	/** Add bytes just read into the room given by Prepare
+	 */
+	void Commit(size_t n)
+	{
+		end += n;
+	}
+
+	/** Add a copy of some data
+	 */
+	void Append(const char *data, size_t len);
+
+	/** Mark bytes at the start of the data as used
+	 */
+	void Consume(size_t n)
+	{
+		start += n;
+		if (start == end)
+			start = end = 0;
+	}
+
+	void Clear()
+	{
+		start = end = 0;
+	}
+
+	/** Find a string in the data
+	 * @param from Where in the data to start looking
+	 * @return Its offset in the data, or std::string::npos
+	 */
+	size_t Find(const char *str, size_t from) const;
+
+	/** Called when a request ends: a block which a large read grew is shrunk again, and
+	 * with nothing left unused the block is given back
+	 */
+	void Reset();
+
+	/** Give back the block, discarding any unused data
+	 */
+	void Release();
+};
 
 /** A modifyable list of HTTP header fields
  */
 class HTTPHeaders
 {
- protected:
+ public:
 	typedef std::map<std::string,std::string,utils::StrCaseLess> HeaderMap;
+ protected:
 	HeaderMap headers;
  public:
 	
@@ -92,6 +185,14 @@ class HTTPHeaders
 		return (it != headers.end());
 	}
 	
+	/** Get all headers
+	 * @return The headers, keyed by name
+	 */
+	const HeaderMap &GetHeaders()
+	{
+		return headers;
+	}
+	
 	/** Get all headers, formatted by the HTTP protocol
 	 * @return Returns all headers, formatted according to the HTTP protocol. There is no request terminator at the end
 	 */
@@ -125,24 +226,29 @@ class CoreExport Connection : public EventHandler
 
 	HttpState State;
 
-	/** Get IP string from sockaddr, using static internal buffer.
-	 * This should not be called after the connection is setup.
-	 * @return The IP string
+	/** Get the headers sent by the client for the current request
+	 * @return The request headers. These are cleared when the request ends.
 	 */
-	const char* GetIPString();
+	HTTPHeaders &GetRequestHeaders()
+	{
+		return headers;
+	}
 
-	/** IP of connection.
+	/** Get the client's IP address as text. It is only formatted the first time it
+	 * is asked for, as most requests never need it.
+	 * @return The IP address, or an empty string if the connection has no address
 	 */
-	std::string ip;
+	const std::string &GetIP();
 
 	/** Connection's send queue.
 	 * Lines waiting to be sent are stored here until their buffer is flushed.
 	 */
 	std::string sendq;
 
-	/** The request buffer from this connection.
+	/** Data read from this connection which hasn't been used yet: the next request, or
+	 * the rest of the request body while one is being received
 	 */
-	std::string requestbuf;
+	RecvBuffer requestbuf;
 
 	/** The last time socket polled as readable/writable, used by idle timeout code
 	 */
@@ -154,11 +260,17 @@ class CoreExport Connection : public EventHandler
 	std::string uri;
 	std::string uriquery;
 	std::string upath;
+
+	/** The method, request-target and version as the client's request line gave them,
+	 * before the URI is cleaned up or anything rewrites the request; for logging
+	 */
+	std::string rawmethod, rawuri, rawversion;
 	enum
 	{
 		HTTP_UNSPECIFIED,
 		HTTP_1_0,
-		HTTP_1_1
+		HTTP_1_1,
+		HTTP_2
 	} http_version;
 	bool keepalive;
 	
@@ -166,31 +278,84 @@ class CoreExport Connection : public EventHandler
 	std::string RequestBody;
 	
 	bool ResponseBufferDone;
+
+	/** The virtual host the current request is for, looked up from its Host header.
+	 * Never NULL; until a request has been read it is the default host.
+	 */
+	VirtualHost *vhost;
+
+	/** When the current request's headers arrived
+	 */
+	timeval RequestStart;
+
+	/** When the first byte of the current response was queued
+	 */
+	timeval ResponseStart;
+
+	/** Status code of the current response, once its headers have been sent
+	 */
+	int ResponseCode;
+
+	/** Bytes written for the current response so far, headers included. A file sent
+	 * by a backend is counted by rfilesent until the request ends.
+	 */
+	unsigned long long ResponseBytes;
 	
 	Backend *ResponseBackend;
 	int filefd;
 	off_t rfilesize, rfilesent;
 
+	/** Type of the file being sent, found by ServeData; NULL for other responses
+	 */
+	const MimeType *rmime;
+
 	/** If this is set to true, then all read/error operations for the connection
 	 * are dropped into the bit-bucket.
 	 * This is used by the global CullList.
 	 */
 	bool quitting;
 
-	/** IPV4 or IPV6 ip address. Use SetSockAddr to set this and GetProtocolFamily/
-	 * GetIPString/GetPort to obtain its values.
+	/** True while the connection is queued by ConnectionManager::SchedulePipeline to
+	 * have further requests from its request buffer processed.
+	 */
+	bool pipelined;
+
+	/** Whether to cork the socket while a response's headers and file are sent (set from
+	 * the bind block the connection arrived on), and whether it is corked now
+	 */
+	bool cork;
+	bool corked;
+
+	/** Storage for privip, so that setting the address doesn't allocate
+	 */
+	sockaddr_storage addr;
+
+	/** IPV4 or IPV6 ip address, exactly as accept() gave it. Use SetSockAddr to set this
+	 * and GetProtocolFamily/GetIP to obtain its values. Points into addr once set.
 	 */
 	sockaddr *privip;
 
+	/** The local port the connection arrived on
+	 */
+	int localport;
+
+	/** The limit rule this connection is counted against by ClientLimiter, or -1
+	 */
+	int limitrule;
+
+	/** GetIP's cached result; empty until it is first called
+	 */
+	std::string ipstring;
+
 	/** Initialize the clients sockaddr
-	 * @param protocol_family The protocol family of the IP address, AF_INET or AF_INET6
-	 * @param ip A human-readable IP address for this connection matching the protcol_family
-	 * @param port The port number of this connection
+	 * @param protocol_family The protocol family of the address, AF_INET or AF_INET6
+	 * @param ip The client's address, of the given family
+	 * @param port The local port number of this connection
 	 */
-	void SetSockAddr(int protocol_family, const char* ip, int port);
+	void SetSockAddr(int protocol_family, const sockaddr *ip, int port);
 
-	/** Get port number from sockaddr
-	 * @return The port number of this connection.
+	/** Get the local port number
+	 * @return The port number this connection arrived on.
 	 */
 	int GetPort();
 
@@ -212,12 +377,32 @@ class CoreExport Connection : public EventHandler
 	 */
 	void ReadData();
 
-	bool AddBuffer(const std::string &a);
+	/** Process data ReadData has just added to the request buffer
+	 * @param newpos Where in the unused data the new data begins
+	 * @return false if the connection should be dropped
+	 */
+	bool AddBuffer(size_t newpos);
+
+	/** Move what belongs to the request body from the request buffer to RequestBody,
+	 * leaving anything after it for the next request, and serve the request once the
+	 * body is complete.
+	 */
+	void TakeRequestBody();
 	
 	void HandleURI();
 	
 	void CheckRequest(int newpos);
 
+	/** Hand a fully received request (headers and any body) to modules, or serve it
+	 * from the document root if no module claims it.
+	 */
+	void ProcessRequest();
+
+	/** Check the client may request the URI, sending a 403 if it may not
+	 * @return False if the request was denied
+	 */
+	bool CheckAccess();
+
 	void ServeData();
 
 	void SendHeaders(unsigned long size, int response, const std::string &rtext, HTTPHeaders &rheaders);
@@ -258,6 +443,21 @@ class CoreExport Connection : public EventHandler
 	 */
 	void FlushWriteBuf();
 
+	/** Send data on the connection's socket without queueing it.
+	 * Modules hooking OnRawSocketWrite (e.g. SSL) are given the data first; otherwise
+	 * it is sent directly. Never blocks.
+	 * @param buf The data to send
+	 * @param len The length of the data
+	 * @return The number of bytes sent, or -1 with errno set (EAGAIN if the socket is full)
+	 */
+	int SendRaw(const char *buf, size_t len);
+
+	/** Hold back (or release) partial segments on the socket, so the headers and start
+	 * of a file go out in the same packet. Does nothing if cork is false.
+	 * @param on true to cork, false to uncork and send whatever is held back
+	 */
+	void Cork(bool on);
+
 	/** Shuts down and closes the connection's socket
 	 * This will not cause the connection to be deleted. Use InspIRCd::QuitConnection for this,
 	 * which will call CloseSocket() for you.
@@ -285,6 +485,15 @@ class CoreExport Connection : public EventHandler
 	/** Default destructor
 	 */
 	virtual ~Connection();
+
+	/** Connections are carved from slabs of fixed size blocks. A culled connection's
+	 * block goes back on a free list for the next accept, rather than to the heap.
+	 */
+	static void *operator new(size_t size);
+
+	/** Return a connection's block to the free list
+	 */
+	static void operator delete(void *p, size_t size);
 };
 
 #endif
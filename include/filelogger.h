@@ -31,6 +31,39 @@ enum DebugLevel
     NONE        =   50
 };
 
+/** Parts of the server that log messages, for use with LOG(). DEBUG and VERBOSE
+ * messages are only logged for the subsystems selected with server::log-subsystems.
+ */
+enum LogSubsystem
+{
+	LS_CORE		=	0x01,	/* Startup, configuration, signals */
+	LS_HTTP		=	0x02,	/* Request parsing and serving */
+	LS_NET		=	0x04,	/* Sockets, buffers, the socket engine */
+	LS_FS		=	0x08,	/* Filesystem access, stat cache, backends */
+	LS_MODULE	=	0x10,	/* Modules */
+	LS_ALL		=	0xff
+};
+
+/** Messages below this level are removed at compile time, arguments and all.
+ * configure sets it above DEBUG for builds without debug information.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 10
+#endif
+
+/** Log a message from a subsystem. Unlike calling InspIRCd::Log() directly, the arguments
+ * are only evaluated if the message will be logged, and messages below LOG_COMPILE_LEVEL
+ * cost nothing at all. LOG expects a 'ServerInstance' in scope, like FOREACH_MOD.
+ */
+#define LOG(level, subsystem, ...) LOG_I(ServerInstance, level, subsystem, __VA_ARGS__)
+
+/** Log a message from a subsystem, through the given InspIRCd instance
+ */
+#define LOG_I(instance, level, subsystem, ...) do { \
+	if (((level) >= LOG_COMPILE_LEVEL) && (instance)->LogEnabled((level), (subsystem))) \
+		(instance)->Log((level), __VA_ARGS__); \
+} while (0)
+
 
 /* Forward declaration -- required */
 class InspIRCd;
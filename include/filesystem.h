@@ -20,12 +20,19 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+class MimeType;
+
 struct StatCacheItem
 {
 	time_t created;
 	struct stat value;
 	int result;
 	int error;
+
+	/** The file's type from MimeManager, once CheckFilePath has looked it up
+	 */
+	bool mimeresolved;
+	const MimeType *mime;
 };
 
 class CoreExport FileSystem
@@ -40,12 +47,38 @@ class CoreExport FileSystem
 	
 	/* Static buffer used for stat results when caching is disabled */
 	struct stat static_stat;
+
+	/* The cache entry behind the last Stat call's result, or NULL if it wasn't cached */
+	StatCacheItem *lastitem;
  public:
 	FileSystem(InspIRCd *Instance);
+
+	/** Stat calls answered from the cache, and those which had to go to the filesystem
+	 * while the cache was enabled
+	 */
+	unsigned long StatCacheHits, StatCacheMisses;
 	
 	int Stat(const char *path, struct stat *&buf, bool followlink = true, bool fromcache = true);
 
-	std::string CheckFilePath(const std::string &basedir, const std::string &path, struct stat *&fst);
+	/** Find the file a request path refers to
+	 * @param basedir The directory the path is relative to
+	 * @param path The request path
+	 * @param fst Set to the stat result of the file found
+	 * @param pathinfo If not NULL, set to any part of the path after the file (beginning with a /)
+	 * @param mime If not NULL, set to the file's type from the server's MimeManager, or NULL if
+	 *  it has none. This is kept with the file's stat cache entry, so is only looked up once.
+	 * @return The full path to the file, or an empty string with errno set on failure. errno
+	 *  is EISDIR if the path is a directory.
+	 */
+	std::string CheckFilePath(const std::string &basedir, const std::string &path, struct stat *&fst, std::string *pathinfo = NULL, const MimeType **mime = NULL);
+
+	/** Find the first of a list of index files which exists in a directory
+	 * @param basedir The directory the path is relative to
+	 * @param path The request path of the directory, ending in a /
+	 * @param names The file names to try, in order
+	 * @return The name of the first which is a regular file, or NULL if none are
+	 */
+	const std::string *FindIndex(const std::string &basedir, const std::string &path, const std::vector<std::string> &names);
 };
 
 #endif
@@ -57,6 +57,11 @@ namespace utils
 	 * @return True for success or false for failure (invalid chars)
 	 */
 	CoreExport bool unhexchar(char &dest, char a, char b);
+
+	/** Percent-encode a decoded request path so it can be sent back in a URL; slashes
+	 * and the other characters allowed in a path are left alone
+	 */
+	CoreExport std::string urlencodepath(const std::string &path);
 	
 	/** utils::stringjoiner joins string lists into a string, using
 	 * the given seperator string.
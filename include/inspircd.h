@@ -37,6 +37,7 @@
 #include <string>
 #include <sstream>
 #include <list>
+#include <deque>
 #include "inspircd_config.h"
 #include "connections.h"
 #include "socket.h"
@@ -48,6 +49,10 @@
 #include "modules.h"
 #include "configreader.h"
 #include "mimetypes.h"
+#include "vhosts.h"
+#include "clientlimits.h"
+#include "acl.h"
+#include "rewrite.h"
 #include "connectionmanager.h"
 #include "filesystem.h"
 
@@ -236,6 +241,14 @@ class CoreExport InspIRCd : public classbase
 	ConnectionManager *Connections;
 
 	MimeManager *MimeTypes;
+
+	VHostManager *VHosts;
+
+	ClientLimiter *Limits;
+
+	AccessControl *ACLs;
+
+	RewriteManager *Rewrites;
 	
 	FileSystem *FileSys;
 	
@@ -397,6 +410,23 @@ class CoreExport InspIRCd : public classbase
 	 */
 	void Log(int level, const std::string &text);
 
+	/** Check whether a message of a level, from a subsystem, would be logged.
+	 * Used by LOG() to skip formatting messages nobody will see.
+	 * @param level The message's level
+	 * @param subsystem The LogSubsystem logging it
+	 * @return True if the message should be logged
+	 */
+	bool LogEnabled(int level, int subsystem)
+	{
+		if (!this->Config || !this->Logger)
+			return false;
+
+		if (Config->forcedebug)
+			return true;
+
+		return (level >= Config->LogLevel) && ((level >= DEFAULT) || (Config->LogSubsystems & subsystem));
+	}
+
 	/** Restart the server.
 	 * This function will not return. If an error occurs,
 	 * it will throw an instance of CoreException.
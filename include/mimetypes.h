@@ -1,23 +1,106 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
 
 #ifndef __MIMETYPES_H__
 #define __MIMETYPES_H__
 
+/** A file extension's MIME type
+ */
+class CoreExport MimeType
+{
+ public:
+	/** The extension, without the dot, in lower case
+	 */
+	std::string ext;
+
+	std::string type;
+
+	/** "Content-Type: type\r\n", ready to be written with a response's headers
+	 */
+	std::string header;
+
+	void SetType(const std::string &t)
+	{
+		type = t;
+		header = "Content-Type: " + t + "\r\n";
+	}
+};
+
+/** Maps file extensions to MIME types.
+ *
+ * Types are held in an open-addressed hash table keyed on the lower cased extension,
+ * and lookups ignore case without copying the extension. Once added a MimeType is never
+ * moved or freed (adding the extension again changes it in place), so the pointers
+ * lookups return can be kept, as the stat cache does.
+ */
 class CoreExport MimeManager : public classbase
 {
-	std::map<std::string, std::string>MimeTypes;
+	/** Table slots; always a power of two in size, and never more than half full
+	 */
+	std::vector<MimeType *> table;
+	size_t count;
+
+	MimeType deftype;
+
+	static size_t Hash(const char *ext, size_t len);
+
+	/** Find the slot for an extension: the one holding it, or the empty one it would go in
+	 */
+	size_t Slot(const char *ext, size_t len) const;
+
+	void Grow();
+
  public:
 	InspIRCd *ServerInstance;
 
-	MimeManager(InspIRCd *Instance) : ServerInstance(Instance)
+	MimeManager(InspIRCd *Instance);
+
+	~MimeManager();
+
+	void AddType(const std::string &ext, const std::string &type);
+
+	/** Add the common types hottpd knows without a mime.types file
+	 */
+	void AddBuiltinTypes();
+
+	/** Add the types from a file in the format of mime.types(5): a type, then the
+	 * extensions for it, separated by whitespace, with # starting a comment.
+	 * @return False, with errno set, if the file couldn't be read
+	 */
+	bool LoadFile(const std::string &filename);
+
+	/** Set the type for files with no extension, or one not known
+	 */
+	void SetDefault(const std::string &type)
 	{
+		deftype.SetType(type);
 	}
 
-	~MimeManager()
+	const MimeType *GetDefault()
 	{
+		return &deftype;
 	}
 
-	void AddType(const std::string &ext, const std::string &type);
+	/** Find the type for an extension (without the dot), in any case
+	 * @return The type, or NULL if the extension isn't known
+	 */
+	const MimeType *Find(const char *ext, size_t len) const;
+
+	/** Find the type for a file from the extension of its last path component
+	 * @return The type, or NULL if there is no extension or it isn't known
+	 */
+	const MimeType *FindForPath(const std::string &path) const;
 
+	/** Get the type name for an extension, or an empty string if it isn't known
+	 */
 	const std::string GetType(const std::string &ext);
 };
 
@@ -327,7 +327,7 @@ enum Implementation
 	I_OnEvent, I_OnRequest,
 	I_OnRawSocketAccept, I_OnRawSocketClose, I_OnRawSocketWrite, I_OnRawSocketRead,
 	I_OnRawSocketConnect, I_OnGarbageCollect, I_OnBufferFlushed,
-	I_OnPreRequest,
+	I_OnPreRequest, I_OnUpgrade, I_OnUpgradedData, I_OnRequestComplete, I_OnReopenLogs,
 	I_END
 };
 
@@ -377,6 +377,40 @@ class CoreExport Module : public Extensible
 	 */
 	virtual int OnPreRequest(Connection *c, const std::string &m, const std::string &v, const std::string &d, const std::string &f);
 
+	/** Called when a client asks to switch the connection to another protocol.
+	 * At present this happens when the connection begins with the HTTP/2 connection preface,
+	 * in which case protocol is "h2". If you return nonzero, the connection is yours: its state
+	 * is HTTP_UPGRADED, the core will not parse any more requests from it, and everything read
+	 * from it is passed to OnUpgradedData. Anything already read after the preface is left in
+	 * c->requestbuf (see RecvBuffer::Data) for you to take; it is cleared when you return. Write
+	 * to it as usual with Connection::Write.
+	 * @param c The connection
+	 * @param protocol The protocol requested
+	 * @return nonzero to take the connection
+	 */
+	virtual int OnUpgrade(Connection *c, const std::string &protocol);
+
+	/** Called with data read from a connection which a module took over in OnUpgrade.
+	 * Every module implementing this is called; ignore connections which are not yours.
+	 * @param c The connection
+	 * @param data The data read (may contain NUL bytes). This points into the connection's
+	 * read buffer, which is cleared when you return.
+	 * @param len The number of bytes read
+	 */
+	virtual void OnUpgradedData(Connection *c, const char *data, size_t len);
+
+	/** Called when a response has been completely written (or queued) and the request ends.
+	 * The request's method, uri, headers and http_version are still set, along with
+	 * c->ResponseCode, c->ResponseBytes and c->RequestStart.
+	 * @param c The connection
+	 */
+	virtual void OnRequestComplete(Connection *c);
+
+	/** Called when the server is sent SIGUSR1, asking for log files to be reopened
+	 * (after they have been rotated, for instance).
+	 */
+	virtual void OnReopenLogs();
+
 	/** Called when a user connects.
 	 * The details of the connecting user are available to you in the parameter Connection *user
 	 * @param user The user who is connecting
@@ -0,0 +1,141 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+#ifndef __REWRITE_H__
+#define __REWRITE_H__
+
+#include "inspircd_config.h"
+#include "hash_map.h"
+#include <string>
+#include <vector>
+#include <regex.h>
+
+/** A rewrite or redirect tag
+ */
+class CoreExport RewriteRule : public classbase
+{
+ public:
+	/** What a URI must do to match, beyond starting with the pattern's literal prefix
+	 */
+	enum MatchType
+	{
+		/** Be the pattern, which has no wildcards */
+		MATCH_EXACT,
+		/** Nothing; the pattern is a literal prefix and a trailing * */
+		MATCH_PREFIX,
+		/** Match the pattern's * and ? wildcards */
+		MATCH_WILDCARD,
+		/** Match the regex */
+		MATCH_REGEX
+	};
+
+	MatchType type;
+
+	/** The wildcard pattern or extended regular expression
+	 */
+	std::string pattern;
+
+	/** The characters every matching URI starts with
+	 */
+	std::string prefix;
+
+	/** The compiled regex, for MATCH_REGEX
+	 */
+	regex_t regex;
+
+	/** The URI or URL matching requests go to, with $1 to $9 standing for what the
+	 * pattern's wildcards or groups matched, and $0 for all of it
+	 */
+	std::string target;
+
+	/** The status to redirect with, or 0 to serve target instead
+	 */
+	int status;
+	std::string statustext;
+
+	/** Parse a pattern; throws CoreException if it is invalid
+	 */
+	RewriteRule(const std::string &match, bool isregex, const std::string &to, int redirect);
+
+	~RewriteRule();
+};
+
+/** URL rewrites and redirects, from rewrite and redirect tags.
+ *
+ * Exact patterns are held in a hash table. Every other pattern is indexed by its literal
+ * prefix (everything before its first wildcard, or for a regex anchored with ^, before its
+ * first special character) in a trie, so one pass over the URI finds the few rules which
+ * could match it however many there are, and only those are tried. The first rule which
+ * matches, in the order they were given, wins.
+ */
+class CoreExport RewriteManager : public classbase
+{
+	/** Rules whose prefix ends at a trie node, in order
+	 */
+	struct TrieNode
+	{
+		std::vector<size_t> rules;
+	};
+
+	typedef nspace::hash_map<std::string, size_t, HostHash> ExactMap;
+
+	InspIRCd *ServerInstance;
+
+	std::vector<RewriteRule *> rules;
+
+	std::vector<RewriteRule *> pending;
+
+	ExactMap exact;
+
+	/** Node 0 is the root, for rules with no prefix
+	 */
+	std::vector<TrieNode> nodes;
+
+	/** Edges of the trie, keyed by node * 256 + the next character
+	 */
+	nspace::hash_map<unsigned long, size_t> edges;
+
+	/** Scratch space for lookups, kept to avoid an allocation for each
+	 */
+	std::vector<size_t> candidates;
+
+	void Clear(std::vector<RewriteRule *> &list);
+
+	/** Index a rule's prefix in the trie
+	 */
+	void AddPrefix(const std::string &prefix, size_t rule);
+
+ public:
+	RewriteManager(InspIRCd *Instance);
+
+	~RewriteManager();
+
+	/** Called before the first rewrite or redirect tag is read
+	 */
+	void Begin();
+
+	/** Add a rule read from the config; it is used once Apply() is called
+	 */
+	void Add(RewriteRule *rule);
+
+	/** Build the lookup tables from the rules added since Begin(), replacing the old ones
+	 */
+	void Apply();
+
+	/** Find the first rule matching a URI
+	 * @param uri The URI, after it has been cleaned up by HandleURI
+	 * @param target Set to the rule's target, with what the pattern matched substituted in
+	 * @return The rule, or NULL if none match
+	 */
+	const RewriteRule *Find(const std::string &uri, std::string &target);
+};
+
+#endif
@@ -139,6 +139,33 @@ namespace utils
 	}
 }
 
+/** Socket options from a bind block, for the listener and the connections it accepts
+ */
+struct ListenOptions
+{
+	/** Seconds to hold a new connection in the kernel until it sends data (TCP_DEFER_ACCEPT), or 0
+	 */
+	int deferaccept;
+	/** Length of the TCP Fast Open queue, or 0 to not accept data in the SYN
+	 */
+	int fastopen;
+	/** SO_SNDBUF and SO_RCVBUF for accepted connections, or 0 to leave them to the kernel
+	 */
+	int sndbuf;
+	int rcvbuf;
+	/** Disable Nagle's algorithm on accepted connections
+	 */
+	bool nodelay;
+	/** Hold back partial segments while a response's headers and file are being sent, so
+	 * they go out together (TCP_CORK, or TCP_NOPUSH on BSD)
+	 */
+	bool cork;
+
+	ListenOptions() : deferaccept(0), fastopen(0), sndbuf(0), rcvbuf(0), nodelay(true), cork(true)
+	{
+	}
+};
+
 /** This class handles incoming connections on client ports.
  * It will create a new User for every valid connection
  * and assign it a file descriptor.
@@ -157,16 +184,30 @@ class CoreExport ListenSocket : public EventHandler
 	std::string bind_addr;
 	/** Port socket is bound to */
 	int bind_port;
+	/** Options from the bind block */
+	ListenOptions options;
+	/** True while removed from the socket engine by Pause */
+	bool paused;
+
+	/** Apply the per-connection options to a newly accepted socket
+	 */
+	void SetupAccepted(int nfd);
  public:
 	/** Create a new listening socket
 	 */
-	ListenSocket(InspIRCd* Instance, int port, char* addr);
+	ListenSocket(InspIRCd* Instance, int port, char* addr, const ListenOptions &opts);
 	/** Handle an I/O event
 	 */
 	void HandleEvent(EventType et, int errornum = 0);
 	/** Close the socket
 	 */
 	~ListenSocket();
+	/** Stop watching for new connections, leaving them queued in the kernel
+	 */
+	void Pause();
+	/** Start watching for new connections again after Pause
+	 */
+	void Resume();
 	/** Set descriptive text
 	 */
 	void SetDescription(const std::string &description)
@@ -279,7 +279,8 @@ public:
 	virtual bool BoundsCheckFd(EventHandler* eh);
 
 	/** Abstraction for BSD sockets accept(2).
-	 * This function should emulate its namesake system call exactly.
+	 * This function should emulate its namesake system call, except that the new socket
+	 * is returned non-blocking and close-on-exec (in one call, with accept4, where possible).
 	 * @param fd This version of the call takes an EventHandler instead of a bare file descriptor.
 	 * @return This method should return exactly the same values as the system call it emulates.
 	 */
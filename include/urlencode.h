@@ -12,9 +12,16 @@
 #ifndef __URLENCODE_H__
 #define __URLENCODE_H__
 
-class URIQueryString
+#include <map>
+#include <string>
+#include "hashcomp.h"
+
+/** The decoded keys and values of a query string, such as Connection::uriquery, which
+ * HandleURI leaves encoded. + is a space, and %XX escapes are decoded; a % which doesn't
+ * start one is dropped. Keys are case insensitive, and may be given more than once, or without a value.
+ */
+class CoreExport URIQueryString
 {
- private
 	typedef std::multimap<std::string,std::string,utils::StrCaseLess> ValueMap;
 	
 	ValueMap Values;
@@ -26,6 +33,8 @@ class URIQueryString
 		return (Values.find(key) != Values.end());
 	}
 	
+	/** Get the first value of a key, or an empty string if it isn't set
+	 */
 	std::string Get(const std::string &key)
 	{
 		ValueMap::iterator it = Values.find(key);
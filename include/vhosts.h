@@ -0,0 +1,181 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+#ifndef __VHOSTS_H__
+#define __VHOSTS_H__
+
+#include "inspircd_config.h"
+#include "hash_map.h"
+#include <string>
+#include <vector>
+#include <map>
+#include "mimetypes.h"
+
+/** FNV-1a, for hashing host names; the standard library has no hash for std::string here
+ */
+struct HostHash
+{
+	size_t operator()(const std::string &s) const
+	{
+		size_t h = 2166136261U;
+		for (std::string::const_iterator i = s.begin(); i != s.end(); i++)
+			h = (h ^ (unsigned char)*i) * 16777619U;
+		return h;
+	}
+};
+
+/** A name-based virtual host, from a vhost tag
+ */
+class CoreExport VirtualHost : public classbase
+{
+ public:
+	/** The primary name, used in logs and for SERVER_NAME
+	 */
+	std::string name;
+
+	/** Names and *.suffix wildcards this host answers to, including name
+	 */
+	std::vector<std::string> aliases;
+
+	/** Base directory for files served on this host. The stat cache is keyed by full
+	 * path, so each document root has its own entries in it.
+	 */
+	std::string docroot;
+
+	/** File names tried, in order, for a request for a directory. The server's if
+	 * the vhost tag doesn't give any.
+	 */
+	std::vector<std::string> indexes;
+
+	/** Maximum size of a POST body on this host
+	 */
+	int maxpostbody;
+
+	/** MIME types which override the server's for this host, or NULL if there are none
+	 */
+	MimeManager *mimetypes;
+
+	VirtualHost();
+
+	~VirtualHost();
+
+	/** Get this host's override for the type of a file, or NULL
+	 */
+	const MimeType *FindType(const std::string &path)
+	{
+		return mimetypes ? mimetypes->FindForPath(path) : NULL;
+	}
+};
+
+/** Finds the virtual host for a Host header.
+ *
+ * Exact names are held in a hash table. Wildcards (*.example.com) are held in a trie
+ * of host labels read from the right, so a lookup costs one hash probe per label of
+ * the requested name however many hosts are configured, and the most specific wildcard
+ * wins. Anything which matches nothing gets the default host, which is built from the
+ * server tag.
+ */
+class CoreExport VHostManager : public classbase
+{
+	typedef nspace::hash_map<std::string, VirtualHost *, HostHash> HostMap;
+
+	/** A level of the wildcard trie
+	 */
+	struct SuffixNode
+	{
+		/** Host for *. followed by the labels leading here, if any
+		 */
+		VirtualHost *wildcard;
+
+		nspace::hash_map<std::string, SuffixNode *, HostHash> children;
+
+		SuffixNode() : wildcard(NULL)
+		{
+		}
+
+		~SuffixNode();
+	};
+
+	InspIRCd *ServerInstance;
+
+	HostMap exact;
+
+	SuffixNode *wildcards;
+
+	std::vector<VirtualHost *> hosts;
+
+	/** Hosts read so far from the config being loaded, and their names; swapped in
+	 * by Apply(), so a bad config leaves the tables in use alone
+	 */
+	std::vector<VirtualHost *> pending;
+
+	HostMap pendingexact;
+
+	SuffixNode *pendingwildcards;
+
+	VirtualHost defaulthost;
+
+	/** Scratch space for lookups, kept to avoid an allocation for each
+	 */
+	std::string key, label;
+
+	void Clear();
+
+	/** Index a name or wildcard for a pending host, throwing CoreException if it is
+	 * invalid or taken
+	 */
+	void AddName(VirtualHost *vh, const std::string &name);
+
+ public:
+	/** The largest POST body any host accepts, for modules which buffer a body
+	 * before the host it is for has been looked up
+	 */
+	int LargestPostBody;
+
+	VHostManager(InspIRCd *Instance);
+
+	~VHostManager();
+
+	/** Called before the first vhost tag is read
+	 */
+	void Begin();
+
+	/** Add a host read from the config, with all of its aliases; it is used once Apply()
+	 * is called. Throws CoreException if a name is invalid or already claimed by another
+	 * host, before anything in use has changed.
+	 */
+	void Add(VirtualHost *vh);
+
+	/** Replace the hosts in use with those added since Begin()
+	 */
+	void Apply();
+
+	/** Find the host for the value of a Host header. Case, any port and a trailing dot
+	 * are ignored. Never returns NULL.
+	 */
+	VirtualHost *Find(const std::string &host);
+
+	/** The host used when no other matches
+	 */
+	VirtualHost *GetDefault()
+	{
+		return &defaulthost;
+	}
+
+	/** All configured hosts, not including the default
+	 */
+	const std::vector<VirtualHost *> &GetHosts()
+	{
+		return hosts;
+	}
+};
+
+#endif
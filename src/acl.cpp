@@ -0,0 +1,346 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+/* $Core: libhttpd_acl */
+
+#include "inspircd.h"
+#include <fstream>
+
+/** Get bit n of an address, counting from the most significant bit of the first byte
+ */
+static inline int Bit(const unsigned char *addr, unsigned int n)
+{
+	return (addr[n >> 3] >> (7 - (n & 7))) & 1;
+}
+
+/** Count the leading bits two addresses have in common, up to max
+ */
+static unsigned int CommonBits(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+	unsigned int bits = 0;
+	for (unsigned int i = 0; bits < max; i++)
+	{
+		unsigned char diff = a[i] ^ b[i];
+		if (!diff)
+		{
+			bits += 8;
+			continue;
+		}
+
+		while (!(diff & 0x80))
+		{
+			diff <<= 1;
+			bits++;
+		}
+		break;
+	}
+	return std::min(bits, max);
+}
+
+CIDRTrie::CIDRTrie() : count(0)
+{
+	roots[0] = roots[1] = -1;
+}
+
+void CIDRTrie::Clear()
+{
+	nodes.clear();
+	roots[0] = roots[1] = -1;
+	count = 0;
+}
+
+int CIDRTrie::NewNode(const unsigned char *prefix, unsigned int bits, int value)
+{
+	Node n;
+	memset(&n, 0, sizeof(n));
+	memcpy(n.prefix, prefix, (bits + 7) / 8);
+	if (bits & 7)
+		n.prefix[bits / 8] &= (unsigned char)(0xFF << (8 - (bits & 7)));
+	n.bits = bits;
+	n.value = value;
+	n.child[0] = n.child[1] = -1;
+	nodes.push_back(n);
+	return nodes.size() - 1;
+}
+
+void CIDRTrie::Add(int family, const unsigned char *addr, unsigned int bits, int value)
+{
+	int r = (family == AF_INET) ? 0 : 1;
+	bits = std::min(bits, r ? 128U : 32U);
+
+	/* Where the node being looked at hangs from; nodes may move as others are added, so
+	 * this is kept as an index rather than a pointer */
+	int parent = -1, dir = 0;
+	int cur = roots[r];
+
+	while (cur >= 0)
+	{
+		unsigned int nbits = nodes[cur].bits;
+		unsigned int common = CommonBits(addr, nodes[cur].prefix, std::min(bits, nbits));
+
+		if ((common == nbits) && (common == bits))
+		{
+			/* Already here; perhaps only as a join between two others */
+			if (nodes[cur].value < 0)
+				count++;
+			nodes[cur].value = value;
+			return;
+		}
+
+		if (common == nbits)
+		{
+			/* Goes somewhere below this node */
+			parent = cur;
+			dir = Bit(addr, nbits);
+			cur = nodes[cur].child[dir];
+			continue;
+		}
+
+		int n;
+		if (common == bits)
+		{
+			/* A shorter prefix of this node; it goes above it */
+			n = NewNode(addr, bits, value);
+			nodes[n].child[Bit(nodes[cur].prefix, bits)] = cur;
+		}
+		else
+		{
+			/* The two differ after common bits, so join them there */
+			n = NewNode(addr, common, -1);
+			int leaf = NewNode(addr, bits, value);
+			nodes[n].child[Bit(addr, common)] = leaf;
+			nodes[n].child[Bit(nodes[cur].prefix, common)] = cur;
+		}
+
+		if (parent < 0)
+			roots[r] = n;
+		else
+			nodes[parent].child[dir] = n;
+		count++;
+		return;
+	}
+
+	int n = NewNode(addr, bits, value);
+	if (parent < 0)
+		roots[r] = n;
+	else
+		nodes[parent].child[dir] = n;
+	count++;
+}
+
+bool CIDRTrie::Add(const std::string &mask, int value)
+{
+	if (mask == "*")
+	{
+		unsigned char any[16];
+		memset(any, 0, sizeof(any));
+		Add(AF_INET, any, 0, value);
+		Add(AF_INET6, any, 0, value);
+		return true;
+	}
+
+	std::string::size_type slash = mask.find('/');
+	std::string addr = mask.substr(0, slash);
+	int family = (addr.find(':') == std::string::npos) ? AF_INET : AF_INET6;
+	int maxbits = (family == AF_INET) ? 32 : 128;
+	int bits = maxbits;
+
+	if (slash != std::string::npos)
+	{
+		std::string len = mask.substr(slash + 1);
+		if (len.empty() || (len.find_first_not_of("0123456789") != std::string::npos))
+			return false;
+		bits = atoi(len.c_str());
+	}
+
+	unsigned char raw[16];
+	if ((inet_pton(family, addr.c_str(), raw) <= 0) || (bits > maxbits))
+		return false;
+
+	Add(family, raw, bits, value);
+	return true;
+}
+
+int CIDRTrie::Find(int family, const unsigned char *addr) const
+{
+	int r = (family == AF_INET) ? 0 : 1;
+	unsigned int maxbits = r ? 128 : 32;
+	int best = -1;
+
+	for (int cur = roots[r]; cur >= 0; )
+	{
+		const Node &n = nodes[cur];
+		if (!utils::sockets::MatchCIDRBits(const_cast<unsigned char *>(addr), const_cast<unsigned char *>(n.prefix), n.bits))
+			break;
+
+		if (n.value >= 0)
+			best = n.value;
+		if (n.bits >= maxbits)
+			break;
+
+		cur = n.child[Bit(addr, n.bits)];
+	}
+
+	return best;
+}
+
+int CIDRTrie::Find(const sockaddr *sa) const
+{
+	if (sa->sa_family == AF_INET)
+		return Find(AF_INET, (const unsigned char *)&((const sockaddr_in *)sa)->sin_addr);
+
+	if (sa->sa_family == AF_INET6)
+	{
+		const in6_addr &a = ((const sockaddr_in6 *)sa)->sin6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(&a))
+			return Find(AF_INET, a.s6_addr + 12);
+		return Find(AF_INET6, a.s6_addr);
+	}
+
+	return -1;
+}
+
+AccessControl::AccessControl(InspIRCd *Instance) : ServerInstance(Instance), Denied(0)
+{
+}
+
+AccessControl::~AccessControl()
+{
+	Clear(acls);
+	Clear(pending);
+}
+
+void AccessControl::Clear(std::vector<PathACL *> &list)
+{
+	for (std::vector<PathACL *>::iterator i = list.begin(); i != list.end(); i++)
+		delete *i;
+	list.clear();
+}
+
+void AccessControl::Begin()
+{
+	Clear(pending);
+}
+
+void AccessControl::AddMasks(PathACL *acl, const std::string &masks, int value, const std::string &source)
+{
+	utils::spacesepstream tokens(masks);
+	std::string mask;
+	while (tokens.GetToken(mask))
+	{
+		if (!acl->masks.Add(mask, value))
+			throw CoreException("Invalid mask " + mask + " in " + source + "; use a CIDR mask such as 192.0.2.0/24, or *");
+		if (value)
+			acl->hasallow = true;
+		else
+			acl->hasdeny = true;
+	}
+}
+
+void AccessControl::AddFile(PathACL *acl, const std::string &filename, int value)
+{
+	std::ifstream file(filename.c_str());
+	if (!file)
+		throw CoreException("Can't read ACL file " + filename + ": " + strerror(errno));
+
+	std::string line;
+	int lineno = 0;
+	while (std::getline(file, line))
+	{
+		lineno++;
+		std::string::size_type hash = line.find('#');
+		if (hash != std::string::npos)
+			line.erase(hash);
+		AddMasks(acl, line, value, filename + ":" + ConvToStr(lineno));
+	}
+}
+
+void AccessControl::Add(const std::string &path, const std::string &allow, const std::string &deny,
+	const std::string &allowfile, const std::string &denyfile, const std::string &def)
+{
+	if (path.empty() || (path[0] != '/'))
+		throw CoreException("The path of an acl must begin with /: " + path);
+	if (!def.empty() && (def != "allow") && (def != "deny"))
+		throw CoreException("The default of an acl must be allow or deny, not " + def);
+
+	PathACL *acl = NULL;
+	for (std::vector<PathACL *>::iterator i = pending.begin(); i != pending.end(); i++)
+	{
+		if ((*i)->path == path)
+			acl = *i;
+	}
+
+	if (!acl)
+	{
+		acl = new PathACL;
+		acl->path = path;
+		acl->defaultallow = -1;
+		acl->hasallow = acl->hasdeny = false;
+		pending.push_back(acl);
+	}
+
+	if (!def.empty())
+		acl->defaultallow = (def == "allow");
+
+	/* Denies are added last, so a mask given as both is denied */
+	std::string source = "the acl for " + path;
+	AddMasks(acl, allow, 1, source);
+	if (!allowfile.empty())
+		AddFile(acl, allowfile, 1);
+	AddMasks(acl, deny, 0, source);
+	if (!denyfile.empty())
+		AddFile(acl, denyfile, 0);
+}
+
+/** Sorts lists by the length of their path, longest first
+ */
+static bool LongerPath(const AccessControl::PathACL *a, const AccessControl::PathACL *b)
+{
+	return a->path.length() > b->path.length();
+}
+
+void AccessControl::Apply()
+{
+	Clear(acls);
+	acls.swap(pending);
+
+	for (std::vector<PathACL *>::iterator i = acls.begin(); i != acls.end(); i++)
+	{
+		if ((*i)->defaultallow < 0)
+			(*i)->defaultallow = !((*i)->hasallow && !(*i)->hasdeny);
+
+		LOG(DEFAULT, LS_CORE, "ACL for %s: %lu masks, default %s", (*i)->path.c_str(), (unsigned long)(*i)->masks.Count(),
+			(*i)->defaultallow ? "allow" : "deny");
+	}
+
+	/* The first list whose path a URI falls under is then the most specific */
+	std::stable_sort(acls.begin(), acls.end(), LongerPath);
+}
+
+bool AccessControl::Allowed(const sockaddr *sa, const std::string &uri)
+{
+	for (std::vector<PathACL *>::iterator i = acls.begin(); i != acls.end(); i++)
+	{
+		const std::string &path = (*i)->path;
+
+		/* /private covers /private and /private/..., but not /privateer */
+		if (uri.compare(0, path.length(), path) || ((path[path.length() - 1] != '/') && (uri.length() > path.length()) && (uri[path.length()] != '/')))
+			continue;
+
+		int value = (*i)->masks.Find(sa);
+		bool allowed = (value < 0) ? ((*i)->defaultallow != 0) : (value != 0);
+		if (!allowed)
+			Denied++;
+		return allowed;
+	}
+
+	return true;
+}
@@ -6,16 +6,16 @@
 
 WriteBackend *WriteBackend::Instance = NULL;
 
-int WriteBackend::ServeFile(int sockfd, int filefd, off_t &sent, off_t filesize)
+int WriteBackend::ServeFile(Connection *c, int filefd, off_t &sent, off_t filesize)
 {
 	char *fdata = (char*) mmap(NULL, filesize, PROT_READ, MAP_SHARED, filefd, 0);
 	if (fdata == MAP_FAILED)
 	{
-		ServerInstance->Log(DEBUG, "mmap to serve file failed: %s", strerror(errno));
+		LOG(DEBUG, LS_FS, "mmap to serve file failed: %s", strerror(errno));
 		return -1;
 	}
 	
-	ssize_t re = send(sockfd, fdata + sent, filesize - sent, MSG_DONTWAIT);
+	ssize_t re = c->SendRaw(fdata + sent, filesize - sent);
 
 	munmap(fdata, filesize);
 
@@ -24,7 +24,7 @@ int WriteBackend::ServeFile(int sockfd, int filefd, off_t &sent, off_t filesize)
 		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
 			return 0;
 		
-		ServerInstance->Log(DEBUG, "send to serve file to %d failed: %s", sockfd, strerror(errno));
+		LOG(DEBUG, LS_FS, "send to serve file to %d failed: %s", c->GetFd(), strerror(errno));
 		return -1;
 	}
 	
@@ -15,37 +15,180 @@
 #include <stdarg.h>
 #include "socketengine.h"
 #include "wildcard.h"
+#ifndef WIN32
+#include <netinet/tcp.h>
+#endif
 
-void Connection::ReadData()
+/** Most read from a connection at once while a request body is arriving
+ */
+#define READ_SIZE 65536
+
+/** Least room given to any read. Modules decrypting in the read hook need room for a
+ * whole TLS record, or what they have decrypted would wait in the library unseen.
+ */
+#define RECV_MIN_READ 16384
+
+/** Size of a connection's read buffer, unless a large read has grown it
+ */
+#define RECV_BUFFER_SIZE 32768
+
+/** Most blocks of RECV_BUFFER_SIZE kept for reuse */
+#define MAX_SPARE_BLOCKS 1024
+
+static std::vector<char *> SpareBlocks;
+
+void RecvBuffer::Resize(size_t newsize)
 {
-	/** A large buffer that may be read into.
-	 */
-	static char ReadBuffer[65535]; // if you change this size, remember to change the read() call below!
+	char *newblock;
+	if ((newsize == RECV_BUFFER_SIZE) && !SpareBlocks.empty())
+	{
+		newblock = SpareBlocks.back();
+		SpareBlocks.pop_back();
+	}
+	else
+	{
+		newblock = (char *)malloc(newsize);
+		if (!newblock)
+			throw CoreException("Out of memory for a read buffer");
+	}
+
+	if (end > start)
+		memcpy(newblock, block + start, end - start);
+	end -= start;
+	start = 0;
+
+	char *old = block;
+	size_t oldsize = size;
+	block = newblock;
+	size = newsize;
+
+	if (old)
+	{
+		if ((oldsize == RECV_BUFFER_SIZE) && (SpareBlocks.size() < MAX_SPARE_BLOCKS))
+			SpareBlocks.push_back(old);
+		else
+			free(old);
+	}
+}
+
+char *RecvBuffer::Prepare(size_t want, size_t &room)
+{
+	if (size - end < want)
+	{
+		if (start && (size - Length() >= want))
+		{
+			/* There is room once the used data is dropped from the front */
+			memmove(block, block + start, end - start);
+			end -= start;
+			start = 0;
+		}
+		else
+		{
+			size_t newsize = size ? size : RECV_BUFFER_SIZE;
+			while (newsize - Length() < want)
+				newsize *= 2;
+			Resize(newsize);
+		}
+	}
+
+	room = size - end;
+	return block + end;
+}
+
+void RecvBuffer::Append(const char *data, size_t len)
+{
+	size_t room;
+	memcpy(Prepare(len, room), data, len);
+	Commit(len);
+}
 
+size_t RecvBuffer::Find(const char *str, size_t from) const
+{
+	size_t len = strlen(str);
+	if (Length() < from + len)
+		return std::string::npos;
+
+	const char *p = block + start + from;
+	const char *last = block + end - len;
+
+	for (; p <= last; p++)
+	{
+		p = (const char *)memchr(p, *str, last - p + 1);
+		if (!p)
+			break;
+		if (!memcmp(p, str, len))
+			return p - (block + start);
+	}
+
+	return std::string::npos;
+}
+
+void RecvBuffer::Reset()
+{
+	if (start == end)
+		Release();
+	else if ((size > RECV_BUFFER_SIZE) && (Length() <= RECV_BUFFER_SIZE / 2))
+		Resize(RECV_BUFFER_SIZE);
+}
+
+void RecvBuffer::Release()
+{
+	if (block)
+	{
+		if ((size == RECV_BUFFER_SIZE) && (SpareBlocks.size() < MAX_SPARE_BLOCKS))
+			SpareBlocks.push_back(block);
+		else
+			free(block);
+	}
+
+	block = NULL;
+	start = end = size = 0;
+}
+
+void Connection::ReadData()
+{
 	int result = EAGAIN;
 
 	if (this->GetFd() == FD_MAGIC_NUMBER)
 		return;
 
+	/* Data is read straight into the free space after what hasn't been used yet. A
+	 * request body is taken from there too, so a large one is given bigger reads. */
+	size_t want = RECV_MIN_READ;
+	if ((State == HTTP_RECV_REQBODY) && (RequestBodyLength - RequestBody.length() > want))
+		want = std::min((size_t)(RequestBodyLength - RequestBody.length()), (size_t)READ_SIZE);
+
+	size_t room;
+	char *tail = requestbuf.Prepare(want, room);
+	size_t had = requestbuf.Length();
+	if (room > READ_SIZE)
+		room = READ_SIZE;
+
+	/* Modules wrapping the connection (e.g. SSL) get first go at the read. */
+	int MOD_RESULT = 0;
+	int modresult = 0;
+	FOREACH_RESULT_I(ServerInstance, I_OnRawSocketRead, OnRawSocketRead(this->fd, tail, room, modresult));
+
+	if (MOD_RESULT)
+		result = modresult;
+	else
 #ifndef WIN32
-	result = read(this->fd, (char *)ReadBuffer, 65535);
+		result = read(this->fd, tail, room);
 #else
-	result = recv(this->fd, (char*)ReadBuffer, 65535, 0);
+		result = recv(this->fd, tail, room, 0);
 #endif
 
+	if (result > 0)
+		requestbuf.Commit(result);
+	else if (!requestbuf.Length())
+		requestbuf.Release();
+
 	if ((result) && (result != -EAGAIN))
 	{
-		int currfd;
-
-		if (result > 0)
-			ReadBuffer[result] = '\0';
-
-		currfd = this->GetFd();
-
-		// add the data to the connection's buffer (which will process it if necessary)
+		// process the new data in the connection's buffer
 		if (result > 0)
 		{
-			if (!this->AddBuffer(ReadBuffer))
+			if (!this->AddBuffer(had))
 			{
 				// fuck, something exploded
 				ServerInstance->Connections->Delete(this);
@@ -74,70 +217,93 @@ void Connection::ReadData()
 	}
 }
 
-bool Connection::AddBuffer(const std::string &a)
+void Connection::TakeRequestBody()
 {
-	if (!a.length())
+	/*
+	 * Note!
+	 *
+	 * Don't be clever here, we *must* only take what we can to the request body
+	 * (i.e. NO MORE than RequestBodyLength!). It would be naughty to accept any
+	 * more than content-length bytes for the request body, primarily
+	 * thanks to pipelining. Anything past the end of the body belongs to the
+	 * next request, and is left in the buffer.
+	 */
+	if (requestbuf.Length() && (RequestBody.length() < RequestBodyLength))
+	{
+		size_t n = std::min((size_t)(RequestBodyLength - RequestBody.length()), requestbuf.Length());
+		RequestBody.append(requestbuf.Data(), n);
+		requestbuf.Consume(n);
+	}
+
+	if (RequestBody.length() == RequestBodyLength)
 	{
-		/* how is this possible .. */
+		// Done reading the request body
+		LOG(DEBUG, LS_NET, "Finished reading request body (%d bytes). Serving request.", RequestBodyLength);
+		ProcessRequest();
+	}
+}
+
+bool Connection::AddBuffer(size_t newpos)
+{
+	if (State == HTTP_UPGRADED)
+	{
+		/* The module owning the connection takes what it wants from the buffer */
+		FOREACH_MOD(I_OnUpgradedData, OnUpgradedData(this, requestbuf.Data(), requestbuf.Length()));
+		requestbuf.Clear();
 		return true;
 	}
 	
 	if (State == HTTP_RECV_REQBODY)
 	{
-		/*
-		 * Note!
-		 *
-		 * Don't be clever here, we *must* only take what we can to the request body
-		 * (i.e. NO MORE than RequestBodyLength!). It would be naughty to accept any
-		 * more than content-length bytes for the request body, primarily
-		 * thanks to pipelining. So, we take what we can, and shove the rest in the request buffer.
-		 */
-		unsigned int remains = RequestBodyLength - RequestBody.length();
-		
-		if (remains < a.length())
-		{
-			RequestBody.append(a.begin(), a.begin() + remains);
-			// The rest of this goes into the request buffer
-			requestbuf.append(a);
-		}
-		else
-			RequestBody.append(a);
-		
-		if (RequestBody.length() == RequestBodyLength)
-		{
-			// Done reading the request body
-			ServerInstance->Log(DEBUG, "Request body: %s", RequestBody.c_str());
-			ServerInstance->Log(DEBUG, "Finished reading request body (%d bytes). Serving request.", RequestBodyLength);
-			ServeData();
-			return true;
-		}
+		TakeRequestBody();
 	}
-	else
+	else if (State == HTTP_WAIT_REQUEST)
 	{
 		/* We can get data for a future request at any time, and that
 		 * is what we're doing here. We only trigger the check for a
 		 * new request if we're waiting for one. */
-		
-		int nspos = requestbuf.length();
-		
-		requestbuf.append(a);
-
-		if (State == HTTP_WAIT_REQUEST)
-			this->CheckRequest(nspos);		
+		this->CheckRequest(newpos);
 	}
 
-	if (requestbuf.length() > 5120)
+	if (requestbuf.Length() > (unsigned int)ServerInstance->Config->MaxRequestBuffer)
 	{
-		// XXX arbitrary limit; needs discussion of a proper default
-		ServerInstance->Log(DEBUG, "Too much data in buffer; dropping");
+		LOG(DEBUG, LS_NET, "Too much data in buffer; dropping");
 		return false;
 	}
 
 	return true;
 }
 
+int Connection::SendRaw(const char *buf, size_t len)
+{
+	int MOD_RESULT = 0;
+	FOREACH_RESULT_I(ServerInstance, I_OnRawSocketWrite, OnRawSocketWrite(this->fd, buf, len));
+
+	if (MOD_RESULT)
+		return MOD_RESULT;
+
+	return ServerInstance->SE->Send(this, buf, len, MSG_DONTWAIT);
+}
+
+void Connection::Cork(bool on)
+{
+	if (!cork || (corked == on))
+		return;
+
+	int value = on ? 1 : 0;
+#if defined(TCP_CORK)
+	setsockopt(this->fd, IPPROTO_TCP, TCP_CORK, (char*)&value, sizeof(value));
+#elif defined(TCP_NOPUSH)
+	setsockopt(this->fd, IPPROTO_TCP, TCP_NOPUSH, (char*)&value, sizeof(value));
+#endif
+	corked = on;
+}
+
 void Connection::AddWriteBuf(const std::string &data)
 {
+	if (!ResponseBytes)
+		gettimeofday(&ResponseStart, NULL);
+	ResponseBytes += data.length();
 	sendq.append(data);
 }
 
@@ -147,7 +313,7 @@ void Connection::FlushWriteBuf()
 	if ((sendq.length()) && (this->fd != FD_MAGIC_NUMBER))
 	{
 		int old_sendq_length = sendq.length();
-		int n_sent = ServerInstance->SE->Send(this, this->sendq.data(), this->sendq.length(), 0);
+		int n_sent = this->SendRaw(this->sendq.data(), this->sendq.length());
 
 		if (n_sent == -1)
 		{
@@ -170,7 +336,7 @@ void Connection::FlushWriteBuf()
 		{
 			/* advance the queue */
 			if (n_sent)
-				this->sendq = this->sendq.substr(n_sent);
+				this->sendq.erase(0, n_sent);
 			if (n_sent != old_sendq_length)
 				this->ServerInstance->SE->WantWrite(this);
 		}
@@ -182,7 +348,7 @@ void Connection::FlushWriteBuf()
 		
 		if ((State == HTTP_SEND_DATA) && ResponseBufferDone)
 		{
-			ServerInstance->Log(DEBUG, "Ending request after emptying write buffer because ResponseBufferDone is true");
+			LOG(DEBUG, LS_NET, "Ending request after emptying write buffer because ResponseBufferDone is true");
 			EndRequest();
 		}
 		else if ((State == HTTP_SEND_HEADERS) && ResponseBackend)
@@ -204,8 +370,13 @@ void Connection::Write(const std::string &text)
 	if (!ServerInstance->SE->BoundsCheckFd(this))
 		return;
 
+	/* While anything is queued the socket is already being polled for write, so
+	 * responses written back to back are sent together */
+	bool queued = !this->sendq.empty();
+
 	this->AddWriteBuf(text);
-	this->ServerInstance->SE->WantWrite(this);
+	if (!queued)
+		this->ServerInstance->SE->WantWrite(this);
 }
 
 /** Write()
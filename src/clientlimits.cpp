@@ -0,0 +1,331 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+/* $Core: libhttpd_clientlimits */
+
+#include "inspircd.h"
+
+/** Drops idle groups every so often
+ */
+class LimitExpiryTimer : public Timer
+{
+	ClientLimiter *limiter;
+ public:
+	LimitExpiryTimer(ClientLimiter *l, time_t now) : Timer(10, now, true), limiter(l)
+	{
+	}
+
+	virtual void Tick(time_t now)
+	{
+		limiter->Expire(now);
+	}
+};
+
+/** Clear the bits of an address after the first bits
+ */
+static void MaskAddress(unsigned char *addr, int len, int bits)
+{
+	for (int i = 0; i < len; i++, bits -= 8)
+	{
+		if (bits <= 0)
+			addr[i] = 0;
+		else if (bits < 8)
+			addr[i] &= (unsigned char)(0xFF << (8 - bits));
+	}
+}
+
+ClientLimiter::ClientLimiter(InspIRCd *Instance) : ServerInstance(Instance), table(64), count(0), expiry(NULL), Refused(0), Rejected(0)
+{
+}
+
+ClientLimiter::~ClientLimiter()
+{
+	if (expiry)
+		ServerInstance->Timers->DelTimer(expiry);
+}
+
+void ClientLimiter::Begin()
+{
+	rules.clear();
+}
+
+void ClientLimiter::AddRule(const std::string &mask, int maxconns, int rate, int burst, int ipv4prefix, int ipv6prefix)
+{
+	LimitRule r;
+	memset(&r, 0, sizeof(r));
+
+	if ((mask != "*") && !mask.empty())
+	{
+		std::string::size_type slash = mask.find('/');
+		std::string addr = mask.substr(0, slash);
+
+		r.family = (addr.find(':') == std::string::npos) ? AF_INET : AF_INET6;
+		int len = (r.family == AF_INET) ? 4 : 16;
+		r.maskbits = (slash == std::string::npos) ? len * 8 : atoi(mask.c_str() + slash + 1);
+
+		if ((inet_pton(r.family, addr.c_str(), r.mask) <= 0) || (r.maskbits < 0) || (r.maskbits > len * 8))
+			throw CoreException("Invalid limit mask " + mask + "; use a CIDR mask such as 192.0.2.0/24, or *");
+		MaskAddress(r.mask, len, r.maskbits);
+	}
+
+	r.maxconns = std::max(maxconns, 0);
+	r.rate = std::max(rate, 0);
+	r.burst = (burst > 0) ? burst : r.rate;
+	r.ipv4prefix = std::min(std::max(ipv4prefix, 0), 32);
+	r.ipv6prefix = std::min(std::max(ipv6prefix, 0), 128);
+	rules.push_back(r);
+}
+
+void ClientLimiter::Apply()
+{
+	/* Rules may have been renumbered, so counts can't be carried over */
+	for (std::vector<Connection *>::iterator i = ServerInstance->local_connections.begin(); i != ServerInstance->local_connections.end(); i++)
+		(*i)->limitrule = -1;
+	std::vector<Entry>(64).swap(table);
+	count = 0;
+
+	if (!expiry && !rules.empty())
+	{
+		expiry = new LimitExpiryTimer(this, ServerInstance->Time());
+		ServerInstance->Timers->AddTimer(expiry);
+	}
+
+	LOG(DEFAULT, LS_CORE, "Loaded %lu connection limits", (unsigned long)rules.size());
+}
+
+int ClientLimiter::Match(const sockaddr *sa, Key &key)
+{
+	if (rules.empty())
+		return -1;
+
+	memset(&key, 0, sizeof(key));
+	int len;
+
+	if (sa->sa_family == AF_INET6)
+	{
+		const unsigned char *a = ((const sockaddr_in6 *)sa)->sin6_addr.s6_addr;
+		/* An IPv4 client of an IPv6 listener is still an IPv4 client */
+		if (IN6_IS_ADDR_V4MAPPED(&((const sockaddr_in6 *)sa)->sin6_addr))
+		{
+			key.family = AF_INET;
+			memcpy(key.addr, a + 12, 4);
+			len = 4;
+		}
+		else
+		{
+			key.family = AF_INET6;
+			memcpy(key.addr, a, 16);
+			len = 16;
+		}
+	}
+	else if (sa->sa_family == AF_INET)
+	{
+		key.family = AF_INET;
+		memcpy(key.addr, &((const sockaddr_in *)sa)->sin_addr, 4);
+		len = 4;
+	}
+	else
+		return -1;
+
+	for (size_t i = 0; i < rules.size(); i++)
+	{
+		const LimitRule &r = rules[i];
+		if (r.family)
+		{
+			if (r.family != key.family)
+				continue;
+
+			unsigned char masked[16];
+			memcpy(masked, key.addr, len);
+			MaskAddress(masked, len, r.maskbits);
+			if (memcmp(masked, r.mask, len))
+				continue;
+		}
+
+		/* The first matching rule applies, even if it limits nothing (to exempt a network) */
+		if (!r.maxconns && !r.rate)
+			return -1;
+
+		MaskAddress(key.addr, len, (key.family == AF_INET) ? r.ipv4prefix : r.ipv6prefix);
+		key.rule = i;
+		return i;
+	}
+
+	return -1;
+}
+
+size_t ClientLimiter::Hash(const Key &key)
+{
+	/* FNV-1a */
+	const unsigned char *p = (const unsigned char *)&key;
+	size_t h = 2166136261U;
+	for (size_t i = 0; i < sizeof(key); i++)
+		h = (h ^ p[i]) * 16777619U;
+	return h;
+}
+
+size_t ClientLimiter::Slot(const Key &key) const
+{
+	size_t mask = table.size() - 1;
+	size_t i = Hash(key) & mask;
+
+	while (table[i].used && memcmp(&table[i].key, &key, sizeof(key)))
+		i = (i + 1) & mask;
+
+	return i;
+}
+
+ClientLimiter::Entry *ClientLimiter::Find(const Key &key, bool create)
+{
+	size_t i = Slot(key);
+	if (table[i].used)
+		return &table[i];
+	if (!create)
+		return NULL;
+
+	if ((count + 1) * 2 > table.size())
+	{
+		Rebuild(table.size() * 2, ServerInstance->Time(), false);
+		i = Slot(key);
+	}
+
+	Entry &e = table[i];
+	e.key = key;
+	e.used = true;
+	e.connections = 0;
+	e.tokens = rules[key.rule].burst;
+	e.refilled = ServerInstance->Time();
+	count++;
+	return &e;
+}
+
+void ClientLimiter::Refill(Entry &e, const LimitRule &r, time_t now)
+{
+	if (now <= e.refilled)
+		return;
+
+	long long tokens = e.tokens + (long long)(now - e.refilled) * r.rate;
+	e.tokens = (int)std::min(tokens, (long long)r.burst);
+	e.refilled = now;
+}
+
+void ClientLimiter::Rebuild(size_t size, time_t now, bool dropidle)
+{
+	std::vector<Entry> old(size);
+	old.swap(table);
+	count = 0;
+
+	for (std::vector<Entry>::iterator i = old.begin(); i != old.end(); i++)
+	{
+		if (!i->used)
+			continue;
+
+		if (dropidle && (i->key.rule < rules.size()))
+		{
+			const LimitRule &r = rules[i->key.rule];
+			Refill(*i, r, now);
+			if (!i->connections && (i->tokens >= r.burst))
+				continue;
+		}
+
+		table[Slot(i->key)] = *i;
+		count++;
+	}
+}
+
+void ClientLimiter::Expire(time_t now)
+{
+	if (!count)
+		return;
+
+	/* Shrink back down after a burst of clients, but keep the table at most half full */
+	size_t size = 64;
+	while (size < count * 4)
+		size *= 2;
+	Rebuild(std::min(size, table.size()), now, true);
+
+	LOG(DEBUG, LS_NET, "Connection limits are tracking %lu client groups", (unsigned long)count);
+}
+
+bool ClientLimiter::Admit(const sockaddr *sa, int &rule)
+{
+	Key key;
+	rule = Match(sa, key);
+	if (rule < 0)
+		return true;
+
+	Entry *e = Find(key, false);
+	if (!e)
+		return true;
+
+	const LimitRule &r = rules[rule];
+	Refill(*e, r, ServerInstance->Time());
+
+	if ((r.maxconns && (e->connections >= r.maxconns)) || (r.rate && (e->tokens < 1)))
+	{
+		Refused++;
+		return false;
+	}
+
+	return true;
+}
+
+void ClientLimiter::Attach(Connection *c, int rule)
+{
+	if (rule < 0)
+		return;
+
+	Key key;
+	if (Match(c->privip, key) != rule)
+		return;
+
+	Find(key, true)->connections++;
+	c->limitrule = rule;
+}
+
+void ClientLimiter::Release(Connection *c)
+{
+	if (c->limitrule < 0)
+		return;
+
+	Key key;
+	if (Match(c->privip, key) == c->limitrule)
+	{
+		Entry *e = Find(key, false);
+		if (e && e->connections)
+			e->connections--;
+	}
+
+	c->limitrule = -1;
+}
+
+bool ClientLimiter::TakeRequest(Connection *c)
+{
+	if (rules.empty() || !c->privip)
+		return true;
+
+	Key key;
+	int rule = Match(c->privip, key);
+	if ((rule < 0) || !rules[rule].rate)
+		return true;
+
+	Entry *e = Find(key, true);
+	Refill(*e, rules[rule], ServerInstance->Time());
+
+	if (e->tokens < 1)
+	{
+		Rejected++;
+		return false;
+	}
+
+	e->tokens--;
+	return true;
+}
@@ -32,11 +32,12 @@ ServerConfig::ServerConfig(InspIRCd* Instance) : ServerInstance(Instance)
 	log_file = NULL;
 	forcedebug = nofork = false;
 	writelog = true;
-	NetBufferSize = 10240;
+	NetBufferSize = 0;
 	SoftLimit = MAXCLIENTS;
 	MaxConn = SOMAXCONN;
 	debugging = 0;
 	LogLevel = DEFAULT;
+	LogSubsystems = LS_ALL;
 	StatCacheDuration = 2;
 	NoAtime = FollowSymLinks = true;
 	KeepAliveMax = 30;
@@ -234,10 +235,31 @@ bool ValidateDnsServer(ServerConfig* conf, const char*, const char*, ValueItem &
 
 bool ValidateNetBufferSize(ServerConfig* conf, const char*, const char*, ValueItem &data)
 {
-	if ((!data.GetInteger()) || (data.GetInteger() > 65535) || (data.GetInteger() < 1024))
+	/* 0 leaves socket buffers to the kernel, which sizes them to suit each connection */
+	if ((data.GetInteger() < 0) || ((data.GetInteger() > 0) && (data.GetInteger() < 1024)))
 	{
-		conf->GetInstance()->Log(DEFAULT,"No NetBufferSize specified or size out of range, setting to default of 10240.");
-		data.Set(10240);
+		conf->GetInstance()->Log(DEFAULT,"netbuffersize out of range, leaving socket buffer sizes to the kernel.");
+		data.Set(0);
+	}
+	return true;
+}
+
+bool ValidateMaxRequestBuffer(ServerConfig* conf, const char*, const char*, ValueItem &data)
+{
+	if (data.GetInteger() < 1024)
+	{
+		conf->GetInstance()->Log(DEFAULT,"max-request-buffer must be at least 1024, setting to default of 16384.");
+		data.Set(16384);
+	}
+	return true;
+}
+
+bool ValidatePipelineBudget(ServerConfig* conf, const char*, const char*, ValueItem &data)
+{
+	if (data.GetInteger() < 1)
+	{
+		conf->GetInstance()->Log(DEFAULT,"pipeline-budget must be at least 1, setting to default of 16.");
+		data.Set(16);
 	}
 	return true;
 }
@@ -263,6 +285,49 @@ bool ValidateLogLevel(ServerConfig* conf, const char*, const char*, ValueItem &d
 	return true;
 }
 
+bool ValidateLogSubsystems(ServerConfig* conf, const char*, const char*, ValueItem &data)
+{
+	utils::spacesepstream names(data.GetString());
+	std::string name;
+	conf->LogSubsystems = 0;
+
+	while (names.GetToken(name))
+	{
+		if (name == "all")
+			conf->LogSubsystems |= LS_ALL;
+		else if (name == "core")
+			conf->LogSubsystems |= LS_CORE;
+		else if (name == "http")
+			conf->LogSubsystems |= LS_HTTP;
+		else if (name == "net")
+			conf->LogSubsystems |= LS_NET;
+		else if (name == "fs")
+			conf->LogSubsystems |= LS_FS;
+		else if (name == "module")
+			conf->LogSubsystems |= LS_MODULE;
+		else
+			throw CoreException("Unknown log subsystem '" + name + "'; use core, http, net, fs, module or all");
+	}
+
+	return true;
+}
+
+bool ValidateIndexFiles(ServerConfig* conf, const char*, const char*, ValueItem &data)
+{
+	utils::spacesepstream names(data.GetString());
+	std::string name;
+	conf->IndexFiles.clear();
+
+	while (names.GetToken(name))
+	{
+		if (name.find('/') != std::string::npos)
+			throw CoreException("Index file names can't contain a /: " + name);
+		conf->IndexFiles.push_back(name);
+	}
+
+	return true;
+}
+
 bool ValidateNotEmpty(ServerConfig*, const char* tag, const char*, ValueItem &data)
 {
 	if (!*data.GetString())
@@ -278,6 +343,20 @@ bool ValidateDir(ServerConfig*, const char *tag, const char*, ValueItem &data)
 	return true;
 }
 
+bool ValidateMimeDefault(ServerConfig* conf, const char*, const char*, ValueItem &data)
+{
+	conf->GetInstance()->MimeTypes->SetDefault(data.GetString());
+	return true;
+}
+
+bool ValidateMimeFile(ServerConfig* conf, const char*, const char*, ValueItem &data)
+{
+	if (*data.GetString() && !conf->GetInstance()->MimeTypes->LoadFile(data.GetString()))
+		throw CoreException(std::string("Can't read mime::types-file ") + data.GetString() + ": " + strerror(errno));
+
+	return true;
+}
+
 /* Callback called before processing the first <module> tag
  */
 bool InitModule(ServerConfig* conf, const char*)
@@ -333,6 +412,165 @@ bool DoneModule(ServerConfig*, const char*)
 	return true;
 }
 
+/* Callback called before processing the first <limit> tag
+ */
+bool InitLimit(ServerConfig* conf, const char*)
+{
+	conf->GetInstance()->Limits->Begin();
+	return true;
+}
+
+/* Callback called to process a single <limit> tag
+ */
+bool DoLimit(ServerConfig* conf, const char*, char**, ValueList &values, int*)
+{
+	conf->GetInstance()->Limits->AddRule(values[0].GetString(), values[1].GetInteger(), values[2].GetInteger(),
+		values[3].GetInteger(), values[4].GetInteger(), values[5].GetInteger());
+	return true;
+}
+
+/* Callback called when there are no more <limit> tags
+ */
+bool DoneLimit(ServerConfig* conf, const char*)
+{
+	conf->GetInstance()->Limits->Apply();
+	return true;
+}
+
+/* Callback called before processing the first <acl> tag
+ */
+bool InitACL(ServerConfig* conf, const char*)
+{
+	conf->GetInstance()->ACLs->Begin();
+	return true;
+}
+
+/* Callback called to process a single <acl> tag
+ */
+bool DoACL(ServerConfig* conf, const char*, char**, ValueList &values, int*)
+{
+	conf->GetInstance()->ACLs->Add(values[0].GetString(), values[1].GetString(), values[2].GetString(),
+		values[3].GetString(), values[4].GetString(), values[5].GetString());
+	return true;
+}
+
+/* Callback called when there are no more <acl> tags
+ */
+bool DoneACL(ServerConfig* conf, const char*)
+{
+	conf->GetInstance()->ACLs->Apply();
+	return true;
+}
+
+/* Callback called before processing the first <redirect> tag. Redirects are read
+ * before rewrites, so they are tried first.
+ */
+bool InitRedirect(ServerConfig* conf, const char*)
+{
+	conf->GetInstance()->Rewrites->Begin();
+	return true;
+}
+
+/* Callback called to process a single <redirect> or <rewrite> tag
+ */
+bool DoRewrite(ServerConfig* conf, const char* tag, char**, ValueList &values, int*)
+{
+	std::string match = values[0].GetString();
+	std::string regex = values[1].GetString();
+	int status = strcmp(tag, "redirect") ? 0 : values[3].GetInteger();
+
+	if (match.empty() == regex.empty())
+		throw CoreException(std::string("Every ") + tag + " needs either a match or a regex");
+
+	conf->GetInstance()->Rewrites->Add(new RewriteRule(match.empty() ? regex : match, !regex.empty(), values[2].GetString(), status));
+	return true;
+}
+
+bool NoRewriteCallback(ServerConfig*, const char*)
+{
+	return true;
+}
+
+/* Callback called when there are no more <rewrite> tags
+ */
+bool DoneRewrite(ServerConfig* conf, const char*)
+{
+	conf->GetInstance()->Rewrites->Apply();
+	return true;
+}
+
+/* Callback called before processing the first <vhost> tag
+ */
+bool InitVHost(ServerConfig* conf, const char*)
+{
+	conf->GetInstance()->VHosts->Begin();
+	return true;
+}
+
+/* Callback called to process a single <vhost> tag
+ */
+bool DoVHost(ServerConfig* conf, const char*, char**, ValueList &values, int*)
+{
+	std::string name = values[0].GetString();
+	const char* docroot = values[2].GetString();
+
+	if (name.empty())
+		throw CoreException("Every vhost must have a name");
+	if (!*docroot)
+		docroot = conf->DocRoot;
+	else if (!ServerConfig::DirValid(docroot))
+		throw CoreException("The document-root for vhost " + name + " must be an existing directory");
+
+	VirtualHost* vh = new VirtualHost;
+	vh->name = name;
+	vh->docroot = docroot;
+	vh->maxpostbody = values[4].GetInteger();
+	vh->aliases.push_back(name);
+
+	utils::spacesepstream aliases(values[1].GetString());
+	std::string alias;
+	while (aliases.GetToken(alias))
+		vh->aliases.push_back(alias);
+
+	/* This checks the names and may throw; the manager owns vh from here either way */
+	conf->GetInstance()->VHosts->Add(vh);
+
+	utils::spacesepstream indexes(values[5].GetString());
+	std::string index;
+	while (indexes.GetToken(index))
+	{
+		if (index.find('/') != std::string::npos)
+			throw CoreException("Index file names can't contain a /: " + index);
+		vh->indexes.push_back(index);
+	}
+
+	/* ext=type pairs */
+	utils::spacesepstream mimes(values[3].GetString());
+	std::string mime;
+	while (mimes.GetToken(mime))
+	{
+		std::string::size_type eq = mime.find('=');
+		if ((eq == std::string::npos) || !eq || (eq + 1 == mime.length()))
+			throw CoreException("Invalid mime-types entry '" + mime + "' for vhost " + name + "; expected ext=type");
+		std::string ext = mime.substr(0, eq);
+		if (ext[0] == '.')
+			ext.erase(0, 1);
+		if (!vh->mimetypes)
+			vh->mimetypes = new MimeManager(conf->GetInstance());
+		vh->mimetypes->AddType(ext, mime.substr(eq + 1));
+	}
+
+	return true;
+}
+
+/* Callback called when there are no more <vhost> tags
+ */
+bool DoneVHost(ServerConfig* conf, const char*)
+{
+	conf->GetInstance()->VHosts->Apply();
+	return true;
+}
+
 void ServerConfig::ReportConfigError(const std::string &errormessage, bool bail)
 {
 	ServerInstance->Log(DEFAULT, "There were errors in your configuration file: %s", errormessage.c_str());
@@ -364,6 +602,10 @@ void ServerConfig::Read(bool bail)
 	int rem = 0, add = 0;           /* Number of modules added, number of modules removed */
 
 	static char debug[MAXBUF];	/* Temporary buffer for debugging value */
+	static char logsubsystems[MAXBUF];	/* Temporary buffer for the log subsystem mask */
+	static char indexfiles[MAXBUF];	/* Temporary buffer for the index file list */
+	static char mimedefault[MAXBUF];	/* Temporary buffers for the mime tag, which is applied by its validators */
+	static char mimefile[MAXBUF];
 	errstr.clear();
 
 	/* These tags MUST occur and must ONLY occur once in the config file */
@@ -374,7 +616,9 @@ void ServerConfig::Read(bool bail)
 		{"server",  "document-root", "", new ValueContainerChar(this->DocRoot), DT_CHARPTR, ValidateDir},
 		{"server",	"softlimit",	MAXCLIENTS_S,		new ValueContainerUInt (&this->SoftLimit),		DT_INTEGER,  ValidateSoftLimit},
 		{"server",	"loglevel",	"default",		new ValueContainerChar (debug),				DT_CHARPTR,  ValidateLogLevel},
-		{"server",	"netbuffersize","10240",		new ValueContainerInt  (&this->NetBufferSize),		DT_INTEGER,  ValidateNetBufferSize},
+		{"server",	"log-subsystems","all",			new ValueContainerChar (logsubsystems),			DT_CHARPTR,  ValidateLogSubsystems},
+		{"server",	"netbuffersize","0",		new ValueContainerInt  (&this->NetBufferSize),		DT_INTEGER,  ValidateNetBufferSize},
+		{"server",	"index",	"index.html index.htm",	new ValueContainerChar (indexfiles),			DT_CHARPTR,  ValidateIndexFiles},
 		{"server",	"moduledir",	MOD_PATH,		new ValueContainerChar (this->ModPath),			DT_CHARPTR,  NoValidation},
 		{"server",	"customversion","",			new ValueContainerChar (this->CustomVersion),		DT_CHARPTR,  NoValidation},
 		{"server",	"pidfile",		"",			new ValueContainerChar (this->PID),			DT_CHARPTR,  NoValidation},
@@ -384,6 +628,9 @@ void ServerConfig::Read(bool bail)
 		{"security",  "group", "", new ValueContainerChar(this->SetGroup), DT_CHARPTR, NoValidation},
 		{"security",  "chroot", "", new ValueContainerChar(this->ChRoot), DT_CHARPTR, NoValidation},
 
+		{"mime",	"default-type",	"application/octet-stream",	new ValueContainerChar (mimedefault),	DT_CHARPTR,  ValidateMimeDefault},
+		{"mime",	"types-file",	"",			new ValueContainerChar (mimefile),			DT_CHARPTR,  ValidateMimeFile},
+
 		{"performance", "stat-cache-time", "2", new ValueContainerInt(&this->StatCacheDuration), DT_INTEGER, NoValidation},
 		{"performance", "noatime", "yes", new ValueContainerBool(&this->NoAtime), DT_BOOLEAN, NoValidation},
 		{"performance", "max-conn-queue", SOMAXCONN_S, new ValueContainerInt(&this->MaxConn), DT_INTEGER, ValidateMaxConn},
@@ -392,6 +639,8 @@ void ServerConfig::Read(bool bail)
 		{"performance", "timeout-total-lifetime", "30", new ValueContainerInt(&this->TimeoutTotalLifetime), DT_INTEGER, NoValidation},
 		{"performance", "timeout-idle-lifetime", "5", new ValueContainerInt(&this->TimeoutIdleLifetime), DT_INTEGER, NoValidation},
 		{"performance", "max-post-body", "1024", new ValueContainerInt(&this->MaxPostBody), DT_INTEGER, NoValidation},
+		{"performance", "max-request-buffer", "16384", new ValueContainerInt(&this->MaxRequestBuffer), DT_INTEGER, ValidateMaxRequestBuffer},
+		{"performance", "pipeline-budget", "16", new ValueContainerInt(&this->PipelineBudget), DT_INTEGER, ValidatePipelineBudget},
 		{"performance", "max-dynamic-processes", "2", new ValueContainerInt(&this->MaximumDynamicProcesses), DT_INTEGER, NoValidation},
 		{NULL,		NULL,		NULL,			NULL,							DT_NOTHING,  NoValidation}
 	};
@@ -407,6 +656,36 @@ void ServerConfig::Read(bool bail)
 				{DT_CHARPTR},
 				InitModule, DoModule, DoneModule},
 
+		{"vhost",
+				{"name",	"aliases",	"document-root",	"mime-types",	"max-post-body",	"index",	NULL},
+				{"",		"",		"",			"",		"-1",			"",		NULL},
+				{DT_CHARPTR,	DT_CHARPTR,	DT_CHARPTR,		DT_CHARPTR,	DT_INTEGER,		DT_CHARPTR},
+				InitVHost, DoVHost, DoneVHost},
+
+		{"limit",
+				{"mask",	"max-connections",	"requests-per-second",	"burst",	"ipv4-prefix",	"ipv6-prefix",	NULL},
+				{"*",		"0",			"0",			"0",		"32",		"64",		NULL},
+				{DT_CHARPTR,	DT_INTEGER,		DT_INTEGER,		DT_INTEGER,	DT_INTEGER,	DT_INTEGER},
+				InitLimit, DoLimit, DoneLimit},
+
+		{"acl",
+				{"path",	"allow",	"deny",		"allow-file",	"deny-file",	"default",	NULL},
+				{"/",		"",		"",		"",		"",		"",		NULL},
+				{DT_CHARPTR,	DT_CHARPTR,	DT_CHARPTR,	DT_CHARPTR,	DT_CHARPTR,	DT_CHARPTR},
+				InitACL, DoACL, DoneACL},
+
+		{"redirect",
+				{"match",	"regex",	"to",		"status",	NULL},
+				{"",		"",		"",		"301",		NULL},
+				{DT_CHARPTR,	DT_CHARPTR,	DT_CHARPTR,	DT_INTEGER},
+				InitRedirect, DoRewrite, NoRewriteCallback},
+
+		{"rewrite",
+				{"match",	"regex",	"to",		NULL},
+				{"",		"",		"",		NULL},
+				{DT_CHARPTR,	DT_CHARPTR,	DT_CHARPTR},
+				NoRewriteCallback, DoRewrite, DoneRewrite},
+
 		{NULL,
 				{NULL},
 				{NULL},
@@ -598,7 +877,7 @@ void ServerConfig::Read(bool bail)
 	}
 
 	/** XXX END PASS **/
-	ServerInstance->Log(DEBUG,"End config");
+	LOG(DEBUG, LS_CORE, "End config");
 
 	ServerInstance->Modules->LoadAll();
 
@@ -693,7 +972,7 @@ bool ServerConfig::LoadConf(ConfigDataHash &target, const char* filename, std::o
 		return false;
 	}
 
-	ServerInstance->Log(DEBUG, "Start to read conf %s", filename);
+	LOG(DEBUG, LS_CORE, "Start to read conf %s", filename);
 
 	/* Start reading characters... */
 	while (getline(conf, line))
@@ -857,7 +1136,7 @@ bool ServerConfig::LoadConf(ConfigDataHash &target, const char* filename, std::o
 				return false;
 			}
 			
-			ServerInstance->Log(DEBUG, "ln %d EOL: s='%s' '%s' set to '%s'", linenumber, section.c_str(), itemname.c_str(), wordbuffer.c_str());
+			LOG(DEBUG, LS_CORE, "ln %d EOL: s='%s' '%s' set to '%s'", linenumber, section.c_str(), itemname.c_str(), wordbuffer.c_str());
 			sectiondata.push_back(KeyVal(itemname, wordbuffer));
 			wordbuffer.clear();
 			itemname.clear();
@@ -14,35 +14,30 @@
 /* $Core: libhttpd_connectionmanager */
 
 
-void ConnectionManager::Add(int socket, int port, int socketfamily, sockaddr *ip)
+Connection *ConnectionManager::Add(int socket, int port, int socketfamily, sockaddr *ip, bool rawhooks)
 {
 	Connection* New = NULL;
 	New = new Connection(ServerInstance);
 
-	ServerInstance->Log(DEBUG,"New user fd: %d", socket);
-
-	char ipaddr[MAXBUF];
-#ifdef IPV6
-	if (socketfamily == AF_INET6)
-		inet_ntop(AF_INET6, &((const sockaddr_in6*)ip)->sin6_addr, ipaddr, sizeof(ipaddr));
-	else
-#endif
-	inet_ntop(AF_INET, &((const sockaddr_in*)ip)->sin_addr, ipaddr, sizeof(ipaddr));
+	LOG(DEBUG, LS_NET, "New user fd: %d", socket);
 
 	New->SetFd(socket);
-	New->SetSockAddr(socketfamily, ipaddr, port);
-	New->ip = New->GetIPString();
+	New->SetSockAddr(socketfamily, ip, port);
 
 	ServerInstance->local_connections.push_back(New);
 
 	if (!ServerInstance->SE->AddFd(New))
 	{
-		ServerInstance->Log(DEBUG,"Internal error on new connection");
+		LOG(DEBUG, LS_NET, "Internal error on new connection");
 		this->Delete(New);
-		return;
+		return NULL;
 	}
 
+	if (rawhooks)
+		FOREACH_MOD(I_OnRawSocketAccept, OnRawSocketAccept(socket, New->GetIP(), port));
 	FOREACH_MOD(I_OnConnectionConnect, OnConnectionConnect(New));
+
+	return New;
 }
 
 void ConnectionManager::Delete(Connection *c)
@@ -52,4 +47,88 @@ void ConnectionManager::Delete(Connection *c)
 	c->State = HTTP_FINISHED;
 }
 
+void ConnectionManager::PauseListeners()
+{
+	if (ListenersPaused)
+		return;
+
+	LOG(DEBUG, LS_NET, "Can't take more connections; pausing listeners");
+	for (std::vector<ListenSocket*>::iterator i = ServerInstance->Config->ports.begin(); i != ServerInstance->Config->ports.end(); i++)
+		(*i)->Pause();
+	ListenersPaused = true;
+}
+
+void ConnectionManager::ResumeListeners()
+{
+	if (!ListenersPaused)
+		return;
+
+	if (((ServerInstance->local_connections.size() + 1) > ServerInstance->Config->SoftLimit) ||
+		((ServerInstance->local_connections.size() + 1) >= MAXCLIENTS))
+		return;
+
+	LOG(DEBUG, LS_NET, "Resuming listeners");
+	for (std::vector<ListenSocket*>::iterator i = ServerInstance->Config->ports.begin(); i != ServerInstance->Config->ports.end(); i++)
+		(*i)->Resume();
+	ListenersPaused = false;
+}
+
+void ConnectionManager::SchedulePipeline(Connection *c)
+{
+	if (c->pipelined || c->quitting)
+		return;
+
+	c->pipelined = true;
+	Pipelines.push_back(c);
+}
+
+void ConnectionManager::CancelPipeline(Connection *c)
+{
+	if (!c->pipelined)
+		return;
+
+	std::deque<Connection *>::iterator i = std::find(Pipelines.begin(), Pipelines.end(), c);
+	if (i != Pipelines.end())
+		Pipelines.erase(i);
+	c->pipelined = false;
+}
+
+void ConnectionManager::ProcessPipelines()
+{
+	if (Pipelines.empty())
+		return;
+
+	std::deque<Connection *> queue;
+	queue.swap(Pipelines);
+
+	int budget = ServerInstance->Config->PipelineBudget;
+
+	while (!queue.empty())
+	{
+		Connection *c = queue.front();
+		queue.pop_front();
+
+		/* c->pipelined stays set while we work, so that EndRequest doesn't queue it again */
+		int n = 0;
+		for (; (n < budget) && !c->quitting && (c->State == HTTP_WAIT_REQUEST) && c->requestbuf.Length(); n++)
+		{
+			size_t had = c->requestbuf.Length();
+			c->CheckRequest(0);
+
+			/* Only part of the next request has arrived; AddBuffer picks it up from here */
+			if ((c->State == HTTP_WAIT_REQUEST) && (c->requestbuf.Length() == had))
+				break;
+		}
+
+		c->pipelined = false;
+
+		if ((n == budget) && !c->quitting && (c->State == HTTP_WAIT_REQUEST) && c->requestbuf.Length())
+		{
+			SchedulePipeline(c);
+			/* Make sure the next iteration doesn't sleep waiting for events */
+			ServerInstance->SE->WantWrite(c);
+		}
+	}
+}
+
 
@@ -16,11 +16,94 @@
 #include "socketengine.h"
 #include "wildcard.h"
 
+/** Connection blocks allocated at once when the free list runs dry */
+#define CONNECTIONS_PER_SLAB 64
+
+/** Buffers with more capacity than this are freed rather than kept for reuse */
+#define MAX_SPARE_BUFFER 65536
+
+/** Most buffers kept in each free list */
+#define MAX_SPARE_BUFFERS 1024
+
+/** Buffers kept when a connection is freed, by size class: small ones (request
+ * bodies, usually) and large ones (send queues). Strings are swapped in and out,
+ * so the memory behind them is reused without being copied. The request buffer
+ * keeps its own blocks; see RecvBuffer.
+ */
+static std::deque<std::string> SpareBuffers[2];
+
+/** Unused Connection blocks, linked through their first bytes */
+static void *FreeConnections = NULL;
+
+static void TakeBuffer(std::string &buf, int sizeclass)
+{
+	if (SpareBuffers[sizeclass].empty())
+		sizeclass = !sizeclass;
+
+	if (!SpareBuffers[sizeclass].empty())
+	{
+		buf.swap(SpareBuffers[sizeclass].back());
+		SpareBuffers[sizeclass].pop_back();
+	}
+}
+
+static void ReturnBuffer(std::string &buf)
+{
+	if (!buf.capacity() || (buf.capacity() > MAX_SPARE_BUFFER))
+		return;
+
+	int sizeclass = (buf.capacity() > 4096);
+	if (SpareBuffers[sizeclass].size() >= MAX_SPARE_BUFFERS)
+		return;
+
+	buf.clear();
+	SpareBuffers[sizeclass].push_back(std::string());
+	SpareBuffers[sizeclass].back().swap(buf);
+}
+
+void *Connection::operator new(size_t size)
+{
+	/* A derived class is larger than our blocks */
+	if (size != sizeof(Connection))
+		return ::operator new(size);
+
+	if (!FreeConnections)
+	{
+		char *slab = (char *)::operator new(size * CONNECTIONS_PER_SLAB);
+		for (int i = 0; i < CONNECTIONS_PER_SLAB; i++)
+		{
+			*(void **)(slab + i * size) = FreeConnections;
+			FreeConnections = slab + i * size;
+		}
+	}
+
+	void *p = FreeConnections;
+	FreeConnections = *(void **)p;
+	return p;
+}
+
+void Connection::operator delete(void *p, size_t size)
+{
+	if (!p)
+		return;
+
+	if (size != sizeof(Connection))
+	{
+		::operator delete(p);
+		return;
+	}
+
+	*(void **)p = FreeConnections;
+	FreeConnections = p;
+}
+
 Connection::Connection(InspIRCd* Instance) : ServerInstance(Instance)
 {
-	quitting = false;
+	quitting = pipelined = cork = corked = false;
 	fd = filefd = -1;
 	privip = NULL;
+	localport = 0;
+	limitrule = -1;
 	State = HTTP_WAIT_REQUEST;
 	http_version = HTTP_UNSPECIFIED;
 	keepalive = true;
@@ -29,24 +112,21 @@ Connection::Connection(InspIRCd* Instance) : ServerInstance(Instance)
 	LastSocketEvent = ServerInstance->Time();
 	ResponseBufferDone = false;
 	ResponseBackend = NULL;
+	rmime = NULL;
+	vhost = ServerInstance->VHosts->GetDefault();
+	ResponseCode = 0;
+	ResponseBytes = 0;
+	RequestStart.tv_sec = RequestStart.tv_usec = 0;
+	ResponseStart.tv_sec = ResponseStart.tv_usec = 0;
+
+	TakeBuffer(sendq, 1);
 }
 
 Connection::~Connection()
 {
-	if (privip)
-	{
-		if (this->GetProtocolFamily() == AF_INET)
-		{
-			delete (sockaddr_in*)privip;
-		}
-#ifdef SUPPORT_IP6LINKS
-		else
-		{
-			delete (sockaddr_in6*)privip;
-		}
-#endif
-	}
-	
+	ReturnBuffer(sendq);
+	ReturnBuffer(RequestBody);
+
 	if (filefd > -1)
 	{
 		close(filefd);
@@ -67,6 +147,12 @@ void Connection::SendError(int code, const std::string &text, bool fatal = false
 	std::string data = "<html><head></head><body>" + text + "<br><small>Powered by Hottpd</small></body></html>";
 	
 	ResponseBackend = NULL;
+
+	// Semi-hack. Disabling keepalive means connection is closed ASAP. This must be done
+	// before the response is sent, as it may be flushed (and the request ended) at once.
+	if (fatal)
+		keepalive = false;
+
 	this->SendHeaders(data.length(), code, text, empty);
 
 	State = HTTP_SEND_DATA;
@@ -75,69 +161,32 @@ void Connection::SendError(int code, const std::string &text, bool fatal = false
 
 	// Flush the write buffer now instead of waiting an iteration, since we've written all we need to
 	this->FlushWriteBuf();
-
-	if (fatal)
-	{
-		// Semi-hack. Disabling keepalive means connection is closed ASAP.
-		keepalive = false;
-	}
 }
 
-void Connection::SetSockAddr(int protocol_family, const char* mip, int port)
+void Connection::SetSockAddr(int protocol_family, const sockaddr* mip, int port)
 {
 	switch (protocol_family)
 	{
-#ifdef SUPPORT_IP6LINKS
 		case AF_INET6:
-		{
-			sockaddr_in6* sin = new sockaddr_in6;
-			sin->sin6_family = AF_INET6;
-			sin->sin6_port = port;
-			inet_pton(AF_INET6, mip, &sin->sin6_addr);
-			this->privip = (sockaddr*)sin;
-		}
+			memcpy(&this->addr, mip, sizeof(sockaddr_in6));
+			this->privip = (sockaddr*)&this->addr;
 		break;
-#endif
 		case AF_INET:
-		{
-			sockaddr_in* sin = new sockaddr_in;
-			sin->sin_family = AF_INET;
-			sin->sin_port = port;
-			inet_pton(AF_INET, mip, &sin->sin_addr);
-			this->privip = (sockaddr*)sin;
-		}
+			memcpy(&this->addr, mip, sizeof(sockaddr_in));
+			this->privip = (sockaddr*)&this->addr;
 		break;
 		default:
-			ServerInstance->Log(DEBUG,"Uh oh, I dont know protocol %d to be set!", protocol_family);
+			LOG(DEBUG, LS_HTTP, "Uh oh, I dont know protocol %d to be set!", protocol_family);
 		break;
 	}
+
+	this->localport = port;
+	this->ipstring.clear();
 }
 
 int Connection::GetPort()
 {
-	if (this->privip == NULL)
-		return 0;
-
-	switch (this->GetProtocolFamily())
-	{
-#ifdef SUPPORT_IP6LINKS
-		case AF_INET6:
-		{
-			sockaddr_in6* sin = (sockaddr_in6*)this->privip;
-			return sin->sin6_port;
-		}
-		break;
-#endif
-		case AF_INET:
-		{
-			sockaddr_in* sin = (sockaddr_in*)this->privip;
-			return sin->sin_port;
-		}
-		break;
-		default:
-		break;
-	}
-	return 0;
+	return this->localport;
 }
 
 int Connection::GetProtocolFamily()
@@ -145,53 +194,30 @@ int Connection::GetProtocolFamily()
 	if (this->privip == NULL)
 		return 0;
 
-	sockaddr_in* sin = (sockaddr_in*)this->privip;
-	return sin->sin_family;
+	return this->privip->sa_family;
 }
 
-/*
- * XXX the duplication here is horrid..
- * do we really need two methods doing essentially the same thing?
- * should cache, too!
- */
-const char* Connection::GetIPString()
+const std::string &Connection::GetIP()
 {
-	static char buf[1024];
-
-	if (this->privip == NULL)
-		return "";
+	if (!this->ipstring.empty() || (this->privip == NULL))
+		return this->ipstring;
 
+	char buf[INET6_ADDRSTRLEN];
 	switch (this->GetProtocolFamily())
 	{
-#ifdef SUPPORT_IP6LINKS
 		case AF_INET6:
-		{
-			static char temp[1024];
-
-			sockaddr_in6* sin = (sockaddr_in6*)this->privip;
-			inet_ntop(sin->sin6_family, &sin->sin6_addr, buf, sizeof(buf));
-			/* IP addresses starting with a : on irc are a Bad Thing (tm) */
-			if (*buf == ':')
-			{
-				strlcpy(&temp[1], buf, sizeof(temp) - 1);
-				*temp = '0';
-				return temp;
-			}
-			return buf;
-		}
+			if (inet_ntop(AF_INET6, &((sockaddr_in6*)this->privip)->sin6_addr, buf, sizeof(buf)))
+				this->ipstring = buf;
 		break;
-#endif
 		case AF_INET:
-		{
-			sockaddr_in* sin = (sockaddr_in*)this->privip;
-			inet_ntop(sin->sin_family, &sin->sin_addr, buf, sizeof(buf));
-			return buf;
-		}
+			if (inet_ntop(AF_INET, &((sockaddr_in*)this->privip)->sin_addr, buf, sizeof(buf)))
+				this->ipstring = buf;
 		break;
 		default:
 		break;
 	}
-	return "";
+
+	return this->ipstring;
 }
 
 void Connection::HandleEvent(EventType et, int errornum)
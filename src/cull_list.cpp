@@ -41,7 +41,11 @@ int CullList::Apply()
 
 		FOREACH_MOD_I(ServerInstance,I_OnConnectionDisconnect, OnConnectionDisconnect(c));
 
+		ServerInstance->Connections->CancelPipeline(c);
+		ServerInstance->Limits->Release(c);
+
 		ServerInstance->SE->DelFd(c);
+		FOREACH_MOD_I(ServerInstance,I_OnRawSocketClose, OnRawSocketClose(c->GetFd()));
 		c->CloseSocket();
 
 		std::vector<Connection*>::iterator x = find(ServerInstance->local_connections.begin(),ServerInstance->local_connections.end(),c);
@@ -52,6 +56,9 @@ int CullList::Apply()
 		list.erase(list.begin());
 	}
 
+	if (n)
+		ServerInstance->Connections->ResumeListeners();
+
 	return n;
 }
 
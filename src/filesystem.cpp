@@ -15,12 +15,12 @@
 #include "filesystem.h"
 
 FileSystem::FileSystem(InspIRCd *Instance)
-	: ServerInstance(Instance)
+	: ServerInstance(Instance), lastitem(NULL), StatCacheHits(0), StatCacheMisses(0)
 {
 }
 
 
-std::string FileSystem::CheckFilePath(const std::string &basedir, const std::string &path, struct stat *&fst)
+std::string FileSystem::CheckFilePath(const std::string &basedir, const std::string &path, struct stat *&fst, std::string *pathinfo, const MimeType **mime)
 {
 	std::string fullpath(basedir);
 	
@@ -53,7 +53,10 @@ std::string FileSystem::CheckFilePath(const std::string &basedir, const std::str
 				if (S_ISREG(fst->st_mode))
 				{
 					// Pathinfo!
-					ServerInstance->Log(DEBUG, "PathInfo found: '%s'", std::string(i + 1, fullpath.end()).c_str());
+					LOG(DEBUG, LS_FS, "PathInfo found: '%s'", std::string(i + 1, fullpath.end()).c_str());
+					
+					if (pathinfo)
+						pathinfo->assign(i, fullpath.end());
 					
 					return std::string(fullpath.begin(), i);;
 				}
@@ -66,24 +69,64 @@ std::string FileSystem::CheckFilePath(const std::string &basedir, const std::str
 		}
 	}
 	
+	if (pathinfo)
+		pathinfo->clear();
+	
 	if (this->Stat(fullpath.c_str(), fst, ServerInstance->Config->FollowSymLinks) < 0)
 		return  std::string();
 	
 	if (!S_ISREG(fst->st_mode))
 	{
-		errno = EACCES;
+		errno = S_ISDIR(fst->st_mode) ? EISDIR : EACCES;
 		return std::string();
 	}
+
+	if (mime)
+	{
+		StatCacheItem *item = lastitem;
+		if (item && item->mimeresolved)
+			*mime = item->mime;
+		else
+		{
+			*mime = ServerInstance->MimeTypes->FindForPath(fullpath);
+			if (item)
+			{
+				item->mime = *mime;
+				item->mimeresolved = true;
+			}
+		}
+	}
 	
 	return fullpath;
 }
 
+const std::string *FileSystem::FindIndex(const std::string &basedir, const std::string &path, const std::vector<std::string> &names)
+{
+	std::string dir(basedir);
+	if (!dir.empty() && (dir[dir.length() - 1] == '/'))
+		dir.erase(dir.length() - 1);
+	dir.append(path);
+
+	std::string::size_type l = dir.length();
+	struct stat *fst;
+
+	for (std::vector<std::string>::const_iterator i = names.begin(); i != names.end(); i++)
+	{
+		dir.replace(l, std::string::npos, *i);
+		if ((this->Stat(dir.c_str(), fst, ServerInstance->Config->FollowSymLinks) == 0) && S_ISREG(fst->st_mode))
+			return &*i;
+	}
+
+	return NULL;
+}
+
 int FileSystem::Stat(const char *path, struct stat *&buf, bool followlink, bool fromcache)
 {
 	if (ServerInstance->Config->StatCacheDuration < 1)
 	{
 		// Cache disabled; simply wrap the call
 		buf = &this->static_stat;
+		lastitem = NULL;
 		if (followlink)
 			return stat(path, &this->static_stat);
 		else
@@ -104,9 +147,11 @@ int FileSystem::Stat(const char *path, struct stat *&buf, bool followlink, bool
 		
 		if (fromcache && (expire > ServerInstance->Time()))
 		{
-			ServerInstance->Log(DEBUG, "Providing stat result from cache for %s", path);
+			LOG(DEBUG, LS_FS, "Providing stat result from cache for %s", path);
+			StatCacheHits++;
 			
 			buf = &v->value;
+			lastitem = v;
 			if (v->result < 0)
 				errno = v->error;
 			return v->result;
@@ -114,14 +159,17 @@ int FileSystem::Stat(const char *path, struct stat *&buf, bool followlink, bool
 		else
 		{
 			// If fromcache is off, we must delete the cache because it would be overwritten later
-			ServerInstance->Log(DEBUG, "Expiring stat cache for %s", path);
+			LOG(DEBUG, LS_FS, "Expiring stat cache for %s", path);
 			delete v;
 			cache->erase(it);
 		}
 	}
 	
+	StatCacheMisses++;
 	StatCacheItem *result = new StatCacheItem;
 	result->created = ServerInstance->Time();
+	result->mimeresolved = false;
+	result->mime = NULL;
 	
 	if (followlink)
 		result->result = stat(path, &result->value);
@@ -135,8 +183,9 @@ int FileSystem::Stat(const char *path, struct stat *&buf, bool followlink, bool
 	
 	cache->insert(std::make_pair<std::string,StatCacheItem*>(path, result));
 	
-	ServerInstance->Log(DEBUG, "Cached %sstat result (%s) for %s", (followlink) ? "" : "link ", (result->result < 0) ? "error" : "success", path);
+	LOG(DEBUG, LS_FS, "Cached %sstat result (%s) for %s", (followlink) ? "" : "link ", (result->result < 0) ? "error" : "success", path);
 	
 	buf = &result->value;
+	lastitem = result;
 	return result->result;
 }
@@ -109,6 +109,28 @@ bool utils::unhexchar(char &dest, char a, char b)
 	return true;
 }
 
+std::string utils::urlencodepath(const std::string &path)
+{
+	static const char hexdigits[] = "0123456789ABCDEF";
+	std::string out;
+	out.reserve(path.length());
+
+	for (std::string::const_iterator i = path.begin(); i != path.end(); i++)
+	{
+		unsigned char c = *i;
+		if (isalnum(c) || (c && strchr("/-._~!$&'()*+,;=:@", c)))
+			out.push_back(c);
+		else
+		{
+			out.push_back('%');
+			out.push_back(hexdigits[c >> 4]);
+			out.push_back(hexdigits[c & 15]);
+		}
+	}
+
+	return out;
+}
+
 utils::stringjoiner::stringjoiner(const std::string &seperator, const std::vector<std::string> &sequence, int begin, int end)
 {
 	for (int v = begin; v < end; v++)
@@ -138,6 +138,7 @@ void InspIRCd::SetSignals()
 #ifndef WIN32
 	signal(SIGALRM, SIG_IGN);
 	signal(SIGHUP,  InspIRCd::SetSignal);
+	signal(SIGUSR1, InspIRCd::SetSignal);
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGCHLD, SIG_IGN);
 #endif
@@ -243,16 +244,15 @@ InspIRCd::InspIRCd(int argc, char** argv) : GlobalCulls(this)
 	this->Modules = new ModuleManager(this);
 	this->Timers = new TimerManager(this);
 	this->MimeTypes = new MimeManager(this);
+	this->VHosts = new VHostManager(this);
+	this->Limits = new ClientLimiter(this);
+	this->ACLs = new AccessControl(this);
+	this->Rewrites = new RewriteManager(this);
 	this->Connections = new ConnectionManager(this);
 	this->FileSys = new FileSystem(this);
 
-	// XXX this is kinda an ugly way to do it, might want to move this to a config tag.
-	this->MimeTypes->AddType("jpg", "image/jpeg");
-	this->MimeTypes->AddType("gif", "image/gif");
-	this->MimeTypes->AddType("css", "text/html");
-	this->MimeTypes->AddType("php", "text/html");
-	this->MimeTypes->AddType("htm", "text/html");
-	this->MimeTypes->AddType("html", "text/html");
+	// More are read from mime::types-file, if it's set
+	this->MimeTypes->AddBuiltinTypes();
 
 	this->Config->argv = argv;
 	this->Config->argc = argc;
@@ -514,7 +514,7 @@ int InspIRCd::Run()
 
 		if (times > this->Config->TimeoutCullFrequency)
 		{
-			this->Log(DEBUG, "Timing out old connections.");
+			LOG_I(this, DEBUG, LS_CORE, "Timing out old connections.");
 			times = 1;
 
 			for (std::vector<Connection*>::const_iterator i = this->local_connections.begin(); i != this->local_connections.end(); i++)
@@ -530,7 +530,7 @@ int InspIRCd::Run()
 					 *
 					 * XXX: if a socket is old, but still writing, we should let it live.
 					 */
-					this->Log(DEBUG, "Timing out %d because it's too old", c->GetFd());
+					LOG_I(this, DEBUG, LS_CORE, "Timing out %d because it's too old", c->GetFd());
 					this->Connections->Delete(c);
 				}
 				else if (TIME >= (c->LastSocketEvent + this->Config->TimeoutIdleLifetime))
@@ -539,7 +539,7 @@ int InspIRCd::Run()
 					 * Socket hasn't been doing anything for quite a while.
 					 * Kill the fuck out of it.
 					 */
-					this->Log(DEBUG, "Timing out %d because it's too idle", c->GetFd());
+					LOG_I(this, DEBUG, LS_CORE, "Timing out %d because it's too idle", c->GetFd());
 					this->Connections->Delete(c);
 				}
 			}
@@ -565,6 +565,9 @@ int InspIRCd::Run()
 			if ((TIME % 5) == 0)
 			{
 				FOREACH_MOD_I(this,I_OnBackgroundTimer,OnBackgroundTimer(TIME));
+
+				/* Listeners paused for lack of descriptors may have nothing to cull */
+				Connections->ResumeListeners();
 			}
 #ifdef WIN32
 			WindowsIPC->Check();
@@ -590,6 +593,9 @@ int InspIRCd::Run()
 		 */
 		this->SE->DispatchEvents();
 
+		/* Serve requests clients pipelined behind ones which finished this time round */
+		this->Connections->ProcessPipelines();
+
 		/* if any connections were quit, take them out */
 		this->GlobalCulls.Apply();
 
@@ -12,20 +12,147 @@
 /* $Core: libhttpd_mimetypes */
 
 #include "inspircd.h"
+#include <fstream>
+
+/** Types known without a mime.types file; one loaded with mime::types-file adds to and overrides these
+ */
+static const char *builtin_types[][2] = {
+	{ "html", "text/html" }, { "htm", "text/html" }, { "css", "text/css" }, { "js", "application/javascript" },
+	{ "json", "application/json" }, { "xml", "application/xml" }, { "txt", "text/plain" }, { "csv", "text/csv" },
+	{ "jpg", "image/jpeg" }, { "jpeg", "image/jpeg" }, { "gif", "image/gif" }, { "png", "image/png" },
+	{ "svg", "image/svg+xml" }, { "ico", "image/x-icon" }, { "webp", "image/webp" },
+	{ "woff", "font/woff" }, { "woff2", "font/woff2" }, { "pdf", "application/pdf" }, { "zip", "application/zip" },
+	{ "gz", "application/gzip" }, { "tar", "application/x-tar" }, { "mp3", "audio/mpeg" }, { "mp4", "video/mp4" },
+	{ "webm", "video/webm" }, { "wasm", "application/wasm" },
+	{ NULL, NULL }
+};
+
+MimeManager::MimeManager(InspIRCd *Instance) : table(64), count(0), ServerInstance(Instance)
+{
+	SetDefault("application/octet-stream");
+}
+
+MimeManager::~MimeManager()
+{
+	for (std::vector<MimeType *>::iterator i = table.begin(); i != table.end(); i++)
+		delete *i;
+}
+
+size_t MimeManager::Hash(const char *ext, size_t len)
+{
+	/* FNV-1a over the lower cased bytes */
+	size_t h = 2166136261U;
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (unsigned char)tolower(ext[i])) * 16777619U;
+	return h;
+}
+
+size_t MimeManager::Slot(const char *ext, size_t len) const
+{
+	size_t mask = table.size() - 1;
+	size_t i = Hash(ext, len) & mask;
+
+	while (table[i])
+	{
+		const std::string &e = table[i]->ext;
+		if ((e.length() == len) && !strncasecmp(e.data(), ext, len))
+			break;
+		i = (i + 1) & mask;
+	}
+
+	return i;
+}
+
+void MimeManager::Grow()
+{
+	std::vector<MimeType *> old(table.size() * 2);
+	old.swap(table);
+
+	for (std::vector<MimeType *>::iterator i = old.begin(); i != old.end(); i++)
+	{
+		if (*i)
+			table[Slot((*i)->ext.data(), (*i)->ext.length())] = *i;
+	}
+}
+
+void MimeManager::AddBuiltinTypes()
+{
+	for (int i = 0; builtin_types[i][0]; i++)
+		AddType(builtin_types[i][0], builtin_types[i][1]);
+}
 
 void MimeManager::AddType(const std::string &ext, const std::string &type)
 {
-	MimeTypes[ext] = type;
+	if (ext.empty())
+		return;
+
+	size_t i = Slot(ext.data(), ext.length());
+	if (!table[i])
+	{
+		if ((count + 1) * 2 > table.size())
+		{
+			Grow();
+			i = Slot(ext.data(), ext.length());
+		}
+
+		table[i] = new MimeType;
+		table[i]->ext = ext;
+		std::transform(table[i]->ext.begin(), table[i]->ext.end(), table[i]->ext.begin(), ::tolower);
+		count++;
+	}
+
+	table[i]->SetType(type);
 }
 
-const std::string MimeManager::GetType(const std::string &ext)
+bool MimeManager::LoadFile(const std::string &filename)
 {
-	std::map<std::string, std::string>::iterator i = MimeTypes.find(ext);
+	std::ifstream file(filename.c_str());
+	if (!file)
+		return false;
+
+	std::string line;
+	int added = 0;
+	while (std::getline(file, line))
+	{
+		std::string::size_type hash = line.find('#');
+		if (hash != std::string::npos)
+			line.erase(hash);
 
-	if (i == MimeTypes.end())
-		return "";
+		std::istringstream tokens(line);
+		std::string type, ext;
+		if (!(tokens >> type))
+			continue;
 
-	return i->second;
+		while (tokens >> ext)
+		{
+			AddType(ext, type);
+			added++;
+		}
+	}
+
+	LOG(DEFAULT, LS_CORE, "Loaded %d MIME types from %s", added, filename.c_str());
+	return true;
 }
 
+const MimeType *MimeManager::Find(const char *ext, size_t len) const
+{
+	if (!len)
+		return NULL;
 
+	return table[Slot(ext, len)];
+}
+
+const MimeType *MimeManager::FindForPath(const std::string &path) const
+{
+	std::string::size_type p = path.find_last_of("./");
+	if ((p == std::string::npos) || (path[p] == '/'))
+		return NULL;
+
+	return Find(path.data() + p + 1, path.length() - p - 1);
+}
+
+const std::string MimeManager::GetType(const std::string &ext)
+{
+	const MimeType *t = Find(ext.data(), ext.length());
+	return t ? t->type : "";
+}
@@ -107,6 +107,10 @@ void		Module::OnConnectionConnect(Connection*) { }
 void		Module::OnConnectionDisconnect(Connection*) { }
 void		Module::OnGracefulShutdown() { }
 int		Module::OnPreRequest(Connection *, const std::string &method, const std::string &vhost, const std::string &dir, const std::string &file) { return 0; }
+int		Module::OnUpgrade(Connection *, const std::string &) { return 0; }
+void		Module::OnUpgradedData(Connection *, const char *, size_t) { }
+void		Module::OnRequestComplete(Connection *) { }
+void		Module::OnReopenLogs() { }
 Version		Module::GetVersion() { return Version(1,0,0,0,VF_VENDOR,-1); }
 void		Module::OnLoadModule(Module*, const std::string&) { }
 void		Module::OnUnloadModule(Module*, const std::string&) { }
@@ -0,0 +1,986 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+#include "inspircd.h"
+#include <set>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+/* $ModDesc: Provides SSL/TLS on listeners bound with ssl="openssl" */
+/* $CompileFlags: pkgconfincludes("openssl","/openssl/ssl.h","") */
+/* $LinkerFlags: rpath("pkg-config --libs openssl") pkgconflibs("openssl","/libssl.so","-lssl -lcrypto -ldl") -lpthread -lrt */
+
+/** Where a session is in its lifetime
+ */
+enum TLSState
+{
+	TLS_HANDSHAKING, /* SSL_accept() has not completed yet */
+	TLS_OPEN /* Handshake done, application data may flow */
+};
+
+/** SSL state for one client connection
+ */
+class TLSSession : public classbase
+{
+ public:
+	SSL *sess;
+	TLSState state;
+
+	/** True when the kernel is doing record encryption for data we send (kTLS).
+	 * Writes then bypass OpenSSL entirely, so the core's plain send path (including
+	 * static files) is used unmodified.
+	 */
+	bool ktls_send;
+
+	TLSSession(SSL *s) : sess(s), state(TLS_HANDSHAKING), ktls_send(false)
+	{
+	}
+
+	~TLSSession()
+	{
+		SSL_free(sess);
+	}
+};
+
+/** Sessions sharing a bucket, searched linearly */
+#define SESSION_SLOTS_PER_BUCKET 8
+
+/** Largest serialised session we will store; server side sessions are usually ~150 bytes */
+#define SESSION_DATA_MAX 512
+
+/** How many ticket keys are accepted: the current one and those it replaced */
+#define TICKET_KEYS 3
+
+#define SHARED_CACHE_MAGIC 0x68745353
+
+/** One cached session, in shared memory
+ */
+struct SharedSession
+{
+	time_t expires;
+	unsigned int idlen;
+	unsigned int len;
+	unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	unsigned char data[SESSION_DATA_MAX];
+};
+
+/** A group of slots under one lock
+ */
+struct SharedBucket
+{
+	pthread_mutex_t lock;
+	SharedSession slots[SESSION_SLOTS_PER_BUCKET];
+};
+
+/** Key material for session tickets
+ */
+struct TicketKey
+{
+	unsigned char name[16];
+	unsigned char aes[32];
+	unsigned char hmac[32];
+};
+
+/** Start of the shared segment; the buckets follow it
+ */
+struct SharedHeader
+{
+	unsigned int magic;
+	unsigned int buckets;
+	size_t size;
+	pthread_mutex_t keylock;
+	time_t keys_created;
+	TicketKey keys[TICKET_KEYS]; /* keys[0] is current */
+};
+
+/** A session cache and ticket key ring in shared memory.
+ * Every process which maps the same named segment resumes sessions and decrypts
+ * tickets issued by any of the others. Without a name, the segment is anonymous
+ * and only this process uses it.
+ */
+class SharedSessionCache : public classbase
+{
+	InspIRCd *ServerInstance;
+	SharedHeader *header;
+	SharedBucket *buckets;
+	size_t size;
+
+	static void InitMutex(pthread_mutex_t *m)
+	{
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(m, &attr);
+		pthread_mutexattr_destroy(&attr);
+	}
+
+	/** Lock a bucket. If the process holding it died, the bucket may be half
+	 * written, so it is emptied.
+	 */
+	void LockBucket(SharedBucket *b)
+	{
+		if (pthread_mutex_lock(&b->lock) == EOWNERDEAD)
+		{
+			memset(b->slots, 0, sizeof(b->slots));
+			pthread_mutex_consistent(&b->lock);
+		}
+	}
+
+	void LockKeys()
+	{
+		if (pthread_mutex_lock(&header->keylock) == EOWNERDEAD)
+		{
+			GenerateKeys(0);
+			pthread_mutex_consistent(&header->keylock);
+		}
+	}
+
+	/** Replace keys from index first onwards with new random keys
+	 */
+	void GenerateKeys(int first)
+	{
+		for (int i = first; i < TICKET_KEYS; i++)
+			RAND_bytes((unsigned char *)&header->keys[i], sizeof(TicketKey));
+		header->keys_created = ServerInstance->Time();
+	}
+
+	SharedBucket *GetBucket(const unsigned char *id, unsigned int idlen)
+	{
+		/* FNV-1a; ids are random, but clients choose them */
+		unsigned int h = 2166136261U;
+		for (unsigned int i = 0; i < idlen; i++)
+			h = (h ^ id[i]) * 16777619U;
+
+		return &buckets[h % header->buckets];
+	}
+
+	void Attach(const std::string &name, unsigned int nbuckets)
+	{
+		int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		bool created = (fd >= 0);
+
+		if (!created && (errno == EEXIST))
+			fd = shm_open(name.c_str(), O_RDWR, 0600);
+		if (fd < 0)
+			throw ModuleException("m_ssl_openssl: Can't open session cache " + name + ": " + strerror(errno));
+
+		if (created && (ftruncate(fd, size) < 0))
+		{
+			close(fd);
+			shm_unlink(name.c_str());
+			throw ModuleException("m_ssl_openssl: Can't size session cache " + name + ": " + strerror(errno));
+		}
+
+		/* Another process may be creating it right now; give it a moment */
+		struct stat st;
+		for (int tries = 0; !created && (fstat(fd, &st) == 0) && (st.st_size == 0) && (tries < 20); tries++)
+			usleep(50000);
+
+		if (!created && (fstat(fd, &st) == 0) && ((size_t)st.st_size != size))
+		{
+			close(fd);
+			throw ModuleException("m_ssl_openssl: Session cache " + name + " was created with a different size. Remove it (from /dev/shm) or change ssl::session-cache-size to match");
+		}
+
+		void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			throw ModuleException("m_ssl_openssl: Can't map session cache " + name + ": " + strerror(errno));
+
+		header = (SharedHeader *)p;
+		buckets = (SharedBucket *)((char *)p + sizeof(SharedHeader));
+
+		if (created)
+		{
+			Initialise(nbuckets);
+			ServerInstance->Log(DEFAULT, "m_ssl_openssl: Created shared session cache %s", name.c_str());
+			return;
+		}
+
+		for (int tries = 0; (header->magic != SHARED_CACHE_MAGIC) && (tries < 20); tries++)
+			usleep(50000);
+
+		if (header->magic != SHARED_CACHE_MAGIC)
+		{
+			munmap(p, size);
+			throw ModuleException("m_ssl_openssl: Session cache " + name + " is not initialised; remove it from /dev/shm");
+		}
+
+		ServerInstance->Log(DEFAULT, "m_ssl_openssl: Attached to shared session cache %s", name.c_str());
+	}
+
+	void Initialise(unsigned int nbuckets)
+	{
+		header->buckets = nbuckets;
+		header->size = size;
+		InitMutex(&header->keylock);
+		GenerateKeys(0);
+
+		for (unsigned int i = 0; i < nbuckets; i++)
+			InitMutex(&buckets[i].lock);
+
+		/* Attaching processes wait for this */
+		__sync_synchronize();
+		header->magic = SHARED_CACHE_MAGIC;
+	}
+
+ public:
+	/** Map the cache
+	 * @param Instance The server instance
+	 * @param name Name of a POSIX shared memory object, or empty for an anonymous segment
+	 * @param sessions Number of sessions to hold
+	 */
+	SharedSessionCache(InspIRCd *Instance, const std::string &name, unsigned int sessions) : ServerInstance(Instance)
+	{
+		unsigned int nbuckets = (sessions + SESSION_SLOTS_PER_BUCKET - 1) / SESSION_SLOTS_PER_BUCKET;
+		if (!nbuckets)
+			nbuckets = 1;
+
+		size = sizeof(SharedHeader) + nbuckets * sizeof(SharedBucket);
+
+		if (!name.empty())
+		{
+			Attach(name, nbuckets);
+			return;
+		}
+
+		void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			throw ModuleException(std::string("m_ssl_openssl: Can't map session cache: ") + strerror(errno));
+
+		header = (SharedHeader *)p;
+		buckets = (SharedBucket *)((char *)p + sizeof(SharedHeader));
+		Initialise(nbuckets);
+	}
+
+	~SharedSessionCache()
+	{
+		munmap(header, size);
+	}
+
+	/** Store a session, replacing an expired or the soonest to expire one if the bucket is full
+	 */
+	void Add(SSL_SESSION *sess)
+	{
+		unsigned int idlen;
+		const unsigned char *id = SSL_SESSION_get_id(sess, &idlen);
+
+		int len = i2d_SSL_SESSION(sess, NULL);
+		if ((len <= 0) || (len > SESSION_DATA_MAX) || !idlen || (idlen > SSL_MAX_SSL_SESSION_ID_LENGTH))
+		{
+			LOG(DEBUG, LS_MODULE, "m_ssl_openssl: Not caching session of %d bytes", len);
+			return;
+		}
+
+		SharedBucket *b = GetBucket(id, idlen);
+		LockBucket(b);
+
+		SharedSession *slot = &b->slots[0];
+		for (int i = 0; i < SESSION_SLOTS_PER_BUCKET; i++)
+		{
+			SharedSession *s = &b->slots[i];
+			if ((s->idlen == idlen) && !memcmp(s->id, id, idlen))
+			{
+				slot = s;
+				break;
+			}
+			if (s->expires < slot->expires)
+				slot = s;
+		}
+
+		unsigned char *p = slot->data;
+		i2d_SSL_SESSION(sess, &p);
+		slot->len = len;
+		slot->idlen = idlen;
+		memcpy(slot->id, id, idlen);
+		slot->expires = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	/** Find a session by id
+	 * @return A new session owned by the caller, or NULL
+	 */
+	SSL_SESSION *Get(const unsigned char *id, unsigned int idlen)
+	{
+		if (!idlen || (idlen > SSL_MAX_SSL_SESSION_ID_LENGTH))
+			return NULL;
+
+		SharedBucket *b = GetBucket(id, idlen);
+		SSL_SESSION *sess = NULL;
+		time_t now = ServerInstance->Time();
+
+		LockBucket(b);
+		for (int i = 0; i < SESSION_SLOTS_PER_BUCKET; i++)
+		{
+			SharedSession *s = &b->slots[i];
+			if ((s->idlen == idlen) && (s->expires > now) && !memcmp(s->id, id, idlen))
+			{
+				const unsigned char *p = s->data;
+				sess = d2i_SSL_SESSION(NULL, &p, s->len);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&b->lock);
+
+		return sess;
+	}
+
+	void Remove(SSL_SESSION *sess)
+	{
+		unsigned int idlen;
+		const unsigned char *id = SSL_SESSION_get_id(sess, &idlen);
+		if (!idlen || (idlen > SSL_MAX_SSL_SESSION_ID_LENGTH))
+			return;
+
+		SharedBucket *b = GetBucket(id, idlen);
+		LockBucket(b);
+		for (int i = 0; i < SESSION_SLOTS_PER_BUCKET; i++)
+		{
+			SharedSession *s = &b->slots[i];
+			if ((s->idlen == idlen) && !memcmp(s->id, id, idlen))
+				memset(s, 0, sizeof(SharedSession));
+		}
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	/** Copy out the key new tickets are encrypted with
+	 */
+	void CurrentKey(TicketKey &key)
+	{
+		LockKeys();
+		key = header->keys[0];
+		pthread_mutex_unlock(&header->keylock);
+	}
+
+	/** Find the key a ticket was encrypted with
+	 * @return 0 if there is none (the ticket is too old), 1 if it is the current key,
+	 * or 2 if the ticket is good but should be replaced with one using the current key
+	 */
+	int FindKey(const unsigned char *name, TicketKey &key)
+	{
+		int re = 0;
+
+		LockKeys();
+		for (int i = 0; i < TICKET_KEYS; i++)
+		{
+			if (!memcmp(header->keys[i].name, name, sizeof(key.name)))
+			{
+				key = header->keys[i];
+				re = i ? 2 : 1;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&header->keylock);
+
+		return re;
+	}
+
+	/** Start using a new ticket key if the current one is older than interval.
+	 * Any process may do this; the rest see the new key straight away.
+	 */
+	void RotateKeys(time_t interval)
+	{
+		LockKeys();
+		if (ServerInstance->Time() - header->keys_created >= interval)
+		{
+			memmove(&header->keys[1], &header->keys[0], (TICKET_KEYS - 1) * sizeof(TicketKey));
+			RAND_bytes((unsigned char *)&header->keys[0], sizeof(TicketKey));
+			header->keys_created = ServerInstance->Time();
+			LOG(DEBUG, LS_MODULE, "m_ssl_openssl: Rotated session ticket key");
+		}
+		pthread_mutex_unlock(&header->keylock);
+	}
+};
+
+static SharedSessionCache *SessionCache = NULL;
+
+static int NewSessionCallback(SSL *, SSL_SESSION *sess)
+{
+	if (SessionCache)
+		SessionCache->Add(sess);
+
+	/* We didn't keep a reference */
+	return 0;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static SSL_SESSION *GetSessionCallback(SSL *, const unsigned char *id, int idlen, int *copy)
+#else
+static SSL_SESSION *GetSessionCallback(SSL *, unsigned char *id, int idlen, int *copy)
+#endif
+{
+	*copy = 0;
+	return SessionCache ? SessionCache->Get(id, idlen) : NULL;
+}
+
+static void RemoveSessionCallback(SSL_CTX *, SSL_SESSION *sess)
+{
+	if (SessionCache)
+		SessionCache->Remove(sess);
+}
+
+/** Encrypt or decrypt a session ticket with the shared key ring
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int TicketKeyCallback(SSL *, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int TicketKeyCallback(SSL *, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+#endif
+{
+	if (!SessionCache)
+		return enc ? -1 : 0;
+
+	TicketKey key;
+	int re = 1;
+
+	if (enc)
+	{
+		SessionCache->CurrentKey(key);
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+			return -1;
+		memcpy(name, key.name, sizeof(key.name));
+		EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes, iv);
+	}
+	else
+	{
+		re = SessionCache->FindKey(name, key);
+		if (!re)
+			return 0;
+		EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes, iv);
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[3];
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof(key.hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	EVP_MAC_CTX_set_params(hctx, params);
+#else
+	HMAC_Init_ex(hctx, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL);
+#endif
+
+	OPENSSL_cleanse(&key, sizeof(key));
+	return re;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+/** Choose the application protocol the client asked for: HTTP/2 if a module provides it,
+ * else HTTP/1.1. A client offering neither gets no ALPN and falls back to HTTP/1.1.
+ */
+static int ALPNCallback(SSL *, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg)
+{
+	InspIRCd *Instance = (InspIRCd *)arg;
+	static const unsigned char h2[] = "\x02h2\x08http/1.1";
+	static const unsigned char http11[] = "\x08http/1.1";
+	unsigned char *selected;
+
+	bool http2 = Instance->Modules->FindFeature("HTTP/2");
+	if (SSL_select_next_proto(&selected, outlen, http2 ? h2 : http11, (http2 ? sizeof(h2) : sizeof(http11)) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	*out = selected;
+	return SSL_TLSEXT_ERR_OK;
+}
+#endif
+
+/** Rotates the session ticket key. Each process runs one of these.
+ */
+class TicketKeyTimer : public Timer
+{
+	time_t interval;
+
+ public:
+	TicketKeyTimer(InspIRCd *Instance, time_t rotate) : Timer(rotate < 60 ? rotate : 60, Instance->Time(), true), interval(rotate)
+	{
+	}
+
+	virtual void Tick(time_t)
+	{
+		if (SessionCache)
+			SessionCache->RotateKeys(interval);
+	}
+};
+
+class ModuleSSLOpenSSL : public Module
+{
+	SSL_CTX *ctx;
+	SharedSessionCache *cache;
+	TicketKeyTimer *keytimer;
+
+	/** Local ports of listeners with ssl="openssl"
+	 */
+	std::set<int> ports;
+
+	/** Sessions, indexed by file descriptor
+	 */
+	TLSSession *sessions[MAX_DESCRIPTORS];
+
+	/** Log the OpenSSL error queue, clearing it
+	 */
+	void LogErrors(const std::string &what)
+	{
+		unsigned long e;
+		char buf[256];
+
+		while ((e = ERR_get_error()))
+		{
+			ERR_error_string_n(e, buf, sizeof(buf));
+			LOG(DEBUG, LS_MODULE, "m_ssl_openssl: %s: %s", what.c_str(), buf);
+		}
+	}
+
+	/** Resolve a file name relative to the directory holding the config file
+	 */
+	std::string ConfigPath(const std::string &file)
+	{
+		if (file.empty() || (file[0] == '/'))
+			return file;
+
+		std::string confpath = ServerInstance->ConfigFileName;
+		std::string::size_type pos = confpath.rfind('/');
+		if (pos == std::string::npos)
+			return file;
+
+		return confpath.substr(0, pos + 1) + file;
+	}
+
+	/** Throw a ModuleException carrying the first queued OpenSSL error
+	 */
+	void Fail(const std::string &what)
+	{
+		char buf[256];
+		ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+		ERR_clear_error();
+		throw ModuleException("m_ssl_openssl: " + what + ": " + buf);
+	}
+
+	void LoadDHParams(const std::string &dhfile)
+	{
+		BIO *bio = BIO_new_file(dhfile.c_str(), "r");
+		if (!bio)
+			Fail("Can't open DH parameters " + dhfile);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		EVP_PKEY *dh = PEM_read_bio_Parameters(bio, NULL);
+		BIO_free(bio);
+		if (!dh)
+			Fail("Can't read DH parameters from " + dhfile);
+		if (!SSL_CTX_set0_tmp_dh_pkey(ctx, dh))
+		{
+			EVP_PKEY_free(dh);
+			Fail("Can't use DH parameters from " + dhfile);
+		}
+#else
+		DH *dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+		if (!dh)
+			Fail("Can't read DH parameters from " + dhfile);
+		int ok = SSL_CTX_set_tmp_dh(ctx, dh);
+		DH_free(dh);
+		if (!ok)
+			Fail("Can't use DH parameters from " + dhfile);
+#endif
+	}
+
+	void ReadConfig()
+	{
+		ConfigReader Conf(ServerInstance);
+
+		for (int i = 0; i < Conf.Enumerate("bind"); i++)
+		{
+			if (Conf.ReadValue("bind", "ssl", i) != "openssl")
+				continue;
+
+			utils::portparser portrange(Conf.ReadValue("bind", "port", i), false);
+			int portno = -1;
+			while ((portno = portrange.GetToken()))
+				ports.insert(portno);
+		}
+
+		if (ports.empty())
+			ServerInstance->Log(DEFAULT, "m_ssl_openssl: No <bind> blocks have ssl=\"openssl\"; SSL will not be used");
+
+		std::string certfile = ConfigPath(Conf.ReadValue("ssl", "certfile", "cert.pem", 0));
+		std::string keyfile = ConfigPath(Conf.ReadValue("ssl", "keyfile", "key.pem", 0));
+		std::string dhfile = ConfigPath(Conf.ReadValue("ssl", "dhfile", 0));
+		std::string ciphers = Conf.ReadValue("ssl", "ciphers", 0);
+		std::string cachename = Conf.ReadValue("ssl", "session-cache", 0);
+		int cachesize = Conf.ReadInteger("ssl", "session-cache-size", "20480", 0, false);
+		int sesstimeout = Conf.ReadInteger("ssl", "session-timeout", "300", 0, true);
+		bool tickets = Conf.ReadFlag("ssl", "tickets", "yes", 0);
+		int keyrotate = Conf.ReadInteger("ssl", "ticket-key-rotate", "3600", 0, false);
+		bool ktls = Conf.ReadFlag("ssl", "ktls", "yes", 0);
+
+		if (SSL_CTX_use_certificate_chain_file(ctx, certfile.c_str()) != 1)
+			Fail("Can't read certificate " + certfile);
+
+		if (SSL_CTX_use_PrivateKey_file(ctx, keyfile.c_str(), SSL_FILETYPE_PEM) != 1)
+			Fail("Can't read private key " + keyfile);
+
+		if (SSL_CTX_check_private_key(ctx) != 1)
+			Fail("Private key " + keyfile + " does not match certificate " + certfile);
+
+		if (!ciphers.empty() && (SSL_CTX_set_cipher_list(ctx, ciphers.c_str()) != 1))
+			Fail("Invalid cipher list '" + ciphers + "'");
+
+		if (!dhfile.empty())
+			LoadDHParams(dhfile);
+#ifdef SSL_CTX_set_dh_auto
+		else
+			SSL_CTX_set_dh_auto(ctx, 1);
+#endif
+
+		/* Sessions are cached in shared memory, keyed by the session id the client offers back.
+		 * Session tickets let the client hold the state instead, encrypted with a key from the
+		 * same segment, so either way any process sharing it can resume the session. */
+		cache = new SharedSessionCache(ServerInstance, cachename, cachesize > 0 ? cachesize : 1);
+		SessionCache = cache;
+
+		if (cachesize > 0)
+		{
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+			SSL_CTX_sess_set_new_cb(ctx, NewSessionCallback);
+			SSL_CTX_sess_set_get_cb(ctx, GetSessionCallback);
+			SSL_CTX_sess_set_remove_cb(ctx, RemoveSessionCallback);
+		}
+		else
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+
+		SSL_CTX_set_timeout(ctx, sesstimeout);
+		SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"hottpd", 6);
+
+		if (tickets)
+		{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, TicketKeyCallback);
+#else
+			SSL_CTX_set_tlsext_ticket_key_cb(ctx, TicketKeyCallback);
+#endif
+			if (keyrotate > 0)
+			{
+				keytimer = new TicketKeyTimer(ServerInstance, keyrotate);
+				ServerInstance->Timers->AddTimer(keytimer);
+			}
+		}
+		else
+			SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+
+		if (ktls)
+		{
+#ifdef SSL_OP_ENABLE_KTLS
+			SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+			ServerInstance->Log(DEFAULT, "m_ssl_openssl: This OpenSSL was built without kTLS support; ktls setting ignored");
+#endif
+		}
+	}
+
+	TLSSession *GetSession(int fd)
+	{
+		if ((fd < 0) || (fd >= MAX_DESCRIPTORS))
+			return NULL;
+
+		return sessions[fd];
+	}
+
+	/** Advance the handshake
+	 * @return false if it failed and the connection should be dropped
+	 */
+	bool Handshake(int fd, TLSSession *session)
+	{
+		ERR_clear_error();
+		int ret = SSL_accept(session->sess);
+
+		if (ret > 0)
+		{
+			session->state = TLS_OPEN;
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+			session->ktls_send = BIO_get_ktls_send(SSL_get_wbio(session->sess));
+#endif
+			LOG(DEBUG, LS_MODULE, "m_ssl_openssl: Handshake on fd %d done: %s %s%s%s", fd,
+				SSL_get_version(session->sess), SSL_get_cipher_name(session->sess),
+				SSL_session_reused(session->sess) ? " (resumed)" : "",
+				session->ktls_send ? " (kTLS)" : "");
+			return true;
+		}
+
+		switch (SSL_get_error(session->sess, ret))
+		{
+			case SSL_ERROR_WANT_READ:
+				return true;
+			case SSL_ERROR_WANT_WRITE:
+				/* Handshake continues from OnBufferFlushed once the socket is writable */
+				ServerInstance->SE->WantWrite(ServerInstance->SE->GetRef(fd));
+				return true;
+			default:
+				LogErrors("Handshake on fd " + ConvToStr(fd) + " failed");
+				return false;
+		}
+	}
+
+	void CloseSession(int fd)
+	{
+		TLSSession *session = GetSession(fd);
+		if (!session)
+			return;
+
+		if (session->state == TLS_OPEN)
+		{
+			/* Send close_notify if there's room; we don't wait for the peer's */
+			ERR_clear_error();
+			SSL_shutdown(session->sess);
+			ERR_clear_error();
+		}
+
+		delete session;
+		sessions[fd] = NULL;
+	}
+
+ public:
+	ModuleSSLOpenSSL(InspIRCd *Srv) : Module(Srv)
+	{
+		memset(sessions, 0, sizeof(sessions));
+		cache = NULL;
+		keytimer = NULL;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		SSL_library_init();
+		SSL_load_error_strings();
+		ctx = SSL_CTX_new(SSLv23_server_method());
+#else
+		ctx = SSL_CTX_new(TLS_server_method());
+#endif
+		if (!ctx)
+			Fail("Can't create SSL context");
+
+		SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+#ifdef SSL_OP_NO_RENEGOTIATION
+		SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+#endif
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+		/* Plenty of clients just close the socket; treat that as a normal EOF */
+		SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+		/* The core may retry a partial write from a different address (its sendq moves),
+		 * and idle keepalive connections shouldn't hold on to record buffers. */
+		SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+		SSL_CTX_set_alpn_select_cb(ctx, ALPNCallback, ServerInstance);
+#endif
+
+		try
+		{
+			ReadConfig();
+		}
+		catch (ModuleException &e)
+		{
+			Cleanup();
+			throw;
+		}
+
+		Implementation eventlist[] = { I_OnRawSocketAccept, I_OnRawSocketRead, I_OnRawSocketWrite, I_OnRawSocketClose, I_OnBufferFlushed };
+		ServerInstance->Modules->Attach(eventlist, this, 5);
+	}
+
+	virtual ~ModuleSSLOpenSSL()
+	{
+		/* Connections still using SSL can't carry on without us */
+		for (int fd = 0; fd < MAX_DESCRIPTORS; fd++)
+		{
+			if (!sessions[fd])
+				continue;
+
+			Connection *c = dynamic_cast<Connection *>(ServerInstance->SE->GetRef(fd));
+			if (c)
+				ServerInstance->Connections->Delete(c);
+
+			CloseSession(fd);
+		}
+
+		Cleanup();
+	}
+
+	void Cleanup()
+	{
+		if (keytimer)
+			ServerInstance->Timers->DelTimer(keytimer);
+
+		SSL_CTX_free(ctx);
+		SessionCache = NULL;
+		delete cache;
+	}
+
+	virtual Version GetVersion()
+	{
+		return Version(1, 0, 0, 0, VF_VENDOR, API_VERSION);
+	}
+
+	virtual void OnRawSocketAccept(int fd, const std::string &ip, int localport)
+	{
+		if ((fd < 0) || (fd >= MAX_DESCRIPTORS) || !ports.count(localport))
+			return;
+
+		SSL *sess = SSL_new(ctx);
+		if (!sess)
+		{
+			LogErrors("SSL_new for " + ip);
+			return;
+		}
+
+		SSL_set_fd(sess, fd);
+		SSL_set_accept_state(sess);
+
+		delete sessions[fd];
+		sessions[fd] = new TLSSession(sess);
+	}
+
+	virtual int OnRawSocketRead(int fd, char *buffer, unsigned int count, int &readresult)
+	{
+		TLSSession *session = GetSession(fd);
+		if (!session)
+			return 0;
+
+		if (session->state == TLS_HANDSHAKING)
+		{
+			if (!Handshake(fd, session))
+			{
+				errno = EIO;
+				readresult = -1;
+				return 1;
+			}
+
+			if (session->state == TLS_HANDSHAKING)
+			{
+				errno = EAGAIN;
+				readresult = -1;
+				return 1;
+			}
+		}
+
+		/* Decrypted data OpenSSL holds on to doesn't make the socket readable, so we may
+		 * only stop reading with data pending if the buffer is full. Reading whole records
+		 * (never leaving less than a record of room) avoids that. */
+		unsigned int total = 0;
+		while (total < count)
+		{
+			ERR_clear_error();
+			int n = SSL_read(session->sess, buffer + total, count - total);
+
+			if (n > 0)
+			{
+				total += n;
+				if (count - total < SSL3_RT_MAX_PLAIN_LENGTH)
+					break;
+				continue;
+			}
+
+			int err = SSL_get_error(session->sess, n);
+			if ((err == SSL_ERROR_WANT_READ) || (err == SSL_ERROR_WANT_WRITE))
+				break;
+
+			/* Return what we have; the error or EOF shows up again on the next read */
+			if (total)
+				break;
+
+			if (err == SSL_ERROR_ZERO_RETURN)
+			{
+				readresult = 0;
+			}
+			else if ((err == SSL_ERROR_SYSCALL) && (ERR_peek_error() == 0))
+			{
+				readresult = errno ? -1 : 0;
+			}
+			else
+			{
+				LogErrors("Read on fd " + ConvToStr(fd));
+				errno = EIO;
+				readresult = -1;
+			}
+			return 1;
+		}
+
+		if (total)
+		{
+			readresult = total;
+		}
+		else
+		{
+			errno = EAGAIN;
+			readresult = -1;
+		}
+		return 1;
+	}
+
+	virtual int OnRawSocketWrite(int fd, const char *buffer, int count)
+	{
+		TLSSession *session = GetSession(fd);
+		if (!session || (count <= 0))
+			return 0;
+
+		/* Let the core write straight to the kernel, which frames and encrypts it */
+		if (session->ktls_send)
+			return 0;
+
+		if (session->state != TLS_OPEN)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+
+		ERR_clear_error();
+		int n = SSL_write(session->sess, buffer, count);
+		if (n > 0)
+			return n;
+
+		int err = SSL_get_error(session->sess, n);
+		if ((err == SSL_ERROR_WANT_WRITE) || (err == SSL_ERROR_WANT_READ))
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+
+		if ((err != SSL_ERROR_SYSCALL) || ERR_peek_error())
+		{
+			LogErrors("Write on fd " + ConvToStr(fd));
+			errno = EIO;
+		}
+		return -1;
+	}
+
+	virtual void OnRawSocketClose(int fd)
+	{
+		CloseSession(fd);
+	}
+
+	virtual void OnBufferFlushed(Connection *c)
+	{
+		TLSSession *session = GetSession(c->GetFd());
+		if (!session || (session->state != TLS_HANDSHAKING))
+			return;
+
+		if (!Handshake(c->GetFd(), session))
+			ServerInstance->Connections->Delete(c);
+	}
+};
+
+MODULE_INIT(ModuleSSLOpenSSL)
@@ -0,0 +1,405 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+#include "inspircd.h"
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+/* $ModDesc: Writes an access log in Combined or JSON format from a background thread */
+/* $LinkerFlags: -lpthread */
+
+/** Log records are formatted on the main thread into a ring buffer, and written out by a
+ * writer thread in large batches. The main thread never touches the file, so a slow or
+ * stalled disk can't hold up requests: if the ring fills, records are dropped (and
+ * counted) rather than waited for.
+ *
+ * There is exactly one producer (the main thread) and one consumer (the writer), so the
+ * ring needs no lock: each side only ever advances its own index.
+ */
+class AccessLogRing : public classbase
+{
+	char *ring;
+	size_t size;
+
+	/** Bytes ever written into the ring (by the main thread) and out of it (by the writer).
+	 * Both only grow; their difference is what is waiting.
+	 */
+	volatile size_t head;
+	volatile size_t tail;
+
+	std::string filename;
+	int fd;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	volatile bool running;
+	volatile bool reopen;
+
+	/** Records dropped because the ring was full, and not yet reported
+	 */
+	volatile unsigned long dropped;
+
+	void Open()
+	{
+		int newfd = open(filename.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+		if (newfd < 0)
+			return;
+
+		if (fd >= 0)
+			close(fd);
+		fd = newfd;
+	}
+
+	void Wait()
+	{
+		struct timeval now;
+		struct timespec until;
+
+		gettimeofday(&now, NULL);
+		until.tv_sec = now.tv_sec;
+		until.tv_nsec = now.tv_usec * 1000 + 200000000;
+		if (until.tv_nsec >= 1000000000)
+		{
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock(&lock);
+		if (running && !reopen && (head == tail))
+			pthread_cond_timedwait(&wake, &lock, &until);
+		pthread_mutex_unlock(&lock);
+	}
+
+	/** Write out everything waiting in the ring
+	 */
+	void Drain()
+	{
+		size_t end = head;
+		__sync_synchronize();
+
+		while (tail != end)
+		{
+			size_t start = tail % size;
+			size_t len = end - tail;
+			struct iovec iov[2];
+			int iovcnt = 1;
+
+			iov[0].iov_base = ring + start;
+			iov[0].iov_len = std::min(len, size - start);
+			if (iov[0].iov_len < len)
+			{
+				iov[1].iov_base = ring;
+				iov[1].iov_len = len - iov[0].iov_len;
+				iovcnt = 2;
+			}
+
+			ssize_t n = (fd >= 0) ? writev(fd, iov, iovcnt) : -1;
+			if ((n < 0) && (errno == EINTR))
+				continue;
+
+			/* If the log can't be written, the records are lost; keeping them would only
+			 * stop newer ones being logged once the problem is fixed. */
+			if (n <= 0)
+				n = len;
+
+			__sync_synchronize();
+			tail += n;
+		}
+	}
+
+	static void *Run(void *arg)
+	{
+		AccessLogRing *self = (AccessLogRing *)arg;
+
+		while (self->running)
+		{
+			if (self->reopen)
+			{
+				self->reopen = false;
+				self->Open();
+			}
+
+			self->Drain();
+			self->Wait();
+		}
+
+		self->Drain();
+		return NULL;
+	}
+
+ public:
+	AccessLogRing(const std::string &file, size_t bufsize) : size(bufsize), head(0), tail(0), filename(file), fd(-1),
+		running(true), reopen(false), dropped(0)
+	{
+		Open();
+		if (fd < 0)
+			throw ModuleException("m_accesslog: can't open " + filename + ": " + strerror(errno));
+
+		ring = new char[size];
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&wake, NULL);
+
+		if (pthread_create(&thread, NULL, Run, this))
+		{
+			close(fd);
+			delete[] ring;
+			pthread_cond_destroy(&wake);
+			pthread_mutex_destroy(&lock);
+			throw ModuleException("m_accesslog: can't start the writer thread");
+		}
+	}
+
+	virtual ~AccessLogRing()
+	{
+		/* The writer finishes what is in the ring before exiting */
+		pthread_mutex_lock(&lock);
+		running = false;
+		pthread_cond_signal(&wake);
+		pthread_mutex_unlock(&lock);
+		pthread_join(thread, NULL);
+
+		if (fd >= 0)
+			close(fd);
+		delete[] ring;
+		pthread_cond_destroy(&wake);
+		pthread_mutex_destroy(&lock);
+	}
+
+	/** Queue a record. Called only from the main thread.
+	 * @return false if there was no room and the record was dropped
+	 */
+	bool Push(const std::string &record)
+	{
+		size_t used = head - tail;
+		size_t len = record.length();
+
+		if (len > size - used)
+		{
+			dropped++;
+			return false;
+		}
+
+		size_t start = head % size;
+		size_t first = std::min(len, size - start);
+		memcpy(ring + start, record.data(), first);
+		memcpy(ring, record.data() + first, len - first);
+
+		/* The data must be in place before the writer can see it */
+		__sync_synchronize();
+		head += len;
+
+		/* The writer wakes by itself a few times a second; only hurry it along when the
+		 * ring is filling up, so busy servers write in large batches. */
+		if (used + len > size / 4)
+			pthread_cond_signal(&wake);
+
+		return true;
+	}
+
+	void Reopen()
+	{
+		pthread_mutex_lock(&lock);
+		reopen = true;
+		pthread_cond_signal(&wake);
+		pthread_mutex_unlock(&lock);
+	}
+
+	unsigned long TakeDropped()
+	{
+		unsigned long d = dropped;
+		dropped = 0;
+		return d;
+	}
+};
+
+class ModuleAccessLog : public Module
+{
+	AccessLogRing *log;
+	bool json;
+
+	/** Cached timestamp for the current second, in the format in use
+	 */
+	time_t lastsecond;
+	std::string timestamp;
+
+	const std::string &Timestamp()
+	{
+		time_t now = ServerInstance->Time();
+		if (now == lastsecond)
+			return timestamp;
+
+		char buf[64];
+		struct tm *tm = localtime(&now);
+		strftime(buf, sizeof(buf), json ? "%Y-%m-%dT%H:%M:%S%z" : "%d/%b/%Y:%H:%M:%S %z", tm);
+		timestamp = buf;
+		lastsecond = now;
+		return timestamp;
+	}
+
+	/** Append a string escaped for a quoted field in Combined format, as Apache does
+	 */
+	static void AppendQuoted(std::string &out, const std::string &str)
+	{
+		for (std::string::const_iterator i = str.begin(); i != str.end(); i++)
+		{
+			unsigned char c = *i;
+			if ((c < 32) || (c >= 127) || (c == '"') || (c == '\\'))
+			{
+				char hex[5];
+				snprintf(hex, sizeof(hex), "\\x%02x", c);
+				out.append(hex);
+			}
+			else
+				out.push_back(c);
+		}
+	}
+
+	/** Append a string escaped for JSON. Bytes outside ASCII are escaped individually,
+	 * since nothing says the request was UTF-8.
+	 */
+	static void AppendJSON(std::string &out, const std::string &str)
+	{
+		for (std::string::const_iterator i = str.begin(); i != str.end(); i++)
+		{
+			unsigned char c = *i;
+			if ((c < 32) || (c >= 127) || (c == '"') || (c == '\\'))
+			{
+				char hex[7];
+				snprintf(hex, sizeof(hex), "\\u%04x", c);
+				out.append(hex);
+			}
+			else
+				out.push_back(c);
+		}
+	}
+
+	void ReadConfig()
+	{
+		ConfigReader Conf(ServerInstance);
+
+		std::string file = Conf.ReadValue("accesslog", "file", "access.log", 0);
+		if (file[0] != '/')
+		{
+			/* Relative to the directory holding the config file */
+			std::string confpath = ServerInstance->ConfigFileName;
+			std::string::size_type pos = confpath.rfind('/');
+			if (pos != std::string::npos)
+				file = confpath.substr(0, pos + 1) + file;
+		}
+
+		std::string format = Conf.ReadValue("accesslog", "format", "combined", 0);
+		if ((format != "combined") && (format != "json"))
+			throw ModuleException("m_accesslog: format must be combined or json, not " + format);
+		json = (format == "json");
+
+		int bufsize = Conf.ReadInteger("accesslog", "buffer-size", "1048576", 0, true);
+		if (bufsize < 65536)
+			bufsize = 65536;
+
+		log = new AccessLogRing(file, bufsize);
+	}
+
+ public:
+	ModuleAccessLog(InspIRCd *Srv) : Module(Srv), log(NULL), json(false), lastsecond(0)
+	{
+		ReadConfig();
+
+		Implementation eventlist[] = { I_OnRequestComplete, I_OnReopenLogs, I_OnBackgroundTimer };
+		ServerInstance->Modules->Attach(eventlist, this, 3);
+	}
+
+	virtual ~ModuleAccessLog()
+	{
+		delete log;
+	}
+
+	virtual Version GetVersion()
+	{
+		return Version(1, 0, 0, 0, VF_VENDOR, API_VERSION);
+	}
+
+	virtual void OnRequestComplete(Connection *c)
+	{
+		HTTPHeaders &headers = c->GetRequestHeaders();
+		std::string record;
+		record.reserve(256);
+
+		/* Microseconds from the request's headers arriving until it finished */
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		long long usec = (now.tv_sec - c->RequestStart.tv_sec) * 1000000LL + (now.tv_usec - c->RequestStart.tv_usec);
+
+		if (json)
+		{
+			record = "{\"time\":\"" + Timestamp() + "\",\"remote_addr\":\"";
+			AppendJSON(record, c->GetIP());
+			record += "\",\"method\":\"";
+			AppendJSON(record, c->rawmethod);
+			record += "\",\"uri\":\"";
+			AppendJSON(record, c->rawuri);
+			record += "\",\"protocol\":\"";
+			AppendJSON(record, c->rawversion);
+			record += "\",\"status\":" + ConvToStr(c->ResponseCode);
+			record += ",\"bytes\":" + ConvToStr((unsigned long)c->ResponseBytes);
+			record += ",\"duration_us\":" + ConvToStr((long)usec);
+			record += ",\"referer\":\"";
+			AppendJSON(record, headers.GetHeader("Referer"));
+			record += "\",\"user_agent\":\"";
+			AppendJSON(record, headers.GetHeader("User-Agent"));
+			record += "\"}\n";
+		}
+		else
+		{
+			/* host ident user [time] "request" status bytes "referer" "agent", plus
+			 * the time taken in microseconds at the end. The request line is logged as
+			 * the client sent it, not as it was served after cleanup and rewrites. */
+			record = c->GetIP() + " - - [" + Timestamp() + "] \"";
+			AppendQuoted(record, c->rawmethod);
+			record.push_back(' ');
+			AppendQuoted(record, c->rawuri);
+			record.push_back(' ');
+			AppendQuoted(record, c->rawversion);
+			record += "\" " + ConvToStr(c->ResponseCode) + " " + ConvToStr((unsigned long)c->ResponseBytes) + " \"";
+
+			const std::string &referer = headers.GetHeader("Referer");
+			if (referer.empty())
+				record.push_back('-');
+			else
+				AppendQuoted(record, referer);
+			record += "\" \"";
+
+			const std::string &agent = headers.GetHeader("User-Agent");
+			if (agent.empty())
+				record.push_back('-');
+			else
+				AppendQuoted(record, agent);
+			record += "\" " + ConvToStr((long)usec) + "\n";
+		}
+
+		log->Push(record);
+	}
+
+	virtual void OnReopenLogs()
+	{
+		log->Reopen();
+	}
+
+	virtual void OnBackgroundTimer(time_t)
+	{
+		unsigned long dropped = log->TakeDropped();
+		if (dropped)
+			ServerInstance->Log(DEFAULT, "m_accesslog: %lu records dropped, the log can't be written fast enough", dropped);
+	}
+};
+
+MODULE_INIT(ModuleAccessLog)
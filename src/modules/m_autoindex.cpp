@@ -0,0 +1,307 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+#include "inspircd.h"
+#include <dirent.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* $ModDesc: Lists the contents of directories which have no index file */
+
+/** A generated listing, kept until the directory changes
+ */
+class DirListing : public classbase
+{
+ public:
+	ino_t ino;
+	time_t mtime;
+	std::string etag;
+	std::string body;
+	unsigned long lastused;
+};
+
+/** A directory entry being listed
+ */
+struct DirEntry
+{
+	std::string name;
+	bool isdir;
+	off_t size;
+	time_t mtime;
+
+	bool operator<(const DirEntry &other) const
+	{
+		if (isdir != other.isdir)
+			return isdir;
+		return name < other.name;
+	}
+};
+
+/** Listings are built once and kept, keyed by the directory's full path; a listing is
+ * used again for as long as the directory's inode and modification time (read through
+ * the stat cache) are unchanged, which covers files being added, removed and renamed.
+ * The time only has a resolution of a second, so a listing built during the second the
+ * directory last changed isn't kept, in case it changes again within that second.
+ *
+ * Entries are read with getdents64 on Linux, in large batches, and with readdir
+ * elsewhere.
+ */
+class ModuleAutoIndex : public Module
+{
+	typedef std::map<std::string, DirListing *> ListingCache;
+
+	ListingCache cache;
+	unsigned int maxentries;
+	bool showhidden;
+	unsigned long uses;
+
+	static std::string EscapeHTML(const std::string &s)
+	{
+		std::string out;
+		out.reserve(s.length());
+		for (std::string::const_iterator i = s.begin(); i != s.end(); i++)
+		{
+			switch (*i)
+			{
+				case '<':
+					out += "&lt;";
+					break;
+				case '>':
+					out += "&gt;";
+					break;
+				case '&':
+					out += "&amp;";
+					break;
+				case '"':
+					out += "&quot;";
+					break;
+				default:
+					out.push_back(*i);
+			}
+		}
+		return out;
+	}
+
+	/** Add a directory entry to the list, unless it's hidden or gone
+	 */
+	void AddEntry(std::vector<DirEntry> &entries, int dfd, const char *name)
+	{
+		if ((name[0] == '.') && (!name[1] || ((name[1] == '.') && !name[2]) || !showhidden))
+			return;
+
+		struct stat st;
+		if (fstatat(dfd, name, &st, ServerInstance->Config->FollowSymLinks ? 0 : AT_SYMLINK_NOFOLLOW) < 0)
+			return;
+		if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+			return;
+
+		DirEntry e;
+		e.name = name;
+		e.isdir = S_ISDIR(st.st_mode);
+		e.size = st.st_size;
+		e.mtime = st.st_mtime;
+		entries.push_back(e);
+	}
+
+	/** Read a directory's entries
+	 * @return False, with errno set, if it couldn't be read
+	 */
+	bool ReadDir(const std::string &path, std::vector<DirEntry> &entries)
+	{
+		int dfd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+		if (dfd < 0)
+			return false;
+
+#ifdef __linux__
+		/* struct dirent64 is laid out as the kernel returns entries */
+		char buf[32768];
+		long n;
+		while ((n = syscall(SYS_getdents64, dfd, buf, sizeof(buf))) > 0)
+		{
+			for (long pos = 0; pos < n; )
+			{
+				struct dirent64 *d = (struct dirent64 *)(buf + pos);
+				AddEntry(entries, dfd, d->d_name);
+				pos += d->d_reclen;
+			}
+		}
+
+		int saved = errno;
+		close(dfd);
+		errno = saved;
+		return (n == 0);
+#else
+		DIR *dir = fdopendir(dfd);
+		if (!dir)
+		{
+			close(dfd);
+			return false;
+		}
+
+		struct dirent *d;
+		while ((d = readdir(dir)))
+			AddEntry(entries, dirfd(dir), d->d_name);
+
+		closedir(dir);
+		return true;
+#endif
+	}
+
+	std::string Render(const std::string &uri, std::vector<DirEntry> &entries)
+	{
+		std::sort(entries.begin(), entries.end());
+
+		std::string title = EscapeHTML(uri);
+		std::string out = "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of " + title +
+			"</title></head>\n<body><h1>Index of " + title + "</h1>\n<table>\n"
+			"<tr><th>Name</th><th>Last modified</th><th>Size</th></tr>\n";
+
+		if (uri != "/")
+			out += "<tr><td><a href=\"../\">../</a></td><td></td><td></td></tr>\n";
+
+		for (std::vector<DirEntry>::iterator i = entries.begin(); i != entries.end(); i++)
+		{
+			char when[32];
+			strftime(when, sizeof(when), "%Y-%m-%d %H:%M", gmtime(&i->mtime));
+
+			/* ./ keeps a name with a colon in it from reading as a URL scheme */
+			std::string slash = i->isdir ? "/" : "";
+			out += "<tr><td><a href=\"./" + EscapeHTML(utils::urlencodepath(i->name)) + slash + "\">" + EscapeHTML(i->name) + slash +
+				"</a></td><td>" + when + "</td><td>" + (i->isdir ? "-" : ConvToStr((long long)i->size)) + "</td></tr>\n";
+		}
+
+		out += "</table>\n<hr><small>hottpd</small>\n</body></html>\n";
+		return out;
+	}
+
+	/** Drop the least recently used listing
+	 */
+	void Evict()
+	{
+		ListingCache::iterator oldest = cache.begin();
+		for (ListingCache::iterator i = cache.begin(); i != cache.end(); i++)
+		{
+			if (i->second->lastused < oldest->second->lastused)
+				oldest = i;
+		}
+
+		delete oldest->second;
+		cache.erase(oldest);
+	}
+
+	void ClearCache()
+	{
+		for (ListingCache::iterator i = cache.begin(); i != cache.end(); i++)
+			delete i->second;
+		cache.clear();
+	}
+
+ public:
+	ModuleAutoIndex(InspIRCd *Srv) : Module(Srv), uses(0)
+	{
+		ConfigReader Conf(ServerInstance);
+		showhidden = Conf.ReadFlag("autoindex", "show-hidden", "no", 0);
+		maxentries = Conf.ReadInteger("autoindex", "cache-entries", "256", 0, true);
+
+		Implementation eventlist[] = { I_OnPreRequest };
+		ServerInstance->Modules->Attach(eventlist, this, 1);
+	}
+
+	virtual ~ModuleAutoIndex()
+	{
+		ClearCache();
+	}
+
+	virtual Version GetVersion()
+	{
+		return Version(1, 0, 0, 0, VF_VENDOR, API_VERSION);
+	}
+
+	virtual int OnPreRequest(Connection *c, const std::string &method, const std::string &vhost, const std::string &dir, const std::string &file)
+	{
+		/* The core has already appended an index file if there is one */
+		if ((method != "GET") || c->uri.empty() || (c->uri[c->uri.length() - 1] != '/'))
+			return 0;
+
+		struct stat *fst = NULL;
+		if (!ServerInstance->FileSys->CheckFilePath(c->vhost->docroot, c->uri, fst).empty() || (errno != EISDIR))
+			return 0;
+
+		std::string path(c->vhost->docroot);
+		if (!path.empty() && (path[path.length() - 1] == '/'))
+			path.erase(path.length() - 1);
+		path.append(c->uri);
+
+		DirListing *listing = NULL;
+		ListingCache::iterator it = cache.find(path);
+		if (it != cache.end())
+		{
+			if ((it->second->ino == fst->st_ino) && (it->second->mtime == fst->st_mtime))
+				listing = it->second;
+			else
+			{
+				delete it->second;
+				cache.erase(it);
+			}
+		}
+
+		/* fst points into the stat cache, which ReadDir doesn't touch, so it's still the directory's */
+		DirListing fresh;
+		if (!listing)
+		{
+			std::vector<DirEntry> entries;
+			if (!ReadDir(path, entries))
+			{
+				c->SendError((errno == EACCES) ? 403 : 500, (errno == EACCES) ? "Forbidden" : "Internal Server Error", false);
+				return 1;
+			}
+
+			LOG(DEBUG, LS_MODULE, "Generated listing of %s (%lu entries)", path.c_str(), (unsigned long)entries.size());
+
+			listing = &fresh;
+			listing->ino = fst->st_ino;
+			listing->mtime = fst->st_mtime;
+			listing->body = Render(c->uri, entries);
+			listing->etag = "\"" + ConvToStr((unsigned long long)fst->st_ino) + "-" + ConvToStr((long long)fst->st_mtime) + "-" +
+				ConvToStr((unsigned long)listing->body.length()) + "\"";
+
+			if (maxentries && (fst->st_mtime < ServerInstance->Time()))
+			{
+				if (cache.size() >= maxentries)
+					Evict();
+				listing = new DirListing(fresh);
+				cache[path] = listing;
+			}
+		}
+		listing->lastused = ++uses;
+
+		HTTPHeaders headers;
+		headers.SetHeader("ETag", listing->etag);
+
+		const std::string &match = c->GetRequestHeaders().GetHeader("If-None-Match");
+		if (!match.empty() && ((match == "*") || (match.find(listing->etag) != std::string::npos)))
+		{
+			c->SendHeaders(0, 304, "Not Modified", headers);
+			return 1;
+		}
+
+		headers.SetHeader("Content-Type", "text/html; charset=utf-8");
+		c->SendHeaders(listing->body.length(), 200, "OK", headers);
+		c->State = HTTP_SEND_DATA;
+		c->Write(listing->body);
+		c->ResponseBufferDone = true;
+		return 1;
+	}
+};
+
+MODULE_INIT(ModuleAutoIndex)
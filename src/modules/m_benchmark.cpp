@@ -0,0 +1,332 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+#include "inspircd.h"
+#include "wildcard.h"
+
+/* $ModDesc: Times the request parsing hot paths and serves the results as JSON; used by make bench */
+
+/** Micro-benchmarks run inside a real server, so they measure the same code, built with
+ * the same flags, with the server's real config, stat cache and MIME table behind it.
+ * tools/bench/run.pl fetches the results before starting its load tests.
+ *
+ * Requests are parsed on a connection which has no socket and is never added to the
+ * socket engine; this module claims its requests before any other module can, and
+ * resets it by hand rather than through EndRequest so no other module sees them.
+ */
+class ModuleBenchmark : public Module
+{
+	std::string path;
+	unsigned long iterations;
+	Connection *fake;
+
+	/** Clients allowed to run the benchmarks */
+	CIDRTrie loopback;
+
+	/** Results are folded into this so the compiler can't discard the work being timed
+	 */
+	volatile unsigned long sink;
+
+	struct Result
+	{
+		std::string name;
+		unsigned long iterations;
+		double nsperop;
+	};
+
+	std::vector<Result> results;
+
+	static double Now()
+	{
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+	}
+
+	void Record(const std::string &name, unsigned long n, double start)
+	{
+		Result r;
+		r.name = name;
+		r.iterations = n;
+		r.nsperop = (Now() - start) / n;
+		results.push_back(r);
+	}
+
+	void ResetFake()
+	{
+		fake->GetRequestHeaders().Clear();
+		fake->method.clear();
+		fake->uri.clear();
+		fake->uriquery.clear();
+		fake->upath.clear();
+		fake->requestbuf.Clear();
+		fake->http_version = Connection::HTTP_UNSPECIFIED;
+		fake->keepalive = true;
+		fake->RequestsCompleted = 0;
+		fake->State = HTTP_WAIT_REQUEST;
+	}
+
+	void BenchCheckRequest()
+	{
+		const std::string request = "GET /images/logo.png?v=3 HTTP/1.1\r\nHost: www.example.com\r\n"
+			"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+			"Accept: image/avif,image/webp,*/*\r\nAccept-Language: en-GB,en;q=0.5\r\n"
+			"Accept-Encoding: gzip, deflate, br\r\nReferer: http://www.example.com/\r\n"
+			"Connection: keep-alive\r\nCache-Control: no-cache\r\n\r\n";
+
+		double start = Now();
+		for (unsigned long i = 0; i < iterations; i++)
+		{
+			fake->requestbuf.Append(request.data(), request.length());
+			fake->CheckRequest(0);
+			sink += fake->uri.length();
+			ResetFake();
+		}
+		Record("CheckRequest", iterations, start);
+	}
+
+	void BenchHandleURI()
+	{
+		double start = Now();
+		for (unsigned long i = 0; i < iterations; i++)
+		{
+			fake->uri = "/static/./css/../js/%61pp%20bundle/main.min.js?cache=1";
+			fake->HandleURI();
+			sink += fake->uri.length();
+		}
+		Record("HandleURI", iterations, start);
+
+		/* REST-style, with long runs between the characters which need looking at */
+		start = Now();
+		for (unsigned long i = 0; i < iterations; i++)
+		{
+			fake->uri = "/api/v2/organisations/acme-corporation-international/projects/website-redesign/"
+				"repositories/frontend-application/branches/feature-new-navigation/files/src/components/menu.tsx";
+			fake->HandleURI();
+			sink += fake->uri.length();
+		}
+		Record("HandleURI (long)", iterations, start);
+		ResetFake();
+	}
+
+	void BenchHeaders()
+	{
+		HTTPHeaders headers;
+		double start = Now();
+		for (unsigned long i = 0; i < iterations; i++)
+		{
+			headers.SetHeader("Host", "www.example.com");
+			headers.SetHeader("User-Agent", "Mozilla/5.0");
+			headers.SetHeader("Accept", "*/*");
+			headers.SetHeader("Accept-Encoding", "gzip");
+			headers.SetHeader("Connection", "keep-alive");
+			headers.SetHeader("Cookie", "session=0123456789abcdef");
+			sink += headers.GetHeader("host").length() + headers.GetHeader("connection").length();
+			sink += headers.IsSet("Content-Length");
+			headers.Clear();
+		}
+		Record("HTTPHeaders", iterations, start);
+	}
+
+	void BenchCheckFilePath()
+	{
+		struct stat *fst = NULL;
+		double start = Now();
+		for (unsigned long i = 0; i < iterations; i++)
+		{
+			sink += ServerInstance->FileSys->CheckFilePath(ServerInstance->Config->DocRoot, "/small.html", fst).length();
+		}
+		Record("CheckFilePath", iterations, start);
+	}
+
+	void BenchFindType()
+	{
+		static const std::string paths[] = { "/index.html", "/img/logo.JPG", "/css/site.css", "/a.png", "/js/app.min.js", "/README" };
+		double start = Now();
+		for (unsigned long i = 0; i < iterations; i++)
+		{
+			const MimeType *t = ServerInstance->MimeTypes->FindForPath(paths[i % 6]);
+			sink += t ? t->header.length() : 0;
+		}
+		Record("MimeManager::FindForPath", iterations, start);
+	}
+
+	void BenchVHostFind()
+	{
+		static const char *names[] = { "www.example.com", "static.cdn.example.net:8080", "Example.ORG.", "unknown.invalid" };
+		double start = Now();
+		for (unsigned long i = 0; i < iterations; i++)
+			sink += ServerInstance->VHosts->Find(names[i % 4])->docroot.length();
+		Record("VHostManager::Find", iterations, start);
+	}
+
+	void BenchCIDRTrie()
+	{
+		/* A blocklist's worth of prefixes; a lookup should cost about what it does with one */
+		CIDRTrie trie;
+		unsigned char addr[16];
+		memset(addr, 0, sizeof(addr));
+		for (unsigned long i = 0; i < 100000; i++)
+		{
+			unsigned long a = (i * 2654435761UL) & 0xFFFFFFFF;
+			addr[0] = a >> 24;
+			addr[1] = a >> 16;
+			addr[2] = a >> 8;
+			trie.Add(AF_INET, addr, 24, 0);
+		}
+
+		static const char *ips[] = { "192.0.2.77", "10.20.30.40", "2001:db8::1", "::ffff:198.51.100.9" };
+		sockaddr_storage sas[4];
+		for (int i = 0; i < 4; i++)
+		{
+			memset(&sas[i], 0, sizeof(sas[i]));
+			if (strchr(ips[i], ':'))
+			{
+				sas[i].ss_family = AF_INET6;
+				inet_pton(AF_INET6, ips[i], &((sockaddr_in6 *)&sas[i])->sin6_addr);
+			}
+			else
+			{
+				sas[i].ss_family = AF_INET;
+				inet_pton(AF_INET, ips[i], &((sockaddr_in *)&sas[i])->sin_addr);
+			}
+		}
+
+		double start = Now();
+		for (unsigned long i = 0; i < iterations; i++)
+			sink += trie.Find((sockaddr *)&sas[i % 4]);
+		Record("CIDRTrie::Find", iterations, start);
+	}
+
+	void BenchRewriteFind()
+	{
+		/* A site's worth of legacy redirects; built here, as the config being used may have none */
+		RewriteManager rewrites(ServerInstance);
+		for (int i = 0; i < 5000; i++)
+			rewrites.Add(new RewriteRule("/old/page" + ConvToStr(i) + ".html", false, "/new/" + ConvToStr(i), 301));
+		for (int i = 0; i < 1000; i++)
+			rewrites.Add(new RewriteRule("/section" + ConvToStr(i) + "/*", false, "/s/" + ConvToStr(i) + "/$1", 301));
+		rewrites.Add(new RewriteRule("/img/*/thumb-*.jpg", false, "/thumbs/$1/$2.jpg", 0));
+		rewrites.Add(new RewriteRule("^/blog/([0-9]+)/(.*)\\.php$", true, "/blog/$1/$2", 0));
+		rewrites.Apply();
+
+		static const std::string uris[] = { "/old/page4321.html", "/section512/a/b.html", "/img/2008/thumb-cat.jpg", "/blog/2008/post.php", "/index.html" };
+		std::string target;
+		double start = Now();
+		for (unsigned long i = 0; i < iterations; i++)
+		{
+			rewrites.Find(uris[i % 5], target);
+			sink += target.length();
+		}
+		Record("RewriteManager::Find", iterations, start);
+	}
+
+	void BenchMatch()
+	{
+		double start = Now();
+		for (unsigned long i = 0; i < iterations; i++)
+		{
+			sink += match("/images/2008/holiday/IMG_0042.jpg", "/images/*/*.jpg");
+			sink += match(false, "WWW.Example.COM", "*.example.com");
+			sink += match("192.168.10.42", "192.168.0.0/16", true);
+		}
+		Record("match", iterations, start);
+	}
+
+	std::string Run()
+	{
+		results.clear();
+		ResetFake();
+
+		BenchCheckRequest();
+		BenchHandleURI();
+		BenchHeaders();
+		BenchCheckFilePath();
+		BenchFindType();
+		BenchVHostFind();
+		BenchCIDRTrie();
+		BenchRewriteFind();
+		BenchMatch();
+
+		std::string out = "[";
+		for (std::vector<Result>::iterator i = results.begin(); i != results.end(); i++)
+		{
+			char buf[256];
+			snprintf(buf, sizeof(buf), "%s\n{\"name\":\"%s\",\"iterations\":%lu,\"ns_per_op\":%.1f}",
+				(i == results.begin()) ? "" : ",", i->name.c_str(), i->iterations, i->nsperop);
+			out += buf;
+		}
+		out += "\n]\n";
+		return out;
+	}
+
+ public:
+	ModuleBenchmark(InspIRCd *Srv) : Module(Srv), fake(NULL), sink(0)
+	{
+		ConfigReader Conf(ServerInstance);
+		path = Conf.ReadValue("benchmark", "path", "/bench-micro", 0);
+		iterations = Conf.ReadInteger("benchmark", "iterations", "100000", 0, true);
+		if (!iterations)
+			iterations = 1;
+
+		loopback.Add("127.0.0.0/8", 1);
+		loopback.Add("::1/128", 1);
+
+		fake = new Connection(ServerInstance);
+
+		Implementation eventlist[] = { I_OnPreRequest };
+		ServerInstance->Modules->Attach(eventlist, this, 1);
+	}
+
+	virtual ~ModuleBenchmark()
+	{
+		delete fake;
+	}
+
+	virtual void Prioritize()
+	{
+		ServerInstance->Modules->SetPriority(this, I_OnPreRequest, PRIO_FIRST);
+	}
+
+	virtual Version GetVersion()
+	{
+		return Version(1, 0, 0, 0, VF_VENDOR, API_VERSION);
+	}
+
+	virtual int OnPreRequest(Connection *c, const std::string &method, const std::string &vhost, const std::string &dir, const std::string &file)
+	{
+		/* A request being timed; nothing to send */
+		if (c == fake)
+			return 1;
+
+		if (c->uri != path)
+			return 0;
+
+		/* Runs for a while, so keep it to the machine running the benchmarks */
+		if (!c->privip || (loopback.Find(c->privip) < 0))
+		{
+			c->SendError(403, "Forbidden", false);
+			return 1;
+		}
+
+		std::string data = Run();
+
+		HTTPHeaders headers;
+		headers.SetHeader("Content-Type", "application/json");
+		c->SendHeaders(data.length(), 200, "OK", headers);
+		c->State = HTTP_SEND_DATA;
+		c->Write(data);
+		c->ResponseBufferDone = true;
+		return 1;
+	}
+};
+
+MODULE_INIT(ModuleBenchmark)
@@ -10,32 +10,653 @@
  */
 
 #include "inspircd.h"
+#include <pwd.h>
+#include <grp.h>
+#include <poll.h>
+#include <set>
+#include <sys/wait.h>
+#include <sys/resource.h>
 
 /* $ModDesc: Provides support for CGI applications */
 
-static int total_cgi_processes = 0;
+/** Spawn requests sent to a helper may be no larger than this
+ */
+#define CGI_SPAWN_MAX 65536
+
+class ModuleCGI;
+
+/** Messages between the server and a spawn helper
+ */
+enum CGIMessageType
+{
+	CGI_MSG_SPAWN,	/* server: start a process. helper: the process started, or failed to */
+	CGI_MSG_KILL,	/* server: kill a process which has not exited yet */
+	CGI_MSG_EXITED	/* helper: a process has exited and been reaped */
+};
+
+/** Fixed part of a request to a helper. A spawn request is followed by the NUL terminated
+ * file to execute, then argc arguments, then envc environment strings.
+ */
+struct CGISpawnRequest
+{
+	CGIMessageType type;
+	unsigned int id;
+	pid_t pid;
+	unsigned int argc;
+	unsigned int envc;
+};
+
+/** A message from a helper. A successful spawn reply carries the write end of the
+ * child's stdin and the read end of its stdout as SCM_RIGHTS. For an exit, status
+ * is as returned by waitpid().
+ */
+struct CGISpawnReply
+{
+	CGIMessageType type;
+	unsigned int id;
+	pid_t pid;
+	int error;
+	int status;
+};
+
+/** Limits applied to every CGI process
+ */
+struct CGILimits
+{
+	/** CPU seconds, or 0 for no limit */
+	rlim_t cpu;
+	/** Bytes of address space, or 0 for no limit */
+	rlim_t memory;
+};
+
+/** The standard reason phrase for a status, for CGI output which gives only a number
+ */
+static const char *StatusText(int status)
+{
+	switch (status)
+	{
+		case 200: return "OK";
+		case 201: return "Created";
+		case 202: return "Accepted";
+		case 204: return "No Content";
+		case 206: return "Partial Content";
+		case 301: return "Moved Permanently";
+		case 302: return "Found";
+		case 303: return "See Other";
+		case 304: return "Not Modified";
+		case 307: return "Temporary Redirect";
+		case 308: return "Permanent Redirect";
+		case 400: return "Bad Request";
+		case 401: return "Unauthorized";
+		case 403: return "Forbidden";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 409: return "Conflict";
+		case 410: return "Gone";
+		case 412: return "Precondition Failed";
+		case 413: return "Request Entity Too Large";
+		case 415: return "Unsupported Media Type";
+		case 422: return "Unprocessable Entity";
+		case 429: return "Too Many Requests";
+		case 500: return "Internal Server Error";
+		case 501: return "Not Implemented";
+		case 502: return "Bad Gateway";
+		case 503: return "Service Unavailable";
+		case 504: return "Gateway Timeout";
+	}
+
+	switch (status / 100)
+	{
+		case 1: return "Informational";
+		case 2: return "OK";
+		case 3: return "Redirection";
+		case 4: return "Client Error";
+		default: return "Server Error";
+	}
+}
+
+/** Written to by a spawn helper's SIGCHLD handler, to wake up its poll() */
+static int helper_sigpipe = -1;
+
+static void HelperSigChld(int)
+{
+	int saved = errno;
+	if (write(helper_sigpipe, "", 1) < 0) { }
+	errno = saved;
+}
+
+static void HelperSend(int sock, CGISpawnReply &reply, int *fds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int) * 2)];
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &reply;
+	iov.iov_len = sizeof(reply);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (fds)
+	{
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * 2);
+	}
+
+	while ((sendmsg(sock, &msg, 0) == -1) && (errno == EINTR))
+		;
+}
+
+/** Start a process with vfork(). The child only sets limits, moves its pipes into place and execs.
+ * @return The pid of the new process, or -1 with errno set
+ */
+static pid_t HelperSpawn(const char *file, char **argv, char **envp, int in, int out, const CGILimits &limits)
+{
+	/* Shared with the child until it execs, so it can tell us why exec failed */
+	volatile int exec_errno = 0;
+	char **saved = environ;
+	sigset_t none;
+	sigemptyset(&none);
+
+	pid_t pid = vfork();
+	if (pid == 0)
+	{
+		struct rlimit rl;
+		if (limits.cpu)
+		{
+			/* SIGXCPU at the soft limit, SIGKILL a second later if that is ignored */
+			rl.rlim_cur = limits.cpu;
+			rl.rlim_max = limits.cpu + 1;
+			setrlimit(RLIMIT_CPU, &rl);
+		}
+		if (limits.memory)
+		{
+			rl.rlim_cur = rl.rlim_max = limits.memory;
+			setrlimit(RLIMIT_AS, &rl);
+		}
+
+		/* A group of its own, so anything it starts is killed along with it */
+		setpgid(0, 0);
+
+		dup2(in, STDIN_FILENO);
+		dup2(out, STDOUT_FILENO);
+		close(in);
+		close(out);
+
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+		signal(SIGHUP, SIG_DFL);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+
+		if (strchr(file, '/'))
+			execve(file, argv, envp);
+		else
+		{
+			/* execvpe() isn't portable, so search the PATH of the CGI environment by pointing
+			 * environ at it. This changes our parent's environ too, which it puts back. */
+			environ = envp;
+			execvp(file, argv);
+		}
+
+		exec_errno = errno;
+		_exit(127);
+	}
+
+	environ = saved;
+
+	if (pid > 0 && exec_errno)
+	{
+		/* The child has already exited; it'll be reaped along with the rest */
+		errno = exec_errno;
+		return -1;
+	}
+
+	return pid;
+}
+
+/** Body of a spawn helper process. This is forked from the server when the module is
+ * loaded, while the server is still small, and starts CGI children with vfork()
+ * on its behalf. A fork() from a server with a large heap is slow and stalls every
+ * connection while the page tables are copied. The helper also reaps its children,
+ * and tells the server when each one exits.
+ */
+static void SpawnHelperMain(InspIRCd *ServerInstance, int sock, const CGILimits &limits)
+{
+	long maxfd = sysconf(_SC_OPEN_MAX);
+	for (int fd = 3; fd < maxfd; fd++)
+	{
+		if (fd != sock)
+			close(fd);
+	}
+
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGTERM, SIG_DFL);
+
+	int sp[2];
+	if (pipe(sp) == -1)
+		_exit(1);
+	fcntl(sp[0], F_SETFD, FD_CLOEXEC);
+	fcntl(sp[1], F_SETFD, FD_CLOEXEC);
+	fcntl(sp[0], F_SETFL, O_NONBLOCK);
+	fcntl(sp[1], F_SETFL, O_NONBLOCK);
+	helper_sigpipe = sp[1];
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = HelperSigChld;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	/* Drop to the same privileges the server will run with */
+	if (*ServerInstance->Config->ChRoot && (chroot(ServerInstance->Config->ChRoot) == -1))
+		_exit(1);
+
+	if (*ServerInstance->Config->SetGroup)
+	{
+		struct group *g = getgrnam(ServerInstance->Config->SetGroup);
+		if (!g || (setgid(g->gr_gid) == -1))
+			_exit(1);
+	}
+
+	if (*ServerInstance->Config->SetUser)
+	{
+		struct passwd *u = getpwnam(ServerInstance->Config->SetUser);
+		if (!u || (setuid(u->pw_uid) == -1))
+			_exit(1);
+	}
+
+	static char buf[CGI_SPAWN_MAX];
+	/* Pointers into buf, kept between requests so they're rarely reallocated */
+	std::vector<char *> argv, envp;
+	/* Children which haven't been reaped, so their pids can't have been reused */
+	std::set<pid_t> children;
+
+	while (true)
+	{
+		struct pollfd pfd[2];
+		pfd[0].fd = sock;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = sp[0];
+		pfd[1].events = POLLIN;
+
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			_exit(1);
+		}
+
+		if (pfd[1].revents)
+		{
+			while (read(sp[0], buf, sizeof(buf)) > 0)
+				;
+
+			pid_t pid;
+			int status;
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+			{
+				if (!children.erase(pid))
+					continue;
+
+				CGISpawnReply reply;
+				memset(&reply, 0, sizeof(reply));
+				reply.type = CGI_MSG_EXITED;
+				reply.pid = pid;
+				reply.status = status;
+				HelperSend(sock, reply, NULL);
+			}
+		}
+
+		if (!pfd[0].revents)
+			continue;
+
+		ssize_t n = recv(sock, buf, sizeof(buf) - 1, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			_exit(0);
+
+		/* Make sure the last string is terminated, however broken the request is */
+		buf[n] = '\0';
+
+		CGISpawnRequest req;
+		CGISpawnReply reply;
+		if ((size_t)n < sizeof(req))
+			continue;
+
+		memcpy(&req, buf, sizeof(req));
+
+		if (req.type == CGI_MSG_KILL)
+		{
+			if (children.find(req.pid) != children.end())
+				kill(-req.pid, SIGKILL);
+			continue;
+		}
+
+		memset(&reply, 0, sizeof(reply));
+		reply.type = CGI_MSG_SPAWN;
+		reply.id = req.id;
+		reply.pid = -1;
+
+		argv.clear();
+		envp.clear();
+		char *file = buf + sizeof(req);
+		char *p = file + strlen(file) + 1;
+		for (unsigned int i = 0; (i < req.argc) && (p < buf + n); i++, p += strlen(p) + 1)
+			argv.push_back(p);
+		for (unsigned int i = 0; (i < req.envc) && (p < buf + n); i++, p += strlen(p) + 1)
+			envp.push_back(p);
+		argv.push_back(NULL);
+		envp.push_back(NULL);
+
+		int to_child[2] = { -1, -1 }, from_child[2] = { -1, -1 };
+
+		if ((pipe(to_child) == -1) || (pipe(from_child) == -1))
+		{
+			reply.error = errno;
+		}
+		else
+		{
+			fcntl(to_child[1], F_SETFD, FD_CLOEXEC);
+			fcntl(from_child[0], F_SETFD, FD_CLOEXEC);
+
+			reply.pid = HelperSpawn(file, &argv[0], &envp[0], to_child[0], from_child[1], limits);
+			if (reply.pid < 0)
+				reply.error = errno;
+			else
+				children.insert(reply.pid);
+		}
+
+		if (to_child[0] > -1)
+			close(to_child[0]);
+		if (from_child[1] > -1)
+			close(from_child[1]);
+
+		int fds[2] = { to_child[1], from_child[0] };
+		HelperSend(sock, reply, (reply.pid > 0) ? fds : NULL);
+
+		if (to_child[1] > -1)
+			close(to_child[1]);
+		if (from_child[0] > -1)
+			close(from_child[0]);
+	}
+}
+
+/** The server's end of the connection to a spawn helper process
+ */
+class CoreExport CGISpawner : public EventHandler
+{
+ private:
+	InspIRCd *ServerInstance;
+	ModuleCGI *Parent;
+	/** Requests waiting for room in the socket buffer */
+	std::deque<std::string> sendq;
+
+	/** Send a request, queueing it if the socket is full
+	 */
+	bool Send(const std::string &msg)
+	{
+		if (GetFd() < 0)
+			return false;
+
+		if (sendq.empty())
+		{
+			if (send(GetFd(), msg.data(), msg.length(), 0) > -1)
+				return true;
+
+			if (errno != EAGAIN)
+				return false;
+
+			ServerInstance->SE->WantWrite(this);
+		}
+
+		sendq.push_back(msg);
+		return true;
+	}
+
+ public:
+	pid_t pid;
+
+	CGISpawner(InspIRCd *Instance, ModuleCGI *Mod) : ServerInstance(Instance), Parent(Mod), pid(-1)
+	{
+		this->SetFd(-1);
+	}
+
+	~CGISpawner()
+	{
+		this->Stop();
+	}
+
+	/** Fork the helper process
+	 * @param limits Resource limits for the processes it starts
+	 * @return False if it couldn't be started
+	 */
+	bool Start(const CGILimits &limits)
+	{
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1)
+			return false;
+
+		pid = fork();
+		if (pid == -1)
+		{
+			close(sv[0]);
+			close(sv[1]);
+			return false;
+		}
+
+		if (pid == 0)
+			SpawnHelperMain(ServerInstance, sv[1], limits);
+
+		close(sv[1]);
+		fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+		ServerInstance->SE->NonBlocking(sv[0]);
+		this->SetFd(sv[0]);
+
+		if (!ServerInstance->SE->AddFd(this))
+		{
+			this->Stop();
+			return false;
+		}
+
+		LOG(DEBUG, LS_MODULE, "Started CGI spawn helper, pid %d", pid);
+		return true;
+	}
+
+	/** Close our end of the helper's socket. The helper exits when it sees this.
+	 */
+	void Stop()
+	{
+		if (GetFd() > -1)
+		{
+			ServerInstance->SE->DelFd(this);
+			ServerInstance->SE->Close(GetFd());
+			this->SetFd(-1);
+		}
+		sendq.clear();
+	}
+
+	/** Ask the helper to start a process. The reply arrives later through ModuleCGI::OnSpawned.
+	 * @return False if the request could not be sent
+	 */
+	bool Spawn(unsigned int id, const std::string &file, const std::vector<std::string> &argv, const std::vector<std::string> &env)
+	{
+		CGISpawnRequest req;
+		memset(&req, 0, sizeof(req));
+		req.type = CGI_MSG_SPAWN;
+		req.id = id;
+		req.argc = argv.size();
+		req.envc = env.size();
+
+		std::string msg((const char *)&req, sizeof(req));
+		msg.append(file.c_str(), file.length() + 1);
+		for (std::vector<std::string>::const_iterator i = argv.begin(); i != argv.end(); i++)
+			msg.append(i->c_str(), i->length() + 1);
+		for (std::vector<std::string>::const_iterator i = env.begin(); i != env.end(); i++)
+			msg.append(i->c_str(), i->length() + 1);
+
+		if (msg.length() >= CGI_SPAWN_MAX)
+			return false;
+
+		return Send(msg);
+	}
+
+	/** Ask the helper to kill a process it started, if it hasn't exited already
+	 */
+	void Kill(pid_t child)
+	{
+		CGISpawnRequest req;
+		memset(&req, 0, sizeof(req));
+		req.type = CGI_MSG_KILL;
+		req.pid = child;
+
+		Send(std::string((const char *)&req, sizeof(req)));
+	}
+
+	virtual void HandleEvent(EventType et, int errornum = 0);
+};
+
+/** Writes a request body to the stdin of a CGI process
+ */
+class CoreExport CGIInput : public EventHandler
+{
+ private:
+	InspIRCd *ServerInstance;
+	std::string data;
+	std::string::size_type pos;
+
+ public:
+	CGIInput(InspIRCd *Instance, int pipefd, const std::string &body) : ServerInstance(Instance), data(body), pos(0)
+	{
+		this->SetFd(pipefd);
+	}
+
+	~CGIInput()
+	{
+		this->Close();
+	}
+
+	/** Start writing. If there is nothing to write, the pipe is closed straight away.
+	 */
+	void Start()
+	{
+		if (data.empty() || !ServerInstance->SE->AddFd(this))
+		{
+			ServerInstance->SE->Close(GetFd());
+			this->SetFd(-1);
+			return;
+		}
+
+		ServerInstance->SE->WantWrite(this);
+	}
+
+	void Close()
+	{
+		if (GetFd() > -1)
+		{
+			ServerInstance->SE->DelFd(this);
+			ServerInstance->SE->Close(GetFd());
+			this->SetFd(-1);
+		}
+	}
+
+	virtual void HandleEvent(EventType et, int errornum = 0)
+	{
+		if (et != EVENT_WRITE)
+		{
+			/* The script closed stdin without reading it all; it's not our problem */
+			this->Close();
+			return;
+		}
+
+		int n = write(GetFd(), data.data() + pos, data.length() - pos);
+		if (n > 0)
+			pos += n;
+
+		if (((n < 0) && (errno != EAGAIN)) || (pos == data.length()))
+		{
+			this->Close();
+			return;
+		}
+
+		ServerInstance->SE->WantWrite(this);
+	}
+};
+
+/** Stops clients waiting on a script being timed out as idle by the core; cgiconfig's
+ * timeout is what ends requests which take too long
+ */
+class CGIIdleTimer : public Timer
+{
+	ModuleCGI *Parent;
+
+ public:
+	CGIIdleTimer(InspIRCd *Instance, ModuleCGI *Mod) : Timer(1, Instance->Time(), true), Parent(Mod)
+	{
+	}
+
+	virtual void Tick(time_t now);
+};
 
 class CoreExport CGIRequest : public EventHandler
 {
  private:
 	InspIRCd *ServerInstance;
+	ModuleCGI *Parent;
 	Connection *c;
 	std::string rbuf;
 
  public:
 	bool done;
 
-	CGIRequest(InspIRCd *Instance, Connection *parent) : ServerInstance(Instance), c(parent), done(false)
+	/** Number of local redirects which led to this request */
+	int redirects;
+
+	/** Identifies this request to the spawn helper until the process has started */
+	unsigned int spawnid;
+	CGISpawner *spawner;
+	/** The process, once it has started */
+	pid_t pid;
+	/** When the request arrived, for timeouts */
+	time_t started;
+	/** True while waiting for a free process slot */
+	bool queued;
+	/** Writes the request body to the process */
+	CGIInput *input;
+
+	/** What to run, kept until the process is started */
+	std::string exe;
+	std::vector<std::string> argv;
+	std::vector<std::string> env;
+
+	CGIRequest(InspIRCd *Instance, ModuleCGI *Mod, Connection *parent) : ServerInstance(Instance), Parent(Mod), c(parent), done(false), redirects(0), spawnid(0), spawner(NULL), pid(0), queued(false), input(NULL)
+	{
+		this->SetFd(-1);
+		started = ServerInstance->Time();
+		LOG(DEBUG, LS_MODULE, "Created CGI request");
+	}
+
+	Connection *GetConnection()
+	{
+		return c;
+	}
+
+	/** Get everything the process has written so far
+	 */
+	std::string &GetOutput()
 	{
-		ServerInstance->Log(DEBUG, "Created CGI request");
-		total_cgi_processes++;
+		return rbuf;
 	}
 
 	~CGIRequest()
 	{
-		ServerInstance->Log(DEBUG, "Destroying CGI request");
+		LOG(DEBUG, LS_MODULE, "Destroying CGI request");
 		this->Close(false);
-		total_cgi_processes--;
+		delete input;
 	}
 
 	virtual void HandleEvent(EventType et, int errornum = 0)
@@ -49,42 +670,14 @@ class CoreExport CGIRequest : public EventHandler
 				/* ignore */
 				break;
 			case EVENT_ERROR:
-				ServerInstance->Log(DEBUG, "Error CGI socket %d (%d: %s)", GetFd(), errno, strerror(errno));
-				this->Close(true);
+				/* A hangup is reported as an error, but there may still be output waiting in the pipe */
+				LOG(DEBUG, LS_MODULE, "Error CGI socket %d (%d: %s)", GetFd(), errornum, strerror(errornum));
+				this->OnRead();
 				break;
 		}
 	}
 
-	void Close(bool SendResponse)
-	{
-		/*
-		 * Remove ident socket from engine, and close it, but dont detatch it
-		 * from its parent user class, or attempt to delete its memory.
-		 */
-		if (GetFd() > -1)
-		{
-			ServerInstance->Log(DEBUG, "Close CGI socket %d", GetFd());
-			ServerInstance->SE->DelFd(this);
-			ServerInstance->SE->Close(GetFd());
-			ServerInstance->SE->Shutdown(GetFd(), SHUT_WR);
-			this->SetFd(-1);
-			done = true;
-
-
-			if (SendResponse)
-			{
-				// Send response
-				ServerInstance->Log(DEBUG, "Sending response. Total request size: %d", rbuf.length());
-
-				HTTPHeaders empty;
-				c->SendHeaders(rbuf.length(), 200, "OK", empty);
-				c->State = HTTP_SEND_DATA;
-				c->Write(rbuf);
-				c->ResponseBufferDone = true;
-			}
-		}
-	}
-
+	void Close(bool SendResponse);
 
 	void OnRead()
 	{
@@ -102,27 +695,23 @@ class CoreExport CGIRequest : public EventHandler
 		{
 			if (errno != EAGAIN)
 			{
-				throw "CGI read errored";
-				ServerInstance->Log(DEBUG, "read returned error, %s", strerror(errno));
-				return;
+				// Treat it like EOF; whatever we have so far gets checked like any other output
+				LOG(DEBUG, LS_MODULE, "read returned error, %s", strerror(errno));
+				this->Close(true);
 			}
+			return;
 		}
 		else
 		{
-			ReadBuffer[result] = '\0';
-			//ServerInstance->Log(DEBUG, "read returned %d bytes", result);
-			rbuf += ReadBuffer;
+			//LOG(DEBUG, LS_MODULE, "read returned %d bytes", result);
+			rbuf.append(ReadBuffer, result);
+			/* The client is waiting on this, so it isn't idle */
+			c->LastSocketEvent = ServerInstance->Time();
 		}
 
 		if (result == 0)
 		{
-			ServerInstance->Log(DEBUG, "CGI returned EOF");
-
-			if (rbuf.length() == 0)
-			{
-				throw "rbuf length 0 after reading CGI (how to handle this?)";
-			}
-
+			LOG(DEBUG, LS_MODULE, "CGI returned EOF");
 			this->Close(true);
 		}
 	}
@@ -133,9 +722,193 @@ class ModuleCGI : public Module
  private:
 	std::map<std::string, std::string> CGITypes;
 	std::map<Connection *, CGIRequest *> CGIRequests;
+	/** Requests waiting for their process to be started, by spawn id */
+	std::map<unsigned int, CGIRequest *> Spawning;
+	std::vector<CGISpawner *> Spawners;
+	/** Processes which are running (or unreaped), and the helper which started them */
+	std::map<pid_t, CGISpawner *> Children;
+	/** Requests waiting for a process slot, oldest first */
+	std::deque<CGIRequest *> Queue;
+	/** Connections being internally redirected by a script, and how many times */
+	std::map<Connection *, int> Redirected;
+	unsigned int NextSpawnID;
+	unsigned int NextSpawner;
+
+	CGILimits Limits;
+	/** Seconds a request may take in total, including time queued */
+	int Timeout;
+	/** Maximum number of queued requests */
+	unsigned int QueueSize;
+	CGIIdleTimer *idletimer;
+
+	/** Number of processes which are running or being started
+	 */
+	int RunningProcesses()
+	{
+		return Spawning.size() + Children.size();
+	}
+
+	/** Send a request to a spawn helper
+	 */
+	bool StartRequest(CGIRequest *cr)
+	{
+		CGISpawner *sp = Spawners[NextSpawner++ % Spawners.size()];
+
+		if (!++NextSpawnID)
+			NextSpawnID++;
+
+		if (!sp->Spawn(NextSpawnID, cr->exe, cr->argv, cr->env))
+		{
+			LOG(DEBUG, LS_MODULE, "Could not send spawn request to CGI helper %d", sp->pid);
+			return false;
+		}
+
+		cr->spawnid = NextSpawnID;
+		cr->spawner = sp;
+		cr->argv.clear();
+		cr->env.clear();
+		Spawning[cr->spawnid] = cr;
+		return true;
+	}
+
+	/** Start queued requests while there are free process slots
+	 */
+	void RunQueue()
+	{
+		while (!Queue.empty() && (RunningProcesses() < ServerInstance->Config->MaximumDynamicProcesses))
+		{
+			CGIRequest *cr = Queue.front();
+			Queue.pop_front();
+			cr->queued = false;
+
+			if (!StartRequest(cr))
+			{
+				Connection *c = cr->GetConnection();
+				DeleteRequest(cr);
+				c->SendError(500, "Internal error", true);
+			}
+		}
+	}
+
+	/** Build the CGI/1.1 environment (RFC 3875 section 4.1) for a request
+	 * @param c The connection making the request
+	 * @param script Full path to the script
+	 * @param pathinfo Any part of the request path after the script
+	 * @param env Filled with NAME=value strings
+	 */
+	void BuildEnvironment(Connection *c, const std::string &script, const std::string &pathinfo, std::vector<std::string> &env)
+	{
+		HTTPHeaders &headers = c->GetRequestHeaders();
+		const HTTPHeaders::HeaderMap &hmap = headers.GetHeaders();
+		std::string host = headers.GetHeader("Host");
+		std::string::size_type colon = host.rfind(':');
+		if ((colon != std::string::npos) && (host.find(']', colon) == std::string::npos))
+			host.erase(colon);
+
+		env.reserve(20 + hmap.size());
+		env.push_back("SERVER_SOFTWARE=hottpd");
+		env.push_back("GATEWAY_INTERFACE=CGI/1.1");
+		env.push_back(std::string("SERVER_PROTOCOL=") + ((c->http_version == Connection::HTTP_1_0) ? "HTTP/1.0" : "HTTP/1.1"));
+		env.push_back("SERVER_NAME=" + host);
+		env.push_back("SERVER_PORT=" + ConvToStr(c->GetPort()));
+		env.push_back("REQUEST_METHOD=" + c->method);
+		env.push_back("REQUEST_URI=" + c->uri + (c->uriquery.empty() ? "" : "?" + c->uriquery));
+		env.push_back("QUERY_STRING=" + c->uriquery);
+		env.push_back("SCRIPT_NAME=" + c->uri.substr(0, c->uri.length() - pathinfo.length()));
+		env.push_back("SCRIPT_FILENAME=" + script);
+		env.push_back("DOCUMENT_ROOT=" + c->vhost->docroot);
+		env.push_back("REMOTE_ADDR=" + c->GetIP());
+		if (getenv("PATH"))
+			env.push_back(std::string("PATH=") + getenv("PATH"));
+		/* php-cgi refuses to run without this when built with --enable-force-cgi-redirect */
+		env.push_back("REDIRECT_STATUS=200");
+
+		if (!pathinfo.empty())
+		{
+			env.push_back("PATH_INFO=" + pathinfo);
+			std::string root(c->vhost->docroot);
+			if (!root.empty() && (root[root.length() - 1] == '/'))
+				root.erase(root.length() - 1);
+			env.push_back("PATH_TRANSLATED=" + root + pathinfo);
+		}
+
+		if (c->RequestBodyLength)
+			env.push_back("CONTENT_LENGTH=" + ConvToStr(c->RequestBody.length()));
+
+		for (HTTPHeaders::HeaderMap::const_iterator i = hmap.begin(); i != hmap.end(); i++)
+		{
+			if (!strcasecmp(i->first.c_str(), "Content-Length"))
+				continue;
+
+			if (!strcasecmp(i->first.c_str(), "Content-Type"))
+			{
+				env.push_back("CONTENT_TYPE=" + i->second);
+				continue;
+			}
+
+			/* Never let a client set HTTP_PROXY, which many libraries take as their proxy setting */
+			if (!strcasecmp(i->first.c_str(), "Proxy"))
+				continue;
+
+			std::string var = "HTTP_";
+			var.reserve(i->first.length() + i->second.length() + 6);
+			for (std::string::const_iterator n = i->first.begin(); n != i->first.end(); n++)
+				var.push_back((*n == '-') ? '_' : toupper(*n));
+			var.push_back('=');
+			var.append(i->second);
+			env.push_back(var);
+		}
+	}
+
+	/** Check if any part of a path has the extension of a CGI type
+	 */
+	bool HasScriptExtension(const std::string &path)
+	{
+		std::string::size_type start = 0;
+
+		while (start < path.length())
+		{
+			std::string::size_type end = path.find('/', start);
+			if (end == std::string::npos)
+				end = path.length();
+
+			std::string::size_type dot = path.rfind('.', end - 1);
+			if ((dot != std::string::npos) && (dot >= start) && (dot + 1 < end))
+			{
+				if (CGITypes.find(path.substr(dot + 1, end - dot - 1)) != CGITypes.end())
+					return true;
+			}
+
+			start = end + 1;
+		}
+
+		return false;
+	}
+
+	/** Forget about a request and free it
+	 */
+	void DeleteRequest(CGIRequest *cr)
+	{
+		if (cr->spawnid)
+			Spawning.erase(cr->spawnid);
+
+		if (cr->queued)
+			Queue.erase(std::find(Queue.begin(), Queue.end(), cr));
+
+		if ((cr->pid > 0) && !cr->done)
+		{
+			/* Nobody wants its output any more */
+			std::map<pid_t, CGISpawner *>::iterator i = Children.find(cr->pid);
+			if (i != Children.end())
+				i->second->Kill(cr->pid);
+		}
+
+		CGIRequests.erase(cr->GetConnection());
+		delete cr;
+	}
 
  public:
-	ModuleCGI(InspIRCd *Srv) : Module(Srv)
+	ModuleCGI(InspIRCd *Srv) : Module(Srv), NextSpawnID(0), NextSpawner(0), idletimer(NULL)
 	{
 		// Read config.
 		ConfigReader Conf(ServerInstance);
@@ -149,131 +922,354 @@ class ModuleCGI : public Module
 			CGITypes[extension] = executable;
 		}
 
-		Implementation eventlist[] = { I_OnPreRequest, I_OnBufferFlushed, I_OnConnectionDisconnect };
+		int helpers = Conf.ReadInteger("cgiconfig", "helpers", "1", 0, true);
+		if (helpers < 1)
+			helpers = 1;
+
+		Timeout = Conf.ReadInteger("cgiconfig", "timeout", "60", 0, true);
+		QueueSize = Conf.ReadInteger("cgiconfig", "queue-size", "64", 0, true);
+		Limits.cpu = Conf.ReadInteger("cgiconfig", "cpu-limit", "0", 0, true);
+		Limits.memory = (rlim_t)Conf.ReadInteger("cgiconfig", "memory-limit", "0", 0, true) * 1024 * 1024;
+
+		for (int i = 0; i < helpers; i++)
+		{
+			CGISpawner *sp = new CGISpawner(ServerInstance, this);
+			if (!sp->Start(Limits))
+			{
+				delete sp;
+				for (std::vector<CGISpawner *>::iterator j = Spawners.begin(); j != Spawners.end(); j++)
+					delete *j;
+				throw ModuleException("Could not start CGI spawn helper: " + std::string(strerror(errno)));
+			}
+			Spawners.push_back(sp);
+		}
+
+		idletimer = new CGIIdleTimer(ServerInstance, this);
+		ServerInstance->Timers->AddTimer(idletimer);
+
+		Implementation eventlist[] = { I_OnPreRequest, I_OnConnectionDisconnect, I_OnBackgroundTimer };
 		ServerInstance->Modules->Attach(eventlist, this, 3);
 	}
 	
 	virtual ~ModuleCGI()
 	{
+		ServerInstance->Timers->DelTimer(idletimer);
+
+		while (!CGIRequests.empty())
+			DeleteRequest(CGIRequests.begin()->second);
+
+		for (std::vector<CGISpawner *>::iterator i = Spawners.begin(); i != Spawners.end(); i++)
+			delete *i;
 	}
-	
-	virtual Version GetVersion()
+
+	/** A spawn helper has replied to a request
+	 * @param sp The helper
+	 * @param fds The child's stdin and stdout, if it was started
+	 */
+	void OnSpawned(CGISpawner *sp, const CGISpawnReply &reply, int fds[2])
 	{
-		return Version(1, 0, 0, 0, VF_VENDOR, API_VERSION);
+		std::map<unsigned int, CGIRequest *>::iterator i = Spawning.find(reply.id);
+
+		if (reply.pid > 0)
+			Children[reply.pid] = sp;
+
+		if (i == Spawning.end())
+		{
+			/* The client went away while we were waiting */
+			if (reply.pid > 0)
+			{
+				sp->Kill(reply.pid);
+				close(fds[0]);
+				close(fds[1]);
+			}
+			return;
+		}
+
+		CGIRequest *cr = i->second;
+		Spawning.erase(i);
+		cr->spawnid = 0;
+		cr->spawner = NULL;
+
+		if (reply.pid < 1)
+		{
+			LOG(DEBUG, LS_MODULE, "CGI spawn failed: %s", strerror(reply.error));
+			Connection *c = cr->GetConnection();
+			DeleteRequest(cr);
+			c->SendError(500, "Internal error", true);
+			RunQueue();
+			return;
+		}
+
+		LOG(DEBUG, LS_MODULE, "CGI child started, pid %d", reply.pid);
+		cr->pid = reply.pid;
+
+		// Pass the request body (if any) to the process' stdin
+		ServerInstance->SE->NonBlocking(fds[0]);
+		cr->input = new CGIInput(ServerInstance, fds[0], cr->GetConnection()->RequestBody);
+		cr->input->Start();
+
+		// read from the child's stdout.
+		ServerInstance->SE->NonBlocking(fds[1]);
+		cr->SetFd(fds[1]);
+
+		if (!ServerInstance->SE->AddFd(cr))
+		{
+			LOG(DEBUG, LS_MODULE, "Internal error on CGI connection(!)");
+			Connection *c = cr->GetConnection();
+			DeleteRequest(cr);
+			c->SendError(500, "Internal error", true);
+		}
 	}
 
-	virtual void OnBufferFlushed(Connection *c)
+	/** A CGI process has finished writing its output. Parse the headers it printed and
+	 * send the response (RFC 3875 section 6).
+	 */
+	void OnComplete(CGIRequest *cr)
 	{
-		std::map<Connection *, CGIRequest *>::iterator i = CGIRequests.find(c);
+		Connection *c = cr->GetConnection();
+		std::string output;
+		int redirects = cr->redirects;
 
-		ServerInstance->Log(DEBUG, "Buffer flushed for %d", c->GetFd());
+		output.swap(cr->GetOutput());
+		DeleteRequest(cr);
 
-		if (i != CGIRequests.end())
+		/* The header block ends at the first empty line; scripts often use bare LFs */
+		std::string::size_type hend = std::string::npos, body = std::string::npos;
+		for (std::string::size_type nl = output.find('\n'); nl != std::string::npos; nl = output.find('\n', nl + 1))
+		{
+			if ((nl + 1 < output.length()) && (output[nl + 1] == '\n'))
+			{
+				hend = nl;
+				body = nl + 2;
+				break;
+			}
+			if ((nl + 2 < output.length()) && (output[nl + 1] == '\r') && (output[nl + 2] == '\n'))
+			{
+				hend = nl;
+				body = nl + 3;
+				break;
+			}
+		}
+
+		if (hend == std::string::npos)
 		{
-			ServerInstance->Log(DEBUG, "Deleted");
-			delete i->second;
-			CGIRequests.erase(i);
+			LOG(DEBUG, LS_MODULE, "CGI output has no header block");
+			c->SendError(500, "Internal error", true);
+			return;
 		}
+
+		HTTPHeaders headers;
+		int status = 0;
+		std::string statustext;
+
+		std::istringstream hstream(output.substr(0, hend));
+		std::string line;
+		while (std::getline(hstream, line))
+		{
+			if (!line.empty() && (line[line.length() - 1] == '\r'))
+				line.erase(line.length() - 1);
+
+			std::string::size_type colon = line.find(':');
+			if ((colon == std::string::npos) || !colon)
+			{
+				LOG(DEBUG, LS_MODULE, "Malformed CGI header '%s'", line.c_str());
+				c->SendError(500, "Internal error", true);
+				return;
+			}
+
+			std::string name = line.substr(0, colon);
+			std::string::size_type vstart = line.find_first_not_of(" \t", colon + 1);
+			std::string value = (vstart == std::string::npos) ? "" : line.substr(vstart);
+
+			if (!strcasecmp(name.c_str(), "Status"))
+			{
+				status = atoi(value.c_str());
+				std::string::size_type sp = value.find(' ');
+				statustext = (sp == std::string::npos) ? "" : value.substr(sp + 1);
+			}
+			else
+				headers.SetHeader(name, value);
+		}
+
+		std::string location = headers.GetHeader("Location");
+
+		if (!location.empty() && (location[0] == '/') && !status)
+		{
+			/* Local redirect: serve the new path as if the client had asked for it */
+			if (++redirects > 10)
+			{
+				LOG(DEBUG, LS_MODULE, "Too many local redirects from CGI");
+				c->SendError(500, "Internal error", true);
+				return;
+			}
+
+			LOG(DEBUG, LS_MODULE, "CGI local redirect to %s", location.c_str());
+			c->method = "GET";
+			c->uri = location;
+			c->uriquery.clear();
+			c->RequestBody.clear();
+			c->RequestBodyLength = 0;
+
+			Redirected[c] = redirects;
+			c->ProcessRequest();
+			Redirected.erase(c);
+			return;
+		}
+
+		if (!status)
+			status = location.empty() ? 200 : 302;
+
+		if ((status < 100) || (status > 999))
+		{
+			LOG(DEBUG, LS_MODULE, "Bad CGI status %d", status);
+			c->SendError(500, "Internal error", true);
+			return;
+		}
+
+		if (statustext.empty())
+			statustext = StatusText(status);
+
+		/* With no body, SendHeaders ends the request itself */
+		c->SendHeaders(output.length() - body, status, statustext, headers);
+		if (body == output.length())
+			return;
+
+		c->State = HTTP_SEND_DATA;
+		c->Write(output.substr(body));
+		c->ResponseBufferDone = true;
+	}
+
+	/** A process started by a spawn helper has exited, freeing its slot
+	 */
+	void OnExited(const CGISpawnReply &reply)
+	{
+		Children.erase(reply.pid);
+
+		if (WIFSIGNALED(reply.status))
+			ServerInstance->Log(DEFAULT, "CGI process %d was killed by signal %d", reply.pid, WTERMSIG(reply.status));
+		else
+			LOG(DEBUG, LS_MODULE, "CGI process %d exited with status %d", reply.pid, WEXITSTATUS(reply.status));
+
+		RunQueue();
+	}
+
+	/** A spawn helper has died. Fail anything it had pending, and replace it.
+	 */
+	void OnSpawnerDied(CGISpawner *sp)
+	{
+		ServerInstance->Log(DEFAULT, "CGI spawn helper %d died, restarting it", sp->pid);
+		sp->Stop();
+
+		std::vector<CGIRequest *> failed;
+		for (std::map<unsigned int, CGIRequest *>::iterator i = Spawning.begin(); i != Spawning.end(); i++)
+		{
+			if (i->second->spawner == sp)
+				failed.push_back(i->second);
+		}
+
+		/* Its children were orphaned; we'll never hear when they exit */
+		for (std::map<pid_t, CGISpawner *>::iterator i = Children.begin(); i != Children.end(); )
+		{
+			if (i->second == sp)
+				Children.erase(i++);
+			else
+				i++;
+		}
+
+		if (!sp->Start(Limits))
+			ServerInstance->Log(DEFAULT, "Could not restart CGI spawn helper: %s", strerror(errno));
+
+		for (std::vector<CGIRequest *>::iterator i = failed.begin(); i != failed.end(); i++)
+		{
+			Connection *c = (*i)->GetConnection();
+			DeleteRequest(*i);
+			c->SendError(500, "Internal error", true);
+		}
+	}
+	
+	virtual Version GetVersion()
+	{
+		return Version(1, 0, 0, 0, VF_VENDOR, API_VERSION);
 	}
 
 	virtual void OnConnectionDisconnect(Connection *c)
 	{
 		std::map<Connection *, CGIRequest *>::iterator i = CGIRequests.find(c);
 
-		ServerInstance->Log(DEBUG, "Disconnect for %d", c->GetFd());
+		LOG(DEBUG, LS_MODULE, "Disconnect for %d", c->GetFd());
 		if (i != CGIRequests.end())
 		{
-			ServerInstance->Log(DEBUG, "Deleted");
-			delete i->second;
-			CGIRequests.erase(i);
+			LOG(DEBUG, LS_MODULE, "Deleted");
+			DeleteRequest(i->second);
+		}
+	}
+
+	/** Keep clients whose script is queued or running, and hasn't timed out, from being
+	 * culled as idle
+	 */
+	void KeepAlive(time_t now)
+	{
+		for (std::map<Connection *, CGIRequest *>::iterator i = CGIRequests.begin(); i != CGIRequests.end(); i++)
+		{
+			if (!Timeout || (i->second->started + Timeout > now))
+				i->first->LastSocketEvent = now;
 		}
 	}
 
-	// Also cull completed requests that are just hanging around..
+	// Give up on requests which have taken too long, killing their processes
 	virtual void OnBackgroundTimer(time_t now)
 	{
-		bool go_again = true;
+		if (!Timeout)
+			return;
 
-		while (go_again)
-		{
-			go_again = false;
+		std::vector<Connection *> expired;
 
-			std::map<Connection *, CGIRequest *>::iterator i;
+		for (std::map<Connection *, CGIRequest *>::iterator i = CGIRequests.begin(); i != CGIRequests.end(); i++)
+		{
+			if (i->second->started + Timeout <= now)
+				expired.push_back(i->first);
+		}
 
-			ServerInstance->Log(DEBUG, "Going again");
-			
-			for (i = CGIRequests.begin(); i != CGIRequests.end(); i++)
-			{
-				if (i->second->done)
-				{
-					ServerInstance->Log(DEBUG, "Deleting %d", i->first->GetFd());
-					delete i->second;
-					CGIRequests.erase(i);
-					go_again = true;
-					break;
-				}
-			}
+		for (std::vector<Connection *>::iterator i = expired.begin(); i != expired.end(); i++)
+		{
+			/* Sending an error may start the next request on the connection, so look again */
+			std::map<Connection *, CGIRequest *>::iterator cr = CGIRequests.find(*i);
+			if ((cr == CGIRequests.end()) || (cr->second->started + Timeout > now))
+				continue;
+
+			LOG(DEBUG, LS_MODULE, "CGI request on %d timed out", (*i)->GetFd());
+			DeleteRequest(cr->second);
+			(*i)->SendError(504, "Gateway Timeout", true);
 		}
+
+		RunQueue();
 	}
 
 	virtual int OnPreRequest(Connection *c, const std::string &method, const std::string &vhost, const std::string &dir, const std::string &file)
 	{
 		/*
 		 * so, we have a request!
-		 * for now, we're going to treat all requests as CGI requests, simply because
-		 * I really don't want to have to deal with this in other ways just now.
 		 *
-		 * step 1: create two sets of FDs via pipe(): one to recieve from child, one to send from parent
-		 * step 2: fork() (see step #3 for why)
-		 * step 3: set up environment in child
-		 * step 4: exec*() new process (NOTE: this replaces the calling process, which is why we need to fork)
-		 * step 5: ???
-		 * step 6: profit.
+		 * step 1: work out what to run, and with what environment
+		 * step 2: hand that to a spawn helper, which starts the process and passes its stdin
+		 *         and stdout back to us (see OnSpawned)
+		 * step 3: ???
+		 * step 4: profit.
 		 */
-		int to_child_fd[2];
-		int from_child_fd[2];
-		pid_t forkres;
 		struct stat *fst = NULL;
 		std::string upath;
-		std::string exe;
-
-		// probably requesting a dir, drop it.
-		if (file.empty())
-			return 0;
-
-		size_t pos;
-
-		pos = file.rfind('.');
+		std::string pathinfo;
 
-		// we can't touch something with no extension.
-		if (pos == std::string::npos)
+		// scripts may be followed by path info, so look for one anywhere in the path
+		if (!HasScriptExtension(c->uri))
 			return 0;
 
-		std::string ext = file.substr((pos + 1), file.length());
-
-		// . on the end of the file - what madness is this?
-		if (ext.empty())
-			return 0;
-
-		std::map<std::string, std::string>::iterator i = CGITypes.find(ext);
+		/* before anything, get the full path and make sure we can access it! (XXX copy paste :() */
+		upath = ServerInstance->FileSys->CheckFilePath(c->vhost->docroot, c->uri, fst, &pathinfo);
 
-		// defined CGI type?
-		if (i == CGITypes.end())
-		{
+		/* A directory with a script's name; the core redirects it */
+		if (upath.empty() && (errno == EISDIR))
 			return 0;
-		}
-
-		if (total_cgi_processes + 1 > ServerInstance->Config->MaximumDynamicProcesses)
-		{
-			// error 500
-			c->SendError(500, "Internal error", true);
-			return 1;
-		}
-
-		exe = i->second;
-
-		/* before anything, get the full path and make sure we can access it! (XXX copy paste :() */
-		upath = ServerInstance->FileSys->CheckFilePath(ServerInstance->Config->DocRoot, c->uri, fst);
 
 		if (upath.empty())
 		{
@@ -289,111 +1285,181 @@ class ModuleCGI : public Module
 					c->SendError(404, "File Not Found", true);
 					break;
 				default:
-					c->SendError(500, "Internal Server Error", true);
+					c->SendError(500, "Internal error", true);
 					break;
 			}
 
 			return 1;
 		}
 
-		/* step 1. */
-		if (pipe(to_child_fd) == -1)
+		// the file actually found must be a script too
+		std::string::size_type pos = upath.rfind('.');
+		if ((pos == std::string::npos) || (upath.find('/', pos) != std::string::npos))
+			return 0;
+
+		std::map<std::string, std::string>::iterator i = CGITypes.find(upath.substr(pos + 1));
+
+		// defined CGI type?
+		if (i == CGITypes.end())
 		{
-			c->SendError(500, "Internal error", true);
-			return 1;
+			return 0;
 		}
 
-		if (pipe(from_child_fd) == -1)
+		bool queue = (RunningProcesses() >= ServerInstance->Config->MaximumDynamicProcesses);
+
+		if (queue && (Queue.size() >= QueueSize))
 		{
-			c->SendError(500, "Internal error", true);
+			c->SendError(503, "Service Unavailable", false);
 			return 1;
 		}
 
-		/* step 2. */
- 		forkres = fork();
+		/* step 1. */
+		CGIRequest *cr = new CGIRequest(ServerInstance, this, c);
+		std::map<Connection *, int>::iterator r = Redirected.find(c);
+		if (r != Redirected.end())
+			cr->redirects = r->second;
 
-		if (forkres == -1)
+		BuildEnvironment(c, upath, pathinfo, cr->env);
+
+		if (i->second.empty())
 		{
-			/* error, fuck .. */
-			c->SendError(500, "Internal error", true);
+			// no exe defined, invoke the proc itself
+			cr->exe = upath;
+			cr->argv.push_back(upath);
+		}
+		else
+		{
+			// Custom handler defined for this type, run it with the file as a param
+			cr->exe = i->second;
+			cr->argv.push_back(cr->exe);
+			cr->argv.push_back(upath);
+		}
+
+		if (queue)
+		{
+			// wait for a process to finish
+			LOG(DEBUG, LS_MODULE, "Queueing CGI request, %d processes running", RunningProcesses());
+			cr->queued = true;
+			Queue.push_back(cr);
+			CGIRequests[c] = cr;
+			c->State = HTTP_SEND_HEADERS;
 			return 1;
 		}
 
-		switch (forkres)
+		/* step 2. */
+		if (!StartRequest(cr))
 		{
-			case 0:
-				/* we're the child */
+			delete cr;
+			c->SendError(500, "Internal error", true);
+			return 1;
+		}
 
-				/*
-				 * step 3.
-				 *  first, we need to move STDIN and STDOUT to the FDs we created pre-fork.
-				 */
+		/* Hold off any pipelined requests until this response is done */
+		CGIRequests[c] = cr;
+		c->State = HTTP_SEND_HEADERS;
+		return 1;
+	}
+};
 
-				// Create stdout: we want to write to from_child. #1 can be written to, so dup2() it to stdout.
-				dup2(from_child_fd[1], STDOUT_FILENO);
+void CGIIdleTimer::Tick(time_t now)
+{
+	Parent->KeepAlive(now);
+}
 
-				// And move stdin to to_child, so parent can write to us.
-				dup2(to_child_fd[0], STDIN_FILENO);
+void CGIRequest::Close(bool SendResponse)
+{
+	/*
+	 * Remove ident socket from engine, and close it, but dont detatch it
+	 * from its parent user class, or attempt to delete its memory.
+	 */
+	if (GetFd() > -1)
+	{
+		LOG(DEBUG, LS_MODULE, "Close CGI socket %d", GetFd());
+		ServerInstance->SE->DelFd(this);
+		ServerInstance->SE->Close(GetFd());
+		ServerInstance->SE->Shutdown(GetFd(), SHUT_WR);
+		this->SetFd(-1);
+		done = true;
 
-				// Close unneeded
-				close(from_child_fd[0]);
-				close(to_child_fd[1]);
 
-				// Set environment variables: this doesn't cause problems, because we fork()ed. (we probably *should not* assume this succeeds)
-				setenv("SERVER_SOFTWARE", "hottpd", 1);
-				setenv("GATEWAY_INTERFACE", "CGI/1.1", 1);
-				setenv("SCRIPT_FILENAME", upath.c_str(), 1);
-				// TODO: set moar here.
+		if (SendResponse)
+		{
+			// Send response. WARNING: this deletes us!
+			LOG(DEBUG, LS_MODULE, "Sending response. Total request size: %lu", (unsigned long)rbuf.length());
+			Parent->OnComplete(this);
+		}
+	}
+}
 
-				if (exe.empty())
+void CGISpawner::HandleEvent(EventType et, int errornum)
+{
+	switch (et)
+	{
+		case EVENT_READ:
+			while (GetFd() > -1)
+			{
+				CGISpawnReply reply;
+				struct msghdr msg;
+				struct iovec iov;
+				char control[CMSG_SPACE(sizeof(int) * 2)];
+				int fds[2] = { -1, -1 };
+
+				memset(&msg, 0, sizeof(msg));
+				iov.iov_base = &reply;
+				iov.iov_len = sizeof(reply);
+				msg.msg_iov = &iov;
+				msg.msg_iovlen = 1;
+				msg.msg_control = control;
+				msg.msg_controllen = sizeof(control);
+
+				ssize_t n = recvmsg(GetFd(), &msg, 0);
+				if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+					return;
+
+				if (n != sizeof(reply))
 				{
-					// no exe defined, invoke the proc itself
-					execvp(upath.c_str(), NULL);
+					Parent->OnSpawnerDied(this);
+					return;
 				}
-				else
+
+				if (reply.type == CGI_MSG_EXITED)
 				{
-					// Custom handler defined for this type, run it with the file as a param
-					// XXX: we really should copy these strings rather than casting.
-					char *argv[3];
-					argv[0] = (char *)exe.c_str();
-					argv[1] = (char *)upath.c_str();
-					argv[2] = NULL;
-
-					execvp(exe.c_str(), argv);
+					Parent->OnExited(reply);
+					continue;
 				}
 
-				exit(0);
-				break;
-			default:
-				/* parent */
-
-				// Close unneeded
-				close(from_child_fd[1]);
-				close(to_child_fd[0]);
-
-				// We may need to write stuff to CGI here. Let's assume we don't.
-				close(to_child_fd[1]);
-
-				// read from_child_fd[0].
-				CGIRequest *cr = new CGIRequest(ServerInstance, c);
-				cr->SetFd(from_child_fd[0]);
-
-				if (!ServerInstance->SE->AddFd(cr))
+				struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+				if (cmsg && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS) && (cmsg->cmsg_len == CMSG_LEN(sizeof(fds))))
 				{
-					ServerInstance->Log(DEBUG,"Internal error on CGI connection(!)");
-					delete cr;
-					return 1;
+					memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+					fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+					fcntl(fds[1], F_SETFD, FD_CLOEXEC);
 				}
+				else
+					reply.pid = -1;
 
-				CGIRequests[c] = cr;
-
-				return 1;
-				break;
-		}
-
-		return 1;
+				Parent->OnSpawned(this, reply, fds);
+			}
+		break;
+		case EVENT_WRITE:
+			while (!sendq.empty())
+			{
+				if (send(GetFd(), sendq.front().data(), sendq.front().length(), 0) == -1)
+				{
+					if (errno == EAGAIN)
+						ServerInstance->SE->WantWrite(this);
+					else
+						Parent->OnSpawnerDied(this);
+					return;
+				}
+				sendq.pop_front();
+			}
+		break;
+		case EVENT_ERROR:
+			Parent->OnSpawnerDied(this);
+		break;
 	}
-};
+}
 
 
 MODULE_INIT(ModuleCGI)
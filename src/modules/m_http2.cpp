@@ -0,0 +1,1847 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+#include "inspircd.h"
+#include <deque>
+#include <sys/socket.h>
+
+/* $ModDesc: Provides HTTP/2, with prior knowledge in cleartext or negotiated by ALPN over SSL */
+
+/** Size of a frame header */
+#define H2_FRAME_HEADER 9
+
+/** Largest frame payload we accept; we never raise it with SETTINGS_MAX_FRAME_SIZE */
+#define H2_MAX_FRAME 16384
+
+/** Initial flow control window, for both directions, until SETTINGS say otherwise */
+#define H2_DEFAULT_WINDOW 65535
+
+#define H2_MAX_WINDOW 0x7fffffffL
+
+/** Once this much is waiting in a client's write buffer, no more DATA frames are
+ * produced for it until it drains.
+ */
+#define H2_MAX_BUFFERED 65536
+
+/** Response data held for a stream before we stop reading it from the server */
+#define H2_STREAM_BUFFER 65536
+
+/** Largest header block (after CONTINUATIONs) or response head we accept */
+#define H2_MAX_HEADERS 65536
+
+/** HPACK dynamic table size we allow the client's encoder (the protocol default) */
+#define HPACK_TABLE_SIZE 4096
+
+enum H2FrameType
+{
+	H2_DATA = 0,
+	H2_HEADERS = 1,
+	H2_PRIORITY = 2,
+	H2_RST_STREAM = 3,
+	H2_SETTINGS = 4,
+	H2_PUSH_PROMISE = 5,
+	H2_PING = 6,
+	H2_GOAWAY = 7,
+	H2_WINDOW_UPDATE = 8,
+	H2_CONTINUATION = 9
+};
+
+#define H2_FLAG_END_STREAM	0x01
+#define H2_FLAG_ACK		0x01
+#define H2_FLAG_END_HEADERS	0x04
+#define H2_FLAG_PADDED		0x08
+#define H2_FLAG_PRIORITY	0x20
+
+enum H2Error
+{
+	H2_NO_ERROR = 0,
+	H2_PROTOCOL_ERROR = 1,
+	H2_INTERNAL_ERROR = 2,
+	H2_FLOW_CONTROL_ERROR = 3,
+	H2_STREAM_CLOSED = 5,
+	H2_FRAME_SIZE_ERROR = 6,
+	H2_REFUSED_STREAM = 7,
+	H2_CANCEL = 8,
+	H2_COMPRESSION_ERROR = 9,
+	H2_ENHANCE_YOUR_CALM = 11
+};
+
+enum H2Setting
+{
+	H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+	H2_SETTINGS_ENABLE_PUSH = 2,
+	H2_SETTINGS_MAX_CONCURRENT_STREAMS = 3,
+	H2_SETTINGS_INITIAL_WINDOW_SIZE = 4,
+	H2_SETTINGS_MAX_FRAME_SIZE = 5,
+	H2_SETTINGS_MAX_HEADER_LIST_SIZE = 6
+};
+
+typedef std::vector<std::pair<std::string, std::string> > HeaderList;
+
+/** The HPACK static table (RFC 7541 appendix A), used by both the decoder and encoder.
+ * Index 1 is the first entry.
+ */
+static const char *hpack_static[][2] = {
+	{ ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+	{ ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+	{ ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+	{ ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+	{ "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+	{ "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+	{ "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+	{ "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+	{ "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+	{ "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+	{ "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+	{ "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+	{ "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+	{ "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+	{ "www-authenticate", "" }
+};
+
+#define HPACK_STATIC_ENTRIES (sizeof(hpack_static) / sizeof(hpack_static[0]))
+
+/** The HPACK Huffman code (RFC 7541 appendix B), indexed by symbol. Symbol 256 is EOS.
+ */
+static const struct
+{
+	unsigned int code;
+	unsigned char bits;
+} hpack_huffman[257] = {
+	{ 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+	{ 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+	{ 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+	{ 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+	{ 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+	{ 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+	{ 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+	{ 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+	{ 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+	{ 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+	{ 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+	{ 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+	{ 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+	{ 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+	{ 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+	{ 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+	{ 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+	{ 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+	{ 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+	{ 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+	{ 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+	{ 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+	{ 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+	{ 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+	{ 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+	{ 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+	{ 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+	{ 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+	{ 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+	{ 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+	{ 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+	{ 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+	{ 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+	{ 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+	{ 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+	{ 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+	{ 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+	{ 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+	{ 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+	{ 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+	{ 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+	{ 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+	{ 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+	{ 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+	{ 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+	{ 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+	{ 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+	{ 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+	{ 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+	{ 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+	{ 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+	{ 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+	{ 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+	{ 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+	{ 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+	{ 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+	{ 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+	{ 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+	{ 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+	{ 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+	{ 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+	{ 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+	{ 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+	{ 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+	{ 0x3fffffff, 30 },
+};
+
+/** Huffman decoding tables. The code is canonical: codes of one length are consecutive,
+ * so a code of length n is valid if it lies in [first[n], first[n] + count[n]).
+ */
+static unsigned int huffman_first[31];
+static unsigned int huffman_count[31];
+static unsigned int huffman_offset[31];
+static unsigned short huffman_symbols[257];
+
+static void BuildHuffmanTables()
+{
+	memset(huffman_count, 0, sizeof(huffman_count));
+	memset(huffman_first, 0, sizeof(huffman_first));
+
+	for (int s = 0; s < 257; s++)
+		huffman_count[hpack_huffman[s].bits]++;
+
+	unsigned int offset = 0;
+	for (int n = 0; n < 31; n++)
+	{
+		huffman_offset[n] = offset;
+		offset += huffman_count[n];
+	}
+
+	unsigned int fill[31];
+	memcpy(fill, huffman_offset, sizeof(fill));
+	for (int s = 0; s < 257; s++)
+	{
+		int n = hpack_huffman[s].bits;
+		if (fill[n] == huffman_offset[n])
+			huffman_first[n] = hpack_huffman[s].code;
+		huffman_symbols[fill[n]++] = s;
+	}
+}
+
+static bool HuffmanDecode(const unsigned char *p, size_t len, std::string &out)
+{
+	unsigned int code = 0;
+	int bits = 0;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		for (int b = 7; b >= 0; b--)
+		{
+			code = (code << 1) | ((p[i] >> b) & 1);
+			bits++;
+
+			if (huffman_count[bits] && (code >= huffman_first[bits]) && (code - huffman_first[bits] < huffman_count[bits]))
+			{
+				unsigned short sym = huffman_symbols[huffman_offset[bits] + code - huffman_first[bits]];
+				if (sym == 256)
+					return false;
+				out.push_back((char)sym);
+				code = 0;
+				bits = 0;
+			}
+			else if (bits >= 30)
+				return false;
+		}
+	}
+
+	/* Padding must be fewer than 8 bits, all ones (a prefix of EOS) */
+	return (bits < 8) && (code == (1U << bits) - 1);
+}
+
+static void HuffmanEncode(const std::string &in, std::string &out)
+{
+	unsigned long long acc = 0;
+	int bits = 0;
+
+	for (std::string::const_iterator i = in.begin(); i != in.end(); i++)
+	{
+		unsigned char c = *i;
+		acc = (acc << hpack_huffman[c].bits) | hpack_huffman[c].code;
+		bits += hpack_huffman[c].bits;
+
+		while (bits >= 8)
+		{
+			bits -= 8;
+			out.push_back((char)(acc >> bits));
+		}
+	}
+
+	if (bits)
+		out.push_back((char)((acc << (8 - bits)) | (0xff >> bits)));
+}
+
+static size_t HuffmanLength(const std::string &in)
+{
+	size_t bits = 0;
+	for (std::string::const_iterator i = in.begin(); i != in.end(); i++)
+		bits += hpack_huffman[(unsigned char)*i].bits;
+	return (bits + 7) / 8;
+}
+
+/** Append an HPACK integer with an n bit prefix; flags fill the bits above the prefix
+ */
+static void HPACKInteger(std::string &out, unsigned int value, int prefix, unsigned char flags)
+{
+	unsigned int max = (1 << prefix) - 1;
+
+	if (value < max)
+	{
+		out.push_back((char)(flags | value));
+		return;
+	}
+
+	out.push_back((char)(flags | max));
+	value -= max;
+	while (value >= 128)
+	{
+		out.push_back((char)((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+	out.push_back((char)value);
+}
+
+static void HPACKString(std::string &out, const std::string &str)
+{
+	size_t hlen = HuffmanLength(str);
+
+	if (hlen < str.length())
+	{
+		HPACKInteger(out, hlen, 7, 0x80);
+		HuffmanEncode(str, out);
+	}
+	else
+	{
+		HPACKInteger(out, str.length(), 7, 0);
+		out.append(str);
+	}
+}
+
+/** Encode one header field. We never add to the client's dynamic table, so there is
+ * no encoder state: fields are either a static table entry or a literal without indexing.
+ */
+static void HPACKEncode(std::string &out, const std::string &name, const std::string &value)
+{
+	unsigned int nameindex = 0;
+
+	for (unsigned int i = 0; i < HPACK_STATIC_ENTRIES; i++)
+	{
+		if (name != hpack_static[i][0])
+			continue;
+
+		if (value == hpack_static[i][1])
+		{
+			HPACKInteger(out, i + 1, 7, 0x80);
+			return;
+		}
+
+		if (!nameindex)
+			nameindex = i + 1;
+	}
+
+	HPACKInteger(out, nameindex, 4, 0x00);
+	if (!nameindex)
+		HPACKString(out, name);
+	HPACKString(out, value);
+}
+
+/** Decodes header blocks from one client. The dynamic table lives as long as the connection.
+ */
+class HPACKDecoder : public classbase
+{
+	std::deque<std::pair<std::string, std::string> > table;
+	size_t size;
+	size_t maxsize;
+
+	void Evict(size_t limit)
+	{
+		while (size > limit)
+		{
+			size -= table.back().first.length() + table.back().second.length() + 32;
+			table.pop_back();
+		}
+	}
+
+	void Insert(const std::string &name, const std::string &value)
+	{
+		size_t entry = name.length() + value.length() + 32;
+
+		/* An entry larger than the table empties it and is not added */
+		Evict(entry > maxsize ? 0 : maxsize - entry);
+		if (entry <= maxsize)
+		{
+			table.push_front(std::make_pair(name, value));
+			size += entry;
+		}
+	}
+
+	bool Lookup(unsigned int index, std::pair<std::string, std::string> &field)
+	{
+		if (!index)
+			return false;
+
+		if (index <= HPACK_STATIC_ENTRIES)
+		{
+			field.first = hpack_static[index - 1][0];
+			field.second = hpack_static[index - 1][1];
+			return true;
+		}
+
+		index -= HPACK_STATIC_ENTRIES + 1;
+		if (index >= table.size())
+			return false;
+
+		field = table[index];
+		return true;
+	}
+
+	static bool ReadInteger(const unsigned char *&p, const unsigned char *end, int prefix, unsigned int &value)
+	{
+		if (p >= end)
+			return false;
+
+		unsigned int max = (1 << prefix) - 1;
+		value = *p++ & max;
+		if (value < max)
+			return true;
+
+		for (int shift = 0; shift <= 21; shift += 7)
+		{
+			if (p >= end)
+				return false;
+
+			unsigned char b = *p++;
+			value += (b & 0x7f) << shift;
+			if (!(b & 0x80))
+				return true;
+		}
+
+		/* Larger than anything we would accept anyway */
+		return false;
+	}
+
+	static bool ReadString(const unsigned char *&p, const unsigned char *end, std::string &str)
+	{
+		if (p >= end)
+			return false;
+
+		bool huffman = *p & 0x80;
+		unsigned int len;
+		if (!ReadInteger(p, end, 7, len) || (len > (unsigned int)(end - p)))
+			return false;
+
+		str.clear();
+		if (huffman)
+		{
+			if (!HuffmanDecode(p, len, str))
+				return false;
+		}
+		else
+			str.assign((const char *)p, len);
+
+		p += len;
+		return true;
+	}
+
+ public:
+	HPACKDecoder() : size(0), maxsize(HPACK_TABLE_SIZE)
+	{
+	}
+
+	/** Decode a complete header block
+	 * @return false on a compression error, which is fatal to the connection
+	 */
+	bool Decode(const std::string &block, HeaderList &headers)
+	{
+		const unsigned char *p = (const unsigned char *)block.data();
+		const unsigned char *end = p + block.length();
+		size_t total = 0;
+
+		while (p < end)
+		{
+			std::pair<std::string, std::string> field;
+			unsigned int index;
+
+			if (*p & 0x80)
+			{
+				/* Indexed field */
+				if (!ReadInteger(p, end, 7, index) || !Lookup(index, field))
+					return false;
+			}
+			else if ((*p & 0xe0) == 0x20)
+			{
+				/* Dynamic table size update */
+				if (!ReadInteger(p, end, 5, index) || (index > HPACK_TABLE_SIZE))
+					return false;
+				maxsize = index;
+				Evict(maxsize);
+				continue;
+			}
+			else
+			{
+				/* Literal, with incremental indexing (01), without indexing (0000) or never indexed (0001) */
+				bool indexing = ((*p & 0xc0) == 0x40);
+
+				if (!ReadInteger(p, end, indexing ? 6 : 4, index))
+					return false;
+
+				if (index)
+				{
+					if (!Lookup(index, field))
+						return false;
+				}
+				else if (!ReadString(p, end, field.first))
+					return false;
+
+				if (!ReadString(p, end, field.second))
+					return false;
+
+				if (indexing)
+					Insert(field.first, field.second);
+			}
+
+			total += field.first.length() + field.second.length() + 32;
+			if (total > H2_MAX_HEADERS)
+				return false;
+
+			headers.push_back(field);
+		}
+
+		return true;
+	}
+};
+
+class Http2Session;
+class ModuleHTTP2;
+
+static ModuleHTTP2 *HTTP2 = NULL;
+
+/** How the body of a response from the server is delimited
+ */
+enum H2BodyType
+{
+	H2_BODY_NONE,
+	H2_BODY_LENGTH,
+	H2_BODY_CHUNKED,
+	H2_BODY_CLOSE
+};
+
+/** Where we are in a chunked response body
+ */
+enum H2ChunkState
+{
+	CHUNK_SIZE,
+	CHUNK_DATA,
+	CHUNK_CRLF,
+	CHUNK_TRAILER
+};
+
+/** One request/response exchange on a HTTP/2 connection.
+ *
+ * Each stream is served by the ordinary HTTP/1.1 code: when the request is complete it
+ * is written, as HTTP/1.1, into one end of a socketpair whose other end is added as a
+ * normal connection. The response read back is turned into HEADERS and DATA frames.
+ * This means every module and backend works unchanged over HTTP/2.
+ *
+ * The stream is the event handler for our end of the socketpair.
+ */
+class Http2Stream : public EventHandler
+{
+ public:
+	Http2Session *session;
+	unsigned int id;
+
+	HeaderList reqheaders;
+	std::string reqbody;
+	unsigned long reqbodylength;
+	/** END_STREAM has been received */
+	bool reqdone;
+	bool headrequest;
+
+	/** Request data not yet written to the socketpair */
+	std::string towrite;
+
+	/** Response head, until it is complete */
+	std::string head;
+	bool headdone;
+	H2BodyType bodytype;
+	unsigned long long remaining;
+	/** Chunked decoding: a partial size line, and whether the data's CRLF or the trailers are next */
+	std::string chunkline;
+	H2ChunkState chunkstate;
+
+	/** Response body waiting to be sent as DATA */
+	std::string out;
+	/** The whole response has been read; END_STREAM follows out */
+	bool outdone;
+	/** Reading from the socketpair is suspended while out is full */
+	bool paused;
+	/** Our end of the socketpair has been closed */
+	bool closed;
+
+	long sendwindow;
+
+	/** Priority: the stream this depends on (0 for none), its weight (1-256) and its
+	 * virtual finish time, used to share bandwidth in proportion to weight.
+	 */
+	unsigned int parent;
+	int weight;
+	unsigned long long vtime;
+
+	Http2Stream(Http2Session *s, unsigned int sid, long window, unsigned long long now) : session(s), id(sid),
+		reqbodylength(0), reqdone(false), headrequest(false), headdone(false), bodytype(H2_BODY_CLOSE), remaining(0),
+		chunkstate(CHUNK_SIZE), outdone(false), paused(false), closed(true), sendwindow(window), parent(0), weight(16), vtime(now)
+	{
+		this->fd = -1;
+	}
+
+	void HandleEvent(EventType et, int errornum = 0);
+};
+
+/** A HTTP/2 connection
+ */
+class Http2Session : public classbase
+{
+ public:
+	Connection *c;
+	std::string inbuf;
+	bool preface;
+	/** A fatal error has been sent; nothing more is processed */
+	bool closing;
+	/** The client sent GOAWAY; close once the last stream is done */
+	bool goaway;
+
+	HPACKDecoder decoder;
+	std::map<unsigned int, Http2Stream *> streams;
+	unsigned int laststream;
+
+	/** A header block being continued, and the flags of the HEADERS frame that began it */
+	unsigned int continuation;
+	unsigned char continuationflags;
+	std::string headerblock;
+	/** Priority fields of the HEADERS frame being processed */
+	unsigned int pendingparent;
+	int pendingweight;
+
+	long sendwindow;
+	long peerwindow;
+	unsigned int peermaxframe;
+
+	/** Virtual time of the last DATA sent, for new streams to start from */
+	unsigned long long vclock;
+
+	Http2Session(Connection *conn) : c(conn), preface(false), closing(false), goaway(false), laststream(0),
+		continuation(0), continuationflags(0), pendingparent(0), pendingweight(16), sendwindow(H2_DEFAULT_WINDOW), peerwindow(H2_DEFAULT_WINDOW),
+		peermaxframe(H2_MAX_FRAME), vclock(0)
+	{
+	}
+};
+
+static void AppendFrameHeader(std::string &out, size_t len, unsigned char type, unsigned char flags, unsigned int sid)
+{
+	char h[H2_FRAME_HEADER];
+	h[0] = (len >> 16) & 0xff;
+	h[1] = (len >> 8) & 0xff;
+	h[2] = len & 0xff;
+	h[3] = type;
+	h[4] = flags;
+	h[5] = (sid >> 24) & 0x7f;
+	h[6] = (sid >> 16) & 0xff;
+	h[7] = (sid >> 8) & 0xff;
+	h[8] = sid & 0xff;
+	out.append(h, H2_FRAME_HEADER);
+}
+
+/** Is this a token character (RFC 9110 5.6.2), which field names and methods are made of?
+ */
+static bool IsTokenChar(unsigned char c)
+{
+	return isalnum(c) || (c && strchr("!#$%&'*+-.^_`|~", c));
+}
+
+/** Check a request's fields before they are turned into HTTP/1.1, so nothing in them can
+ * end a line or the request early (RFC 9113 8.2.1 and 8.3.1). Anything which fails makes
+ * the request malformed.
+ */
+static bool ValidRequestHeaders(const HeaderList &headers)
+{
+	bool regular = false;
+	std::string method, path;
+	bool hasauthority = false, hasscheme = false;
+
+	for (HeaderList::const_iterator i = headers.begin(); i != headers.end(); i++)
+	{
+		const std::string &name = i->first;
+		const std::string &value = i->second;
+
+		if (name.empty())
+			return false;
+
+		/* Field names are lower case tokens; pseudo-fields are a colon and one */
+		for (std::string::const_iterator c = name.begin() + (name[0] == ':'); c != name.end(); c++)
+		{
+			if (!IsTokenChar(*c) || ((*c >= 'A') && (*c <= 'Z')))
+				return false;
+		}
+
+		if (value.find_first_of(std::string("\0\r\n", 3)) != std::string::npos)
+			return false;
+		if (!value.empty() && (strchr(" \t", value[0]) || strchr(" \t", value[value.length() - 1])))
+			return false;
+
+		if (name[0] != ':')
+		{
+			regular = true;
+			continue;
+		}
+
+		/* Pseudo-fields come first, once each */
+		if (regular)
+			return false;
+
+		if ((name == ":method") && method.empty())
+			method = value;
+		else if ((name == ":path") && path.empty())
+			path = value;
+		else if ((name == ":authority") && !hasauthority)
+			hasauthority = true;
+		else if ((name == ":scheme") && !hasscheme)
+			hasscheme = true;
+		else
+			return false;
+
+		/* These go into the request line and Host field, so can't have spaces either */
+		for (std::string::const_iterator c = value.begin(); c != value.end(); c++)
+		{
+			if (((unsigned char)*c <= ' ') || ((unsigned char)*c == 127))
+				return false;
+		}
+	}
+
+	if (method.empty() || path.empty())
+		return false;
+
+	for (std::string::const_iterator c = method.begin(); c != method.end(); c++)
+	{
+		if (!IsTokenChar(*c))
+			return false;
+	}
+
+	return (path[0] == '/') || ((path == "*") && (method == "OPTIONS"));
+}
+
+static void AppendUInt32(std::string &out, unsigned int v)
+{
+	out.push_back((char)((v >> 24) & 0xff));
+	out.push_back((char)((v >> 16) & 0xff));
+	out.push_back((char)((v >> 8) & 0xff));
+	out.push_back((char)(v & 0xff));
+}
+
+static unsigned int ReadUInt32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+class ModuleHTTP2 : public Module
+{
+	std::map<Connection *, Http2Session *> Sessions;
+
+	/** SETTINGS_MAX_CONCURRENT_STREAMS we advertise */
+	unsigned int maxstreams;
+
+	void ReadConfig()
+	{
+		ConfigReader Conf(ServerInstance);
+		maxstreams = Conf.ReadInteger("http2", "max-streams", "100", 0, true);
+		if (!maxstreams)
+			maxstreams = 100;
+	}
+
+	Http2Session *GetSession(Connection *c)
+	{
+		std::map<Connection *, Http2Session *>::iterator i = Sessions.find(c);
+		return (i == Sessions.end()) ? NULL : i->second;
+	}
+
+	Http2Stream *GetStream(Http2Session *session, unsigned int sid)
+	{
+		std::map<unsigned int, Http2Stream *>::iterator i = session->streams.find(sid);
+		return (i == session->streams.end()) ? NULL : i->second;
+	}
+
+	void SendFrame(Http2Session *session, unsigned char type, unsigned char flags, unsigned int sid, const std::string &payload)
+	{
+		std::string frame;
+		AppendFrameHeader(frame, payload.length(), type, flags, sid);
+		frame.append(payload);
+		session->c->Write(frame);
+	}
+
+	void SendRstStream(Http2Session *session, unsigned int sid, H2Error error)
+	{
+		std::string payload;
+		AppendUInt32(payload, error);
+		SendFrame(session, H2_RST_STREAM, 0, sid, payload);
+	}
+
+	void SendWindowUpdate(Http2Session *session, unsigned int sid, unsigned int increment)
+	{
+		std::string payload;
+		AppendUInt32(payload, increment);
+		SendFrame(session, H2_WINDOW_UPDATE, 0, sid, payload);
+	}
+
+	/** Fail the whole connection: send GOAWAY, flush what we can and close it
+	 */
+	void Fatal(Http2Session *session, H2Error error, const char *why)
+	{
+		if (session->closing)
+			return;
+
+		LOG(DEBUG, LS_MODULE, "HTTP/2 connection error on fd %d: %s", session->c->GetFd(), why);
+
+		std::string payload;
+		AppendUInt32(payload, session->laststream);
+		AppendUInt32(payload, error);
+		SendFrame(session, H2_GOAWAY, 0, 0, payload);
+
+		session->closing = true;
+		session->c->FlushWriteBuf();
+		ServerInstance->Connections->Delete(session->c);
+	}
+
+	/** Close our end of a stream's socketpair. The server side sees EOF and is cleaned
+	 * up like any other closed connection.
+	 */
+	void CloseSocket(Http2Stream *s)
+	{
+		if (s->closed)
+			return;
+
+		if (!s->paused)
+			ServerInstance->SE->DelFd(s);
+		close(s->GetFd());
+		s->SetFd(-1);
+		s->closed = true;
+	}
+
+	/** Forget a stream, because it is finished or reset
+	 */
+	void DestroyStream(Http2Stream *s)
+	{
+		Http2Session *session = s->session;
+
+		CloseSocket(s);
+		session->streams.erase(s->id);
+		delete s;
+
+		if (session->goaway && session->streams.empty() && !session->closing)
+		{
+			session->closing = true;
+			session->c->FlushWriteBuf();
+			ServerInstance->Connections->Delete(session->c);
+		}
+	}
+
+	void ResetStream(Http2Stream *s, H2Error error)
+	{
+		SendRstStream(s->session, s->id, error);
+		DestroyStream(s);
+	}
+
+	/** Turn a complete request into HTTP/1.1 and hand it to the server through a socketpair
+	 */
+	void StartStream(Http2Stream *s)
+	{
+		Http2Session *session = s->session;
+		std::string method, path, authority;
+		std::vector<std::string> names;
+		std::map<std::string, std::string> values;
+
+		for (HeaderList::iterator i = s->reqheaders.begin(); i != s->reqheaders.end(); i++)
+		{
+			const std::string &name = i->first;
+
+			if (name == ":method")
+				method = i->second;
+			else if (name == ":path")
+				path = i->second;
+			else if (name == ":authority")
+				authority = i->second;
+			else if ((name[0] == ':') || (name == "connection") || (name == "keep-alive") || (name == "te") ||
+				(name == "transfer-encoding") || (name == "upgrade") || (name == "content-length") || (name == "expect"))
+				continue;
+			else if (values.find(name) == values.end())
+			{
+				names.push_back(name);
+				values[name] = i->second;
+			}
+			else
+			{
+				/* Cookies may be split into separate fields; anything else repeated is a list */
+				values[name] += (name == "cookie") ? "; " : ", ";
+				values[name] += i->second;
+			}
+		}
+
+		s->reqheaders.clear();
+		s->headrequest = (method == "HEAD");
+
+		std::string req = method + " " + path + " HTTP/1.1\r\n";
+		if (values.find("host") == values.end())
+			req += "Host: " + authority + "\r\n";
+		for (std::vector<std::string>::iterator i = names.begin(); i != names.end(); i++)
+			req += *i + ": " + values[*i] + "\r\n";
+		if (s->reqbodylength || (method == "POST"))
+			req += "Content-Length: " + ConvToStr((long)s->reqbodylength) + "\r\n";
+		req += "Connection: close\r\n\r\n";
+
+		/* A body over the limit was not kept; the server will refuse it from the Content-Length alone */
+		if (s->reqbody.length() == s->reqbodylength)
+			req += s->reqbody;
+		s->reqbody.clear();
+
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		{
+			LOG(DEBUG, LS_MODULE, "HTTP/2 socketpair failed: %s", strerror(errno));
+			ResetStream(s, H2_REFUSED_STREAM);
+			return;
+		}
+
+		ServerInstance->SE->NonBlocking(fds[0]);
+		ServerInstance->SE->NonBlocking(fds[1]);
+
+		s->SetFd(fds[1]);
+		if (!ServerInstance->SE->AddFd(s))
+		{
+			close(fds[0]);
+			close(fds[1]);
+			s->SetFd(-1);
+			ResetStream(s, H2_REFUSED_STREAM);
+			return;
+		}
+		s->closed = false;
+
+		/* The server side inherits the client's address and the port it connected to */
+		if (!ServerInstance->Connections->Add(fds[0], session->c->GetPort(), session->c->GetProtocolFamily(), session->c->privip, false))
+		{
+			ResetStream(s, H2_REFUSED_STREAM);
+			return;
+		}
+
+		LOG(DEBUG, LS_MODULE, "HTTP/2 stream %u on fd %d: %s %s", s->id, session->c->GetFd(), method.c_str(), path.c_str());
+
+		s->towrite = req;
+		WriteRequest(s);
+	}
+
+	void WriteRequest(Http2Stream *s)
+	{
+		int n = send(s->GetFd(), s->towrite.data(), s->towrite.length(), 0);
+		if ((n < 0) && (errno != EAGAIN))
+		{
+			ResetStream(s, H2_INTERNAL_ERROR);
+			return;
+		}
+
+		if (n > 0)
+			s->towrite.erase(0, n);
+		if (!s->towrite.empty())
+			ServerInstance->SE->WantWrite(s);
+	}
+
+	/** Parse the server's response head and send it as a HEADERS frame
+	 * @return false if the response is malformed
+	 */
+	bool ParseHead(Http2Stream *s)
+	{
+		std::string::size_type end = s->head.find("\r\n\r\n");
+		std::string::size_type eol = s->head.find("\r\n");
+		std::string status(s->head, 0, eol);
+
+		if ((status.length() < 12) || (status.compare(0, 7, "HTTP/1.") != 0) || (status[8] != ' '))
+			return false;
+
+		int code = atoi(status.c_str() + 9);
+		if ((code < 200) || (code > 999))
+			return false;
+
+		std::string block;
+		HPACKEncode(block, ":status", ConvToStr(code));
+
+		bool chunked = false;
+		bool haslength = false;
+		unsigned long long length = 0;
+
+		for (std::string::size_type pos = eol + 2; pos < end; )
+		{
+			std::string::size_type next = s->head.find("\r\n", pos);
+			std::string line(s->head, pos, next - pos);
+			pos = next + 2;
+
+			std::string::size_type colon = line.find(':');
+			if ((colon == std::string::npos) || !colon)
+				return false;
+
+			std::string name(line, 0, colon);
+			std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+			std::string::size_type vstart = line.find_first_not_of(" \t", colon + 1);
+			std::string value = (vstart == std::string::npos) ? "" : line.substr(vstart);
+
+			if (name == "transfer-encoding")
+			{
+				chunked = (strcasecmp(value.c_str(), "chunked") == 0);
+				continue;
+			}
+			if ((name == "connection") || (name == "keep-alive") || (name == "proxy-connection") || (name == "upgrade"))
+				continue;
+			if (name == "content-length")
+			{
+				haslength = true;
+				length = strtoull(value.c_str(), NULL, 10);
+			}
+
+			HPACKEncode(block, name, value);
+		}
+
+		s->head.erase(0, end + 4);
+		s->headdone = true;
+
+		if (s->headrequest || (code == 204) || (code == 304) || (haslength && !length && !chunked))
+			s->bodytype = H2_BODY_NONE;
+		else if (chunked)
+			s->bodytype = H2_BODY_CHUNKED;
+		else if (haslength)
+		{
+			s->bodytype = H2_BODY_LENGTH;
+			s->remaining = length;
+		}
+		else
+			s->bodytype = H2_BODY_CLOSE;
+
+		unsigned char flags = (s->bodytype == H2_BODY_NONE) ? H2_FLAG_END_STREAM : 0;
+		std::string frames;
+		size_t max = s->session->peermaxframe;
+
+		/* Headers aren't flow controlled, and are sent straight away */
+		for (size_t pos = 0; (pos < block.length()) || !pos; pos += max)
+		{
+			size_t len = std::min(max, block.length() - pos);
+			bool last = (pos + len >= block.length());
+
+			if (!pos)
+				AppendFrameHeader(frames, len, H2_HEADERS, flags | (last ? H2_FLAG_END_HEADERS : 0), s->id);
+			else
+				AppendFrameHeader(frames, len, H2_CONTINUATION, last ? H2_FLAG_END_HEADERS : 0, s->id);
+			frames.append(block, pos, len);
+
+			if (last)
+				break;
+		}
+		s->session->c->Write(frames);
+
+		/* With no body, the stream was ended along with the headers; the caller destroys it */
+		return true;
+	}
+
+	/** Take response body bytes from the server, undoing any chunked encoding
+	 * @return false if the chunked encoding is malformed; the caller resets the stream
+	 */
+	bool ParseBody(Http2Stream *s, const char *data, size_t len)
+	{
+		switch (s->bodytype)
+		{
+			case H2_BODY_NONE:
+				return true;
+
+			case H2_BODY_CLOSE:
+				s->out.append(data, len);
+				return true;
+
+			case H2_BODY_LENGTH:
+				if (len > s->remaining)
+					len = s->remaining;
+				s->out.append(data, len);
+				s->remaining -= len;
+				if (!s->remaining)
+				{
+					s->outdone = true;
+					CloseSocket(s);
+				}
+				return true;
+
+			case H2_BODY_CHUNKED:
+				break;
+		}
+
+		while (len && !s->outdone)
+		{
+			if (s->chunkstate == CHUNK_DATA)
+			{
+				size_t n = (len < s->remaining) ? len : s->remaining;
+				s->out.append(data, n);
+				s->remaining -= n;
+				data += n;
+				len -= n;
+
+				if (!s->remaining)
+					s->chunkstate = CHUNK_CRLF;
+				continue;
+			}
+
+			/* Everything else is line based */
+			const char *nl = (const char *)memchr(data, '\n', len);
+			size_t n = nl ? (nl - data + 1) : len;
+			s->chunkline.append(data, n);
+			data += n;
+			len -= n;
+
+			if (!nl)
+			{
+				if (s->chunkline.length() > 1024)
+					return false;
+				continue;
+			}
+
+			std::string line;
+			line.swap(s->chunkline);
+
+			if (s->chunkstate == CHUNK_CRLF)
+			{
+				s->chunkstate = CHUNK_SIZE;
+			}
+			else if (s->chunkstate == CHUNK_SIZE)
+			{
+				s->remaining = strtoull(line.c_str(), NULL, 16);
+				s->chunkstate = s->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+			}
+			else if ((line == "\r\n") || (line == "\n"))
+			{
+				/* End of the trailers, and the response */
+				s->outdone = true;
+				CloseSocket(s);
+			}
+		}
+
+		return true;
+	}
+
+	/** Is this stream waiting for an ancestor which could send right now?
+	 */
+	bool Blocked(Http2Stream *s)
+	{
+		unsigned int p = s->parent;
+
+		for (int depth = 0; p && (depth < 32); depth++)
+		{
+			Http2Stream *a = GetStream(s->session, p);
+			if (!a)
+				return false;
+			if (!a->out.empty() && (a->sendwindow > 0) && (s->session->sendwindow > 0))
+				return true;
+			p = a->parent;
+		}
+
+		return false;
+	}
+
+	/** Send as much buffered response data as flow control and the client's write buffer
+	 * allow. The stream with the lowest virtual finish time goes next, so streams share the
+	 * connection in proportion to their weights; streams whose ancestors have data to send wait.
+	 */
+	void Pump(Http2Session *session)
+	{
+		if (session->closing)
+			return;
+
+		std::string frames;
+
+		while (session->c->sendq.length() + frames.length() < H2_MAX_BUFFERED)
+		{
+			Http2Stream *best = NULL;
+
+			for (std::map<unsigned int, Http2Stream *>::iterator i = session->streams.begin(); i != session->streams.end(); i++)
+			{
+				Http2Stream *s = i->second;
+
+				if (!s->headdone)
+					continue;
+
+				bool ready = s->out.empty() ? s->outdone : ((s->sendwindow > 0) && (session->sendwindow > 0));
+				if (!ready || Blocked(s))
+					continue;
+
+				if (!best || (s->vtime < best->vtime))
+					best = s;
+			}
+
+			if (!best)
+				break;
+
+			size_t len = best->out.length();
+			len = std::min(len, (size_t)session->peermaxframe);
+			if (len)
+			{
+				len = std::min(len, (size_t)best->sendwindow);
+				len = std::min(len, (size_t)session->sendwindow);
+			}
+
+			bool end = best->outdone && (len == best->out.length());
+
+			AppendFrameHeader(frames, len, H2_DATA, end ? H2_FLAG_END_STREAM : 0, best->id);
+			frames.append(best->out, 0, len);
+			best->out.erase(0, len);
+
+			best->sendwindow -= len;
+			session->sendwindow -= len;
+			best->vtime += (len + H2_FRAME_HEADER) * 256 / best->weight;
+			session->vclock = best->vtime;
+
+			if (end)
+			{
+				DestroyStream(best);
+				if (session->closing)
+					break;
+			}
+			else if (best->paused && (best->out.length() < H2_STREAM_BUFFER / 2))
+			{
+				if (ServerInstance->SE->AddFd(best))
+					best->paused = false;
+				else
+					ResetStream(best, H2_INTERNAL_ERROR);
+			}
+		}
+
+		if (!frames.empty())
+			session->c->Write(frames);
+	}
+
+	/** Begin a stream once its header block is complete
+	 */
+	void HeadersComplete(Http2Session *session, unsigned int sid, unsigned char flags)
+	{
+		HeaderList headers;
+		std::string block;
+		block.swap(session->headerblock);
+		session->continuation = 0;
+
+		/* Always decode, even for a stream we will refuse, to keep the table in step */
+		if (!session->decoder.Decode(block, headers))
+		{
+			Fatal(session, H2_COMPRESSION_ERROR, "bad header block");
+			return;
+		}
+
+		Http2Stream *s = GetStream(session, sid);
+		if (s)
+		{
+			/* Trailers; nothing we can pass on */
+			if (s->reqdone || !(flags & H2_FLAG_END_STREAM))
+			{
+				ResetStream(s, H2_PROTOCOL_ERROR);
+				return;
+			}
+
+			s->reqdone = true;
+			StartStream(s);
+			return;
+		}
+
+		if (sid <= session->laststream)
+		{
+			Fatal(session, H2_PROTOCOL_ERROR, "stream id reused");
+			return;
+		}
+		session->laststream = sid;
+
+		if (session->goaway || (session->streams.size() >= maxstreams))
+		{
+			SendRstStream(session, sid, H2_REFUSED_STREAM);
+			return;
+		}
+
+		if (!ValidRequestHeaders(headers))
+		{
+			LOG(DEBUG, LS_MODULE, "HTTP/2 stream %u has a malformed request", sid);
+			SendRstStream(session, sid, H2_PROTOCOL_ERROR);
+			return;
+		}
+
+		s = new Http2Stream(session, sid, session->peerwindow, session->vclock);
+		s->reqheaders.swap(headers);
+		session->streams[sid] = s;
+
+		if (session->pendingparent != sid)
+		{
+			s->parent = session->pendingparent;
+			s->weight = session->pendingweight;
+		}
+
+		if (flags & H2_FLAG_END_STREAM)
+		{
+			s->reqdone = true;
+			StartStream(s);
+		}
+	}
+
+	void OnData(Http2Session *session, unsigned int sid, unsigned char flags, const unsigned char *p, size_t len)
+	{
+		if (!sid)
+		{
+			Fatal(session, H2_PROTOCOL_ERROR, "DATA on stream 0");
+			return;
+		}
+
+		/* The whole frame counts against flow control, padding included; since we
+		 * buffer request bodies, we give it all back straight away. */
+		if (len)
+			SendWindowUpdate(session, 0, len);
+
+		size_t pad = 0;
+		if (flags & H2_FLAG_PADDED)
+		{
+			if (!len || (p[0] >= len))
+			{
+				Fatal(session, H2_PROTOCOL_ERROR, "bad padding");
+				return;
+			}
+			pad = p[0];
+			p++;
+			len -= pad + 1;
+		}
+
+		Http2Stream *s = GetStream(session, sid);
+		if (!s || s->reqdone)
+		{
+			if (sid > session->laststream)
+				Fatal(session, H2_PROTOCOL_ERROR, "DATA on idle stream");
+			else
+				SendRstStream(session, sid, H2_STREAM_CLOSED);
+			return;
+		}
+
+		if (len + pad)
+			SendWindowUpdate(session, sid, len + pad + ((flags & H2_FLAG_PADDED) ? 1 : 0));
+
+		s->reqbodylength += len;
+		if (s->reqbodylength <= (unsigned long)ServerInstance->VHosts->LargestPostBody)
+			s->reqbody.append((const char *)p, len);
+		else
+			s->reqbody.clear();
+
+		if (flags & H2_FLAG_END_STREAM)
+		{
+			s->reqdone = true;
+			StartStream(s);
+		}
+	}
+
+	/** Read the priority fields of a HEADERS or PRIORITY frame
+	 */
+	void ReadPriority(Http2Session *session, const unsigned char *p)
+	{
+		session->pendingparent = ReadUInt32(p) & 0x7fffffff;
+		session->pendingweight = p[4] + 1;
+	}
+
+	void OnHeaders(Http2Session *session, unsigned int sid, unsigned char flags, const unsigned char *p, size_t len)
+	{
+		if (!sid || !(sid & 1))
+		{
+			Fatal(session, H2_PROTOCOL_ERROR, "HEADERS on invalid stream");
+			return;
+		}
+
+		size_t pad = 0;
+		if (flags & H2_FLAG_PADDED)
+		{
+			if (!len)
+			{
+				Fatal(session, H2_PROTOCOL_ERROR, "bad padding");
+				return;
+			}
+			pad = p[0];
+			p++;
+			len--;
+		}
+
+		session->pendingparent = sid;
+		session->pendingweight = 16;
+		if (flags & H2_FLAG_PRIORITY)
+		{
+			if (len < 5)
+			{
+				Fatal(session, H2_FRAME_SIZE_ERROR, "short HEADERS");
+				return;
+			}
+			ReadPriority(session, p);
+			p += 5;
+			len -= 5;
+		}
+
+		if (pad > len)
+		{
+			Fatal(session, H2_PROTOCOL_ERROR, "bad padding");
+			return;
+		}
+
+		session->headerblock.assign((const char *)p, len - pad);
+
+		if (flags & H2_FLAG_END_HEADERS)
+			HeadersComplete(session, sid, flags);
+		else
+		{
+			session->continuation = sid;
+			session->continuationflags = flags;
+		}
+	}
+
+	void OnContinuation(Http2Session *session, unsigned int sid, unsigned char flags, const unsigned char *p, size_t len)
+	{
+		if (!session->continuation || (sid != session->continuation))
+		{
+			Fatal(session, H2_PROTOCOL_ERROR, "unexpected CONTINUATION");
+			return;
+		}
+
+		session->headerblock.append((const char *)p, len);
+		if (session->headerblock.length() > H2_MAX_HEADERS)
+		{
+			Fatal(session, H2_ENHANCE_YOUR_CALM, "header block too large");
+			return;
+		}
+
+		if (flags & H2_FLAG_END_HEADERS)
+			HeadersComplete(session, sid, session->continuationflags);
+	}
+
+	void OnPriority(Http2Session *session, unsigned int sid, const unsigned char *p, size_t len)
+	{
+		if (!sid)
+		{
+			Fatal(session, H2_PROTOCOL_ERROR, "PRIORITY on stream 0");
+			return;
+		}
+		if (len != 5)
+		{
+			SendRstStream(session, sid, H2_FRAME_SIZE_ERROR);
+			return;
+		}
+
+		Http2Stream *s = GetStream(session, sid);
+		if (!s)
+			return;
+
+		unsigned int parent = ReadUInt32(p) & 0x7fffffff;
+		if (parent == sid)
+		{
+			ResetStream(s, H2_PROTOCOL_ERROR);
+			return;
+		}
+
+		s->parent = parent;
+		s->weight = p[4] + 1;
+	}
+
+	void OnSettings(Http2Session *session, unsigned int sid, unsigned char flags, const unsigned char *p, size_t len)
+	{
+		if (sid)
+		{
+			Fatal(session, H2_PROTOCOL_ERROR, "SETTINGS on a stream");
+			return;
+		}
+
+		if (flags & H2_FLAG_ACK)
+		{
+			if (len)
+				Fatal(session, H2_FRAME_SIZE_ERROR, "SETTINGS ACK with payload");
+			return;
+		}
+
+		if (len % 6)
+		{
+			Fatal(session, H2_FRAME_SIZE_ERROR, "bad SETTINGS length");
+			return;
+		}
+
+		for (size_t i = 0; i < len; i += 6)
+		{
+			unsigned int id = (p[i] << 8) | p[i + 1];
+			unsigned int value = ReadUInt32(p + i + 2);
+
+			if (id == H2_SETTINGS_INITIAL_WINDOW_SIZE)
+			{
+				if (value > H2_MAX_WINDOW)
+				{
+					Fatal(session, H2_FLOW_CONTROL_ERROR, "window too large");
+					return;
+				}
+
+				/* Applies to every stream, including those already open */
+				long delta = (long)value - session->peerwindow;
+				session->peerwindow = value;
+				for (std::map<unsigned int, Http2Stream *>::iterator s = session->streams.begin(); s != session->streams.end(); s++)
+					s->second->sendwindow += delta;
+			}
+			else if (id == H2_SETTINGS_MAX_FRAME_SIZE)
+			{
+				if ((value < 16384) || (value > 16777215))
+				{
+					Fatal(session, H2_PROTOCOL_ERROR, "bad frame size");
+					return;
+				}
+				session->peermaxframe = value;
+			}
+			else if ((id == H2_SETTINGS_ENABLE_PUSH) && (value > 1))
+			{
+				Fatal(session, H2_PROTOCOL_ERROR, "bad ENABLE_PUSH");
+				return;
+			}
+			/* We don't push, and never index anything in the client's table, so the
+			 * other settings don't concern us */
+		}
+
+		SendFrame(session, H2_SETTINGS, H2_FLAG_ACK, 0, "");
+	}
+
+	void OnWindowUpdate(Http2Session *session, unsigned int sid, const unsigned char *p, size_t len)
+	{
+		if (len != 4)
+		{
+			Fatal(session, H2_FRAME_SIZE_ERROR, "bad WINDOW_UPDATE length");
+			return;
+		}
+
+		long increment = ReadUInt32(p) & 0x7fffffff;
+
+		if (!sid)
+		{
+			if (!increment || (session->sendwindow + increment > H2_MAX_WINDOW))
+			{
+				Fatal(session, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR, "bad connection WINDOW_UPDATE");
+				return;
+			}
+			session->sendwindow += increment;
+			return;
+		}
+
+		Http2Stream *s = GetStream(session, sid);
+		if (!s)
+			return;
+
+		if (!increment || (s->sendwindow + increment > H2_MAX_WINDOW))
+		{
+			ResetStream(s, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+			return;
+		}
+		s->sendwindow += increment;
+	}
+
+	/** Handle one frame from the client
+	 */
+	void OnFrame(Http2Session *session, unsigned char type, unsigned char flags, unsigned int sid, const unsigned char *p, size_t len)
+	{
+		if (session->continuation && (type != H2_CONTINUATION))
+		{
+			Fatal(session, H2_PROTOCOL_ERROR, "header block interrupted");
+			return;
+		}
+
+		switch (type)
+		{
+			case H2_DATA:
+				OnData(session, sid, flags, p, len);
+			break;
+			case H2_HEADERS:
+				OnHeaders(session, sid, flags, p, len);
+			break;
+			case H2_PRIORITY:
+				OnPriority(session, sid, p, len);
+			break;
+			case H2_RST_STREAM:
+				if (!sid || (len != 4))
+					Fatal(session, sid ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR, "bad RST_STREAM");
+				else if (GetStream(session, sid))
+					DestroyStream(GetStream(session, sid));
+			break;
+			case H2_SETTINGS:
+				OnSettings(session, sid, flags, p, len);
+			break;
+			case H2_PUSH_PROMISE:
+				Fatal(session, H2_PROTOCOL_ERROR, "PUSH_PROMISE from client");
+			break;
+			case H2_PING:
+				if (sid || (len != 8))
+					Fatal(session, sid ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR, "bad PING");
+				else if (!(flags & H2_FLAG_ACK))
+					SendFrame(session, H2_PING, H2_FLAG_ACK, 0, std::string((const char *)p, len));
+			break;
+			case H2_GOAWAY:
+				session->goaway = true;
+				if (session->streams.empty())
+				{
+					session->closing = true;
+					ServerInstance->Connections->Delete(session->c);
+				}
+			break;
+			case H2_WINDOW_UPDATE:
+				OnWindowUpdate(session, sid, p, len);
+			break;
+			case H2_CONTINUATION:
+				OnContinuation(session, sid, flags, p, len);
+			break;
+			default:
+				/* Unknown frame types are ignored */
+			break;
+		}
+	}
+
+	void Process(Http2Session *session)
+	{
+		if (!session->preface)
+		{
+			/* The core consumed "PRI * HTTP/2.0\r\n\r\n"; the rest of the preface follows */
+			if (session->inbuf.length() < 6)
+				return;
+
+			if (session->inbuf.compare(0, 6, "SM\r\n\r\n") != 0)
+			{
+				Fatal(session, H2_PROTOCOL_ERROR, "bad connection preface");
+				return;
+			}
+
+			session->inbuf.erase(0, 6);
+			session->preface = true;
+		}
+
+		size_t pos = 0;
+		while (!session->closing && (session->inbuf.length() - pos >= H2_FRAME_HEADER))
+		{
+			const unsigned char *h = (const unsigned char *)session->inbuf.data() + pos;
+			size_t len = (h[0] << 16) | (h[1] << 8) | h[2];
+
+			if (len > H2_MAX_FRAME)
+			{
+				Fatal(session, H2_FRAME_SIZE_ERROR, "frame too large");
+				return;
+			}
+
+			if (session->inbuf.length() - pos < H2_FRAME_HEADER + len)
+				break;
+
+			OnFrame(session, h[3], h[4], ReadUInt32(h + 5) & 0x7fffffff, h + H2_FRAME_HEADER, len);
+			pos += H2_FRAME_HEADER + len;
+		}
+
+		if (session->closing)
+			return;
+
+		session->inbuf.erase(0, pos);
+		Pump(session);
+	}
+
+	void DestroySession(Http2Session *session)
+	{
+		while (!session->streams.empty())
+		{
+			Http2Stream *s = session->streams.begin()->second;
+			CloseSocket(s);
+			session->streams.erase(session->streams.begin());
+			delete s;
+		}
+
+		Sessions.erase(session->c);
+		delete session;
+	}
+
+ public:
+	ModuleHTTP2(InspIRCd *Srv) : Module(Srv)
+	{
+		BuildHuffmanTables();
+		ReadConfig();
+
+		HTTP2 = this;
+		ServerInstance->Modules->PublishFeature("HTTP/2", this);
+
+		Implementation eventlist[] = { I_OnUpgrade, I_OnUpgradedData, I_OnBufferFlushed, I_OnConnectionDisconnect };
+		ServerInstance->Modules->Attach(eventlist, this, 4);
+	}
+
+	virtual ~ModuleHTTP2()
+	{
+		while (!Sessions.empty())
+		{
+			Http2Session *session = Sessions.begin()->second;
+			ServerInstance->Connections->Delete(session->c);
+			DestroySession(session);
+		}
+
+		ServerInstance->Modules->UnpublishFeature("HTTP/2");
+		HTTP2 = NULL;
+	}
+
+	virtual Version GetVersion()
+	{
+		return Version(1, 0, 0, 0, VF_VENDOR, API_VERSION);
+	}
+
+	virtual int OnUpgrade(Connection *c, const std::string &protocol)
+	{
+		if (protocol != "h2")
+			return 0;
+
+		Http2Session *session = new Http2Session(c);
+		Sessions[c] = session;
+		session->inbuf.assign(c->requestbuf.Data(), c->requestbuf.Length());
+
+		LOG(DEBUG, LS_MODULE, "HTTP/2 connection on fd %d", c->GetFd());
+
+		/* Our SETTINGS must be the first frame we send */
+		std::string settings;
+		settings.push_back(0);
+		settings.push_back(H2_SETTINGS_MAX_CONCURRENT_STREAMS);
+		AppendUInt32(settings, maxstreams);
+		settings.push_back(0);
+		settings.push_back(H2_SETTINGS_MAX_HEADER_LIST_SIZE);
+		AppendUInt32(settings, H2_MAX_HEADERS);
+		SendFrame(session, H2_SETTINGS, 0, 0, settings);
+
+		Process(session);
+		return 1;
+	}
+
+	virtual void OnUpgradedData(Connection *c, const char *data, size_t len)
+	{
+		Http2Session *session = GetSession(c);
+		if (!session || session->closing)
+			return;
+
+		session->inbuf.append(data, len);
+		Process(session);
+	}
+
+	virtual void OnBufferFlushed(Connection *c)
+	{
+		Http2Session *session = GetSession(c);
+		if (session)
+			Pump(session);
+	}
+
+	virtual void OnConnectionDisconnect(Connection *c)
+	{
+		Http2Session *session = GetSession(c);
+		if (session)
+			DestroySession(session);
+	}
+
+	/** Handle events on our end of a stream's socketpair
+	 */
+	void StreamEvent(Http2Stream *s, EventType et)
+	{
+		/* WARNING: May delete the stream! */
+		Http2Session *session = s->session;
+
+		if (session->closing)
+			return;
+
+		if (et == EVENT_WRITE)
+		{
+			WriteRequest(s);
+			return;
+		}
+
+		static char buffer[65536];
+		int n;
+
+		/* On EVENT_ERROR (the server closed its end), whatever it wrote may still be waiting */
+		while ((n = recv(s->GetFd(), buffer, sizeof(buffer), 0)) > 0)
+		{
+			const char *data = buffer;
+			size_t len = n;
+
+			if (!s->headdone)
+			{
+				size_t had = s->head.length();
+				s->head.append(data, len);
+
+				std::string::size_type end = s->head.find("\r\n\r\n", had >= 3 ? had - 3 : 0);
+				if (end == std::string::npos)
+				{
+					if (s->head.length() > H2_MAX_HEADERS)
+					{
+						ResetStream(s, H2_INTERNAL_ERROR);
+						Pump(session);
+						return;
+					}
+					continue;
+				}
+
+				/* Whatever follows the head is body */
+				size_t used = end + 4 - had;
+				data += used;
+				len -= used;
+				s->head.erase(end + 4);
+
+				if (!ParseHead(s))
+				{
+					ResetStream(s, H2_INTERNAL_ERROR);
+					Pump(session);
+					return;
+				}
+
+				/* END_STREAM went with the headers, so there is nothing left to send */
+				if (s->bodytype == H2_BODY_NONE)
+				{
+					DestroyStream(s);
+					Pump(session);
+					return;
+				}
+			}
+
+			if (!ParseBody(s, data, len))
+			{
+				ResetStream(s, H2_INTERNAL_ERROR);
+				Pump(session);
+				return;
+			}
+
+			if (s->closed)
+				break;
+
+			if (s->out.length() >= H2_STREAM_BUFFER)
+			{
+				ServerInstance->SE->DelFd(s);
+				s->paused = true;
+				break;
+			}
+		}
+
+		if (!s->closed && !s->paused && ((n == 0) || ((n < 0) && (errno != EAGAIN))))
+		{
+			/* The server closed the connection. That ends a response without a length;
+			 * otherwise it was cut short. */
+			if (!s->headdone || ((s->bodytype != H2_BODY_CLOSE) && !s->outdone))
+			{
+				ResetStream(s, H2_INTERNAL_ERROR);
+				Pump(session);
+				return;
+			}
+
+			s->outdone = true;
+			CloseSocket(s);
+		}
+
+		Pump(session);
+	}
+};
+
+void Http2Stream::HandleEvent(EventType et, int)
+{
+	/* WARNING: May delete this stream! */
+	if (HTTP2)
+		HTTP2->StreamEvent(this, et);
+}
+
+MODULE_INIT(ModuleHTTP2)
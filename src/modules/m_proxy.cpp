@@ -0,0 +1,1231 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+#include "inspircd.h"
+
+/* $ModDesc: Provides reverse proxying of requests to pools of upstream HTTP servers */
+
+/** Once this much response data is waiting in a client's write buffer, reading from
+ * the upstream is paused until the client catches up.
+ */
+#define PROXY_MAX_BUFFERED 262144
+
+class UpstreamGroup;
+class UpstreamSocket;
+class ProxyRequest;
+class ModuleProxy;
+
+static ModuleProxy *Proxy = NULL;
+
+/** How upstream servers in a group are chosen
+ */
+enum BalanceType
+{
+	BALANCE_ROUNDROBIN,
+	BALANCE_LEASTCONN
+};
+
+/** A single backend server belonging to an upstream group
+ */
+class UpstreamServer : public classbase
+{
+ public:
+	UpstreamGroup *group;
+	std::string address;
+	int port;
+	sockaddr_storage addr;
+	socklen_t addrlen;
+
+	/** Number of requests currently being served by this server */
+	int active;
+	/** Consecutive failures since the last success */
+	int fails;
+	/** This server is not used until this time, after too many failures */
+	time_t ejected_until;
+	/** Connections kept alive for reuse, most recently used at the back */
+	std::deque<UpstreamSocket *> idle;
+
+	UpstreamServer(UpstreamGroup *g) : group(g), port(0), addrlen(0), active(0), fails(0), ejected_until(0)
+	{
+		memset(&addr, 0, sizeof(addr));
+	}
+};
+
+/** A named group of upstream servers, referenced by proxy blocks
+ */
+class UpstreamGroup : public classbase
+{
+ public:
+	std::string name;
+	BalanceType balance;
+	/** Maximum number of idle keepalive connections per server */
+	unsigned int keepalive;
+	/** Seconds an idle keepalive connection is kept open */
+	int keepalive_timeout;
+	/** Consecutive failures before a server is ejected */
+	int max_fails;
+	/** Seconds an ejected server is left out of rotation */
+	int fail_timeout;
+	/** Seconds without upstream activity before a request is abandoned */
+	int timeout;
+	/** Host header to send upstream, or empty to pass the client's */
+	std::string host;
+	std::vector<UpstreamServer *> servers;
+	unsigned int next;
+
+	UpstreamGroup() : balance(BALANCE_ROUNDROBIN), keepalive(8), keepalive_timeout(15), max_fails(3), fail_timeout(10), timeout(30), next(0)
+	{
+	}
+
+	~UpstreamGroup()
+	{
+		for (std::vector<UpstreamServer *>::iterator i = servers.begin(); i != servers.end(); i++)
+			delete *i;
+	}
+
+	/** Choose a server for a new request, skipping ejected servers and the one given.
+	 * @return A server, or NULL if every server is ejected
+	 */
+	UpstreamServer *Pick(time_t now, UpstreamServer *avoid)
+	{
+		UpstreamServer *best = NULL;
+		size_t n = servers.size();
+
+		for (size_t i = 0; i < n; i++)
+		{
+			UpstreamServer *s = servers[(next + i) % n];
+
+			if ((s->ejected_until > now) || ((s == avoid) && (n > 1)))
+				continue;
+
+			if (balance == BALANCE_ROUNDROBIN)
+			{
+				best = s;
+				break;
+			}
+
+			if (!best || (s->active < best->active))
+				best = s;
+		}
+
+		if (n)
+			next = (next + 1) % n;
+
+		return best;
+	}
+};
+
+/** A path prefix which is forwarded to an upstream group
+ */
+struct ProxyRoute
+{
+	std::string path;
+	UpstreamGroup *group;
+	bool strip;
+};
+
+/** States of a connection to an upstream server
+ */
+enum UpstreamState
+{
+	UPSTREAM_CONNECTING,
+	UPSTREAM_ACTIVE,
+	UPSTREAM_IDLE
+};
+
+/** How the end of an upstream response body is found
+ */
+enum BodyMode
+{
+	BODY_NONE,
+	BODY_LENGTH,
+	BODY_CHUNKED,
+	BODY_CLOSE
+};
+
+/** States of the chunked transfer-coding parser
+ */
+enum ChunkState
+{
+	CHUNK_SIZE,
+	CHUNK_DATA,
+	CHUNK_DATA_END,
+	CHUNK_TRAILER,
+	CHUNK_DONE
+};
+
+/** A connection to an upstream server. It is either serving a request, or
+ * sitting in its server's idle pool waiting to be reused.
+ */
+class CoreExport UpstreamSocket : public EventHandler
+{
+ public:
+	InspIRCd *ServerInstance;
+	UpstreamServer *server;
+	UpstreamState state;
+	ProxyRequest *req;
+	/** True if this connection has already completed a request */
+	bool reused;
+	/** Last time anything happened on this connection */
+	time_t last;
+
+	UpstreamSocket(InspIRCd *Instance, UpstreamServer *s) : ServerInstance(Instance), server(s), state(UPSTREAM_CONNECTING), req(NULL), reused(false)
+	{
+		last = ServerInstance->Time();
+		this->SetFd(-1);
+	}
+
+	/** Begin a nonblocking connect to the server
+	 * @return False if the connect failed immediately
+	 */
+	bool Connect()
+	{
+		int sfd = socket(server->addr.ss_family, SOCK_STREAM, 0);
+		if (sfd < 0)
+			return false;
+
+		this->SetFd(sfd);
+		ServerInstance->SE->NonBlocking(sfd);
+
+		if ((ServerInstance->SE->Connect(this, (sockaddr *)&server->addr, server->addrlen) < 0) && (errno != EINPROGRESS))
+		{
+			LOG(DEBUG, LS_MODULE, "Proxy: connect to %s:%d failed: %s", server->address.c_str(), server->port, strerror(errno));
+			ServerInstance->SE->Close(sfd);
+			this->SetFd(-1);
+			return false;
+		}
+
+		if (!ServerInstance->SE->AddFd(this))
+		{
+			ServerInstance->SE->Close(sfd);
+			this->SetFd(-1);
+			return false;
+		}
+
+		/* The first write event tells us the connect finished */
+		ServerInstance->SE->WantWrite(this);
+		return true;
+	}
+
+	/** Remove from the socket engine and close the socket
+	 */
+	void Close()
+	{
+		if (GetFd() > -1)
+		{
+			ServerInstance->SE->DelFd(this);
+			ServerInstance->SE->Shutdown(this, 2);
+			ServerInstance->SE->Close(this);
+			this->SetFd(-1);
+		}
+	}
+
+	virtual void HandleEvent(EventType et, int errornum = 0);
+
+	virtual ~UpstreamSocket()
+	{
+		this->Close();
+	}
+};
+
+/** Stops clients waiting on an upstream being timed out as idle by the core; the
+ * upstream timeout is what ends requests which take too long
+ */
+class ProxyIdleTimer : public Timer
+{
+ public:
+	ProxyIdleTimer(InspIRCd *Instance) : Timer(1, Instance->Time(), true)
+	{
+	}
+
+	virtual void Tick(time_t now);
+};
+
+/** A client request which is being forwarded to an upstream server
+ */
+class ProxyRequest : public classbase
+{
+ public:
+	Connection *c;
+	UpstreamGroup *group;
+	UpstreamSocket *sock;
+	/** The complete request to send upstream, kept for retries */
+	std::string request;
+	/** How much of request has been sent on the current socket */
+	std::string::size_type sent;
+	/** Response bytes received before the end of the response headers */
+	std::string head;
+	/** True once the response headers have been written to the client */
+	bool headers_sent;
+	/** True if any response bytes have arrived on the current socket */
+	bool got_data;
+	/** True if reading from upstream is paused for a slow client */
+	bool paused;
+	/** True if the upstream connection may be reused when this response ends */
+	bool reusable;
+	/** True if this is a HEAD request (the response has no body) */
+	bool head_request;
+	/** Number of times the request has been attempted */
+	int tries;
+
+	BodyMode mode;
+	/** Bytes of body still expected with BODY_LENGTH */
+	unsigned long remaining;
+	/** True if the client receives the upstream chunked coding untouched */
+	bool passthrough_chunks;
+	/** True if the client receives a close-delimited upstream body as chunks */
+	bool encode_chunks;
+
+	ChunkState chunkstate;
+	unsigned long chunkleft;
+	std::string chunkline;
+
+	ProxyRequest(Connection *conn, UpstreamGroup *g) : c(conn), group(g), sock(NULL), sent(0), headers_sent(false), got_data(false),
+		paused(false), reusable(true), head_request(false), tries(0), mode(BODY_NONE), remaining(0),
+		passthrough_chunks(false), encode_chunks(false), chunkstate(CHUNK_SIZE), chunkleft(0)
+	{
+	}
+};
+
+class ModuleProxy : public Module
+{
+ private:
+	std::map<std::string, UpstreamGroup *> Groups;
+	std::vector<ProxyRoute> Routes;
+	std::map<Connection *, ProxyRequest *> Requests;
+	ProxyIdleTimer *idletimer;
+
+	/** Parse an "address:port" or "[v6address]:port" server definition
+	 */
+	bool ParseServer(UpstreamServer *s, const std::string &def)
+	{
+		std::string::size_type colon = def.rfind(':');
+		if ((colon == std::string::npos) || (colon == 0) || (colon == def.length() - 1))
+			return false;
+
+		s->address = def.substr(0, colon);
+		s->port = atoi(def.substr(colon + 1).c_str());
+
+		if ((s->address[0] == '[') && (s->address[s->address.length() - 1] == ']'))
+			s->address = s->address.substr(1, s->address.length() - 2);
+
+		if ((s->port < 1) || (s->port > 65535))
+			return false;
+
+		memset(&s->addr, 0, sizeof(s->addr));
+		if (s->address.find(':') != std::string::npos)
+		{
+			sockaddr_in6 *sin6 = (sockaddr_in6 *)&s->addr;
+			if (inet_pton(AF_INET6, s->address.c_str(), &sin6->sin6_addr) < 1)
+				return false;
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_port = htons(s->port);
+			s->addrlen = sizeof(sockaddr_in6);
+		}
+		else
+		{
+			sockaddr_in *sin = (sockaddr_in *)&s->addr;
+			if (inet_pton(AF_INET, s->address.c_str(), &sin->sin_addr) < 1)
+				return false;
+			sin->sin_family = AF_INET;
+			sin->sin_port = htons(s->port);
+			s->addrlen = sizeof(sockaddr_in);
+		}
+
+		return true;
+	}
+
+	void ReadConfig()
+	{
+		ConfigReader Conf(ServerInstance);
+
+		for (int i = 0; i < Conf.Enumerate("upstream"); i++)
+		{
+			UpstreamGroup *g = new UpstreamGroup;
+			g->name = Conf.ReadValue("upstream", "name", i);
+			g->balance = (Conf.ReadValue("upstream", "balance", "roundrobin", i) == "leastconn") ? BALANCE_LEASTCONN : BALANCE_ROUNDROBIN;
+			g->keepalive = Conf.ReadInteger("upstream", "keepalive", "8", i, true);
+			g->keepalive_timeout = Conf.ReadInteger("upstream", "keepalive-timeout", "15", i, true);
+			g->max_fails = Conf.ReadInteger("upstream", "max-fails", "3", i, true);
+			g->fail_timeout = Conf.ReadInteger("upstream", "fail-timeout", "10", i, true);
+			g->timeout = Conf.ReadInteger("upstream", "timeout", "30", i, true);
+			g->host = Conf.ReadValue("upstream", "host", i);
+
+			if (g->name.empty() || Groups.find(g->name) != Groups.end())
+			{
+				delete g;
+				throw ModuleException("<upstream> blocks must have a unique name");
+			}
+
+			utils::spacesepstream servers(Conf.ReadValue("upstream", "servers", i));
+			std::string def;
+			while (servers.GetToken(def))
+			{
+				UpstreamServer *s = new UpstreamServer(g);
+				if (!ParseServer(s, def))
+				{
+					delete s;
+					delete g;
+					throw ModuleException("Invalid upstream server '" + def + "' (expected address:port)");
+				}
+				g->servers.push_back(s);
+			}
+
+			if (g->servers.empty())
+			{
+				delete g;
+				throw ModuleException("<upstream> block '" + g->name + "' has no servers");
+			}
+
+			Groups[g->name] = g;
+		}
+
+		for (int i = 0; i < Conf.Enumerate("proxy"); i++)
+		{
+			ProxyRoute r;
+			r.path = Conf.ReadValue("proxy", "path", i);
+			std::map<std::string, UpstreamGroup *>::iterator g = Groups.find(Conf.ReadValue("proxy", "upstream", i));
+			if (r.path.empty() || (r.path[0] != '/') || (g == Groups.end()))
+				throw ModuleException("<proxy> blocks need a path beginning with / and the name of an <upstream>");
+
+			r.group = g->second;
+			r.strip = Conf.ReadFlag("proxy", "strip-path", "no", i);
+			Routes.push_back(r);
+		}
+	}
+
+	/** Find the most specific route for a URI
+	 */
+	ProxyRoute *FindRoute(const std::string &uri)
+	{
+		ProxyRoute *best = NULL;
+
+		for (std::vector<ProxyRoute>::iterator i = Routes.begin(); i != Routes.end(); i++)
+		{
+			/* /api covers /api and /api/..., but not /apifoo */
+			const std::string &path = i->path;
+			if (uri.compare(0, path.length(), path) || ((path[path.length() - 1] != '/') && (uri.length() > path.length()) && (uri[path.length()] != '/')))
+				continue;
+
+			if (!best || (i->path.length() > best->path.length()))
+				best = &(*i);
+		}
+
+		return best;
+	}
+
+	static bool IsHopByHop(const char *name, size_t len)
+	{
+		static const char *hop[] = { "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate", "Proxy-Authorization",
+			"TE", "Trailer", "Transfer-Encoding", "Upgrade", "Content-Length", NULL };
+
+		for (int i = 0; hop[i]; i++)
+		{
+			if ((strlen(hop[i]) == len) && !strncasecmp(hop[i], name, len))
+				return true;
+		}
+		return false;
+	}
+
+	/** Build the request which is sent upstream
+	 */
+	void BuildRequest(ProxyRequest *pr, const ProxyRoute *route)
+	{
+		Connection *c = pr->c;
+		HTTPHeaders h = c->GetRequestHeaders();
+
+		/* The URI has been decoded and cleaned up, so it is encoded again to go upstream */
+		std::string path = c->uri;
+		if (route->strip)
+		{
+			path.erase(0, route->path.length());
+			if (path.empty() || (path[0] != '/'))
+				path.insert(0, "/");
+		}
+		path = utils::urlencodepath(path);
+		if (!c->uriquery.empty())
+			path += "?" + c->uriquery;
+
+		h.RemoveHeader("Connection");
+		h.RemoveHeader("Keep-Alive");
+		h.RemoveHeader("Proxy-Connection");
+		h.RemoveHeader("Proxy-Authorization");
+		h.RemoveHeader("TE");
+		h.RemoveHeader("Trailer");
+		h.RemoveHeader("Transfer-Encoding");
+		h.RemoveHeader("Upgrade");
+		h.RemoveHeader("Content-Length");
+
+		if (!pr->group->host.empty())
+			h.SetHeader("Host", pr->group->host);
+
+		std::string xff = h.GetHeader("X-Forwarded-For");
+		h.SetHeader("X-Forwarded-For", xff.empty() ? c->GetIP() : xff + ", " + c->GetIP());
+		h.SetHeader("Connection", "keep-alive");
+		if (c->RequestBodyLength)
+			h.SetHeader("Content-Length", ConvToStr(c->RequestBody.length()));
+
+		pr->request = c->method + " " + path + " HTTP/1.1\r\n" + h.GetFormattedHeaders() + "\r\n" + c->RequestBody;
+		pr->head_request = (c->method == "HEAD");
+	}
+
+	/** Take an idle connection to a server from its pool, or open a new one
+	 */
+	UpstreamSocket *GetSocket(UpstreamServer *s)
+	{
+		while (!s->idle.empty())
+		{
+			UpstreamSocket *us = s->idle.back();
+			s->idle.pop_back();
+
+			if (us->last + s->group->keepalive_timeout > ServerInstance->Time())
+			{
+				LOG(DEBUG, LS_MODULE, "Proxy: reusing keepalive connection %d to %s:%d", us->GetFd(), s->address.c_str(), s->port);
+				us->state = UPSTREAM_ACTIVE;
+				return us;
+			}
+
+			delete us;
+		}
+
+		UpstreamSocket *us = new UpstreamSocket(ServerInstance, s);
+		if (!us->Connect())
+		{
+			delete us;
+			return NULL;
+		}
+
+		return us;
+	}
+
+	/** Attach the request to an upstream connection and start sending it
+	 * @return False if no upstream server could be used
+	 */
+	bool Dispatch(ProxyRequest *pr, UpstreamServer *avoid)
+	{
+		while (pr->tries < 2)
+		{
+			pr->tries++;
+
+			UpstreamServer *s = pr->group->Pick(ServerInstance->Time(), avoid);
+			if (!s)
+				return false;
+
+			UpstreamSocket *us = GetSocket(s);
+			if (!us)
+			{
+				Failed(s);
+				avoid = s;
+				continue;
+			}
+
+			s->active++;
+			us->req = pr;
+			pr->sock = us;
+			pr->sent = 0;
+			pr->got_data = false;
+			pr->head.clear();
+
+			if (us->state == UPSTREAM_ACTIVE)
+				ServerInstance->SE->WantWrite(us);
+
+			return true;
+		}
+
+		return false;
+	}
+
+	/** Record a failure of a server, ejecting it if it fails too often
+	 */
+	void Failed(UpstreamServer *s)
+	{
+		if (++s->fails >= s->group->max_fails)
+		{
+			ServerInstance->Log(DEFAULT, "Proxy: upstream %s:%d failed %d times, ejecting for %d seconds", s->address.c_str(), s->port, s->fails, s->group->fail_timeout);
+			s->ejected_until = ServerInstance->Time() + s->group->fail_timeout;
+			s->fails = 0;
+		}
+	}
+
+	/** Detach the socket from a request. The socket is pooled if it can be reused, otherwise closed.
+	 */
+	void ReleaseSocket(ProxyRequest *pr, bool keep)
+	{
+		UpstreamSocket *us = pr->sock;
+		if (!us)
+			return;
+
+		pr->sock = NULL;
+		us->req = NULL;
+		us->server->active--;
+
+		if (pr->paused)
+		{
+			/* Paused sockets are out of the socket engine; put it back so we notice it closing */
+			pr->paused = false;
+			if (keep && !ServerInstance->SE->AddFd(us))
+				keep = false;
+		}
+
+		if (keep && (us->server->idle.size() < us->server->group->keepalive))
+		{
+			us->state = UPSTREAM_IDLE;
+			us->reused = true;
+			us->last = ServerInstance->Time();
+			us->server->idle.push_back(us);
+		}
+		else
+		{
+			delete us;
+		}
+	}
+
+	/** Remove a request from our list and free it
+	 */
+	void Finish(ProxyRequest *pr, bool keep)
+	{
+		ReleaseSocket(pr, keep);
+		Requests.erase(pr->c);
+		delete pr;
+	}
+
+	/** Send output for a request to the client, writing directly to the socket when nothing is queued
+	 */
+	void Emit(Connection *c, const char *data, size_t len)
+	{
+		if (!len)
+			return;
+
+		if (c->sendq.empty())
+		{
+			int n = c->SendRaw(data, len);
+			if (n > 0)
+			{
+				/* Bypassed AddWriteBuf, so count it here as that would have */
+				if (!c->ResponseBytes)
+					gettimeofday(&c->ResponseStart, NULL);
+				c->ResponseBytes += n;
+				data += n;
+				len -= n;
+			}
+			else if ((n < 0) && (errno != EAGAIN))
+			{
+				ServerInstance->Connections->Delete(c);
+				return;
+			}
+		}
+
+		if (len)
+			c->Write(std::string(data, len));
+	}
+
+	/** Emit data to the client as a single chunk
+	 */
+	void EmitChunk(Connection *c, const char *data, size_t len)
+	{
+		char sz[32];
+		snprintf(sz, sizeof(sz), "%lx\r\n", (unsigned long)len);
+		c->Write(std::string(sz) + std::string(data, len) + "\r\n");
+	}
+
+	/** Parse the response headers from upstream and send our response headers to the client
+	 * @return -1 on a malformed response, 0 if more data is needed, otherwise the number of header bytes consumed
+	 */
+	int ParseHead(ProxyRequest *pr)
+	{
+		std::string::size_type end = pr->head.find("\r\n\r\n");
+		if (end == std::string::npos)
+			return (pr->head.length() > 65536) ? -1 : 0;
+
+		std::string::size_type eol = pr->head.find("\r\n");
+		std::string status(pr->head, 0, eol);
+
+		/* HTTP/1.x NNN Text */
+		if ((status.length() < 12) || (status.compare(0, 7, "HTTP/1.") != 0) || (status[8] != ' '))
+			return -1;
+
+		int code = atoi(status.c_str() + 9);
+		std::string text = (status.length() > 13) ? status.substr(13) : "";
+		bool upstream10 = (status[7] == '0');
+
+		if ((code >= 100) && (code < 200))
+		{
+			/* Interim response; drop it and look for the real one */
+			pr->head.erase(0, end + 4);
+			return ParseHead(pr);
+		}
+
+		Connection *c = pr->c;
+		std::string out;
+		bool chunked = false, have_length = false, upstream_close = upstream10, upstream_keepalive = false;
+		unsigned long length = 0;
+
+		for (std::string::size_type pos = eol + 2; pos < end; )
+		{
+			std::string::size_type next = pr->head.find("\r\n", pos);
+			const char *line = pr->head.data() + pos;
+			size_t linelen = next - pos;
+			pos = next + 2;
+
+			const char *colon = (const char *)memchr(line, ':', linelen);
+			if (!colon || (colon == line))
+				return -1;
+
+			size_t namelen = colon - line;
+			std::string value(colon + 1, line + linelen);
+			value.erase(0, value.find_first_not_of(" \t"));
+
+			if ((namelen == 17) && !strncasecmp(line, "Transfer-Encoding", 17))
+				chunked = (strcasestr(value.c_str(), "chunked") != NULL);
+			else if ((namelen == 14) && !strncasecmp(line, "Content-Length", 14))
+			{
+				have_length = true;
+				length = strtoul(value.c_str(), NULL, 10);
+			}
+			else if ((namelen == 10) && !strncasecmp(line, "Connection", 10))
+			{
+				if (strcasestr(value.c_str(), "close"))
+					upstream_close = true;
+				else if (strcasestr(value.c_str(), "keep-alive"))
+					upstream_keepalive = true;
+			}
+
+			if (!IsHopByHop(line, namelen))
+				out.append(line, linelen).append("\r\n");
+		}
+
+		if (upstream_close && !(upstream10 && upstream_keepalive))
+			pr->reusable = false;
+
+		if (pr->head_request || (code == 204) || (code == 304))
+		{
+			pr->mode = BODY_NONE;
+			if (have_length && pr->head_request)
+				out += "Content-Length: " + ConvToStr(length) + "\r\n";
+		}
+		else if (chunked)
+		{
+			pr->mode = BODY_CHUNKED;
+			pr->chunkstate = CHUNK_SIZE;
+			if (c->http_version == Connection::HTTP_1_1)
+			{
+				pr->passthrough_chunks = true;
+				out += "Transfer-Encoding: chunked\r\n";
+			}
+			else
+				c->keepalive = false;
+		}
+		else if (have_length)
+		{
+			pr->mode = BODY_LENGTH;
+			pr->remaining = length;
+			out += "Content-Length: " + ConvToStr(length) + "\r\n";
+		}
+		else
+		{
+			pr->mode = BODY_CLOSE;
+			pr->reusable = false;
+			if (c->http_version == Connection::HTTP_1_1)
+			{
+				pr->encode_chunks = true;
+				out += "Transfer-Encoding: chunked\r\n";
+			}
+			else
+				c->keepalive = false;
+		}
+
+		out += c->keepalive ? "Connection: Keep-Alive\r\n" : "Connection: Close\r\n";
+
+		c->Write(std::string((c->http_version == Connection::HTTP_1_0) ? "HTTP/1.0 " : "HTTP/1.1 ") + ConvToStr(code) + " " + text + "\r\n" + out + "\r\n");
+		c->ResponseCode = code;
+		c->State = HTTP_SEND_DATA;
+		pr->headers_sent = true;
+
+		/* A server answering with a 5xx is up, just unhappy; only connection level errors eject it */
+		pr->sock->server->fails = 0;
+
+		return end + 4;
+	}
+
+	/** Pass chunked body data to the client, either untouched or decoded
+	 * @return -1 on a malformed chunk, otherwise the number of bytes consumed
+	 */
+	int ConsumeChunked(ProxyRequest *pr, const char *data, size_t len)
+	{
+		size_t i = 0;
+
+		while ((i < len) && (pr->chunkstate != CHUNK_DONE))
+		{
+			switch (pr->chunkstate)
+			{
+				case CHUNK_SIZE:
+				case CHUNK_TRAILER:
+				{
+					const char *nl = (const char *)memchr(data + i, '\n', len - i);
+					size_t take = nl ? (nl - (data + i) + 1) : (len - i);
+					pr->chunkline.append(data + i, take);
+					if (pr->passthrough_chunks)
+						Emit(pr->c, data + i, take);
+					i += take;
+
+					if (pr->chunkline.length() > 4096)
+						return -1;
+					if (!nl)
+						break;
+
+					if (pr->chunkstate == CHUNK_SIZE)
+					{
+						char *endp;
+						pr->chunkleft = strtoul(pr->chunkline.c_str(), &endp, 16);
+						if (endp == pr->chunkline.c_str())
+							return -1;
+						pr->chunkstate = pr->chunkleft ? CHUNK_DATA : CHUNK_TRAILER;
+					}
+					else if ((pr->chunkline == "\r\n") || (pr->chunkline == "\n"))
+					{
+						pr->chunkstate = CHUNK_DONE;
+					}
+					pr->chunkline.clear();
+				}
+				break;
+				case CHUNK_DATA:
+				{
+					size_t take = std::min((unsigned long)(len - i), pr->chunkleft);
+					Emit(pr->c, data + i, take);
+					pr->chunkleft -= take;
+					i += take;
+					if (!pr->chunkleft)
+						pr->chunkstate = CHUNK_DATA_END;
+				}
+				break;
+				case CHUNK_DATA_END:
+				{
+					/* The CRLF after the chunk data; reuse the line reader to skip it */
+					if (pr->passthrough_chunks)
+						Emit(pr->c, data + i, 1);
+					if (data[i] == '\n')
+						pr->chunkstate = CHUNK_SIZE;
+					i++;
+				}
+				break;
+				case CHUNK_DONE:
+				break;
+			}
+		}
+
+		return i;
+	}
+
+	/** Handle response data arriving from upstream
+	 * @return False if the request was finished or abandoned
+	 */
+	bool Consume(ProxyRequest *pr, const char *data, size_t len)
+	{
+		Connection *c = pr->c;
+		pr->got_data = true;
+
+		if (!pr->headers_sent)
+		{
+			pr->head.append(data, len);
+			int used = ParseHead(pr);
+			if (used < 0)
+			{
+				LOG(DEBUG, LS_MODULE, "Proxy: malformed response from upstream %s:%d", pr->sock->server->address.c_str(), pr->sock->server->port);
+				Failed(pr->sock->server);
+				Abort(pr, 502, "Bad Gateway");
+				return false;
+			}
+			if (!used)
+				return true;
+
+			/* Whatever followed the headers is the start of the body */
+			std::string rest(pr->head, used);
+			pr->head.clear();
+			if (rest.empty() && (pr->mode != BODY_NONE) && !((pr->mode == BODY_LENGTH) && !pr->remaining))
+				return true;
+			return ConsumeBody(pr, rest.data(), rest.length());
+		}
+
+		return ConsumeBody(pr, data, len);
+	}
+
+	bool ConsumeBody(ProxyRequest *pr, const char *data, size_t len)
+	{
+		Connection *c = pr->c;
+		bool done = false;
+
+		switch (pr->mode)
+		{
+			case BODY_NONE:
+				/* Anything more is garbage, so don't reuse the connection */
+				if (len)
+					pr->reusable = false;
+				done = true;
+			break;
+			case BODY_LENGTH:
+			{
+				size_t take = std::min((unsigned long)len, pr->remaining);
+				Emit(c, data, take);
+				pr->remaining -= take;
+				if (take < len)
+					pr->reusable = false;
+				done = !pr->remaining;
+			}
+			break;
+			case BODY_CHUNKED:
+			{
+				int used = ConsumeChunked(pr, data, len);
+				if (used < 0)
+				{
+					Abort(pr, 502, "Bad Gateway");
+					return false;
+				}
+				if ((size_t)used < len)
+					pr->reusable = false;
+				done = (pr->chunkstate == CHUNK_DONE);
+			}
+			break;
+			case BODY_CLOSE:
+				if (pr->encode_chunks)
+				{
+					if (len)
+						EmitChunk(c, data, len);
+				}
+				else
+					Emit(c, data, len);
+			break;
+		}
+
+		if (c->quitting)
+			return false;
+
+		if (done)
+		{
+			Complete(pr);
+			return false;
+		}
+
+		if (c->sendq.length() > PROXY_MAX_BUFFERED)
+		{
+			LOG(DEBUG, LS_MODULE, "Proxy: client %d is slow, pausing upstream", c->GetFd());
+			ServerInstance->SE->DelFd(pr->sock);
+			pr->paused = true;
+		}
+
+		return true;
+	}
+
+	/** The response has been completely passed on to the client
+	 */
+	void Complete(ProxyRequest *pr)
+	{
+		Connection *c = pr->c;
+
+		if (pr->encode_chunks)
+			c->Write("0\r\n\r\n");
+
+		Finish(pr, pr->reusable);
+
+		/* May end the request and start on the next pipelined one */
+		c->ResponseBufferDone = true;
+		c->FlushWriteBuf();
+	}
+
+	/** Give up on a request, replying with an error if the client has had nothing yet
+	 */
+	void Abort(ProxyRequest *pr, int code, const char *text)
+	{
+		Connection *c = pr->c;
+		bool headers_sent = pr->headers_sent;
+
+		Finish(pr, false);
+
+		if (headers_sent)
+			ServerInstance->Connections->Delete(c);
+		else
+			c->SendError(code, text, false);
+	}
+
+ public:
+	ModuleProxy(InspIRCd *Srv) : Module(Srv), idletimer(NULL)
+	{
+		try
+		{
+			ReadConfig();
+		}
+		catch (ModuleException &e)
+		{
+			Cleanup();
+			throw;
+		}
+
+		Proxy = this;
+		idletimer = new ProxyIdleTimer(ServerInstance);
+		ServerInstance->Timers->AddTimer(idletimer);
+
+		Implementation eventlist[] = { I_OnPreRequest, I_OnBufferFlushed, I_OnConnectionDisconnect, I_OnBackgroundTimer };
+		ServerInstance->Modules->Attach(eventlist, this, 4);
+	}
+
+	void Cleanup()
+	{
+		while (!Requests.empty())
+			Finish(Requests.begin()->second, false);
+
+		for (std::map<std::string, UpstreamGroup *>::iterator g = Groups.begin(); g != Groups.end(); g++)
+		{
+			for (std::vector<UpstreamServer *>::iterator s = g->second->servers.begin(); s != g->second->servers.end(); s++)
+			{
+				while (!(*s)->idle.empty())
+				{
+					delete (*s)->idle.back();
+					(*s)->idle.pop_back();
+				}
+			}
+			delete g->second;
+		}
+
+		Groups.clear();
+		Routes.clear();
+	}
+
+	virtual ~ModuleProxy()
+	{
+		if (idletimer)
+			ServerInstance->Timers->DelTimer(idletimer);
+		Cleanup();
+		Proxy = NULL;
+	}
+
+	virtual Version GetVersion()
+	{
+		return Version(1, 0, 0, 0, VF_VENDOR, API_VERSION);
+	}
+
+	virtual int OnPreRequest(Connection *c, const std::string &method, const std::string &vhost, const std::string &dir, const std::string &file)
+	{
+		ProxyRoute *route = FindRoute(c->uri);
+		if (!route)
+			return 0;
+
+		ProxyRequest *pr = new ProxyRequest(c, route->group);
+		BuildRequest(pr, route);
+
+		if (!Dispatch(pr, NULL))
+		{
+			LOG(DEBUG, LS_MODULE, "Proxy: no usable upstream in group %s", route->group->name.c_str());
+			delete pr;
+			c->SendError(502, "Bad Gateway", false);
+			return 1;
+		}
+
+		/* Hold off any pipelined requests until this response is done */
+		c->State = HTTP_SEND_HEADERS;
+		c->LastSocketEvent = ServerInstance->Time();
+		Requests[c] = pr;
+		return 1;
+	}
+
+	virtual void OnBufferFlushed(Connection *c)
+	{
+		std::map<Connection *, ProxyRequest *>::iterator i = Requests.find(c);
+		if ((i == Requests.end()) || !i->second->paused)
+			return;
+
+		ProxyRequest *pr = i->second;
+		pr->paused = false;
+		if (!ServerInstance->SE->AddFd(pr->sock))
+			Abort(pr, 502, "Bad Gateway");
+	}
+
+	virtual void OnConnectionDisconnect(Connection *c)
+	{
+		std::map<Connection *, ProxyRequest *>::iterator i = Requests.find(c);
+		if (i != Requests.end())
+			Finish(i->second, false);
+	}
+
+	virtual void OnBackgroundTimer(time_t now)
+	{
+		std::vector<ProxyRequest *> expired;
+
+		for (std::map<Connection *, ProxyRequest *>::iterator i = Requests.begin(); i != Requests.end(); i++)
+		{
+			ProxyRequest *pr = i->second;
+			if (!pr->paused && pr->sock && (pr->sock->last + pr->group->timeout <= now))
+				expired.push_back(pr);
+		}
+
+		for (std::vector<ProxyRequest *>::iterator i = expired.begin(); i != expired.end(); i++)
+		{
+			LOG(DEBUG, LS_MODULE, "Proxy: upstream %s:%d timed out", (*i)->sock->server->address.c_str(), (*i)->sock->server->port);
+			if (!(*i)->got_data)
+				Failed((*i)->sock->server);
+			Abort(*i, 504, "Gateway Timeout");
+		}
+
+		/* Close pooled connections which have been idle too long */
+		for (std::map<std::string, UpstreamGroup *>::iterator g = Groups.begin(); g != Groups.end(); g++)
+		{
+			for (std::vector<UpstreamServer *>::iterator s = g->second->servers.begin(); s != g->second->servers.end(); s++)
+			{
+				std::deque<UpstreamSocket *> &idle = (*s)->idle;
+				while (!idle.empty() && (idle.front()->last + g->second->keepalive_timeout <= now))
+				{
+					delete idle.front();
+					idle.pop_front();
+				}
+			}
+		}
+	}
+
+	/** Keep clients whose upstream hasn't timed out from being culled as idle. Those
+	 * paused for a slow client are left to the core, as it is the client holding them up.
+	 */
+	void KeepAlive(time_t now)
+	{
+		for (std::map<Connection *, ProxyRequest *>::iterator i = Requests.begin(); i != Requests.end(); i++)
+		{
+			ProxyRequest *pr = i->second;
+			if (!pr->paused && pr->sock && (pr->sock->last + pr->group->timeout > now))
+				pr->c->LastSocketEvent = now;
+		}
+	}
+
+	/** An idle pooled connection became readable or errored: the server closed it
+	 */
+	void IdleEvent(UpstreamSocket *us)
+	{
+		std::deque<UpstreamSocket *> &idle = us->server->idle;
+		std::deque<UpstreamSocket *>::iterator i = std::find(idle.begin(), idle.end(), us);
+		if (i != idle.end())
+			idle.erase(i);
+
+		LOG(DEBUG, LS_MODULE, "Proxy: pooled connection %d to %s:%d closed", us->GetFd(), us->server->address.c_str(), us->server->port);
+		delete us;
+	}
+
+	/** The upstream connection of a request failed
+	 */
+	void SocketError(ProxyRequest *pr)
+	{
+		UpstreamSocket *us = pr->sock;
+		UpstreamServer *s = us->server;
+
+		if (pr->mode == BODY_CLOSE && pr->headers_sent)
+		{
+			/* End of a close-delimited body */
+			Complete(pr);
+			return;
+		}
+
+		if (!pr->got_data)
+		{
+			/* A pooled connection may have been closed by the server just as we reused it.
+			 * That's not the server's fault, and the request is safe to try again. */
+			bool stale = us->reused;
+			ReleaseSocket(pr, false);
+
+			if (!stale)
+				Failed(s);
+
+			if (stale)
+				pr->tries--;
+
+			if (Dispatch(pr, stale ? NULL : s))
+				return;
+
+			Abort(pr, 502, "Bad Gateway");
+			return;
+		}
+
+		Abort(pr, 502, "Bad Gateway");
+	}
+
+	void SocketEvent(UpstreamSocket *us, EventType et)
+	{
+		ProxyRequest *pr = us->req;
+		us->last = ServerInstance->Time();
+
+		if (!pr)
+		{
+			IdleEvent(us);
+			return;
+		}
+
+		/* The client is waiting on this, so it isn't idle */
+		pr->c->LastSocketEvent = us->last;
+
+		if (et == EVENT_ERROR)
+		{
+			SocketError(pr);
+			return;
+		}
+
+		if (et == EVENT_WRITE)
+		{
+			if (us->state == UPSTREAM_CONNECTING)
+			{
+				int err = 0;
+				socklen_t errlen = sizeof(err);
+				if ((getsockopt(us->GetFd(), SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) || err)
+				{
+					LOG(DEBUG, LS_MODULE, "Proxy: connect to %s:%d failed: %s", us->server->address.c_str(), us->server->port, strerror(err));
+					SocketError(pr);
+					return;
+				}
+				us->state = UPSTREAM_ACTIVE;
+			}
+
+			if (pr->sent < pr->request.length())
+			{
+				int n = ServerInstance->SE->Send(us, pr->request.data() + pr->sent, pr->request.length() - pr->sent, 0);
+				if ((n < 0) && (errno != EAGAIN))
+				{
+					SocketError(pr);
+					return;
+				}
+				if (n > 0)
+					pr->sent += n;
+				if (pr->sent < pr->request.length())
+					ServerInstance->SE->WantWrite(us);
+			}
+			return;
+		}
+
+		static char buffer[65536];
+		int n = ServerInstance->SE->Recv(us, buffer, sizeof(buffer), 0);
+
+		if (n > 0)
+		{
+			Consume(pr, buffer, n);
+		}
+		else if ((n == 0) || (errno != EAGAIN))
+		{
+			SocketError(pr);
+		}
+	}
+};
+
+void UpstreamSocket::HandleEvent(EventType et, int)
+{
+	/* WARNING: May delete this socket! */
+	if (Proxy)
+		Proxy->SocketEvent(this, et);
+}
+
+void ProxyIdleTimer::Tick(time_t now)
+{
+	if (Proxy)
+		Proxy->KeepAlive(now);
+}
+
+MODULE_INIT(ModuleProxy)
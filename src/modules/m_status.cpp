@@ -0,0 +1,388 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+#include "inspircd.h"
+#include "urlencode.h"
+
+/* $ModDesc: Serves request counters and latency histograms at a status URL */
+
+/** A histogram of latencies in microseconds, with buckets growing on a log-linear scale:
+ * each power of two is split into four buckets, so a bucket's width is never more than a
+ * quarter of its lower bound. That keeps percentiles within 25% across any range while the
+ * whole histogram stays a small fixed array, and recording is a few shifts.
+ *
+ * hottpd handles requests on a single thread, so plain counters are enough.
+ */
+class LatencyHistogram : public classbase
+{
+ public:
+	/** Four linear buckets below 4us, then four per power of two up to 2^38us (about three days)
+	 */
+	static const int BUCKETS = 4 + 37 * 4;
+
+ private:
+	unsigned long long counts[BUCKETS];
+	unsigned long long total;
+	unsigned long long sum;
+
+	static int Bucket(unsigned long long usec)
+	{
+		if (usec < 4)
+			return usec;
+
+		int e = 2;
+		while ((usec >> (e + 1)) && (e < 38))
+			e++;
+
+		int sub = (usec >> (e - 2)) & 3;
+		int idx = 4 + (e - 2) * 4 + sub;
+		return std::min(idx, BUCKETS - 1);
+	}
+
+ public:
+	LatencyHistogram() : total(0), sum(0)
+	{
+		memset(counts, 0, sizeof(counts));
+	}
+
+	/** Highest value, in microseconds, which falls in the given bucket
+	 */
+	static unsigned long long UpperBound(int idx)
+	{
+		if (idx < 4)
+			return idx;
+
+		int e = 2 + (idx - 4) / 4;
+		int sub = (idx - 4) % 4;
+		return ((5ULL + sub) << (e - 2)) - 1;
+	}
+
+	void Record(unsigned long long usec)
+	{
+		counts[Bucket(usec)]++;
+		total++;
+		sum += usec;
+	}
+
+	unsigned long long Count() const
+	{
+		return total;
+	}
+
+	unsigned long long Sum() const
+	{
+		return sum;
+	}
+
+	/** Number of values recorded below the given power of two (in microseconds). Bucket
+	 * boundaries fall on every power of two, so this is exact.
+	 */
+	unsigned long long CountBelow(int power) const
+	{
+		unsigned long long n = 0;
+		int limit = (power <= 2) ? (1 << power) : 4 + (power - 2) * 4;
+		for (int i = 0; (i < limit) && (i < BUCKETS); i++)
+			n += counts[i];
+		return n;
+	}
+
+	/** The value below which the given fraction of recorded values fall, rounded up to the
+	 * top of its bucket
+	 */
+	unsigned long long Percentile(double fraction) const
+	{
+		if (!total)
+			return 0;
+
+		unsigned long long want = (unsigned long long)(fraction * total);
+		if (want >= total)
+			want = total - 1;
+
+		unsigned long long seen = 0;
+		for (int i = 0; i < BUCKETS; i++)
+		{
+			seen += counts[i];
+			if (seen > want)
+				return UpperBound(i);
+		}
+		return UpperBound(BUCKETS - 1);
+	}
+};
+
+class ModuleStatus : public Module
+{
+	std::string path;
+	CIDRTrie allow;
+
+	unsigned long long requests;
+	unsigned long long bytes;
+	std::map<int, unsigned long long> codes;
+
+	/** Time from the request's headers arriving until the first byte of the response was
+	 * queued, and until the last byte was sent
+	 */
+	LatencyHistogram firstbyte;
+	LatencyHistogram lastbyte;
+
+	/** Counters as they were at the previous background timer, and the rates since then
+	 */
+	time_t lastsample;
+	unsigned long long lastrequests;
+	unsigned long long lastbytes;
+	double reqrate;
+	double byterate;
+
+	static long long Elapsed(const timeval &from, const timeval &to)
+	{
+		return (to.tv_sec - from.tv_sec) * 1000000LL + (to.tv_usec - from.tv_usec);
+	}
+
+	static const char *StateName(int state)
+	{
+		switch (state)
+		{
+			case HTTP_WAIT_REQUEST:
+				return "wait_request";
+			case HTTP_RECV_REQBODY:
+				return "recv_body";
+			case HTTP_SEND_HEADERS:
+				return "send_headers";
+			case HTTP_SEND_DATA:
+				return "send_data";
+			case HTTP_UPGRADED:
+				return "upgraded";
+			default:
+				return "finished";
+		}
+	}
+
+	bool Allowed(Connection *c)
+	{
+		return c->privip && (allow.Find(c->privip) >= 0);
+	}
+
+	void ReadConfig()
+	{
+		ConfigReader Conf(ServerInstance);
+
+		path = Conf.ReadValue("status", "path", "/server-status", 0);
+		if (path.empty() || (path[0] != '/'))
+			throw ModuleException("m_status: path must begin with /");
+
+		allow.Clear();
+		utils::spacesepstream masks(Conf.ReadValue("status", "allow", "127.0.0.0/8 ::1/128", 0));
+		std::string mask;
+		while (masks.GetToken(mask))
+		{
+			if (!allow.Add(mask, 1))
+				throw ModuleException("m_status: invalid allow mask " + mask);
+		}
+	}
+
+	void CountStates(unsigned long *states)
+	{
+		for (int i = 0; i <= HTTP_FINISHED; i++)
+			states[i] = 0;
+
+		for (std::vector<Connection*>::iterator i = ServerInstance->local_connections.begin(); i != ServerInstance->local_connections.end(); i++)
+		{
+			if (((*i)->State >= 0) && ((*i)->State <= HTTP_FINISHED))
+				states[(*i)->State]++;
+		}
+	}
+
+	static std::string Micro(unsigned long long usec)
+	{
+		char buf[32];
+		if (usec >= 1000000)
+			snprintf(buf, sizeof(buf), "%.2fs", usec / 1000000.0);
+		else if (usec >= 1000)
+			snprintf(buf, sizeof(buf), "%.2fms", usec / 1000.0);
+		else
+			snprintf(buf, sizeof(buf), "%lluus", usec);
+		return buf;
+	}
+
+	void TextHistogram(std::string &out, const char *name, const LatencyHistogram &h)
+	{
+		out += std::string(name) + ": p50 " + Micro(h.Percentile(0.5)) + ", p90 " + Micro(h.Percentile(0.9))
+			+ ", p99 " + Micro(h.Percentile(0.99)) + ", p99.9 " + Micro(h.Percentile(0.999))
+			+ " (" + ConvToStr((unsigned long)h.Count()) + " samples)\n";
+	}
+
+	std::string Text()
+	{
+		char buf[256];
+		std::string out;
+
+		snprintf(buf, sizeof(buf), "Uptime: %lus\n", (unsigned long)(ServerInstance->Time() - ServerInstance->startup_time));
+		out += buf;
+		snprintf(buf, sizeof(buf), "Requests: %llu (%.2f/s)\nBytes out: %llu (%.0f/s)\n", requests, reqrate, bytes, byterate);
+		out += buf;
+
+		unsigned long states[HTTP_FINISHED + 1];
+		CountStates(states);
+		out += "Connections: " + ConvToStr(ServerInstance->local_connections.size()) + "\n";
+		for (int i = 0; i <= HTTP_FINISHED; i++)
+			out += std::string("  ") + StateName(i) + ": " + ConvToStr(states[i]) + "\n";
+
+		FileSystem *fs = ServerInstance->FileSys;
+		unsigned long lookups = fs->StatCacheHits + fs->StatCacheMisses;
+		snprintf(buf, sizeof(buf), "Stat cache: %lu hits, %lu misses (%.1f%%)\n", fs->StatCacheHits, fs->StatCacheMisses,
+			lookups ? (fs->StatCacheHits * 100.0 / lookups) : 0.0);
+		out += buf;
+
+		out += "Responses:\n";
+		for (std::map<int, unsigned long long>::iterator i = codes.begin(); i != codes.end(); i++)
+			out += "  " + ConvToStr(i->first) + ": " + ConvToStr((unsigned long)i->second) + "\n";
+
+		TextHistogram(out, "Time to first byte", firstbyte);
+		TextHistogram(out, "Time to last byte", lastbyte);
+		return out;
+	}
+
+	void PrometheusHistogram(std::string &out, const char *name, const char *help, const LatencyHistogram &h)
+	{
+		char buf[128];
+
+		out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " histogram\n";
+
+		/* 128us up to about 33s */
+		for (int power = 7; power <= 25; power++)
+		{
+			snprintf(buf, sizeof(buf), "%s_bucket{le=\"%g\"} %llu\n", name, (1 << power) / 1000000.0, h.CountBelow(power));
+			out += buf;
+		}
+
+		snprintf(buf, sizeof(buf), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %g\n%s_count %llu\n", name, h.Count(),
+			name, h.Sum() / 1000000.0, name, h.Count());
+		out += buf;
+	}
+
+	std::string Prometheus()
+	{
+		char buf[128];
+		std::string out;
+
+		snprintf(buf, sizeof(buf), "# TYPE hottpd_requests_total counter\nhottpd_requests_total %llu\n", requests);
+		out += buf;
+		snprintf(buf, sizeof(buf), "# TYPE hottpd_response_bytes_total counter\nhottpd_response_bytes_total %llu\n", bytes);
+		out += buf;
+
+		out += "# TYPE hottpd_responses_total counter\n";
+		for (std::map<int, unsigned long long>::iterator i = codes.begin(); i != codes.end(); i++)
+		{
+			snprintf(buf, sizeof(buf), "hottpd_responses_total{code=\"%d\"} %llu\n", i->first, i->second);
+			out += buf;
+		}
+
+		unsigned long states[HTTP_FINISHED + 1];
+		CountStates(states);
+		out += "# TYPE hottpd_connections gauge\n";
+		for (int i = 0; i <= HTTP_FINISHED; i++)
+		{
+			snprintf(buf, sizeof(buf), "hottpd_connections{state=\"%s\"} %lu\n", StateName(i), states[i]);
+			out += buf;
+		}
+
+		FileSystem *fs = ServerInstance->FileSys;
+		snprintf(buf, sizeof(buf), "# TYPE hottpd_stat_cache_hits_total counter\nhottpd_stat_cache_hits_total %lu\n", fs->StatCacheHits);
+		out += buf;
+		snprintf(buf, sizeof(buf), "# TYPE hottpd_stat_cache_misses_total counter\nhottpd_stat_cache_misses_total %lu\n", fs->StatCacheMisses);
+		out += buf;
+
+		PrometheusHistogram(out, "hottpd_first_byte_seconds", "Time from request headers to the first response byte", firstbyte);
+		PrometheusHistogram(out, "hottpd_last_byte_seconds", "Time from request headers to the end of the response", lastbyte);
+		return out;
+	}
+
+ public:
+	ModuleStatus(InspIRCd *Srv) : Module(Srv), requests(0), bytes(0), lastsample(0), lastrequests(0), lastbytes(0),
+		reqrate(0), byterate(0)
+	{
+		ReadConfig();
+		lastsample = ServerInstance->Time();
+
+		Implementation eventlist[] = { I_OnPreRequest, I_OnRequestComplete, I_OnBackgroundTimer };
+		ServerInstance->Modules->Attach(eventlist, this, 3);
+	}
+
+	virtual ~ModuleStatus()
+	{
+	}
+
+	virtual Version GetVersion()
+	{
+		return Version(1, 0, 0, 0, VF_VENDOR, API_VERSION);
+	}
+
+	virtual int OnPreRequest(Connection *c, const std::string &method, const std::string &vhost, const std::string &dir, const std::string &file)
+	{
+		if (c->uri != path)
+			return 0;
+
+		if (!Allowed(c))
+		{
+			c->SendError(403, "Forbidden", false);
+			return 1;
+		}
+
+		bool prometheus = (URIQueryString(c->uriquery).Get("format") == "prometheus");
+		std::string data = prometheus ? Prometheus() : Text();
+
+		HTTPHeaders headers;
+		headers.SetHeader("Content-Type", prometheus ? "text/plain; version=0.0.4" : "text/plain");
+		headers.SetHeader("Cache-Control", "no-cache");
+
+		c->SendHeaders(data.length(), 200, "OK", headers);
+		c->State = HTTP_SEND_DATA;
+		c->Write(data);
+		c->ResponseBufferDone = true;
+		return 1;
+	}
+
+	virtual void OnRequestComplete(Connection *c)
+	{
+		struct timeval now;
+		gettimeofday(&now, NULL);
+
+		requests++;
+		bytes += c->ResponseBytes;
+		codes[c->ResponseCode]++;
+
+		long long total = Elapsed(c->RequestStart, now);
+		long long first = Elapsed(c->RequestStart, c->ResponseStart);
+		if (total < 0)
+			total = 0;
+		/* Nothing was queued for this response, so ResponseStart is left from an earlier one */
+		if ((first < 0) || (first > total))
+			first = total;
+
+		firstbyte.Record(first);
+		lastbyte.Record(total);
+	}
+
+	virtual void OnBackgroundTimer(time_t curtime)
+	{
+		if (curtime <= lastsample)
+			return;
+
+		double secs = curtime - lastsample;
+		reqrate = (requests - lastrequests) / secs;
+		byterate = (bytes - lastbytes) / secs;
+
+		lastsample = curtime;
+		lastrequests = requests;
+		lastbytes = bytes;
+	}
+};
+
+MODULE_INIT(ModuleStatus)
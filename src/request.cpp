@@ -15,6 +15,23 @@
 #include <stdarg.h>
 #include "socketengine.h"
 #include "wildcard.h"
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+/** Take the next word from a line, as reading it with >> would
+ */
+static void NextToken(const char *&p, const char *end, std::string &out)
+{
+	while ((p < end) && isspace((unsigned char)*p))
+		p++;
+
+	const char *word = p;
+	while ((p < end) && !isspace((unsigned char)*p))
+		p++;
+
+	out.assign(word, p - word);
+}
 
 void Connection::CheckRequest(int newpos)
 {
@@ -23,37 +40,46 @@ void Connection::CheckRequest(int newpos)
 	 * three bytes of old data) to save time.
 	 *
 	 * rfind can't be used, as it would break pipelining.
+	 *
+	 * The request is parsed where it lies in the buffer, and only the fields are copied out.
 	 */
 	
-	std::string::size_type reqend = requestbuf.find("\r\n\r\n", (newpos >= 3) ? (newpos - 3) : 0);
+	size_t reqend = requestbuf.Find("\r\n\r\n", (newpos >= 3) ? (newpos - 3) : 0);
 	if (reqend == std::string::npos)
 		return;
 
-	ServerInstance->Log(DEBUG, "Got headers.");
+	LOG(DEBUG, LS_HTTP, "Got headers.");
+	gettimeofday(&RequestStart, NULL);
 	
 	/* BIG HUGE WARNING THAT YOU SHOULD READ BEFORE YOU MAKE AN INFINITE LOOP!
 	 *
-	 * Erase from the requestbuf before you call anything like SendError, etc.
+	 * Consume the request from the requestbuf before you call anything like SendError, etc.
 	 * Not doing so has very unfortunate consequences, k?
 	 */
 	
-	std::string::size_type hbegin = 0, hend;
-	for (; (hend = requestbuf.find("\r\n", hbegin)) != std::string::npos; hbegin = hend + 2)
+	const char *buf = requestbuf.Data();
+	size_t hbegin = 0, hend;
+	for (; (hend = requestbuf.Find("\r\n", hbegin)) != std::string::npos; hbegin = hend + 2)
 	{
 		if (hbegin == hend)
 			break;
 		
+		const char *line = buf + hbegin;
+		const char *lineend = buf + hend;
+
 		if (method.empty())
 		{
-			std::istringstream cheader(std::string(requestbuf, hbegin, hend - hbegin));
 			std::string tmpversion;
-			cheader >> method;
-			cheader >> uri;
-			cheader >> tmpversion;
+			NextToken(line, lineend, method);
+			NextToken(line, lineend, uri);
+			NextToken(line, lineend, tmpversion);
+			rawmethod = method;
+			rawuri = uri;
+			rawversion = tmpversion;
 
 			if (method.empty() || uri.empty() || tmpversion.empty())
 			{
-				requestbuf.erase(0, reqend + 4);
+				requestbuf.Consume(reqend + 4);
 				SendError(400, "Bad Request", false);
 				return;
 			}
@@ -64,6 +90,11 @@ void Connection::CheckRequest(int newpos)
 			{
 				http_version = HTTP_1_1;
 			}
+			else if (tmpversion == "HTTP/2.0")
+			{
+				/* Only valid as the connection preface; see below */
+				http_version = HTTP_2;
+			}
 			else if (tmpversion == "HTTP/1.0")
 			{
 				http_version = HTTP_1_0;
@@ -74,7 +105,7 @@ void Connection::CheckRequest(int newpos)
 			}
 			else
 			{
-				requestbuf.erase(0, reqend + 4);
+				requestbuf.Consume(reqend + 4);
 				/*
 				 * Note: You may expect that this is a fatal error, however, it may not be.
 				 * The connection is left open so that the connection may re-send the request
@@ -91,21 +122,19 @@ void Connection::CheckRequest(int newpos)
 		}
 		else
 		{
-			std::string cheader = requestbuf.substr(hbegin, hend - hbegin);
-	
-			std::string::size_type fieldsep = cheader.find(':');
-			if ((fieldsep == std::string::npos) || (fieldsep == 0) || (fieldsep == cheader.length() - 1))
+			const char *fieldsep = (const char *)memchr(line, ':', lineend - line);
+			if (!fieldsep || (fieldsep == line) || (fieldsep == lineend - 1))
 			{
-				requestbuf.erase(0, reqend + 4);
+				requestbuf.Consume(reqend + 4);
 				SendError(400, "Bad Request", false);
 				return;
 			}
 	
-			headers.SetHeader(cheader.substr(0, fieldsep), cheader.substr(fieldsep + 2));
+			headers.SetHeader(std::string(line, fieldsep), std::string(fieldsep + 2, lineend));
 		}
 	}
 
-	requestbuf.erase(0, reqend + 4);
+	requestbuf.Consume(reqend + 4);
 
 	if (method.empty() || uri.empty() || http_version == HTTP_UNSPECIFIED)
 	{
@@ -115,7 +144,38 @@ void Connection::CheckRequest(int newpos)
 	
 	// In the interest of convention, make the method uppercase
 	std::transform(method.begin(), method.end(), method.begin(), ::toupper);
+
+	if (http_version == HTTP_2)
+	{
+		/* "PRI * HTTP/2.0" followed by "SM" is how a HTTP/2 client with prior knowledge
+		 * (or one which negotiated h2 through TLS ALPN) starts. Hand the connection to a
+		 * module which speaks HTTP/2, if there is one. */
+		int MOD_RESULT = 0;
+		if ((method == "PRI") && (uri == "*") && !RequestsCompleted)
+		{
+			State = HTTP_UPGRADED;
+			FOREACH_RESULT_I(ServerInstance, I_OnUpgrade, OnUpgrade(this, "h2"));
+		}
+
+		/* Anything after the preface was the module's to take */
+		requestbuf.Clear();
+
+		if (!MOD_RESULT)
+		{
+			State = HTTP_WAIT_REQUEST;
+			SendError(505, "Version Not Supported", true);
+		}
+		return;
+	}
 	
+	vhost = ServerInstance->VHosts->Find(headers.GetHeader("Host"));
+
+	if (!ServerInstance->Limits->TakeRequest(this))
+	{
+		SendError(429, "Too Many Requests", true);
+		return;
+	}
+
 	// Important header checks for internal state and RFC compatibility
 	if (strcasecmp(headers.GetHeader("Connection").c_str(), "close") == 0)
 		keepalive = false;
@@ -125,7 +185,7 @@ void Connection::CheckRequest(int newpos)
 	// XXX: I'd think this would be better done on EndRequest
 	if ((RequestsCompleted + 1) >= ServerInstance->Config->KeepAliveMax)
 	{
-		ServerInstance->Log(DEBUG, "Closing connection after request due to keepalive limit");
+		LOG(DEBUG, LS_HTTP, "Closing connection after request due to keepalive limit");
 		keepalive = false;
 	}
 	
@@ -134,7 +194,7 @@ void Connection::CheckRequest(int newpos)
 	{
 		RequestBodyLength = atoi(headers.GetHeader("Content-Length").c_str());
 
-		if (RequestBodyLength > (unsigned int)ServerInstance->Config->MaxPostBody)
+		if (RequestBodyLength > (unsigned int)vhost->maxpostbody)
 		{
 			// Sorry, lardy. Don't try send so much crap.
 			SendError(413, "Request Entity Too Large", true);
@@ -144,7 +204,7 @@ void Connection::CheckRequest(int newpos)
 	
 	if (headers.IsSet("Transfer-Encoding"))
 	{
-		ServerInstance->Log(DEBUG, "Transfer encoded request bodies are not yet supported");
+		LOG(DEBUG, LS_HTTP, "Transfer encoded request bodies are not yet supported");
 		SendError(500, "Internal Server Error", true);
 		return;
 	}
@@ -154,23 +214,69 @@ void Connection::CheckRequest(int newpos)
 		if (method != "POST")
 		{
 			// We currently only accept bodies for POST requests.
-			ServerInstance->Log(DEBUG, "Rejecting non-POST request with a request body");
+			LOG(DEBUG, LS_HTTP, "Rejecting non-POST request with a request body");
 			// This will kill the connection, which we must do because the client will send the request body anyway.
 			SendError(500, "Internal Server Error", true);
 			return;
 		}
 		
-		ServerInstance->Log(DEBUG, "Reading %d bytes for the request body", RequestBodyLength);
+		LOG(DEBUG, LS_HTTP, "Reading %d bytes for the request body", RequestBodyLength);
 		State = HTTP_RECV_REQBODY;
+
+		/* Any of the body that arrived along with the headers is in the request buffer */
+		RequestBody.reserve(RequestBodyLength);
+		TakeRequestBody();
 		return;
 	}
 
+	ProcessRequest();
+}
+
+void Connection::ProcessRequest()
+{
 	std::string dir;
 	std::string file;
 	size_t pos = 0;
 
 	HandleURI();
 
+	if (!CheckAccess())
+		return;
+
+	std::string target;
+	const RewriteRule *rule = ServerInstance->Rewrites->Find(uri, target);
+	if (rule && rule->status)
+	{
+		if (!uriquery.empty() && (target.find('?') == std::string::npos))
+			target.append("?").append(uriquery);
+
+		LOG(DEBUG, LS_HTTP, "Redirecting %s to %s", uri.c_str(), target.c_str());
+		HTTPHeaders redirect;
+		redirect.SetHeader("Location", target);
+		this->SendHeaders(0, rule->status, rule->statustext, redirect);
+		return;
+	}
+	else if (rule)
+	{
+		/* Served as if it had been requested, though it isn't matched against the rules
+		 * again; the query is kept unless the target has its own */
+		LOG(DEBUG, LS_HTTP, "Rewriting %s to %s", uri.c_str(), target.c_str());
+		uri = target;
+		HandleURI();
+
+		if (!CheckAccess())
+			return;
+	}
+
+	/* A directory is served by its index file, found before modules see the request so
+	 * they can handle it (a script, say) like any other */
+	if (!uri.empty() && (uri[uri.length() - 1] == '/') && !vhost->indexes.empty())
+	{
+		const std::string *index = ServerInstance->FileSys->FindIndex(vhost->docroot, uri, vhost->indexes);
+		if (index)
+			uri.append(*index);
+	}
+
 	// Find last /
 	pos = uri.rfind('/');
 	// dir is everything including the last /
@@ -178,15 +284,15 @@ void Connection::CheckRequest(int newpos)
 	// file is everything after the last /
 	file = uri.substr((pos + 1), uri.length());
 
-	std::string vhost = headers.GetHeader("Host");
+	std::string host = headers.GetHeader("Host");
 
 	int MOD_RESULT = 0;
-	FOREACH_RESULT_I(ServerInstance, I_OnPreRequest, OnPreRequest(this, method, vhost.empty() ? "" : vhost, dir, file));
+	FOREACH_RESULT_I(ServerInstance, I_OnPreRequest, OnPreRequest(this, method, host, dir, file));
 
 	if (MOD_RESULT == 1)
 	{
 		// Module handled the request, get out. Assume module sent headers etc.
-		ServerInstance->Log(DEBUG, "Module handled request for us");
+		LOG(DEBUG, LS_HTTP, "Module handled request for us");
 		return;
 	}
 
@@ -198,125 +304,209 @@ void Connection::CheckRequest(int newpos)
 	}
 	
 	ServeData();
- }
+}
+
+bool Connection::CheckAccess()
+{
+	/* Checked against the cleaned up URI, so /public/../private is /private */
+	if (privip && !ServerInstance->ACLs->Allowed(privip, uri))
+	{
+		LOG(DEBUG, LS_HTTP, "Denied %s access to %s by an ACL", GetIP().c_str(), uri.c_str());
+		this->SendError(403, "Forbidden", false);
+		return false;
+	}
+
+	return true;
+}
+
+/** Whether HandleURI has to look at a character; everything else is copied as it is
+ */
+static inline bool IsURISpecial(char c)
+{
+	return (c == '%') || (c == '/') || (c == '?') || (c == '#') || !c;
+}
+
+/** Find the next character HandleURI has to look at, or end. Dots only matter at the end
+ * of a segment, where they are checked for, so they aren't searched for here.
+ *
+ * URIs are scanned a block at a time where the compiler lets us use SSE2 or AVX2 (x86_64
+ * always has SSE2), comparing every byte of the block against each special character at
+ * once; the tail, and everything on other platforms, is scanned a byte at a time.
+ */
+static const char *FindURISpecial(const char *p, const char *end)
+{
+#if defined(__AVX2__) && defined(__GNUC__)
+	const __m256i pct32 = _mm256_set1_epi8('%'), slash32 = _mm256_set1_epi8('/'), query32 = _mm256_set1_epi8('?'),
+		frag32 = _mm256_set1_epi8('#'), nul32 = _mm256_setzero_si256();
+	for (; end - p >= 32; p += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);
+		__m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, pct32), _mm256_cmpeq_epi8(v, slash32)),
+			_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, query32), _mm256_cmpeq_epi8(v, frag32)), _mm256_cmpeq_epi8(v, nul32)));
+		unsigned int mask = _mm256_movemask_epi8(hit);
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+#endif
+#if defined(__SSE2__) && defined(__GNUC__)
+	const __m128i pct = _mm_set1_epi8('%'), slash = _mm_set1_epi8('/'), query = _mm_set1_epi8('?'),
+		frag = _mm_set1_epi8('#'), nul = _mm_setzero_si128();
+	for (; end - p >= 16; p += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		__m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, slash)),
+			_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, query), _mm_cmpeq_epi8(v, frag)), _mm_cmpeq_epi8(v, nul)));
+		unsigned int mask = _mm_movemask_epi8(hit);
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+#endif
+	for (; p < end; p++)
+	{
+		if (IsURISpecial(*p))
+			return p;
+	}
+	return end;
+}
 
-// XXX does this belong here?
+/** Decode and clean up the URI in place, in one pass: escapes are decoded, except that an
+ * encoded / is taken as a separator and control characters are dropped; empty and . segments
+ * are removed, and .. removes the segment before it, so the result can never climb above the
+ * document root. The query string, if there is one, is moved to uriquery undecoded (see
+ * URIQueryString for decoding it); a fragment is dropped.
+ *
+ * The cleaned URI is never longer than what has been read of the original, so it is written
+ * over the start of it as it is read, and runs of ordinary characters are found a block at a
+ * time and moved together, or not at all until something has been removed.
+ */
 void Connection::HandleURI()
 {
 	// TODO absolute URLs (i.e. http://[HOST HEADER VALUE]/blah)
-	if (uri[0] != '/')
+	if (uri.empty() || (uri[0] != '/'))
 		return;
-	
-	std::string sanepath;
-	std::string pathpart;
-	for (std::string::const_iterator i = uri.begin() + 1; ; ++i)
+
+	char *out = &uri[0];
+	const char *end = out + uri.length();
+	const char *p = out + 1;
+	/* Where the next character is written, and where the segment being read starts */
+	size_t w = 1, seg = 1;
+
+	for (;;)
 	{
-		char c = (i == uri.end()) ? 0 : *i;
-		
+		const char *special = FindURISpecial(p, end);
+		size_t n = special - p;
+		if (n && (out + w != p))
+			memmove(out + w, p, n);
+		w += n;
+		p = special;
+
+		char c = (p == end) ? 0 : *p;
+
 		if (c == '%')
 		{
 			// URL Encoded value
-			if (((i + 1) == uri.end()) || ((i + 2) == uri.end()))
+			if (end - p < 3)
 			{
 				// Without an actual value. Idiots.
-				i = uri.end() - 1;
+				p = end;
 				continue;
 			}
-			
-            char v;
-            if (!utils::unhexchar(v, *(i + 1), *(i + 2)))
-            {
-                ServerInstance->Log(DEBUG, "URLEncoded value is invalid (not hex)");
-                i += 2;
-                continue;
-            }
-            if ((v < 32) || (v == 127))
+
+			char v;
+			if (!utils::unhexchar(v, p[1], p[2]))
 			{
-				ServerInstance->Log(DEBUG, "URLEncoded unprintable character %d removed from URI.", v);
-				i += 2;
+				LOG(DEBUG, LS_HTTP, "URLEncoded value is invalid (not hex)");
+				p += 3;
 				continue;
 			}
-			
-			if (v != '/')
+			p += 3;
+
+			if (((unsigned char)v < 32) || (v == 127))
 			{
-				// Slashes are *NOT* allowed. They will be parsed like a normal /. Other characters are fine.
-				pathpart.push_back(v);
-				i += 2;
+				LOG(DEBUG, LS_HTTP, "URLEncoded unprintable character %d removed from URI.", v);
 				continue;
 			}
-			
-			// Parse this as if it were the normal character
-			i += 2;
-			c = v;
-		}
-		
-		if (!c || (c == '/'))
-		{
-			// End of the URL *or* a path seperator
-			
-			if (!pathpart.length() || (pathpart == "."))
-			{
-				// Do nothing; these are meaningless and will be cleaned from the path
-			}
-			else if (pathpart == "..")
-			{
-				std::string::size_type sloc = sanepath.rfind('/', sanepath.length() - 2);
-				if (sloc != std::string::npos)
-					sanepath.erase(sloc + 1);
-				else
-					sanepath.clear();
-			}
-			else
+
+			if (v != '/')
 			{
-				sanepath.append(pathpart);
-				if (c)
-					sanepath.push_back('/');
+				out[w++] = v;
+				continue;
 			}
-			
-			pathpart.clear();
-			
-			if (!c)
-				break;
+
+			// Slashes are *NOT* allowed. They will be parsed like a normal /.
 		}
 		else if (c == '?')
 		{
 			// Begin query
-			// TODO URLEncode support
-			uriquery.assign<std::string::const_iterator>(i + 1, uri.end());
-			i = uri.end() - 1;
+			uriquery.assign(p + 1, end);
+			c = 0;
 		}
-		else if (c == '#')
+		else if (c == '/')
 		{
-			// The client should not be sending this. Idiot.
-			i = uri.end() - 1;
+			p++;
 		}
 		else
 		{
-			pathpart.push_back(c);
+			// End of the URL, or a fragment, which the client should not be sending. Idiot.
+			c = 0;
+		}
+
+		// End of a segment; it has been written from seg to w
+		size_t len = w - seg;
+		if (!len || ((len == 1) && (out[seg] == '.')))
+		{
+			// These are meaningless and will be cleaned from the path
+			w = seg;
+		}
+		else if ((len == 2) && (out[seg] == '.') && (out[seg + 1] == '.'))
+		{
+			// Remove the segment before this one, if there is one; out[0] is always a /
+			w = seg;
+			if (w > 1)
+			{
+				for (w -= 2; out[w] != '/'; w--)
+					;
+				w++;
+			}
+		}
+		else if (c)
+		{
+			out[w++] = '/';
 		}
+		seg = w;
+
+		if (!c)
+			break;
 	}
-	
-	uri.clear();
-	if (sanepath[0] != '/')
-		uri.push_back('/');
-	
-	uri.append(sanepath);
-	
-	ServerInstance->Log(DEBUG, "Cleaned URI to '%s'", uri.c_str());
+
+	uri.resize(w);
+
+	LOG(DEBUG, LS_HTTP, "Cleaned URI to '%s'", uri.c_str());
 }
 
 void Connection::ServeData()
 {
-	ServerInstance->Log(DEBUG, "ServeData: %s: %s", method.c_str(), uri.c_str());
+	LOG(DEBUG, LS_HTTP, "ServeData: %s: %s", method.c_str(), uri.c_str());
 	
 	struct stat *fst = NULL;
+	const MimeType *type = NULL;
 		
-	upath = ServerInstance->FileSys->CheckFilePath(ServerInstance->Config->DocRoot, uri, fst);
+	upath = ServerInstance->FileSys->CheckFilePath(vhost->docroot, uri, fst, NULL, &type);
 
 	if (upath.empty())
 	{
 		switch (errno)
 		{
+			case EISDIR:
+				if (uri[uri.length() - 1] != '/')
+				{
+					/* Relative links in the directory's index only work from a URL ending in a / */
+					HTTPHeaders redirect;
+					redirect.SetHeader("Location", utils::urlencodepath(uri) + "/" + (uriquery.empty() ? "" : "?" + uriquery));
+					this->SendHeaders(0, 301, "Moved Permanently", redirect);
+					break;
+				}
+				/* Fall through */
 			case EACCES:
 				this->SendError(403, "Forbidden", false);
 				break;
@@ -357,7 +547,7 @@ void Connection::ServeData()
 				this->SendError(404, "File Not Found", false);
 				break;
 			default:
-				ServerInstance->Log(DEBUG, "open() to serve file '%s' failed with error: %s", upath.c_str(), strerror(errno));
+				LOG(DEBUG, LS_HTTP, "open() to serve file '%s' failed with error: %s", upath.c_str(), strerror(errno));
 				this->SendError(500, "Internal Server Error", false);
 				break;
 		}
@@ -370,6 +560,10 @@ void Connection::ServeData()
 	rfilesent = 0;
 	ResponseBackend = WriteBackend::GetInstance(ServerInstance);
 
+	rmime = vhost->FindType(upath);
+	if (!rmime)
+		rmime = type ? type : ServerInstance->MimeTypes->GetDefault();
+
 	HTTPHeaders empty;
 	// When the headers have finished being sent, sending of data will be automatically triggered.
 	this->SendHeaders(fst->st_size, 200, "OK", empty);
@@ -378,6 +572,13 @@ void Connection::ServeData()
 void Connection::SendHeaders(unsigned long size, int response, const std::string &rtext, HTTPHeaders &rheaders)
 {
 	State = HTTP_SEND_HEADERS;
+	ResponseCode = response;
+
+	/* The headers are written first and the file after them, in separate calls; without
+	 * this a small file goes out in two packets (or waits on Nagle for the first to be
+	 * acknowledged). EndRequest uncorks. */
+	if (size && ResponseBackend)
+		Cork(true);
 	
 	if (http_version == HTTP_1_0)
 		this->Write("HTTP/1.0 ");
@@ -395,20 +596,19 @@ void Connection::SendHeaders(unsigned long size, int response, const std::string
 	rheaders.CreateHeader("Server", "hottpd");
 	rheaders.SetHeader("Content-Length", ConvToStr(size));
 	
+	/* Written from the type's prebuilt header line, not through rheaders */
+	const MimeType *type = NULL;
 	if (size && !rheaders.IsSet("Content-Type"))
 	{
-		size_t p = uri.find_last_of("."); // XXX hack of sorts
-		std::string mime;
-
-		if (p != std::string::npos)
-			mime = ServerInstance->MimeTypes->GetType(uri.substr(p + 1));
+		type = rmime;
+		if (!type)
+			type = vhost->FindType(uri);
+		if (!type)
+			type = ServerInstance->MimeTypes->FindForPath(uri);
+		if (!type)
+			type = ServerInstance->MimeTypes->GetDefault();
 
-		if (mime.empty())
-			mime = "application/x-octet-stream";
-
-		ServerInstance->Log(DEBUG, "Sending mimetype %s for %s", mime.c_str(), uri.c_str());
-
-		rheaders.SetHeader("Content-Type", mime);
+		LOG(DEBUG, LS_HTTP, "Sending mimetype %s for %s", type->type.c_str(), uri.c_str());
 	}
 	else if (!size)
 		rheaders.RemoveHeader("Content-Type");
@@ -421,6 +621,8 @@ void Connection::SendHeaders(unsigned long size, int response, const std::string
 		rheaders.SetHeader("Connection", "Close");
 	
 	this->Write(rheaders.GetFormattedHeaders());
+	if (type)
+		this->Write(type->header);
 	this->Write("\r\n");
 		
 	if (!size)
@@ -432,14 +634,22 @@ void Connection::SendHeaders(unsigned long size, int response, const std::string
 
 void Connection::EndRequest()
 {
-	ServerInstance->Log(DEBUG, "Ending request ***");
+	LOG(DEBUG, LS_HTTP, "Ending request ***");
 	
 	RequestsCompleted++;
+	Cork(false);
+
+	ResponseBytes += rfilesent;
+	FOREACH_MOD(I_OnRequestComplete, OnRequestComplete(this));
+	ResponseCode = 0;
+	ResponseBytes = 0;
 	
 	if (!keepalive)
 	{
-		ServerInstance->Log(DEBUG, "NOT keepalive, killing!");
+		LOG(DEBUG, LS_HTTP, "NOT keepalive, killing!");
 		State = HTTP_FINISHED;
+		/* A response with no body ends as soon as its headers are queued; send them before the socket is closed */
+		FlushWriteBuf();
 		ServerInstance->Connections->Delete(this);
 		return;
 	}
@@ -449,13 +659,21 @@ void Connection::EndRequest()
 	uri.clear();
 	uriquery.clear();
 	upath.clear();
-	RequestBody.clear();
+	rawmethod.clear();
+	rawuri.clear();
+	rawversion.clear();
+	/* Keep the body's buffer for the next request, unless it was a large upload */
+	if (RequestBody.capacity() > 65536)
+		std::string().swap(RequestBody);
+	else
+		RequestBody.clear();
 	http_version = HTTP_UNSPECIFIED;
 	RequestBodyLength = 0;
 	State = HTTP_WAIT_REQUEST;
 	ResponseBackend = NULL;
 	ResponseBufferDone = false;
 	rfilesize = rfilesent = 0;
+	rmime = NULL;
 	
 	if (filefd > -1)
 	{
@@ -463,35 +681,31 @@ void Connection::EndRequest()
 		filefd = -1;
 	}
 	
-	if (requestbuf.length())
-	{
-		/* XXX should this be delayed to the next iteration to avoid letting a
-		 * connection hog the process? If so, it would need to trigger regardless
-		 * of a read event... */
-		
-		this->CheckRequest(0);
-	}
+	/* Another request is waiting; it is served from the mainloop, see ProcessPipelines */
+	requestbuf.Reset();
+	if (requestbuf.Length())
+		ServerInstance->Connections->SchedulePipeline(this);
 }
 
 void Connection::SendStaticData()
 {
-	ServerInstance->Log(DEBUG, "Sending response with backend");
+	LOG(DEBUG, LS_HTTP, "Sending response with backend");
 	
 	if (filefd < 0)
 	{
-		ServerInstance->Log(DEBUG, "Backend triggered but connection has no open file - closing connection");
+		LOG(DEBUG, LS_HTTP, "Backend triggered but connection has no open file - closing connection");
 		ServerInstance->Connections->Delete(this);
 	}
 	
-	int re = ResponseBackend->ServeFile(GetFd(), filefd, rfilesent, rfilesize);
+	int re = ResponseBackend->ServeFile(this, filefd, rfilesent, rfilesize);
 	if (re < 0)
 	{
-		ServerInstance->Log(DEBUG, "Response backend returned error; closing connection");
+		LOG(DEBUG, LS_HTTP, "Response backend returned error; closing connection");
 		ServerInstance->Connections->Delete(this);
 	}	
 	else if (rfilesent == rfilesize)
 	{
-		ServerInstance->Log(DEBUG, "Response backend finished serving request");
+		LOG(DEBUG, LS_HTTP, "Response backend finished serving request");
 		EndRequest();
 	}
 	else
@@ -0,0 +1,325 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+/* $Core: libhttpd_rewrite */
+
+#include "inspircd.h"
+
+/** What a pattern's wildcards or groups matched; 0 is the whole match
+ */
+struct Captures
+{
+	const char *start[10];
+	size_t len[10];
+	int count;
+};
+
+/** Match a wildcard pattern, case sensitively, noting what each wildcard matched.
+ *
+ * This is the same algorithm as csmatch(): a * first matches nothing, and when the rest
+ * of the pattern fails to match, the last * takes one more character and it is tried
+ * again. Earlier wildcards never change once a later * has been reached, so what they
+ * matched can be noted as it goes.
+ */
+static bool WildcardCapture(const char *str, const char *mask, Captures &caps)
+{
+	const char *s = str, *w = mask;
+	const char *starw = NULL, *stars = NULL;
+	int star = 0, n = 1;
+
+	while (*s)
+	{
+		if (*w == '*')
+		{
+			star = n;
+			if (n < 10)
+			{
+				caps.start[n] = s;
+				caps.len[n] = 0;
+			}
+			n++;
+			starw = ++w;
+			stars = s;
+		}
+		else if ((*w == '?') || (*w == *s))
+		{
+			if ((*w == '?') && (n < 10))
+			{
+				caps.start[n] = s;
+				caps.len[n] = 1;
+			}
+			if (*w == '?')
+				n++;
+			w++;
+			s++;
+		}
+		else if (starw)
+		{
+			/* Give the last * another character and try the rest of the pattern again */
+			s = ++stars;
+			w = starw;
+			if (star < 10)
+				caps.len[star] = s - caps.start[star];
+			n = star + 1;
+		}
+		else
+			return false;
+	}
+
+	for (; *w == '*'; w++, n++)
+	{
+		if (n < 10)
+		{
+			caps.start[n] = s;
+			caps.len[n] = 0;
+		}
+	}
+
+	if (*w)
+		return false;
+
+	caps.start[0] = str;
+	caps.len[0] = s - str;
+	caps.count = std::min(n, 10);
+	return true;
+}
+
+RewriteRule::RewriteRule(const std::string &match, bool isregex, const std::string &to, int redirect) : pattern(match), target(to), status(redirect)
+{
+	if (pattern.empty() || target.empty())
+		throw CoreException("Every rewrite and redirect needs a pattern to match and a target");
+
+	switch (status)
+	{
+		case 0:
+			if (target[0] != '/')
+				throw CoreException("The target of the rewrite for " + pattern + " must be a path beginning with /");
+			break;
+		case 301:
+			statustext = "Moved Permanently";
+			break;
+		case 302:
+			statustext = "Found";
+			break;
+		case 303:
+			statustext = "See Other";
+			break;
+		case 307:
+			statustext = "Temporary Redirect";
+			break;
+		case 308:
+			statustext = "Permanent Redirect";
+			break;
+		default:
+			throw CoreException("The status of the redirect for " + pattern + " must be 301, 302, 303, 307 or 308");
+	}
+
+	if (!isregex)
+	{
+		std::string::size_type wild = pattern.find_first_of("*?");
+		prefix = pattern.substr(0, wild);
+
+		if (wild == std::string::npos)
+			type = MATCH_EXACT;
+		else if (wild == pattern.length() - 1 && pattern[wild] == '*')
+			type = MATCH_PREFIX;
+		else
+			type = MATCH_WILDCARD;
+		return;
+	}
+
+	type = MATCH_REGEX;
+	int err = regcomp(&regex, pattern.c_str(), REG_EXTENDED);
+	if (err)
+	{
+		char buf[256];
+		regerror(err, &regex, buf, sizeof(buf));
+		throw CoreException("Invalid regex " + pattern + ": " + buf);
+	}
+
+	/* Only a regex anchored at the start has a prefix every match starts with. A character
+	 * followed by a quantifier might not be there, and an alternation could start anywhere. */
+	if ((pattern[0] == '^') && (pattern.find('|') == std::string::npos))
+	{
+		std::string::size_type special = pattern.find_first_of(".[]()*+?{}\\^$", 1);
+		prefix = pattern.substr(1, (special == std::string::npos) ? std::string::npos : special - 1);
+		if (!prefix.empty() && (special != std::string::npos) && strchr("*?{", pattern[special]))
+			prefix.erase(prefix.length() - 1);
+	}
+}
+
+RewriteRule::~RewriteRule()
+{
+	if (type == MATCH_REGEX)
+		regfree(&regex);
+}
+
+RewriteManager::RewriteManager(InspIRCd *Instance) : ServerInstance(Instance), nodes(1)
+{
+}
+
+RewriteManager::~RewriteManager()
+{
+	Clear(rules);
+	Clear(pending);
+}
+
+void RewriteManager::Clear(std::vector<RewriteRule *> &list)
+{
+	for (std::vector<RewriteRule *>::iterator i = list.begin(); i != list.end(); i++)
+		delete *i;
+	list.clear();
+}
+
+void RewriteManager::Begin()
+{
+	Clear(pending);
+}
+
+void RewriteManager::Add(RewriteRule *rule)
+{
+	pending.push_back(rule);
+}
+
+void RewriteManager::AddPrefix(const std::string &prefix, size_t rule)
+{
+	size_t node = 0;
+	for (std::string::const_iterator i = prefix.begin(); i != prefix.end(); i++)
+	{
+		unsigned long key = node * 256 + (unsigned char)*i;
+		nspace::hash_map<unsigned long, size_t>::iterator edge = edges.find(key);
+		if (edge != edges.end())
+			node = edge->second;
+		else
+		{
+			nodes.push_back(TrieNode());
+			node = edges[key] = nodes.size() - 1;
+		}
+	}
+
+	nodes[node].rules.push_back(rule);
+}
+
+void RewriteManager::Apply()
+{
+	Clear(rules);
+	rules.swap(pending);
+
+	exact.clear();
+	edges.clear();
+	std::vector<TrieNode>(1).swap(nodes);
+
+	for (size_t i = 0; i < rules.size(); i++)
+	{
+		if (rules[i]->type != RewriteRule::MATCH_EXACT)
+			AddPrefix(rules[i]->prefix, i);
+		else if (exact.find(rules[i]->pattern) == exact.end())
+			exact[rules[i]->pattern] = i;
+	}
+
+	LOG(DEFAULT, LS_CORE, "Loaded %lu rewrites and redirects (%lu exact)", (unsigned long)rules.size(), (unsigned long)exact.size());
+}
+
+const RewriteRule *RewriteManager::Find(const std::string &uri, std::string &target)
+{
+	if (rules.empty())
+		return NULL;
+
+	/* Every rule whose prefix the URI starts with, found in one pass along it */
+	candidates.clear();
+	size_t node = 0;
+	candidates.insert(candidates.end(), nodes[0].rules.begin(), nodes[0].rules.end());
+	for (std::string::const_iterator i = uri.begin(); i != uri.end(); i++)
+	{
+		nspace::hash_map<unsigned long, size_t>::iterator edge = edges.find(node * 256 + (unsigned char)*i);
+		if (edge == edges.end())
+			break;
+		node = edge->second;
+		candidates.insert(candidates.end(), nodes[node].rules.begin(), nodes[node].rules.end());
+	}
+
+	ExactMap::iterator e = exact.find(uri);
+	if (e != exact.end())
+		candidates.push_back(e->second);
+
+	if (candidates.empty())
+		return NULL;
+	std::sort(candidates.begin(), candidates.end());
+
+	Captures caps;
+	caps.start[0] = uri.c_str();
+	caps.len[0] = uri.length();
+	caps.count = 1;
+
+	RewriteRule *rule = NULL;
+	for (std::vector<size_t>::iterator i = candidates.begin(); !rule && (i != candidates.end()); i++)
+	{
+		RewriteRule *r = rules[*i];
+		switch (r->type)
+		{
+			case RewriteRule::MATCH_EXACT:
+				rule = r;
+				break;
+			case RewriteRule::MATCH_PREFIX:
+				caps.start[1] = uri.c_str() + r->prefix.length();
+				caps.len[1] = uri.length() - r->prefix.length();
+				caps.count = 2;
+				rule = r;
+				break;
+			case RewriteRule::MATCH_WILDCARD:
+				if (WildcardCapture(uri.c_str(), r->pattern.c_str(), caps))
+					rule = r;
+				break;
+			case RewriteRule::MATCH_REGEX:
+			{
+				regmatch_t m[10];
+				if (regexec(&r->regex, uri.c_str(), 10, m, 0))
+					break;
+
+				/* A group which took no part in the match is empty */
+				caps.count = std::min((int)r->regex.re_nsub + 1, 10);
+				for (int n = 0; n < caps.count; n++)
+				{
+					caps.start[n] = uri.c_str() + std::max((int)m[n].rm_so, 0);
+					caps.len[n] = (m[n].rm_so >= 0) ? m[n].rm_eo - m[n].rm_so : 0;
+				}
+				rule = r;
+				break;
+			}
+		}
+	}
+
+	if (!rule)
+		return NULL;
+
+	/* The URI has been decoded, so what was matched is encoded again as it is put in the target */
+	target.clear();
+	for (std::string::const_iterator i = rule->target.begin(); i != rule->target.end(); i++)
+	{
+		if ((*i != '$') || ((i + 1) == rule->target.end()))
+			target.push_back(*i);
+		else if (*(i + 1) == '$')
+		{
+			target.push_back('$');
+			i++;
+		}
+		else if (isdigit(*(i + 1)))
+		{
+			int n = *++i - '0';
+			if (n < caps.count)
+				target.append(utils::urlencodepath(std::string(caps.start[n], caps.len[n])));
+		}
+		else
+			target.push_back(*i);
+	}
+
+	return rule;
+}
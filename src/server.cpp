@@ -28,6 +28,11 @@ void InspIRCd::SignalHandler(int signal)
 		case SIGTERM:
 			Exit(signal);
 			break;
+#ifndef WIN32
+		case SIGUSR1:
+			FOREACH_MOD_I(this, I_OnReopenLogs, OnReopenLogs());
+			break;
+#endif
 	}
 }
 
@@ -57,6 +62,7 @@ void InspIRCd::GracefulShutdown()
 		/* This calls the constructor and closes the listening socket */
 		delete Config->ports[i];
 	}
+	Config->ports.clear();
 	ShuttingDown = true;
 	FOREACH_MOD_I(this,I_OnGracefulShutdown, OnGracefulShutdown());
 }
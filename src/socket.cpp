@@ -15,17 +15,39 @@
 #include "inspircd.h"
 #include "socket.h"
 #include "socketengine.h"
+#ifndef WIN32
+#include <netinet/tcp.h>
+#endif
 
-ListenSocket::ListenSocket(InspIRCd* Instance, int port, char* addr) : ServerInstance(Instance), desc("plaintext"), bind_addr(addr), bind_port(port)
+ListenSocket::ListenSocket(InspIRCd* Instance, int port, char* addr, const ListenOptions &opts) : ServerInstance(Instance), desc("plaintext"),
+	bind_addr(addr), bind_port(port), options(opts), paused(false)
 {
 	this->SetFd(utils::sockets::OpenTCPSocket(addr));
 	if (this->GetFd() > -1)
 	{
+		/* Buffer sizes are inherited by accepted sockets, and the receive buffer has to be
+		 * set before listen() for the window scale offered in the handshake to allow for it */
+		if (options.sndbuf)
+			setsockopt(this->fd, SOL_SOCKET, SO_SNDBUF, (char*)&options.sndbuf, sizeof(options.sndbuf));
+		if (options.rcvbuf)
+			setsockopt(this->fd, SOL_SOCKET, SO_RCVBUF, (char*)&options.rcvbuf, sizeof(options.rcvbuf));
+#ifdef TCP_FASTOPEN
+		if (options.fastopen)
+			setsockopt(this->fd, IPPROTO_TCP, TCP_FASTOPEN, (char*)&options.fastopen, sizeof(options.fastopen));
+#endif
+
 		if (!Instance->BindSocket(this->fd,port,addr))
 		{
-			Instance->Log(DEBUG, "Failed to bind listener: %s (%d)", strerror(errno), errno);
+			LOG_I(Instance, DEBUG, LS_NET, "Failed to bind listener: %s (%d)", strerror(errno), errno);
 			this->fd = -1;
 		}
+#ifdef TCP_DEFER_ACCEPT
+		else if (options.deferaccept)
+		{
+			/* Connections which never send a request never wake us at all */
+			setsockopt(this->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (char*)&options.deferaccept, sizeof(options.deferaccept));
+		}
+#endif
 #ifdef IPV6
 		if ((!*addr) || (strchr(addr,':')))
 			this->family = AF_INET6;
@@ -40,62 +62,75 @@ ListenSocket::~ListenSocket()
 {
 	if (this->GetFd() > -1)
 	{
-		ServerInstance->SE->DelFd(this);
-		ServerInstance->Log(DEBUG,"Shut down listener on fd %d", this->fd);
+		if (!paused)
+			ServerInstance->SE->DelFd(this);
+		LOG(DEBUG, LS_NET, "Shut down listener on fd %d", this->fd);
 		if (ServerInstance->SE->Shutdown(this, 2) || ServerInstance->SE->Close(this))
-			ServerInstance->Log(DEBUG,"Failed to cancel listener: %s", strerror(errno));
+			LOG(DEBUG, LS_NET, "Failed to cancel listener: %s", strerror(errno));
 		this->fd = -1;
 	}
 }
 
-// XXX - There's probably a nicer way to do this.
-static sockaddr *sock_us;
-static sockaddr *client;
-static bool setup_sock;
+void ListenSocket::SetupAccepted(int nfd)
+{
+	int on = 1;
+#ifndef WIN32
+	if (options.nodelay)
+		setsockopt(nfd, IPPROTO_TCP, TCP_NODELAY, (char*)&on, sizeof(on));
+#endif
+}
 
-void ListenSocket::HandleEvent(EventType, int)
+void ListenSocket::Pause()
 {
-	if (!setup_sock)
-	{
-		sock_us = new sockaddr[2];
-		client = new sockaddr[2];
-		setup_sock = true;
-	}
+	if (paused)
+		return;
 
-	socklen_t uslen, length;		// length of our port number
-	int nfd, in_port;
+	ServerInstance->SE->DelFd(this);
+	paused = true;
+}
 
-#ifdef IPV6
-	if (this->family == AF_INET6)
-	{
-		uslen = sizeof(sockaddr_in6);
-		length = sizeof(sockaddr_in6);
-	}
-	else
-#endif
-	{
-		uslen = sizeof(sockaddr_in);
-		length = sizeof(sockaddr_in);
-	}
+void ListenSocket::Resume()
+{
+	if (!paused)
+		return;
+
+	if (ServerInstance->SE->AddFd(this))
+		paused = false;
+}
+
+void ListenSocket::HandleEvent(EventType, int)
+{
+	/* Big enough for either family */
+	sockaddr_storage client;
+	socklen_t length;
+	int nfd;
 
 	do
 	{
 		if ((ServerInstance->local_connections.size() + 1) > ServerInstance->Config->SoftLimit ||
 			(ServerInstance->local_connections.size() + 1) >= MAXCLIENTS)
 		{
-			/*
-			 * Don't even *try* to accept under these conditions, get the fuck out of here.
-			 * This will doubtlessly cause more read events, but pulling in the queue is
-			 * going to do no good for us.
-			 *
-			 * XXX: in the future, perhaps a way to avoid monitoring listeners under
-			 * such a condition would be nice.
-			 *		-- w00t
-			 */
+			/* Don't even *try* to accept under these conditions. The listeners are level
+			 * triggered, so leaving them in the socket engine would wake us every
+			 * iteration for connections we won't take; they come back when connections
+			 * are culled (see ConnectionManager::ResumeListeners). */
+			ServerInstance->Connections->PauseListeners();
 			break;
 		}
 
-		nfd = ServerInstance->SE->Accept(this, (sockaddr*)client, &length);
+		length = sizeof(client);
+		nfd = ServerInstance->SE->Accept(this, (sockaddr*)&client, &length);
+
+		if (nfd < 0)
+		{
+			/* Out of descriptors: the connection stays queued, and would wake us at once */
+			if ((errno == EMFILE) || (errno == ENFILE))
+			{
+				ServerInstance->Log(DEFAULT, "Can't accept connections: %s", strerror(errno));
+				ServerInstance->Connections->PauseListeners();
+			}
+			break;
+		}
 
 		/*
 		 * XXX -
@@ -109,36 +144,28 @@ void ListenSocket::HandleEvent(EventType, int)
 		if ((unsigned int)nfd >= MAX_DESCRIPTORS)
 		{
 			close(nfd);
-			shutdown(nfd, 2);
 			break;
 		}
 #endif
 
-		if ((nfd > -1) && (!ServerInstance->SE->GetSockName(this, sock_us, &uslen)))
+		/* A client over its limits costs us no more than this */
+		int rule;
+		if (!ServerInstance->Limits->Admit((sockaddr*)&client, rule))
 		{
-			char buf[MAXBUF];
-	#ifdef IPV6
-			if (this->family == AF_INET6)
-			{
-				inet_ntop(AF_INET6, &((const sockaddr_in6*)client)->sin6_addr, buf, sizeof(buf));
-				in_port = ntohs(((sockaddr_in6*)sock_us)->sin6_port);
-			}
-			else
-	#endif
-			{
-				inet_ntop(AF_INET, &((const sockaddr_in*)client)->sin_addr, buf, sizeof(buf));
-				in_port = ntohs(((sockaddr_in*)sock_us)->sin_port);
-			}
-
-			ServerInstance->SE->NonBlocking(nfd);
-			ServerInstance->Connections->Add(nfd, in_port, this->family, client);
+			close(nfd);
+			continue;
 		}
-		else
+
+		/* Accept hands back non-blocking sockets, and we only bind to fixed ports, so the
+		 * local port is the one we bound */
+		SetupAccepted(nfd);
+		Connection *c = ServerInstance->Connections->Add(nfd, bind_port, this->family, (sockaddr*)&client);
+		if (c)
 		{
-			ServerInstance->SE->Shutdown(nfd, 2);
-			ServerInstance->SE->Close(nfd);
+			c->cork = options.cork;
+			ServerInstance->Limits->Attach(c, rule);
 		}
-	} while (ServerInstance->SE->CanMultiaccept && nfd >= 0);
+	} while (ServerInstance->SE->CanMultiaccept);
 }
 
 /** This will bind a socket to a port. It works for UDP/TCP.
@@ -253,14 +280,14 @@ bool InspIRCd::BindSocket(int sockfd, int port, char* addr, bool dolisten)
 			}
 			else
 			{
-				this->Log(DEBUG,"New socket binding for %d with listen: %s:%d", sockfd, addr, port);
+				LOG_I(this, DEBUG, LS_NET, "New socket binding for %d with listen: %s:%d", sockfd, addr, port);
 				SE->NonBlocking(sockfd);
 				return true;
 			}
 		}
 		else
 		{
-			this->Log(DEBUG,"New socket binding for %d without listen: %s:%d", sockfd, addr, port);
+			LOG_I(this, DEBUG, LS_NET, "New socket binding for %d without listen: %s:%d", sockfd, addr, port);
 			return true;
 		}
 	}
@@ -272,7 +299,6 @@ int utils::sockets::OpenTCPSocket(char* addr, int socktype)
 	int sockfd;
 	int on = 1;
 	addr = addr;
-	struct linger linger = { 0, 0 };
 #ifdef IPV6
 	if (strchr(addr,':') || (!*addr))
 		sockfd = socket (PF_INET6, socktype, 0);
@@ -288,10 +314,9 @@ int utils::sockets::OpenTCPSocket(char* addr, int socktype)
 	else
 	{
 		setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (char*)&on, sizeof(on));
-		/* This is BSD compatible, setting l_onoff to 0 is *NOT* http://web.irc.org/mla/ircd-dev/msg02259.html */
-		linger.l_onoff = 1;
-		linger.l_linger = 1;
-		setsockopt(sockfd, SOL_SOCKET, SO_LINGER, (char*)&linger,sizeof(linger));
+		/* No SO_LINGER: accepted sockets inherit it, and a lingering close() blocks the
+		 * whole server for as long as the peer takes to acknowledge what is left. The
+		 * kernel finishes sending in the background by default. */
 		return (sockfd);
 	}
 }
@@ -315,6 +340,14 @@ int InspIRCd::BindPorts(bool, int &ports_found, FailedPortList &failed_ports)
 		if (strncmp(Addr, "::ffff:", 7) == 0)
 			this->Log(DEFAULT, "Using 4in6 (::ffff:) isn't recommended. You should bind IPv4 addresses directly instead.");
 		
+		ListenOptions options;
+		Config->ConfValueInteger(Config->config_data, "bind", "defer-accept", "0", count, options.deferaccept);
+		Config->ConfValueInteger(Config->config_data, "bind", "fastopen", "0", count, options.fastopen);
+		Config->ConfValueInteger(Config->config_data, "bind", "send-buffer", ConvToStr(Config->NetBufferSize).c_str(), count, options.sndbuf);
+		Config->ConfValueInteger(Config->config_data, "bind", "receive-buffer", ConvToStr(Config->NetBufferSize).c_str(), count, options.rcvbuf);
+		options.nodelay = Config->ConfValueBool(Config->config_data, "bind", "nodelay", "yes", count);
+		options.cork = Config->ConfValueBool(Config->config_data, "bind", "cork", "yes", count);
+
 		utils::portparser portrange(configToken, false);
 		int portno = -1;
 		while ((portno = portrange.GetToken()))
@@ -341,7 +374,7 @@ int InspIRCd::BindPorts(bool, int &ports_found, FailedPortList &failed_ports)
 			}
 			if (!skip)
 			{
-				ListenSocket* ll = new ListenSocket(this, portno, Addr);
+				ListenSocket* ll = new ListenSocket(this, portno, Addr, options);
 				if (ll->GetFd() > -1)
 				{
 					bound++;
@@ -135,7 +135,17 @@ int SocketEngine::RecvFrom(EventHandler* fd, void *buf, size_t len, int flags, s
 
 int SocketEngine::Accept(EventHandler* fd, sockaddr *addr, socklen_t *addrlen)
 {
-	return accept(fd->GetFd(), addr, addrlen);
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+	return accept4(fd->GetFd(), addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int nfd = accept(fd->GetFd(), addr, addrlen);
+	if (nfd > -1)
+	{
+		NonBlocking(nfd);
+		fcntl(nfd, F_SETFD, FD_CLOEXEC);
+	}
+	return nfd;
+#endif
 }
 
 int SocketEngine::Close(EventHandler* fd)
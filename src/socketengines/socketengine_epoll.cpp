@@ -43,7 +43,7 @@ bool EPollEngine::AddFd(EventHandler* eh)
 	int fd = eh->GetFd();
 	if ((fd < 0) || (fd > MAX_DESCRIPTORS))
 	{
-		ServerInstance->Log(DEBUG,"Out of range FD");
+		LOG(DEBUG, LS_NET, "Out of range FD");
 		return false;
 	}
 
@@ -63,7 +63,7 @@ bool EPollEngine::AddFd(EventHandler* eh)
 		return false;
 	}
 
-	ServerInstance->Log(DEBUG,"New file descriptor: %d", fd);
+	LOG(DEBUG, LS_NET, "New file descriptor: %d", fd);
 
 	ref[fd] = eh;
 	CurrentSetSize++;
@@ -96,14 +96,14 @@ bool EPollEngine::DelFd(EventHandler* eh, bool force)
 
 	if (i < 0 && !force)
 	{
-		ServerInstance->Log(DEBUG,"Cant remove socket: %s", strerror(errno));
+		LOG(DEBUG, LS_NET, "Cant remove socket: %s", strerror(errno));
 		return false;
 	}
 
 	ref[fd] = NULL;
 	CurrentSetSize--;
 
-	ServerInstance->Log(DEBUG,"Remove file descriptor: %d", fd);
+	LOG(DEBUG, LS_NET, "Remove file descriptor: %d", fd);
 	return true;
 }
 
@@ -86,7 +86,7 @@ bool IOCPEngine::AddFd(EventHandler* eh)
 		PostReadEvent(eh);
 
 	/* log message */
-	ServerInstance->Log(DEBUG, "New fake fd: %u, real fd: %u, address 0x%p", *fake_fd, eh->GetFd(), eh);
+	LOG(DEBUG, LS_NET, "New fake fd: %u, real fd: %u, address 0x%p", *fake_fd, eh->GetFd(), eh);
 
 	/* post a write event if there is data to be written */
 	if(eh->Writeable())
@@ -125,7 +125,7 @@ bool IOCPEngine::DelFd(EventHandler* eh, bool force /* = false */)
 	void* m_writeEvent = NULL;
 	void* m_acceptEvent = NULL;
 
-	ServerInstance->Log(DEBUG, "Removing fake fd %u, real fd %u, address 0x%p", *fake_fd, eh->GetFd(), eh);
+	LOG(DEBUG, LS_NET, "Removing fake fd %u, real fd %u, address 0x%p", *fake_fd, eh->GetFd(), eh);
 
 	/* Cancel pending i/o operations. */
 	if (CancelIo((HANDLE)fd) == FALSE)
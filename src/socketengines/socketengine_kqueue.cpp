@@ -74,7 +74,7 @@ bool KQueueEngine::AddFd(EventHandler* eh)
 	ref[fd] = eh;
 	CurrentSetSize++;
 
-	ServerInstance->Log(DEBUG,"New file descriptor: %d", fd);
+	LOG(DEBUG, LS_NET, "New file descriptor: %d", fd);
 	return true;
 }
 
@@ -100,7 +100,7 @@ bool KQueueEngine::DelFd(EventHandler* eh, bool force)
 	CurrentSetSize--;
 	ref[fd] = NULL;
 
-	ServerInstance->Log(DEBUG,"Remove file descriptor: %d", fd);
+	LOG(DEBUG, LS_NET, "Remove file descriptor: %d", fd);
 	return true;
 }
 
@@ -52,7 +52,7 @@ bool PortsEngine::AddFd(EventHandler* eh)
 	ref[fd] = eh;
 	port_associate(EngineHandle, PORT_SOURCE_FD, fd, eh->Readable() ? POLLRDNORM : POLLWRNORM, eh);
 
-	ServerInstance->Log(DEBUG,"New file descriptor: %d", fd);
+	LOG(DEBUG, LS_NET, "New file descriptor: %d", fd);
 	CurrentSetSize++;
 	return true;
 }
@@ -73,7 +73,7 @@ bool PortsEngine::DelFd(EventHandler* eh, bool force)
 	CurrentSetSize--;
 	ref[fd] = NULL;
 
-	ServerInstance->Log(DEBUG,"Remove file descriptor: %d", fd);
+	LOG(DEBUG, LS_NET, "Remove file descriptor: %d", fd);
 	return true;
 }
 
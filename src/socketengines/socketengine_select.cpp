@@ -44,7 +44,7 @@ bool SelectEngine::AddFd(EventHandler* eh)
 	ref[fd] = eh;
 	CurrentSetSize++;
 
-	ServerInstance->Log(DEBUG,"New file descriptor: %d", fd);
+	LOG(DEBUG, LS_NET, "New file descriptor: %d", fd);
 	return true;
 }
 
@@ -68,7 +68,7 @@ bool SelectEngine::DelFd(EventHandler* eh, bool force)
 	ref[fd] = NULL;
 	fds[fd] = 0;
 
-	ServerInstance->Log(DEBUG,"Remove file descriptor: %d", fd);
+	LOG(DEBUG, LS_NET, "Remove file descriptor: %d", fd);
 	return true;
 }
 
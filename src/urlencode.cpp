@@ -9,66 +9,56 @@
  *
  */
 
+/* $Core: libhttpd_urlencode */
+
 #include "inspircd.h"
 #include "urlencode.h"
 
 URIQueryString::URIQueryString(const std::string &str)
 {
-	std::string::iterator it = str.begin();
 	std::string key, value;
 	bool keynow = true;
 	
-	for (; it != str.end(); it++)
+	for (std::string::const_iterator it = str.begin(); ; it++)
 	{
-		if (*it == '=')
-		{
-			keynow = false;
-		}
-		else if (*it == '&')
+		if ((it == str.end()) || (*it == '&') || (*it == ';'))
 		{
-			if (!key.empty() && !value.empty())
-				Values.insert(std::make_pair<std::string,std::string>(key, value));
+			if (!key.empty())
+				Values.insert(std::make_pair(key, value));
 			
 			key.clear();
 			value.clear();
 			keynow = true;
+			
+			if (it == str.end())
+				break;
+			continue;
+		}
+		
+		char c = *it;
+		if ((c == '=') && keynow)
+		{
+			keynow = false;
+			continue;
 		}
-		else if (*it == '+')
+		else if (c == '+')
 		{
-			if (keynow)
-				key += ' ';
-			else
-				value += ' ';
+			c = ' ';
 		}
-		else if (*it == '%')
+		else if (c == '%')
 		{
-			if ((it + 1 == str.end()) || (it + 2 == str.end())
+			if ((it + 1 == str.end()) || (it + 2 == str.end()) || !utils::unhexchar(c, *(it + 1), *(it + 2)))
 			{
 				// Invalid hex representation, skip it
-				it = str.end() - 1;
 				continue;
 			}
 			
-			char c;
-			if (!utils::unhexchar(*(it + 1), *(it + 2)))
-			{
-				i += 2;
-				continue;
-			}
-			
-			if (keynow)
-				key += c;
-			else
-				value += c;
-			
-			i += 2;
+			it += 2;
 		}
+		
+		if (keynow)
+			key += c;
 		else
-		{
-			if (keynow)
-				key += *it;
-			else
-				value += *it;
-		}
+			value += c;
 	}
 }
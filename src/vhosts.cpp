@@ -0,0 +1,188 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ * Based on InspIRCd - (C) 2002-2007 InspIRCd Development Team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+/* $Core: libhttpd_vhosts */
+
+#include "inspircd.h"
+
+VirtualHost::VirtualHost() : maxpostbody(0), mimetypes(NULL)
+{
+}
+
+VirtualHost::~VirtualHost()
+{
+	delete mimetypes;
+}
+
+VHostManager::SuffixNode::~SuffixNode()
+{
+	for (nspace::hash_map<std::string, SuffixNode *, HostHash>::iterator i = children.begin(); i != children.end(); i++)
+		delete i->second;
+}
+
+VHostManager::VHostManager(InspIRCd *Instance) : ServerInstance(Instance), wildcards(new SuffixNode), pendingwildcards(new SuffixNode), LargestPostBody(0)
+{
+	defaulthost.maxpostbody = 0;
+}
+
+VHostManager::~VHostManager()
+{
+	Clear();
+	for (std::vector<VirtualHost *>::iterator i = pending.begin(); i != pending.end(); i++)
+		delete *i;
+	delete wildcards;
+	delete pendingwildcards;
+}
+
+void VHostManager::Clear()
+{
+	for (std::vector<VirtualHost *>::iterator i = hosts.begin(); i != hosts.end(); i++)
+		delete *i;
+	hosts.clear();
+	exact.clear();
+	delete wildcards;
+	wildcards = new SuffixNode;
+}
+
+void VHostManager::Begin()
+{
+	for (std::vector<VirtualHost *>::iterator i = pending.begin(); i != pending.end(); i++)
+		delete *i;
+	pending.clear();
+	pendingexact.clear();
+	delete pendingwildcards;
+	pendingwildcards = new SuffixNode;
+}
+
+void VHostManager::Add(VirtualHost *vh)
+{
+	pending.push_back(vh);
+	for (std::vector<std::string>::iterator n = vh->aliases.begin(); n != vh->aliases.end(); n++)
+		AddName(vh, *n);
+}
+
+void VHostManager::AddName(VirtualHost *vh, const std::string &name)
+{
+	std::string lname(name);
+	std::transform(lname.begin(), lname.end(), lname.begin(), ::tolower);
+	if (!lname.empty() && (lname[lname.length() - 1] == '.'))
+		lname.erase(lname.length() - 1);
+
+	bool wild = (lname.length() > 2) && (lname[0] == '*') && (lname[1] == '.');
+	if (lname.empty() || (lname.find_first_of("*?", wild ? 1 : 0) != std::string::npos))
+		throw CoreException("Invalid vhost name '" + name + "' in vhost " + vh->name + "; wildcards must be of the form *.example.com");
+
+	if (!wild)
+	{
+		VirtualHost *&slot = pendingexact[lname];
+		if (slot)
+			throw CoreException("The vhost name " + lname + " is used by both " + slot->name + " and " + vh->name);
+		slot = vh;
+		return;
+	}
+
+	/* Walk down from the last label, creating the path as needed */
+	SuffixNode *node = pendingwildcards;
+	std::string::size_type end = lname.length();
+	while (end > 1)
+	{
+		std::string::size_type dot = lname.rfind('.', end - 1);
+		SuffixNode *&child = node->children[lname.substr(dot + 1, end - dot - 1)];
+		if (!child)
+			child = new SuffixNode;
+		node = child;
+		end = dot;
+	}
+
+	if (node->wildcard)
+		throw CoreException("The vhost name " + lname + " is used by both " + node->wildcard->name + " and " + vh->name);
+	node->wildcard = vh;
+}
+
+void VHostManager::Apply()
+{
+	/* Everything was checked as it was added, so nothing below can fail */
+	Clear();
+	hosts.swap(pending);
+	exact.swap(pendingexact);
+	std::swap(wildcards, pendingwildcards);
+
+	defaulthost.docroot = ServerInstance->Config->DocRoot;
+	defaulthost.maxpostbody = LargestPostBody = ServerInstance->Config->MaxPostBody;
+	defaulthost.indexes = ServerInstance->Config->IndexFiles;
+
+	/* Hosts from the old config are gone; the next request on each connection looks again */
+	for (std::vector<Connection *>::iterator i = ServerInstance->local_connections.begin(); i != ServerInstance->local_connections.end(); i++)
+		(*i)->vhost = &defaulthost;
+
+	for (std::vector<VirtualHost *>::iterator i = hosts.begin(); i != hosts.end(); i++)
+	{
+		VirtualHost *vh = *i;
+		if (vh->maxpostbody < 0)
+			vh->maxpostbody = ServerInstance->Config->MaxPostBody;
+		LargestPostBody = std::max(LargestPostBody, vh->maxpostbody);
+		if (vh->indexes.empty())
+			vh->indexes = ServerInstance->Config->IndexFiles;
+	}
+
+	LOG(DEFAULT, LS_CORE, "Loaded %lu virtual hosts", (unsigned long)hosts.size());
+}
+
+VirtualHost *VHostManager::Find(const std::string &host)
+{
+	if (hosts.empty())
+		return &defaulthost;
+
+	const char *p = host.data();
+	std::string::size_type len = host.length();
+
+	/* Drop the port, which comes after the ] of an IPv6 literal */
+	const char *c = (const char *)memchr(p, (len && (*p == '[')) ? ']' : ':', len);
+	if (c)
+		len = (*c == ']') ? c - p + 1 : c - p;
+	if (len && (p[len - 1] == '.'))
+		len--;
+	if (!len || (len > 255))
+		return &defaulthost;
+
+	key.assign(p, len);
+	for (std::string::iterator i = key.begin(); i != key.end(); i++)
+		*i = tolower(*i);
+
+	HostMap::iterator i = exact.find(key);
+	if (i != exact.end())
+		return i->second;
+
+	/* Follow the labels from the right; the deepest wildcard passed on the way with at
+	 * least one label still in front of it is the most specific match */
+	VirtualHost *best = &defaulthost;
+	SuffixNode *node = wildcards;
+	std::string::size_type end = len;
+	while (true)
+	{
+		std::string::size_type dot = key.rfind('.', end - 1);
+		std::string::size_type from = (dot == std::string::npos) ? 0 : dot + 1;
+		label.assign(key, from, end - from);
+
+		nspace::hash_map<std::string, SuffixNode *, HostHash>::iterator n = node->children.find(label);
+		if (n == node->children.end())
+			break;
+		node = n->second;
+
+		if ((dot == std::string::npos) || !dot)
+			break;
+		if (node->wildcard)
+			best = node->wildcard;
+		end = dot;
+	}
+
+	return best;
+}
@@ -0,0 +1,434 @@
+/*
+ *   hottpd - a fast, extensible, featureful http server
+ *          (C) 2007-2008 hottpd development team
+ *
+ *    This program is free but copyrighted software; see
+ *              the file COPYING for details.
+ *
+ */
+
+/* A small HTTP/1.1 load generator for tools/bench/run.pl.
+ *
+ * It holds a fixed number of connections open to one server, keeps a fixed number of
+ * requests outstanding on each (one, or more when pipelining), and records the time from
+ * each request being written until the last byte of its response arrives. Paths are
+ * picked from a weighted list, so one run can mix small and large files. Results are
+ * printed as a single line of JSON.
+ *
+ * It is deliberately self contained (no hottpd headers, no libraries) so it can be
+ * built and pointed at any server.
+ */
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+struct Target
+{
+	std::string path;
+	int weight;
+};
+
+struct Options
+{
+	std::string name;
+	std::string address;
+	int port;
+	int connections;
+	double duration;
+	int pipeline;
+	bool keepalive;
+	std::vector<Target> targets;
+	int totalweight;
+};
+
+static double Now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+class Client
+{
+ public:
+	int fd;
+
+	/** When each request still waiting for its response was written
+	 */
+	std::deque<double> outstanding;
+
+	std::string sendq;
+	std::string header;
+	bool inbody;
+	long long bodyleft;
+	bool closeafter;
+
+	Client() : fd(-1), inbody(false), bodyleft(0), closeafter(false)
+	{
+	}
+};
+
+class LoadGen
+{
+	Options &opt;
+	sockaddr_in sa;
+	std::vector<Client> clients;
+
+	std::vector<unsigned int> latencies;
+	unsigned long long bytes;
+	unsigned long errors;
+	unsigned long long completed;
+	bool stopping;
+
+	const std::string &PickPath()
+	{
+		int n = rand() % opt.totalweight;
+		for (std::vector<Target>::iterator i = opt.targets.begin(); i != opt.targets.end(); i++)
+		{
+			n -= i->weight;
+			if (n < 0)
+				return i->path;
+		}
+		return opt.targets.back().path;
+	}
+
+	bool Connect(Client &c)
+	{
+		c.fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (c.fd < 0)
+			return false;
+
+		int one = 1;
+		setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL) | O_NONBLOCK);
+
+		if ((connect(c.fd, (sockaddr *)&sa, sizeof(sa)) < 0) && (errno != EINPROGRESS))
+		{
+			close(c.fd);
+			c.fd = -1;
+			return false;
+		}
+
+		c.outstanding.clear();
+		c.sendq.clear();
+		c.header.clear();
+		c.inbody = false;
+		c.bodyleft = 0;
+		c.closeafter = false;
+		return true;
+	}
+
+	void Disconnect(Client &c, bool error)
+	{
+		if (error)
+			errors += std::max((size_t)1, c.outstanding.size());
+		close(c.fd);
+		c.fd = -1;
+	}
+
+	void Queue(Client &c)
+	{
+		while (!stopping && ((int)c.outstanding.size() < (opt.keepalive ? opt.pipeline : 1)))
+		{
+			c.sendq += "GET " + PickPath() + " HTTP/1.1\r\nHost: " + opt.address + "\r\n";
+			c.sendq += opt.keepalive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+			c.outstanding.push_back(Now());
+		}
+	}
+
+	void Complete(Client &c)
+	{
+		double sent = c.outstanding.front();
+		c.outstanding.pop_front();
+		latencies.push_back((unsigned int)((Now() - sent) * 1e6));
+		completed++;
+	}
+
+	/** Consume what was read. Returns false if the connection should be closed.
+	 */
+	bool Parse(Client &c, const char *data, size_t len)
+	{
+		while (len)
+		{
+			if (c.inbody)
+			{
+				size_t take = std::min((long long)len, c.bodyleft);
+				c.bodyleft -= take;
+				data += take;
+				len -= take;
+				if (!c.bodyleft)
+				{
+					c.inbody = false;
+					Complete(c);
+					if (c.closeafter)
+						return false;
+				}
+				continue;
+			}
+
+			size_t before = c.header.length();
+			c.header.append(data, len);
+			std::string::size_type end = c.header.find("\r\n\r\n");
+			if (end == std::string::npos)
+				return true;
+
+			size_t used = end + 4 - before;
+			data += used;
+			len -= used;
+			c.header.erase(end + 2);
+
+			if ((c.header.compare(0, 9, "HTTP/1.1 ") && c.header.compare(0, 9, "HTTP/1.0 ")) || (c.header[9] != '2'))
+				errors++;
+
+			c.bodyleft = 0;
+			c.closeafter = !opt.keepalive;
+			for (std::string::size_type pos = c.header.find("\r\n"); pos != std::string::npos; )
+			{
+				std::string::size_type next = c.header.find("\r\n", pos + 2);
+				if (next == std::string::npos)
+					break;
+				std::string line = c.header.substr(pos + 2, next - pos - 2);
+				if (!strncasecmp(line.c_str(), "Content-Length:", 15))
+					c.bodyleft = atoll(line.c_str() + 15);
+				else if (!strncasecmp(line.c_str(), "Connection:", 11) && strstr(line.c_str(), "close"))
+					c.closeafter = true;
+				pos = next;
+			}
+			c.header.clear();
+
+			if (c.bodyleft)
+				c.inbody = true;
+			else
+			{
+				Complete(c);
+				if (c.closeafter)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	static unsigned int Percentile(const std::vector<unsigned int> &sorted, double fraction)
+	{
+		if (sorted.empty())
+			return 0;
+		size_t idx = (size_t)(fraction * sorted.size());
+		return sorted[std::min(idx, sorted.size() - 1)];
+	}
+
+ public:
+	LoadGen(Options &o) : opt(o), bytes(0), errors(0), completed(0), stopping(false)
+	{
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(opt.port);
+		inet_pton(AF_INET, opt.address.c_str(), &sa.sin_addr);
+		clients.resize(opt.connections);
+		latencies.reserve(1 << 20);
+	}
+
+	int Run()
+	{
+		std::vector<pollfd> pfds(clients.size());
+		char buf[65536];
+		double start = Now();
+		double end = start + opt.duration;
+
+		for (size_t i = 0; i < clients.size(); i++)
+		{
+			if (!Connect(clients[i]))
+			{
+				fprintf(stderr, "loadgen: can't connect to %s:%d: %s\n", opt.address.c_str(), opt.port, strerror(errno));
+				return 1;
+			}
+		}
+
+		while (true)
+		{
+			double now = Now();
+			if (now >= end)
+			{
+				/* Let requests already written finish, rather than counting them as lost */
+				stopping = true;
+				bool busy = false;
+				for (size_t i = 0; i < clients.size(); i++)
+					busy = busy || ((clients[i].fd >= 0) && !clients[i].outstanding.empty());
+				if (!busy || (now >= end + 5))
+					break;
+			}
+
+			for (size_t i = 0; i < clients.size(); i++)
+			{
+				Client &c = clients[i];
+				if ((c.fd < 0) && !stopping && !Connect(c))
+					errors++;
+				if (c.fd >= 0)
+					Queue(c);
+
+				pfds[i].fd = c.fd;
+				pfds[i].events = POLLIN | (c.sendq.empty() ? 0 : POLLOUT);
+				pfds[i].revents = 0;
+			}
+
+			if (poll(&pfds[0], pfds.size(), 100) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				perror("loadgen: poll");
+				return 1;
+			}
+
+			for (size_t i = 0; i < clients.size(); i++)
+			{
+				Client &c = clients[i];
+				if ((c.fd < 0) || !pfds[i].revents)
+					continue;
+
+				if (pfds[i].revents & POLLOUT)
+				{
+					ssize_t n = write(c.fd, c.sendq.data(), c.sendq.length());
+					if ((n < 0) && (errno != EAGAIN))
+					{
+						Disconnect(c, true);
+						continue;
+					}
+					if (n > 0)
+						c.sendq.erase(0, n);
+				}
+
+				if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP))
+				{
+					ssize_t n = read(c.fd, buf, sizeof(buf));
+					if (n == 0)
+						Disconnect(c, !c.outstanding.empty());
+					else if (n < 0)
+					{
+						if (errno != EAGAIN)
+							Disconnect(c, true);
+					}
+					else
+					{
+						bytes += n;
+						if (!Parse(c, buf, n))
+							Disconnect(c, !c.outstanding.empty());
+					}
+				}
+			}
+		}
+
+		double elapsed = std::min(Now(), end) - start;
+		for (size_t i = 0; i < clients.size(); i++)
+		{
+			if (clients[i].fd >= 0)
+				close(clients[i].fd);
+		}
+
+		std::sort(latencies.begin(), latencies.end());
+		printf("{\"name\":\"%s\",\"connections\":%d,\"pipeline\":%d,\"keepalive\":%s,\"duration\":%.2f,"
+			"\"requests\":%llu,\"errors\":%lu,\"requests_per_sec\":%.1f,\"bytes_per_sec\":%.0f,"
+			"\"p50_us\":%u,\"p99_us\":%u,\"p999_us\":%u}\n",
+			opt.name.c_str(), opt.connections, opt.pipeline, opt.keepalive ? "true" : "false", elapsed,
+			completed, errors, completed / elapsed, bytes / elapsed,
+			Percentile(latencies, 0.5), Percentile(latencies, 0.99), Percentile(latencies, 0.999));
+		return 0;
+	}
+};
+
+static void Usage()
+{
+	fprintf(stderr, "Usage: loadgen [-n name] [-a address] [-p port] [-c connections] [-d seconds]\n"
+		"               [-P pipeline depth] [-C] -u path[=weight] [-u path[=weight] ...]\n"
+		"  -C closes the connection after every request instead of using keep-alive.\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	Options opt;
+	opt.name = "load";
+	opt.address = "127.0.0.1";
+	opt.port = 8080;
+	opt.connections = 16;
+	opt.duration = 10;
+	opt.pipeline = 1;
+	opt.keepalive = true;
+	opt.totalweight = 0;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "n:a:p:c:d:P:Cu:")) != -1)
+	{
+		switch (ch)
+		{
+			case 'n':
+				opt.name = optarg;
+				break;
+			case 'a':
+				opt.address = optarg;
+				break;
+			case 'p':
+				opt.port = atoi(optarg);
+				break;
+			case 'c':
+				opt.connections = atoi(optarg);
+				break;
+			case 'd':
+				opt.duration = atof(optarg);
+				break;
+			case 'P':
+				opt.pipeline = atoi(optarg);
+				break;
+			case 'C':
+				opt.keepalive = false;
+				break;
+			case 'u':
+			{
+				Target t;
+				std::string arg = optarg;
+				std::string::size_type eq = arg.rfind('=');
+
+				/* Only a number after the last = is a weight; otherwise it's part of a query string */
+				if ((eq != std::string::npos) && (eq + 1 < arg.length()) && (arg.find_first_not_of("0123456789", eq + 1) == std::string::npos))
+				{
+					t.path = arg.substr(0, eq);
+					t.weight = atoi(arg.c_str() + eq + 1);
+				}
+				else
+				{
+					t.path = arg;
+					t.weight = 1;
+				}
+				if (t.weight <= 0)
+					Usage();
+				opt.targets.push_back(t);
+				opt.totalweight += t.weight;
+				break;
+			}
+			default:
+				Usage();
+		}
+	}
+
+	if (opt.targets.empty() || (opt.connections < 1) || (opt.pipeline < 1) || (opt.duration <= 0))
+		Usage();
+
+	signal(SIGPIPE, SIG_IGN);
+	srand(1);
+
+	LoadGen gen(opt);
+	return gen.Run();
+}
@@ -0,0 +1,237 @@
+#!/usr/bin/perl
+
+#       +------------------------------------+
+#       |      hottpd benchmark driver       |
+#       +------------------------------------+
+#
+#  hottpd: (C) 2007-2008 hottpd development team
+#
+#  This program is free but copyrighted software; see
+#          the file COPYING for details.
+#
+# ---------------------------------------------------
+#
+# Starts a hottpd from the build tree on a scratch document root, fetches the
+# micro-benchmark results from m_benchmark, then runs tools/bench/loadgen through a
+# fixed set of load scenarios. Everything is written as one JSON document (to
+# bench-results.json by default) so runs can be compared; give --baseline an earlier
+# results file to have any result more than --threshold percent worse reported, and
+# the exit status set.
+
+use strict;
+use warnings;
+use Getopt::Long;
+use File::Temp qw(tempdir);
+use IO::Socket::INET;
+use POSIX qw(:sys_wait_h);
+
+my $binary = "src/hottpd";
+my $moduledir = "src/modules";
+my $loadgen = "tools/bench/loadgen";
+my $port = 18080;
+my $duration = 5;
+my $iterations = 100000;
+my $output = "bench-results.json";
+my $baseline;
+my $threshold = 10;
+
+GetOptions(
+	"binary=s" => \$binary,
+	"moduledir=s" => \$moduledir,
+	"loadgen=s" => \$loadgen,
+	"port=i" => \$port,
+	"duration=f" => \$duration,
+	"iterations=i" => \$iterations,
+	"output=s" => \$output,
+	"baseline=s" => \$baseline,
+	"threshold=f" => \$threshold,
+) or die "Usage: $0 [--binary path] [--moduledir dir] [--loadgen path] [--port n] [--duration secs]\n" .
+	"       [--iterations n] [--output file] [--baseline file] [--threshold percent]\n";
+
+# Load scenarios: name, connections, pipeline depth, keep-alive, paths with weights
+my @scenarios = (
+	["small-keepalive", 32, 1, 1, "/small.html"],
+	["small-close", 32, 1, 0, "/small.html"],
+	["small-pipelined", 32, 16, 1, "/small.html"],
+	["large-keepalive", 8, 1, 1, "/large.bin"],
+	["mixed", 32, 1, 1, "/small.html=90 /medium.html=9 /large.bin=1"],
+);
+
+for my $file ($binary, $loadgen) {
+	die "$file not found; run make first\n" unless -x $file;
+}
+
+my $dir = tempdir("hottpd-bench-XXXXXX", TMPDIR => 1, CLEANUP => 1);
+mkdir "$dir/www" or die "Can't create $dir/www: $!\n";
+
+sub write_file {
+	my ($name, $size) = @_;
+	open(my $fh, ">", $name) or die "Can't write $name: $!\n";
+	binmode $fh;
+	my $chunk = "x" x 65536;
+	while ($size > 0) {
+		my $n = $size > 65536 ? 65536 : $size;
+		print $fh substr($chunk, 0, $n);
+		$size -= $n;
+	}
+	close $fh;
+}
+
+write_file("$dir/www/small.html", 1024);
+write_file("$dir/www/medium.html", 32768);
+write_file("$dir/www/large.bin", 1048576);
+
+my $moddir = $moduledir =~ m{^/} ? $moduledir : "$ENV{PWD}/$moduledir";
+open(my $conf, ">", "$dir/hottpd.conf") or die "Can't write $dir/hottpd.conf: $!\n";
+print $conf <<EOF;
+server
+{
+	document-root = "$dir/www/"
+	moduledir = "$moddir"
+	pidfile = "$dir/hottpd.pid"
+}
+
+bind
+{
+	address = 127.0.0.1
+	port = $port
+}
+
+performance
+{
+	keepalive-max = 100000000
+	timeout-total-lifetime = 3600
+	timeout-idle-lifetime = 60
+	max-conn-queue = 1024
+}
+
+module
+{
+	name = m_benchmark.so
+}
+
+benchmark
+{
+	path = "/bench-micro"
+	iterations = $iterations
+}
+EOF
+close $conf;
+
+# Core libraries are found next to the binary, not wherever make install last put them
+my $libdir = $binary;
+$libdir =~ s{/[^/]*$}{};
+$ENV{LD_LIBRARY_PATH} = $libdir . (defined $ENV{LD_LIBRARY_PATH} ? ":$ENV{LD_LIBRARY_PATH}" : "");
+
+my $pid = fork();
+die "fork: $!\n" unless defined $pid;
+if (!$pid) {
+	open(STDOUT, ">", "$dir/stdout.txt");
+	open(STDERR, ">&STDOUT");
+	exec($binary, "--nofork", "--config", "$dir/hottpd.conf", "--logfile", "$dir/hottpd.log") or exit 127;
+}
+
+sub stop_server {
+	return unless $pid;
+	kill "TERM", $pid;
+	waitpid($pid, 0);
+	$pid = 0;
+}
+
+$SIG{INT} = $SIG{TERM} = sub { stop_server(); exit 1; };
+END { stop_server(); }
+
+sub fetch {
+	my ($path) = @_;
+	my $sock = IO::Socket::INET->new(PeerAddr => "127.0.0.1", PeerPort => $port, Proto => "tcp") or return undef;
+	print $sock "GET $path HTTP/1.0\r\nHost: 127.0.0.1\r\n\r\n";
+	local $/;
+	my $response = <$sock>;
+	close $sock;
+	return undef unless defined $response && $response =~ m{^HTTP/1\.\d 200};
+	$response =~ s/^.*?\r\n\r\n//s;
+	return $response;
+}
+
+my $up = 0;
+for (1 .. 50) {
+	if (waitpid($pid, WNOHANG)) {
+		$pid = 0;
+		last;
+	}
+	if (IO::Socket::INET->new(PeerAddr => "127.0.0.1", PeerPort => $port, Proto => "tcp")) {
+		$up = 1;
+		last;
+	}
+	select(undef, undef, undef, 0.1);
+}
+if (!$up) {
+	my $log = `cat $dir/stdout.txt 2>/dev/null`;
+	die "hottpd didn't start on port $port:\n$log";
+}
+
+print STDERR "Running micro-benchmarks ($iterations iterations each)\n";
+my $micro = fetch("/bench-micro");
+die "Couldn't fetch micro-benchmark results; is m_benchmark built?\n" unless defined $micro;
+$micro =~ s/\s+$//;
+
+my @load;
+for my $s (@scenarios) {
+	my ($name, $conns, $depth, $keepalive, $paths) = @$s;
+	print STDERR "Running $name for ${duration}s\n";
+	my @args = ($loadgen, "-n", $name, "-p", $port, "-c", $conns, "-d", $duration, "-P", $depth);
+	push @args, "-C" unless $keepalive;
+	push @args, map { ("-u", $_) } split(/ /, $paths);
+	open(my $lg, "-|", @args) or die "Can't run $loadgen: $!\n";
+	my $line = <$lg>;
+	close $lg;
+	die "$name: loadgen failed\n" unless defined $line && $line =~ /^\{/;
+	chomp $line;
+	push @load, $line;
+}
+
+stop_server();
+
+my $version = `$binary --version 2>/dev/null` || "";
+$version =~ s/[\r\n"\\]//g;
+my $json = "{\n\"version\":\"$version\",\n\"time\":" . time() . ",\n\"micro\":$micro,\n\"load\":[\n" . join(",\n", @load) . "\n]\n}\n";
+
+open(my $out, ">", $output) or die "Can't write $output: $!\n";
+print $out $json;
+close $out;
+print $json;
+
+exit 0 unless defined $baseline;
+
+# Compare against the baseline. Only the fields below are compared; the parsing is
+# just enough for files this script wrote.
+sub results {
+	my ($text) = @_;
+	my %r;
+	while ($text =~ /\{("name":"([^"]+)"[^{}]*)\}/g) {
+		my ($body, $name) = ($1, $2);
+		while ($body =~ /"(ns_per_op|requests_per_sec|p99_us)":([\d.]+)/g) {
+			$r{"$name.$1"} = $2;
+		}
+	}
+	return %r;
+}
+
+open(my $bf, "<", $baseline) or die "Can't read $baseline: $!\n";
+my %old = results(do { local $/; <$bf> });
+close $bf;
+my %new = results($json);
+
+my $regressions = 0;
+for my $key (sort keys %new) {
+	next unless exists $old{$key} && $old{$key} > 0;
+	# Higher is better for throughput, lower is better for times
+	my $change = ($new{$key} - $old{$key}) * 100 / $old{$key};
+	$change = -$change if $key =~ /requests_per_sec$/;
+	if ($change > $threshold) {
+		printf STDERR "REGRESSION %s: %s -> %s (%.1f%% worse)\n", $key, $old{$key}, $new{$key}, $change;
+		$regressions++;
+	}
+}
+print STDERR $regressions ? "$regressions regressions against $baseline\n" : "No regressions against $baseline\n";
+exit($regressions ? 1 : 0);